@@ -0,0 +1,769 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgnumeric_sqlite.c
+ *    SQLite loadable extension giving exact numeric arithmetic.
+ *
+ *    .load ./pgnumeric
+ *    CREATE TABLE t (amount BLOB);
+ *    INSERT INTO t VALUES (numeric('19.99'));
+ *    SELECT numeric_text(numeric_sum(amount)) FROM t;
+ *
+ * Values are stored as BLOBs holding the numeric_sortkey() encoding
+ * followed by the display scale as a big-endian 16-bit word.  SQLite
+ * compares BLOBs with memcmp(), so ORDER BY, min(), max() and indexes on
+ * such columns follow numeric order.
+ *
+ * SQLite never applies a collation to BLOBs, so a value that keeps its
+ * scale cannot compare equal to the same number at another scale: 1.0 and
+ * 1.00 are distinct under "=", GROUP BY, DISTINCT and UNIQUE, ordered by
+ * scale, just as their text forms differ.  To treat them as one value,
+ * compare or group on numeric_trim_scale(x), PostgreSQL's trim_scale(),
+ * whose result is the same BLOB for all numerically equal values, or use
+ * numeric_cmp().  TEXT compared under the NUMERIC collation is always
+ * compared by value.
+ *
+ * Every function also accepts INTEGER, REAL (converted as
+ * numeric_from_double() does) and TEXT arguments, and returns NULL for a
+ * NULL argument.  The NUMERIC collation orders TEXT as numbers, with text
+ * that does not parse after every number.
+ *
+ * Copyright (c) 2011, Hiroaki Nakamura
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3ext.h>
+
+#include "numeric.h"
+
+SQLITE_EXTENSION_INIT1
+
+#define SCALE_BYTES         2
+#define COLLATE_KEY_LEN     128     /* keys at most this long stay on stack */
+#define COLLATE_TEXT        0xFF    /* class byte of unparsable text */
+
+#define lengthof(array)     (sizeof(array) / sizeof((array)[0]))
+
+typedef numeric_errcode_t (*unary_fn) (const numeric *num, numeric *result);
+typedef numeric_errcode_t (*binary_fn) (const numeric *num1,
+        const numeric *num2, numeric *result);
+typedef numeric_errcode_t (*scaled_fn) (const numeric *num, int scale,
+        numeric *result);
+
+typedef struct unary_func
+{
+    const char *name;
+    unary_fn    fn;
+} unary_func;
+
+typedef struct binary_func
+{
+    const char *name;
+    binary_fn   fn;
+} binary_func;
+
+typedef struct scaled_func
+{
+    const char *name;
+    scaled_fn   fn;
+} scaled_func;
+
+/*
+ * Aggregate state for numeric_sum() and numeric_avg().  The aggregate
+ * context holds only a pointer to it, as sqlite3_aggregate_context()
+ * memory is not aligned enough for the int128 in numeric_accum.
+ */
+typedef struct sum_state
+{
+    int64_t     count;
+    numeric_accum acc;
+} sum_state;
+
+/* Aggregate state for numeric_min() and numeric_max() */
+typedef struct minmax_state
+{
+    bool        started;
+    numeric     best;
+} minmax_state;
+
+static const unary_func unary_funcs[] = {
+    {"numeric", numeric_plus},
+    {"numeric_abs", numeric_abs},
+    {"numeric_neg", numeric_minus},
+    {"numeric_sign", numeric_sign},
+    {"numeric_ceil", numeric_ceil},
+    {"numeric_floor", numeric_floor},
+    {"numeric_sqrt", numeric_sqrt},
+    {"numeric_exp", numeric_exp},
+    {"numeric_ln", numeric_ln},
+    {"numeric_log10", numeric_log10},
+    {"numeric_trim_scale", numeric_trim_scale},
+};
+
+static const binary_func binary_funcs[] = {
+    {"numeric_add", numeric_add},
+    {"numeric_sub", numeric_sub},
+    {"numeric_mul", numeric_mul},
+    {"numeric_div", numeric_div},
+    {"numeric_div_trunc", numeric_div_trunc},
+    {"numeric_mod", numeric_mod},
+    {"numeric_power", numeric_power},
+    {"numeric_gcd", numeric_gcd},
+    {"numeric_lcm", numeric_lcm},
+};
+
+static const scaled_func scaled_funcs[] = {
+    {"numeric_round", numeric_round},
+    {"numeric_trunc", numeric_trunc},
+};
+
+static bool arg_numeric(sqlite3_context *ctx, sqlite3_value *value,
+        numeric *result);
+static void result_numeric(sqlite3_context *ctx, const numeric *num);
+static void result_errcode(sqlite3_context *ctx, numeric_errcode_t errcode);
+static void call_unary(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void call_binary(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void call_scaled(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void numeric_text_func(sqlite3_context *ctx, int argc,
+        sqlite3_value **argv);
+static void numeric_cmp_func(sqlite3_context *ctx, int argc,
+        sqlite3_value **argv);
+static sum_state *sum_state_get(sqlite3_context *ctx, bool create);
+static void sum_step(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void sum_final(sqlite3_context *ctx);
+static void avg_final(sqlite3_context *ctx);
+static void minmax_step(sqlite3_context *ctx, sqlite3_value *value,
+        int want);
+static void min_step(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void max_step(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void minmax_final(sqlite3_context *ctx);
+static unsigned char *collate_key(const void *str, int len,
+        unsigned char *buf, size_t *keylen);
+static int collate_numeric(void *arg, int len1, const void *str1,
+        int len2, const void *str2);
+
+
+/*
+ * sqlite3_pgnumeric_init() -
+ *
+ *  Extension entry point: register the functions, aggregates and
+ *  collation with db.
+ */
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int
+sqlite3_pgnumeric_init(sqlite3 *db, char **errmsg,
+        const sqlite3_api_routines *api)
+{
+    const int   flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+    int         rc = SQLITE_OK;
+    size_t      i;
+
+    SQLITE_EXTENSION_INIT2(api);
+    (void) errmsg;
+
+    for (i = 0; rc == SQLITE_OK && i < lengthof(unary_funcs); i++)
+        rc = sqlite3_create_function(db, unary_funcs[i].name, 1, flags,
+                                     (void *) &unary_funcs[i], call_unary,
+                                     NULL, NULL);
+    for (i = 0; rc == SQLITE_OK && i < lengthof(binary_funcs); i++)
+        rc = sqlite3_create_function(db, binary_funcs[i].name, 2, flags,
+                                     (void *) &binary_funcs[i], call_binary,
+                                     NULL, NULL);
+    for (i = 0; rc == SQLITE_OK && i < lengthof(scaled_funcs); i++)
+    {
+        rc = sqlite3_create_function(db, scaled_funcs[i].name, 1, flags,
+                                     (void *) &scaled_funcs[i], call_scaled,
+                                     NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_create_function(db, scaled_funcs[i].name, 2, flags,
+                                         (void *) &scaled_funcs[i],
+                                         call_scaled, NULL, NULL);
+    }
+
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_text", 1, flags, NULL,
+                                     numeric_text_func, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_cmp", 2, flags, NULL,
+                                     numeric_cmp_func, NULL, NULL);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_sum", 1, flags, NULL,
+                                     NULL, sum_step, sum_final);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_avg", 1, flags, NULL,
+                                     NULL, sum_step, avg_final);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_min", 1, flags, NULL,
+                                     NULL, min_step, minmax_final);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(db, "numeric_max", 1, flags, NULL,
+                                     NULL, max_step, minmax_final);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_collation(db, "NUMERIC", SQLITE_UTF8, NULL,
+                                      collate_numeric);
+    return rc;
+}
+
+
+/*
+ * arg_numeric() -
+ *
+ *  Convert an SQL argument into result.  Returns false, leaving the
+ *  function result NULL or an error, if value is NULL or not a number.
+ */
+static bool
+arg_numeric(sqlite3_context *ctx, sqlite3_value *value, numeric *result)
+{
+    numeric_errcode_t errcode;
+
+    switch (sqlite3_value_type(value))
+    {
+        case SQLITE_NULL:
+            return false;
+        case SQLITE_INTEGER:
+            errcode = numeric_from_int64(sqlite3_value_int64(value), result);
+            break;
+        case SQLITE_FLOAT:
+            errcode = numeric_from_double(sqlite3_value_double(value), result);
+            break;
+        case SQLITE_BLOB:
+            {
+                const unsigned char *blob = sqlite3_value_blob(value);
+                int         len = sqlite3_value_bytes(value);
+                int         dscale;
+
+                if (len <= SCALE_BYTES)
+                {
+                    errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+                    break;
+                }
+                len -= SCALE_BYTES;
+                dscale = (blob[len] << 8) | blob[len + 1];
+                errcode = numeric_from_sortkey(blob, len, dscale, result);
+            }
+            break;
+        default:
+            {
+                const char *text = (const char *) sqlite3_value_text(value);
+
+                if (text == NULL)
+                {
+                    sqlite3_result_error_nomem(ctx);
+                    return false;
+                }
+                errcode = numeric_from_str(text, -1, -1, result);
+            }
+            break;
+    }
+
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        result_errcode(ctx, errcode);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * result_numeric() -
+ *
+ *  Return num from an SQL function as a BLOB.
+ */
+static void
+result_numeric(sqlite3_context *ctx, const numeric *num)
+{
+    size_t      maxlen = numeric_sortkey_max_length(num) + SCALE_BYTES;
+    size_t      keylen;
+    int         dscale = NUMERIC_IS_NAN(num) ? 0 : num->dscale;
+    unsigned char *blob;
+    numeric_errcode_t errcode;
+
+    if (dscale > UINT16_MAX)
+    {
+        result_errcode(ctx, NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE);
+        return;
+    }
+
+    blob = (unsigned char *) sqlite3_malloc((int) maxlen);
+    if (blob == NULL)
+    {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    errcode = numeric_sortkey(num, blob, maxlen, &keylen);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        sqlite3_free(blob);
+        result_errcode(ctx, errcode);
+        return;
+    }
+    blob[keylen] = (unsigned char) (dscale >> 8);
+    blob[keylen + 1] = (unsigned char) (dscale & 0xFF);
+    sqlite3_result_blob(ctx, blob, (int) (keylen + SCALE_BYTES), sqlite3_free);
+}
+
+
+static void
+result_errcode(sqlite3_context *ctx, numeric_errcode_t errcode)
+{
+    switch (errcode)
+    {
+        case NUMERIC_ERRCODE_NO_ERROR:
+            break;
+        case NUMERIC_ERRCODE_DIVISION_BY_ZERO:
+            sqlite3_result_error(ctx, "division by zero", -1);
+            break;
+        case NUMERIC_ERRCODE_INVALID_ARGUMENT:
+            sqlite3_result_error(ctx, "invalid numeric argument", -1);
+            break;
+        case NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE:
+            sqlite3_result_error(ctx, "numeric value out of range", -1);
+            break;
+        case NUMERIC_ERRCODE_OUT_OF_MEMORY:
+            sqlite3_result_error_nomem(ctx);
+            break;
+        default:
+            sqlite3_result_error(ctx, "numeric error", -1);
+            break;
+    }
+}
+
+
+static void
+call_unary(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const unary_func *func = (const unary_func *) sqlite3_user_data(ctx);
+    numeric     x;
+    numeric     r;
+    numeric_errcode_t errcode;
+
+    (void) argc;
+    numeric_init(&x);
+    numeric_init(&r);
+    if (arg_numeric(ctx, argv[0], &x))
+    {
+        errcode = func->fn(&x, &r);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            result_numeric(ctx, &r);
+        else
+            result_errcode(ctx, errcode);
+    }
+    numeric_dispose(&r);
+    numeric_dispose(&x);
+}
+
+
+static void
+call_binary(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const binary_func *func = (const binary_func *) sqlite3_user_data(ctx);
+    numeric     x;
+    numeric     y;
+    numeric     r;
+    numeric_errcode_t errcode;
+
+    (void) argc;
+    numeric_init(&x);
+    numeric_init(&y);
+    numeric_init(&r);
+    if (arg_numeric(ctx, argv[0], &x) && arg_numeric(ctx, argv[1], &y))
+    {
+        errcode = func->fn(&x, &y, &r);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            result_numeric(ctx, &r);
+        else
+            result_errcode(ctx, errcode);
+    }
+    numeric_dispose(&r);
+    numeric_dispose(&y);
+    numeric_dispose(&x);
+}
+
+
+/*
+ * call_scaled() -
+ *
+ *  numeric_round(x [, scale]) and numeric_trunc(x [, scale]); scale
+ *  defaults to 0.
+ */
+static void
+call_scaled(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const scaled_func *func = (const scaled_func *) sqlite3_user_data(ctx);
+    numeric     x;
+    numeric     r;
+    int         scale = 0;
+    numeric_errcode_t errcode;
+
+    if (argc == 2)
+    {
+        if (sqlite3_value_type(argv[1]) == SQLITE_NULL)
+            return;
+        scale = sqlite3_value_int(argv[1]);
+    }
+
+    numeric_init(&x);
+    numeric_init(&r);
+    if (arg_numeric(ctx, argv[0], &x))
+    {
+        errcode = func->fn(&x, scale, &r);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            result_numeric(ctx, &r);
+        else
+            result_errcode(ctx, errcode);
+    }
+    numeric_dispose(&r);
+    numeric_dispose(&x);
+}
+
+
+static void
+numeric_text_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    numeric     x;
+    char       *str;
+    numeric_errcode_t errcode;
+
+    (void) argc;
+    numeric_init(&x);
+    if (arg_numeric(ctx, argv[0], &x))
+    {
+        errcode = numeric_to_str(&x, -1, &str);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        {
+            sqlite3_result_text(ctx, str, -1, SQLITE_TRANSIENT);
+            free(str);
+        }
+        else
+            result_errcode(ctx, errcode);
+    }
+    numeric_dispose(&x);
+}
+
+
+static void
+numeric_cmp_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    numeric     x;
+    numeric     y;
+
+    (void) argc;
+    numeric_init(&x);
+    numeric_init(&y);
+    if (arg_numeric(ctx, argv[0], &x) && arg_numeric(ctx, argv[1], &y))
+        sqlite3_result_int(ctx, numeric_cmp(&x, &y));
+    numeric_dispose(&y);
+    numeric_dispose(&x);
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Aggregates
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * sum_state_get() -
+ *
+ *  Return the sum state of the current group, creating it if create is
+ *  set.  Returns NULL if there is none, or when out of memory.
+ */
+static sum_state *
+sum_state_get(sqlite3_context *ctx, bool create)
+{
+    sum_state **slot;
+
+    slot = (sum_state **)
+        sqlite3_aggregate_context(ctx, create ? sizeof(sum_state *) : 0);
+    if (slot == NULL)
+        return NULL;
+    if (*slot == NULL && create)
+    {
+        *slot = (sum_state *) malloc(sizeof(sum_state));
+        if (*slot != NULL)
+        {
+            (*slot)->count = 0;
+            numeric_accum_init(&(*slot)->acc);
+        }
+    }
+    return *slot;
+}
+
+
+/*
+ * sum_step() -
+ *
+ *  Add a row to a numeric_sum() or numeric_avg() state.  INTEGER rows
+ *  take the accumulator's native fast path; the rest are converted.
+ */
+static void
+sum_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    sum_state  *state;
+    numeric     x;
+
+    (void) argc;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    state = sum_state_get(ctx, true);
+    if (state == NULL)
+    {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_INTEGER)
+        numeric_accum_add_int64(&state->acc, sqlite3_value_int64(argv[0]));
+    else
+    {
+        numeric_init(&x);
+        if (!arg_numeric(ctx, argv[0], &x))
+        {
+            numeric_dispose(&x);
+            return;
+        }
+        numeric_accum_add_numeric(&state->acc, &x);
+        numeric_dispose(&x);
+    }
+    state->count++;
+}
+
+
+static void
+sum_final(sqlite3_context *ctx)
+{
+    sum_state  *state = sum_state_get(ctx, false);
+    numeric     r;
+    numeric_errcode_t errcode;
+
+    if (state == NULL)
+        return;                 /* sum of no rows is NULL */
+
+    numeric_init(&r);
+    errcode = numeric_accum_finalize(&state->acc, &r);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        result_numeric(ctx, &r);
+    else
+        result_errcode(ctx, errcode);
+    numeric_dispose(&r);
+    numeric_accum_dispose(&state->acc);
+    free(state);
+}
+
+
+static void
+avg_final(sqlite3_context *ctx)
+{
+    sum_state  *state = sum_state_get(ctx, false);
+    numeric     sum;
+    numeric     count;
+    numeric     r;
+    numeric_errcode_t errcode;
+
+    if (state == NULL)
+        return;
+
+    numeric_init(&sum);
+    numeric_init(&count);
+    numeric_init(&r);
+    errcode = numeric_accum_finalize(&state->acc, &sum);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_from_int64(state->count, &count);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_div(&sum, &count, &r);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        result_numeric(ctx, &r);
+    else
+        result_errcode(ctx, errcode);
+    numeric_dispose(&r);
+    numeric_dispose(&count);
+    numeric_dispose(&sum);
+    numeric_accum_dispose(&state->acc);
+    free(state);
+}
+
+
+/*
+ * minmax_step() -
+ *
+ *  Keep the row if numeric_cmp() against the best so far gives want.
+ *  The state takes over the row's digits rather than copying them.
+ */
+static void
+minmax_step(sqlite3_context *ctx, sqlite3_value *value, int want)
+{
+    minmax_state *state;
+    numeric     x;
+
+    if (sqlite3_value_type(value) == SQLITE_NULL)
+        return;
+
+    state = (minmax_state *)
+        sqlite3_aggregate_context(ctx, sizeof(minmax_state));
+    if (state == NULL)
+    {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    numeric_init(&x);
+    if (!arg_numeric(ctx, value, &x))
+    {
+        numeric_dispose(&x);
+        return;
+    }
+    if (!state->started || numeric_cmp(&x, &state->best) == want)
+    {
+        if (state->started)
+            numeric_dispose(&state->best);
+        state->best = x;
+        state->started = true;
+    }
+    else
+        numeric_dispose(&x);
+}
+
+
+static void
+min_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    (void) argc;
+    minmax_step(ctx, argv[0], -1);
+}
+
+
+static void
+max_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    (void) argc;
+    minmax_step(ctx, argv[0], 1);
+}
+
+
+static void
+minmax_final(sqlite3_context *ctx)
+{
+    minmax_state *state = (minmax_state *) sqlite3_aggregate_context(ctx, 0);
+
+    if (state == NULL || !state->started)
+        return;
+
+    result_numeric(ctx, &state->best);
+    numeric_dispose(&state->best);
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * NUMERIC collation
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * collate_key() -
+ *
+ *  Build the collation key of the text str[0 .. len-1]: its sort key, or
+ *  COLLATE_TEXT and the text itself if it does not parse.  The key is put
+ *  in buf, which holds COLLATE_KEY_LEN bytes, if it fits, and otherwise in
+ *  a block from sqlite3_malloc().  Returns NULL when out of memory.
+ */
+static unsigned char *
+collate_key(const void *str, int len, unsigned char *buf, size_t *keylen)
+{
+    char        text[COLLATE_KEY_LEN];
+    char       *cstr = text;
+    unsigned char *key = NULL;
+    numeric     x;
+    size_t      maxlen;
+
+    if (len >= COLLATE_KEY_LEN &&
+        (cstr = (char *) sqlite3_malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(cstr, str, len);
+    cstr[len] = '\0';
+
+    numeric_init(&x);
+    if (numeric_from_str(cstr, -1, -1, &x) == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        maxlen = numeric_sortkey_max_length(&x);
+        key = (maxlen <= COLLATE_KEY_LEN) ? buf :
+            (unsigned char *) sqlite3_malloc((int) maxlen);
+        if (key != NULL && numeric_sortkey(&x, key, maxlen, keylen) !=
+            NUMERIC_ERRCODE_NO_ERROR)
+        {
+            /* out of range for a key; order it as text */
+            if (key != buf)
+                sqlite3_free(key);
+            key = NULL;
+        }
+    }
+    numeric_dispose(&x);
+
+    if (key == NULL)
+    {
+        maxlen = (size_t) len + 1;
+        key = (maxlen <= COLLATE_KEY_LEN) ? buf :
+            (unsigned char *) sqlite3_malloc((int) maxlen);
+        if (key != NULL)
+        {
+            key[0] = COLLATE_TEXT;
+            memcpy(key + 1, str, len);
+            *keylen = maxlen;
+        }
+    }
+
+    if (cstr != text)
+        sqlite3_free(cstr);
+    return key;
+}
+
+
+static int
+collate_numeric(void *arg, int len1, const void *str1, int len2,
+        const void *str2)
+{
+    unsigned char buf1[COLLATE_KEY_LEN];
+    unsigned char buf2[COLLATE_KEY_LEN];
+    unsigned char *key1;
+    unsigned char *key2;
+    size_t      keylen1 = 0;
+    size_t      keylen2 = 0;
+    int         c;
+
+    (void) arg;
+    key1 = collate_key(str1, len1, buf1, &keylen1);
+    key2 = collate_key(str2, len2, buf2, &keylen2);
+    if (key1 == NULL || key2 == NULL)
+    {
+        /* a collation cannot fail; fall back to byte order */
+        key1 = key1 ? key1 : buf1;
+        key2 = key2 ? key2 : buf2;
+        keylen1 = keylen2 = 0;
+        c = memcmp(str1, str2, len1 < len2 ? len1 : len2);
+        if (c == 0)
+            c = (len1 > len2) - (len1 < len2);
+    }
+    else
+    {
+        c = memcmp(key1, key2, keylen1 < keylen2 ? keylen1 : keylen2);
+        if (c == 0)
+            c = (keylen1 > keylen2) - (keylen1 < keylen2);
+    }
+
+    if (key1 != buf1)
+        sqlite3_free(key1);
+    if (key2 != buf2)
+        sqlite3_free(key2);
+    return c;
+}
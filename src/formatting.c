@@ -0,0 +1,662 @@
+/*-------------------------------------------------------------------------
+ *
+ * formatting.c
+ *    to_char-style formatting of numeric values.
+ *
+ * This is a standalone subset of the numeric part of PostgreSQL's
+ * to_char().  A pattern is compiled once into a numeric_format, which then
+ * renders values straight from their NBASE digits into a caller-supplied
+ * buffer.  Rounding to the pattern's fractional positions is done on the
+ * fly, so no intermediate string or copy of the value is needed.
+ *
+ * Supported pattern elements:
+ *
+ *  9       digit position (leading zeroes are blank)
+ *  0       digit position (leading zeroes are printed from here on)
+ *  . D     decimal point (D uses the locale's decimal point)
+ *  , G     group separator (G uses the locale's separator)
+ *  L       currency symbol
+ *  S       sign anchored to the number (+ or -)
+ *  MI      minus sign in the given position (blank for positive values)
+ *  PR      negative value in angle brackets (must be last)
+ *  FM      fill mode: suppress padding blanks and trailing zeroes
+ *  "..."   literal text
+ *
+ * Any other character is copied to the output as is.
+ *
+ * Portions Copyright (c) 1999-2010, PostgreSQL Global Development Group
+ *
+ * IDENTIFICATION
+ *    $PostgreSQL: pgsql/src/backend/utils/adt/formatting.c,v 1.167 2010/02/26 02:01:08 momjian Exp $
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "numeric.h"
+
+extern int pg_strncasecmp(const char *s1, const char *s2, size_t n);
+
+#define Max(x, y)       ((x) > (y) ? (x) : (y))
+#define Min(x, y)       ((x) < (y) ? (x) : (y))
+
+/* ----------
+ * Format nodes
+ * ----------
+ */
+typedef enum
+{
+    NODE_DIGIT,                 /* 9 or 0 */
+    NODE_DECIMAL,               /* . or D */
+    NODE_GROUP,                 /* , or G */
+    NODE_CURRENCY,              /* L */
+    NODE_SIGN,                  /* S */
+    NODE_MINUS,                 /* MI */
+    NODE_BRACKET,               /* PR */
+    NODE_LITERAL                /* anything else */
+} format_node_type;
+
+typedef struct format_node
+{
+    format_node_type type;
+    int         exponent;       /* NODE_DIGIT: decimal exponent (10^n) */
+    int         offset;         /* NODE_LITERAL: start in pattern copy */
+    int         length;         /* NODE_LITERAL: byte length */
+} format_node;
+
+#define NUMERIC_FORMAT_MAX_SYMBOL   16
+
+struct numeric_format
+{
+    format_node *nodes;
+    int         nnodes;
+    char       *literals;       /* copy of the pattern, for NODE_LITERAL */
+    int         int_digits;     /* digit positions before decimal point */
+    int         frac_digits;    /* digit positions after decimal point */
+    int         zero_start;     /* highest exponent with a '0', or INT_MIN */
+    int         zero_end;       /* lowest exponent with a '0', or INT_MAX */
+    bool        fill_mode;      /* FM */
+    bool        sign_lead;      /* S, PR or default sign before digits */
+    format_node_type sign_type; /* NODE_SIGN, NODE_MINUS, NODE_BRACKET, or
+                                 * NODE_DIGIT for the default sign */
+    size_t      max_length;     /* output bytes including terminator */
+    char        currency[NUMERIC_FORMAT_MAX_SYMBOL];
+    char        decimal_point[NUMERIC_FORMAT_MAX_SYMBOL];
+    char        thousands_sep[NUMERIC_FORMAT_MAX_SYMBOL];
+};
+
+static const numeric_format_locale default_locale = {"$", ".", ","};
+
+#if DEC_DIGITS == 4
+static const int digit_powers[4] = {1, 10, 100, 1000};
+#elif DEC_DIGITS == 2
+static const int digit_powers[2] = {1, 10};
+#elif DEC_DIGITS == 1
+static const int digit_powers[1] = {1};
+#else
+#error unsupported NBASE
+#endif
+
+static int decimal_digit(const numeric *num, int exponent);
+static int top_exponent(const numeric *num);
+static numeric_errcode_t add_node(numeric_format *fmt, int *allocated,
+                format_node_type type);
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Pattern compilation
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_format_compile() -
+ *
+ *  Compile a to_char-style pattern.  locale supplies the strings used for
+ *  L, D and G; NULL means "$", "." and ",".  The compiled format must be
+ *  released with numeric_format_free().
+ */
+numeric_errcode_t
+numeric_format_compile(const char *pattern, const numeric_format_locale *locale,
+        numeric_format **result)
+{
+    numeric_format *fmt;
+    int         allocated = 0;
+    bool        have_decimal = false;
+    bool        have_digit = false;
+    int         i;
+    int         exponent;
+    const char *cp;
+    numeric_errcode_t errcode;
+
+    if (locale == NULL)
+        locale = &default_locale;
+    if (strlen(locale->currency_symbol) >= NUMERIC_FORMAT_MAX_SYMBOL ||
+        strlen(locale->decimal_point) >= NUMERIC_FORMAT_MAX_SYMBOL ||
+        strlen(locale->thousands_sep) >= NUMERIC_FORMAT_MAX_SYMBOL)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    fmt = (numeric_format *) calloc(1, sizeof(numeric_format));
+    if (!fmt)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    fmt->literals = strdup(pattern);
+    if (!fmt->literals)
+    {
+        numeric_format_free(fmt);
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+    strcpy(fmt->currency, locale->currency_symbol);
+    strcpy(fmt->decimal_point, locale->decimal_point);
+    strcpy(fmt->thousands_sep, locale->thousands_sep);
+    fmt->sign_type = NODE_DIGIT;
+    fmt->zero_start = INT_MIN;
+    fmt->zero_end = INT_MAX;
+
+    /*
+     * First pass: build the node list.  Digit exponents can only be assigned
+     * once we know how many integer positions there are, so we store the
+     * position number for now.
+     */
+    cp = pattern;
+    while (*cp)
+    {
+        format_node_type type;
+        int         len = 1;
+        bool        is_zero = false;
+
+        if (*cp == '9' || *cp == '0')
+        {
+            type = NODE_DIGIT;
+            is_zero = (*cp == '0');
+        }
+        else if (*cp == '.' || *cp == 'D' || *cp == 'd')
+            type = NODE_DECIMAL;
+        else if (*cp == ',' || *cp == 'G' || *cp == 'g')
+            type = NODE_GROUP;
+        else if (*cp == 'L' || *cp == 'l')
+            type = NODE_CURRENCY;
+        else if (*cp == 'S' || *cp == 's')
+            type = NODE_SIGN;
+        else if (pg_strncasecmp(cp, "MI", 2) == 0)
+        {
+            type = NODE_MINUS;
+            len = 2;
+        }
+        else if (pg_strncasecmp(cp, "PR", 2) == 0)
+        {
+            type = NODE_BRACKET;
+            len = 2;
+        }
+        else if (pg_strncasecmp(cp, "FM", 2) == 0)
+        {
+            fmt->fill_mode = true;
+            cp += 2;
+            continue;
+        }
+        else if (*cp == '"')
+        {
+            /* Quoted literal text, up to the closing quote */
+            const char *end = strchr(cp + 1, '"');
+
+            if (end == NULL)
+            {
+                numeric_format_free(fmt);
+                return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            }
+            errcode = add_node(fmt, &allocated, NODE_LITERAL);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            {
+                numeric_format_free(fmt);
+                return errcode;
+            }
+            fmt->nodes[fmt->nnodes - 1].offset = cp + 1 - pattern;
+            fmt->nodes[fmt->nnodes - 1].length = end - cp - 1;
+            cp = end + 1;
+            continue;
+        }
+        else
+            type = NODE_LITERAL;
+
+        /* Reject what we cannot give a meaning to */
+        if ((type == NODE_DECIMAL && have_decimal) ||
+            ((type == NODE_SIGN || type == NODE_MINUS ||
+              type == NODE_BRACKET) && fmt->sign_type != NODE_DIGIT) ||
+            (type == NODE_BRACKET && cp[2] != '\0'))
+        {
+            numeric_format_free(fmt);
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        }
+
+        errcode = add_node(fmt, &allocated, type);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            numeric_format_free(fmt);
+            return errcode;
+        }
+
+        switch (type)
+        {
+            case NODE_DIGIT:
+                have_digit = true;
+                if (have_decimal)
+                {
+                    fmt->frac_digits++;
+                    if (is_zero)
+                        fmt->zero_end = -fmt->frac_digits;
+                }
+                else
+                {
+                    fmt->int_digits++;
+                    if (is_zero && fmt->zero_start == INT_MIN)
+                        fmt->zero_start = -fmt->int_digits;
+                }
+                break;
+            case NODE_DECIMAL:
+                have_decimal = true;
+                break;
+            case NODE_SIGN:
+            case NODE_MINUS:
+            case NODE_BRACKET:
+                fmt->sign_type = type;
+                /* MI always prints in its own position */
+                fmt->sign_lead = (type != NODE_MINUS) &&
+                    !have_digit && !have_decimal;
+                break;
+            case NODE_LITERAL:
+                fmt->nodes[fmt->nnodes - 1].offset = cp - pattern;
+                fmt->nodes[fmt->nnodes - 1].length = 1;
+                break;
+            default:
+                break;
+        }
+
+        cp += len;
+    }
+
+    if (fmt->int_digits + fmt->frac_digits > NUMERIC_MAX_PRECISION)
+    {
+        numeric_format_free(fmt);
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
+
+    /* The default sign and PR's '<' go just before the first digit */
+    if (fmt->sign_type == NODE_DIGIT || fmt->sign_type == NODE_BRACKET)
+        fmt->sign_lead = true;
+
+    /*
+     * Second pass: assign decimal exponents to the digit positions, and the
+     * exponent of the first leading-zero position, and add up the longest
+     * possible output.
+     */
+    if (fmt->zero_start != INT_MIN)
+        fmt->zero_start += fmt->int_digits;
+
+    exponent = fmt->int_digits - 1;
+    fmt->max_length = 1;        /* terminator */
+    if (fmt->sign_type == NODE_DIGIT || fmt->sign_type == NODE_BRACKET)
+        fmt->max_length++;      /* sign slot before the first digit */
+    for (i = 0; i < fmt->nnodes; i++)
+    {
+        format_node *node = &fmt->nodes[i];
+
+        switch (node->type)
+        {
+            case NODE_DIGIT:
+                node->exponent = exponent--;
+                fmt->max_length++;
+                break;
+            case NODE_DECIMAL:
+                fmt->max_length += strlen(fmt->decimal_point);
+                break;
+            case NODE_GROUP:
+                fmt->max_length += Max(strlen(fmt->thousands_sep), 1);
+                break;
+            case NODE_CURRENCY:
+                fmt->max_length += strlen(fmt->currency);
+                break;
+            case NODE_SIGN:
+            case NODE_MINUS:
+            case NODE_BRACKET:
+                fmt->max_length++;
+                break;
+            case NODE_LITERAL:
+                fmt->max_length += node->length;
+                break;
+        }
+    }
+    /* NaN is printed as is, however short the pattern */
+    fmt->max_length = Max(fmt->max_length, sizeof("NaN"));
+
+    *result = fmt;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * numeric_format_free() -
+ *
+ *  Release a compiled format
+ */
+void
+numeric_format_free(numeric_format *fmt)
+{
+    if (fmt == NULL)
+        return;
+    free(fmt->nodes);
+    free(fmt->literals);
+    free(fmt);
+}
+
+/*
+ * numeric_format_max_length() -
+ *
+ *  Return the buffer size, including the terminator, that is always large
+ *  enough for numeric_format_render() with this format.
+ */
+size_t
+numeric_format_max_length(const numeric_format *fmt)
+{
+    return fmt->max_length;
+}
+
+/*
+ * add_node() -
+ *
+ *  Append a node of the given type to fmt's node list
+ */
+static numeric_errcode_t
+add_node(numeric_format *fmt, int *allocated, format_node_type type)
+{
+    if (fmt->nnodes >= *allocated)
+    {
+        int         newsize = Max(*allocated * 2, 16);
+        format_node *nodes;
+
+        nodes = (format_node *) realloc(fmt->nodes,
+                                        newsize * sizeof(format_node));
+        if (!nodes)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        fmt->nodes = nodes;
+        *allocated = newsize;
+    }
+    memset(&fmt->nodes[fmt->nnodes], 0, sizeof(format_node));
+    fmt->nodes[fmt->nnodes].type = type;
+    fmt->nnodes++;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Rendering
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_format_render() -
+ *
+ *  Render num according to fmt into buf, which must hold at least
+ *  numeric_format_max_length(fmt) bytes.  The output is NUL-terminated;
+ *  its length without the terminator is stored into *length if that is
+ *  not NULL.
+ *
+ *  The value is rounded half away from zero to the pattern's fractional
+ *  positions.  If its integral part does not fit the pattern, every digit
+ *  position is filled with '#', as to_char does.
+ */
+numeric_errcode_t
+numeric_format_render(const numeric_format *fmt, const numeric *num,
+        char *buf, size_t buflen, size_t *length)
+{
+    char       *cp = buf;
+    int         top;
+    int         round_at = INT_MIN;     /* exponent receiving the carry */
+    int         frac_end;               /* lowest exponent to print */
+    bool        negative;
+    bool        overflow = false;
+    bool        started = false;
+    bool        sign_done;
+    int         i;
+
+    if (buflen < fmt->max_length)
+        return NUMERIC_ERRCODE_BUFFER_TOO_SMALL;
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        strcpy(buf, "NaN");
+        if (length)
+            *length = 3;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /*
+     * Work out the rounding.  If the first dropped digit is 5 or more, the
+     * lowest printed digit that is not a 9 is incremented and the 9s below
+     * it become 0s.  Doing this up front lets us emit the digits in a single
+     * left-to-right pass.
+     */
+    top = top_exponent(num);
+    if (top >= -fmt->frac_digits - 1 &&
+        decimal_digit(num, -fmt->frac_digits - 1) >= 5)
+    {
+        round_at = -fmt->frac_digits;
+        while (round_at <= top && decimal_digit(num, round_at) == 9)
+            round_at++;
+        top = Max(top, round_at);
+    }
+    else if (top < -fmt->frac_digits)
+        top = INT_MIN;          /* rounds to zero */
+
+    if (top >= fmt->int_digits)
+        overflow = true;
+
+    negative = (num->sign == NUMERIC_NEG && top != INT_MIN);
+
+    /* In fill mode, trailing fractional zeroes are dropped up to any '0' */
+    frac_end = -fmt->frac_digits;
+    if (fmt->fill_mode && !overflow)
+    {
+        int         last_zero = (fmt->zero_end == INT_MAX) ? 0 : fmt->zero_end;
+
+        while (frac_end < last_zero)
+        {
+            int         dig = decimal_digit(num, frac_end);
+
+            if (round_at != INT_MIN)
+            {
+                if (frac_end < round_at)
+                    dig = 0;
+                else if (frac_end == round_at)
+                    dig++;
+            }
+            if (dig != 0)
+                break;
+            frac_end++;
+        }
+    }
+
+    sign_done = !fmt->sign_lead;
+
+    for (i = 0; i < fmt->nnodes; i++)
+    {
+        const format_node *node = &fmt->nodes[i];
+
+        /*
+         * The leading sign goes right before the first printed digit, or
+         * before the decimal point if no integral digit is printed.
+         */
+        if (!sign_done &&
+            (node->type == NODE_DECIMAL ||
+             (node->type == NODE_DIGIT &&
+              (overflow || node->exponent <= top ||
+               node->exponent <= fmt->zero_start || node->exponent < 0 ||
+               (node->exponent == 0 && fmt->frac_digits == 0)))))
+        {
+            switch (fmt->sign_type)
+            {
+                case NODE_SIGN:
+                    *cp++ = negative ? '-' : '+';
+                    break;
+                case NODE_BRACKET:
+                    if (negative)
+                        *cp++ = '<';
+                    else if (!fmt->fill_mode)
+                        *cp++ = ' ';
+                    break;
+                default:
+                    if (negative)
+                        *cp++ = '-';
+                    else if (!fmt->fill_mode)
+                        *cp++ = ' ';
+                    break;
+            }
+            sign_done = true;
+            started = true;
+        }
+
+        switch (node->type)
+        {
+            case NODE_DIGIT:
+                if (overflow)
+                    *cp++ = '#';
+                else if (started || node->exponent < 0)
+                {
+                    int         dig;
+
+                    if (node->exponent < frac_end)
+                        break;
+                    dig = decimal_digit(num, node->exponent);
+                    if (round_at != INT_MIN)
+                    {
+                        if (node->exponent < round_at)
+                            dig = 0;
+                        else if (node->exponent == round_at)
+                            dig++;
+                    }
+                    *cp++ = '0' + dig;
+                }
+                else if (node->exponent <= top ||
+                         node->exponent <= fmt->zero_start ||
+                         (node->exponent == 0 && fmt->frac_digits == 0))
+                {
+                    /* First printed digit when there's no leading sign */
+                    started = true;
+                    i--;
+                    continue;
+                }
+                else if (!fmt->fill_mode)
+                    *cp++ = ' ';
+                break;
+            case NODE_DECIMAL:
+                started = true;
+                strcpy(cp, fmt->decimal_point);
+                cp += strlen(fmt->decimal_point);
+                break;
+            case NODE_GROUP:
+                if (started || overflow)
+                {
+                    strcpy(cp, fmt->thousands_sep);
+                    cp += strlen(fmt->thousands_sep);
+                }
+                else if (!fmt->fill_mode)
+                    *cp++ = ' ';
+                break;
+            case NODE_CURRENCY:
+                strcpy(cp, fmt->currency);
+                cp += strlen(fmt->currency);
+                break;
+            case NODE_SIGN:
+                if (!fmt->sign_lead)
+                    *cp++ = negative ? '-' : '+';
+                break;
+            case NODE_MINUS:
+                if (negative)
+                    *cp++ = '-';
+                else if (!fmt->fill_mode)
+                    *cp++ = ' ';
+                break;
+            case NODE_BRACKET:
+                if (negative)
+                    *cp++ = '>';
+                else if (!fmt->fill_mode)
+                    *cp++ = ' ';
+                break;
+            case NODE_LITERAL:
+                memcpy(cp, fmt->literals + node->offset, node->length);
+                cp += node->length;
+                break;
+        }
+    }
+
+    *cp = '\0';
+    if (length)
+        *length = cp - buf;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * decimal_digit() -
+ *
+ *  Return the decimal digit of ABS(num) at the given decimal exponent,
+ *  reading it directly from the NBASE digits.
+ */
+static int
+decimal_digit(const numeric *num, int exponent)
+{
+    int         nbase_exponent;
+    int         i;
+
+    /* floor(exponent / DEC_DIGITS), also for negative exponents */
+    if (exponent >= 0)
+        nbase_exponent = exponent / DEC_DIGITS;
+    else
+        nbase_exponent = -((-exponent + DEC_DIGITS - 1) / DEC_DIGITS);
+
+    i = num->weight - nbase_exponent;
+    if (i < 0 || i >= num->ndigits)
+        return 0;
+
+    return (num->digits[i] /
+            digit_powers[exponent - nbase_exponent * DEC_DIGITS]) % 10;
+}
+
+/*
+ * top_exponent() -
+ *
+ *  Return the decimal exponent of the most significant nonzero digit of
+ *  num, or INT_MIN if num is zero.
+ */
+static int
+top_exponent(const numeric *num)
+{
+    int         i;
+    int         exponent;
+
+    for (i = 0; i < num->ndigits; i++)
+    {
+        if (num->digits[i] != 0)
+        {
+            exponent = (num->weight - i) * DEC_DIGITS;
+#if DEC_DIGITS > 1
+            {
+                int         pow10 = 1;
+
+                while (pow10 * 10 <= num->digits[i])
+                {
+                    pow10 *= 10;
+                    exponent++;
+                }
+            }
+#endif
+            return exponent;
+        }
+    }
+    return INT_MIN;
+}
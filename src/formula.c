@@ -0,0 +1,972 @@
+/*-------------------------------------------------------------------------
+ *
+ * formula.c
+ *    Compiled arithmetic formulas over numeric values.
+ *
+ * A formula such as "round(price * qty * (1 + rate / 100), 2)" is parsed
+ * once into a short register-based program whose instructions call the
+ * numeric_* functions directly.  Sub-expressions that only involve
+ * constants are evaluated at compile time, so literals are parsed and
+ * folded exactly once.  The registers are owned by the compiled formula
+ * and reused from row to row.
+ *
+ * The arithmetic operators, round() and trunc() use the numeric_var_*
+ * working-variable functions, so intermediate values are not copied into
+ * exact-size numerics between instructions; the result is finalized once
+ * at the end.  Every formula owns a digit pool which is attached to the
+ * thread while it runs, so the digit buffers of the registers and of the
+ * temporaries inside the numeric functions are recycled from row to row.
+ * Once the pool has grown to fit a formula's values,
+ * numeric_formula_eval_into() does not allocate at all.
+ *
+ * Grammar (lowest to highest precedence):
+ *
+ *  expr    := term { ('+' | '-') term }
+ *  term    := unary { ('*' | '/' | '%') unary }
+ *  unary   := ('+' | '-') unary | power
+ *  power   := primary [ '^' unary ]
+ *  primary := number | name | name '(' expr { ',' expr } ')' | '(' expr ')'
+ *
+ * Names are matched case-insensitively, first against the built-in
+ * functions (when followed by '('), then against the input names.
+ *
+ * Copyright (c) 2011, Hiroaki Nakamura
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "numeric.h"
+
+typedef struct digit_pool digit_pool;
+
+extern int pg_strncasecmp(const char *s1, const char *s2, size_t n);
+extern digit_pool *digit_pool_create(void);
+extern void digit_pool_destroy(digit_pool *pool);
+extern digit_pool *digit_pool_attach(digit_pool *pool);
+extern void digit_pool_detach(digit_pool *pool, digit_pool *prev,
+                const numeric *keep, int nkeep);
+
+#define Max(x, y)       ((x) > (y) ? (x) : (y))
+
+#define FORMULA_MAX_ARGS    2
+#define FORMULA_MAX_DEPTH   128 /* nesting of unary operands */
+
+/* ----------
+ * Operands and instructions
+ * ----------
+ */
+typedef enum
+{
+    OPERAND_INPUT,              /* index into the row's inputs */
+    OPERAND_CONST,              /* index into formula->consts */
+    OPERAND_REG                 /* index into formula->regs */
+} formula_operand_kind;
+
+typedef struct formula_operand
+{
+    formula_operand_kind kind;
+    int         index;
+} formula_operand;
+
+typedef numeric_errcode_t (*formula_unary_fn) (const numeric *num,
+        numeric *result);
+typedef numeric_errcode_t (*formula_binary_fn) (const numeric *num1,
+        const numeric *num2, numeric *result);
+typedef numeric_errcode_t (*formula_scale_fn) (const numeric *num, int scale,
+        numeric *result);
+
+typedef enum
+{
+    FORMULA_UNARY,
+    FORMULA_BINARY,
+    FORMULA_SCALE               /* second argument is an int32 scale */
+} formula_fn_kind;
+
+typedef struct formula_insn
+{
+    formula_fn_kind kind;
+    union
+    {
+        formula_unary_fn unary;
+        formula_binary_fn binary;
+        formula_scale_fn scale;
+    }           fn;
+    formula_operand dst;
+    int         nargs;
+    formula_operand arg[FORMULA_MAX_ARGS];
+    int         scale;          /* FORMULA_SCALE with a constant scale */
+    bool        const_scale;
+} formula_insn;
+
+struct numeric_formula
+{
+    formula_insn *insns;
+    int         ninsns;
+    numeric    *consts;
+    int         nconsts;
+    numeric    *regs;
+    int         nregs;
+    int         ninputs;
+    formula_operand result;
+    digit_pool *pool;           /* digit buffers, attached while running */
+};
+
+/* ----------
+ * Built-in functions
+ * ----------
+ */
+typedef struct formula_builtin
+{
+    const char *name;
+    formula_fn_kind kind;
+    int         min_args;
+    void        (*fn) (void);
+} formula_builtin;
+
+#define BUILTIN(name, kind, min_args, fn) \
+    {name, kind, min_args, (void (*) (void)) fn}
+
+static const formula_builtin builtins[] = {
+    BUILTIN("abs", FORMULA_UNARY, 1, numeric_abs),
+    BUILTIN("sign", FORMULA_UNARY, 1, numeric_sign),
+    BUILTIN("ceil", FORMULA_UNARY, 1, numeric_ceil),
+    BUILTIN("floor", FORMULA_UNARY, 1, numeric_floor),
+    BUILTIN("sqrt", FORMULA_UNARY, 1, numeric_sqrt),
+    BUILTIN("exp", FORMULA_UNARY, 1, numeric_exp),
+    BUILTIN("ln", FORMULA_UNARY, 1, numeric_ln),
+    BUILTIN("log10", FORMULA_UNARY, 1, numeric_log10),
+    BUILTIN("power", FORMULA_BINARY, 2, numeric_power),
+    BUILTIN("mod", FORMULA_BINARY, 2, numeric_mod),
+    BUILTIN("div", FORMULA_BINARY, 2, numeric_div_trunc),
+    BUILTIN("min", FORMULA_BINARY, 2, numeric_min),
+    BUILTIN("max", FORMULA_BINARY, 2, numeric_max),
+    BUILTIN("round", FORMULA_SCALE, 1, numeric_var_round),
+    BUILTIN("trunc", FORMULA_SCALE, 1, numeric_var_trunc),
+    {NULL, FORMULA_UNARY, 0, NULL}
+};
+
+/* ----------
+ * Parser state
+ * ----------
+ */
+typedef struct formula_parser
+{
+    const char *cp;
+    const char *const *names;
+    numeric_formula *formula;
+    int         insns_allocated;
+    int         consts_allocated;
+    int         nregs;          /* registers in use (a stack) */
+    int         depth;          /* nesting of parse_unary() calls */
+} formula_parser;
+
+static numeric_errcode_t formula_mul(const numeric *num1,
+                const numeric *num2, numeric *result);
+static numeric_errcode_t formula_div(const numeric *num1,
+                const numeric *num2, numeric *result);
+static numeric_errcode_t parse_expr(formula_parser *p, formula_operand *op);
+static numeric_errcode_t parse_term(formula_parser *p, formula_operand *op);
+static numeric_errcode_t parse_unary(formula_parser *p, formula_operand *op);
+static numeric_errcode_t parse_power(formula_parser *p, formula_operand *op);
+static numeric_errcode_t parse_primary(formula_parser *p,
+                formula_operand *op);
+static numeric_errcode_t parse_number(formula_parser *p, formula_operand *op);
+static numeric_errcode_t parse_call(formula_parser *p,
+                const formula_builtin *builtin, formula_operand *op);
+static numeric_errcode_t emit(formula_parser *p, formula_fn_kind kind,
+                void (*fn) (void), int nargs, const formula_operand *args,
+                formula_operand *op);
+static numeric_errcode_t add_const(formula_parser *p, numeric *value,
+                formula_operand *op);
+static void skip_space(formula_parser *p);
+static const numeric *operand_value(const numeric_formula *formula,
+                const numeric *inputs, formula_operand op);
+static numeric_errcode_t run_insns(numeric_formula *formula,
+                const numeric *inputs, numeric *result);
+static numeric_errcode_t run_insn(const formula_insn *insn,
+                const numeric *args[], numeric *dst);
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Compilation
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_formula_compile() -
+ *
+ *  Compile expr into a formula over nnames inputs called names[0 ..
+ *  nnames-1]; at evaluation time the inputs are passed in the same order.
+ *  Returns NUMERIC_ERRCODE_INVALID_ARGUMENT for a syntax error, an unknown
+ *  name or operands nested more than FORMULA_MAX_DEPTH deep, and any error
+ *  raised while folding constant sub-expressions.
+ */
+numeric_errcode_t
+numeric_formula_compile(const char *expr, const char *const *names,
+        int nnames, numeric_formula **result)
+{
+    formula_parser parser;
+    numeric_formula *formula;
+    formula_operand op;
+    numeric_errcode_t errcode;
+
+    formula = (numeric_formula *) calloc(1, sizeof(numeric_formula));
+    if (!formula)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    formula->ninputs = nnames;
+
+    memset(&parser, 0, sizeof(parser));
+    parser.cp = expr;
+    parser.names = names;
+    parser.formula = formula;
+
+    errcode = parse_expr(&parser, &op);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        skip_space(&parser);
+        if (*parser.cp != '\0')
+            errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        formula->pool = digit_pool_create();
+        if (!formula->pool)
+            errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR && formula->nregs > 0)
+    {
+        int         i;
+
+        formula->regs = (numeric *) malloc(formula->nregs * sizeof(numeric));
+        if (!formula->regs)
+            errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        else
+        {
+            for (i = 0; i < formula->nregs; i++)
+                numeric_init(&formula->regs[i]);
+        }
+    }
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_formula_free(formula);
+        return errcode;
+    }
+
+    formula->result = op;
+    *result = formula;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * numeric_formula_free() -
+ *
+ *  Release a compiled formula
+ */
+void
+numeric_formula_free(numeric_formula *formula)
+{
+    int         i;
+
+    if (formula == NULL)
+        return;
+    for (i = 0; i < formula->nconsts; i++)
+        numeric_dispose(&formula->consts[i]);
+    if (formula->regs)
+    {
+        digit_pool *prev = digit_pool_attach(formula->pool);
+
+        /* the register buffers go back to the pool, which frees them */
+        for (i = 0; i < formula->nregs; i++)
+            numeric_dispose(&formula->regs[i]);
+        digit_pool_attach(prev);
+    }
+    digit_pool_destroy(formula->pool);
+    free(formula->consts);
+    free(formula->regs);
+    free(formula->insns);
+    free(formula);
+}
+
+
+/*
+ * parse_expr() -
+ *
+ *  expr := term { ('+' | '-') term }
+ */
+static numeric_errcode_t
+parse_expr(formula_parser *p, formula_operand *op)
+{
+    formula_operand args[2];
+    numeric_errcode_t errcode;
+
+    errcode = parse_term(p, &args[0]);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    for (;;)
+    {
+        formula_binary_fn fn;
+
+        skip_space(p);
+        if (*p->cp == '+')
+            fn = numeric_var_add;
+        else if (*p->cp == '-')
+            fn = numeric_var_sub;
+        else
+            break;
+        p->cp++;
+
+        errcode = parse_term(p, &args[1]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        errcode = emit(p, FORMULA_BINARY, (void (*) (void)) fn, 2, args,
+                       &args[0]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+    }
+
+    *op = args[0];
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * parse_term() -
+ *
+ *  term := unary { ('*' | '/' | '%') unary }
+ */
+static numeric_errcode_t
+parse_term(formula_parser *p, formula_operand *op)
+{
+    formula_operand args[2];
+    numeric_errcode_t errcode;
+
+    errcode = parse_unary(p, &args[0]);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    for (;;)
+    {
+        formula_binary_fn fn;
+
+        skip_space(p);
+        if (*p->cp == '*')
+            fn = formula_mul;
+        else if (*p->cp == '/')
+            fn = formula_div;
+        else if (*p->cp == '%')
+            fn = numeric_mod;
+        else
+            break;
+        p->cp++;
+
+        errcode = parse_unary(p, &args[1]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        errcode = emit(p, FORMULA_BINARY, (void (*) (void)) fn, 2, args,
+                       &args[0]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+    }
+
+    *op = args[0];
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * parse_unary() -
+ *
+ *  unary := ('+' | '-') unary | power
+ */
+static numeric_errcode_t
+parse_unary(formula_parser *p, formula_operand *op)
+{
+    numeric_errcode_t errcode;
+
+    /* Every nesting of the grammar goes through here; bound the stack */
+    if (p->depth >= FORMULA_MAX_DEPTH)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    p->depth++;
+
+    skip_space(p);
+    if (*p->cp == '+')
+    {
+        p->cp++;
+        errcode = parse_unary(p, op);
+    }
+    else if (*p->cp == '-')
+    {
+        p->cp++;
+        errcode = parse_unary(p, op);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = emit(p, FORMULA_UNARY,
+                           (void (*) (void)) numeric_minus, 1, op, op);
+    }
+    else
+        errcode = parse_power(p, op);
+
+    p->depth--;
+    return errcode;
+}
+
+/*
+ * parse_power() -
+ *
+ *  power := primary [ '^' unary ]
+ *
+ *  '^' is right associative and binds tighter than a unary minus on its
+ *  left: -2 ^ 2 is -4.
+ */
+static numeric_errcode_t
+parse_power(formula_parser *p, formula_operand *op)
+{
+    formula_operand args[2];
+    numeric_errcode_t errcode;
+
+    errcode = parse_primary(p, &args[0]);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    skip_space(p);
+    if (*p->cp == '^')
+    {
+        p->cp++;
+        errcode = parse_unary(p, &args[1]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        return emit(p, FORMULA_BINARY, (void (*) (void)) numeric_power, 2,
+                    args, op);
+    }
+
+    *op = args[0];
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * parse_primary() -
+ *
+ *  primary := number | name | name '(' args ')' | '(' expr ')'
+ */
+static numeric_errcode_t
+parse_primary(formula_parser *p, formula_operand *op)
+{
+    const char *start;
+    size_t      len;
+    int         i;
+    numeric_errcode_t errcode;
+
+    skip_space(p);
+
+    if (*p->cp == '(')
+    {
+        p->cp++;
+        errcode = parse_expr(p, op);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        skip_space(p);
+        if (*p->cp != ')')
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        p->cp++;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    if (isdigit((unsigned char) *p->cp) || *p->cp == '.')
+        return parse_number(p, op);
+
+    if (!isalpha((unsigned char) *p->cp) && *p->cp != '_')
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    start = p->cp;
+    while (isalnum((unsigned char) *p->cp) || *p->cp == '_')
+        p->cp++;
+    len = p->cp - start;
+
+    skip_space(p);
+    if (*p->cp == '(')
+    {
+        for (i = 0; builtins[i].name != NULL; i++)
+        {
+            if (strlen(builtins[i].name) == len &&
+                pg_strncasecmp(start, builtins[i].name, len) == 0)
+            {
+                p->cp++;
+                return parse_call(p, &builtins[i], op);
+            }
+        }
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
+
+    for (i = 0; i < p->formula->ninputs; i++)
+    {
+        if (strlen(p->names[i]) == len &&
+            pg_strncasecmp(start, p->names[i], len) == 0)
+        {
+            op->kind = OPERAND_INPUT;
+            op->index = i;
+            return NUMERIC_ERRCODE_NO_ERROR;
+        }
+    }
+    return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+}
+
+/*
+ * parse_number() -
+ *
+ *  Parse a numeric literal into a new constant
+ */
+static numeric_errcode_t
+parse_number(formula_parser *p, formula_operand *op)
+{
+    const char *start = p->cp;
+    char       *str;
+    numeric     value;
+    numeric_errcode_t errcode;
+
+    while (isdigit((unsigned char) *p->cp) || *p->cp == '.')
+        p->cp++;
+    if ((*p->cp == 'e' || *p->cp == 'E') &&
+        (isdigit((unsigned char) p->cp[1]) ||
+         ((p->cp[1] == '+' || p->cp[1] == '-') &&
+          isdigit((unsigned char) p->cp[2]))))
+    {
+        p->cp += 2;
+        while (isdigit((unsigned char) *p->cp))
+            p->cp++;
+    }
+
+    str = (char *) malloc(p->cp - start + 1);
+    if (!str)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    memcpy(str, start, p->cp - start);
+    str[p->cp - start] = '\0';
+
+    numeric_init(&value);
+    errcode = numeric_from_str(str, -1, -1, &value);
+    free(str);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_dispose(&value);
+        return errcode;
+    }
+
+    return add_const(p, &value, op);
+}
+
+/*
+ * parse_call() -
+ *
+ *  Parse the argument list of a built-in function, after the '('
+ */
+static numeric_errcode_t
+parse_call(formula_parser *p, const formula_builtin *builtin,
+        formula_operand *op)
+{
+    formula_operand args[FORMULA_MAX_ARGS];
+    int         max_args;
+    int         nargs = 0;
+    numeric_errcode_t errcode;
+
+    max_args = (builtin->kind == FORMULA_UNARY) ? 1 : 2;
+
+    for (;;)
+    {
+        if (nargs == max_args)
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        errcode = parse_expr(p, &args[nargs++]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        skip_space(p);
+        if (*p->cp == ')')
+            break;
+        if (*p->cp != ',')
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        p->cp++;
+    }
+    p->cp++;
+
+    if (nargs < builtin->min_args)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    /* round(x) and trunc(x) mean scale 0 */
+    if (builtin->kind == FORMULA_SCALE && nargs == 1)
+    {
+        numeric     zero;
+
+        numeric_init(&zero);
+        errcode = numeric_from_int32(0, &zero);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            numeric_dispose(&zero);
+            return errcode;
+        }
+        errcode = add_const(p, &zero, &args[1]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        nargs = 2;
+    }
+
+    return emit(p, builtin->kind, builtin->fn, nargs, args, op);
+}
+
+/*
+ * emit() -
+ *
+ *  Append an instruction applying fn to args, and return its result
+ *  operand in *op.  If all arguments are constants, the instruction is
+ *  executed right away and its result becomes a new constant instead.
+ *
+ *  Registers are handed out as a stack: the arguments of an instruction
+ *  are always the most recently allocated registers, so they are released
+ *  and the result reuses the first of them.  Every numeric_* function
+ *  allows its result to alias an argument.
+ */
+static numeric_errcode_t
+emit(formula_parser *p, formula_fn_kind kind, void (*fn) (void), int nargs,
+        const formula_operand *args, formula_operand *op)
+{
+    numeric_formula *formula = p->formula;
+    formula_insn insn;
+    bool        all_const = true;
+    int         i;
+    numeric_errcode_t errcode;
+
+    memset(&insn, 0, sizeof(insn));
+    insn.kind = kind;
+    insn.nargs = nargs;
+    switch (kind)
+    {
+        case FORMULA_UNARY:
+            insn.fn.unary = (formula_unary_fn) fn;
+            break;
+        case FORMULA_BINARY:
+            insn.fn.binary = (formula_binary_fn) fn;
+            break;
+        case FORMULA_SCALE:
+            insn.fn.scale = (formula_scale_fn) fn;
+            break;
+    }
+    for (i = 0; i < nargs; i++)
+    {
+        insn.arg[i] = args[i];
+        if (args[i].kind != OPERAND_CONST)
+            all_const = false;
+    }
+
+    /* A constant scale is converted once, here */
+    if (kind == FORMULA_SCALE && args[1].kind == OPERAND_CONST)
+    {
+        int32_t     scale;
+
+        errcode = numeric_to_int32(&formula->consts[args[1].index], &scale);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        insn.scale = scale;
+        insn.const_scale = true;
+    }
+
+    if (all_const)
+    {
+        const numeric *values[FORMULA_MAX_ARGS];
+        numeric     value;
+
+        for (i = 0; i < nargs; i++)
+            values[i] = &formula->consts[args[i].index];
+        numeric_init(&value);
+        errcode = run_insn(&insn, values, &value);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = numeric_finalize(&value);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            numeric_dispose(&value);
+            return errcode;
+        }
+        return add_const(p, &value, op);
+    }
+
+    for (i = nargs - 1; i >= 0; i--)
+    {
+        if (args[i].kind == OPERAND_REG)
+            p->nregs--;
+    }
+    insn.dst.kind = OPERAND_REG;
+    insn.dst.index = p->nregs++;
+    formula->nregs = Max(formula->nregs, p->nregs);
+
+    if (formula->ninsns >= p->insns_allocated)
+    {
+        int         newsize = Max(p->insns_allocated * 2, 8);
+        formula_insn *insns;
+
+        insns = (formula_insn *) realloc(formula->insns,
+                                         newsize * sizeof(formula_insn));
+        if (!insns)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        formula->insns = insns;
+        p->insns_allocated = newsize;
+    }
+    formula->insns[formula->ninsns++] = insn;
+
+    *op = insn.dst;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * add_const() -
+ *
+ *  Take over value as a new constant of the formula
+ */
+static numeric_errcode_t
+add_const(formula_parser *p, numeric *value, formula_operand *op)
+{
+    numeric_formula *formula = p->formula;
+
+    if (formula->nconsts >= p->consts_allocated)
+    {
+        int         newsize = Max(p->consts_allocated * 2, 8);
+        numeric    *consts;
+
+        consts = (numeric *) realloc(formula->consts,
+                                     newsize * sizeof(numeric));
+        if (!consts)
+        {
+            numeric_dispose(value);
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        }
+        formula->consts = consts;
+        p->consts_allocated = newsize;
+    }
+    formula->consts[formula->nconsts] = *value;
+
+    op->kind = OPERAND_CONST;
+    op->index = formula->nconsts++;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * skip_space() -
+ */
+static void
+skip_space(formula_parser *p)
+{
+    while (isspace((unsigned char) *p->cp))
+        p->cp++;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Evaluation
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_formula_eval() -
+ *
+ *  Evaluate a formula for one row.  inputs holds the values for the names
+ *  given to numeric_formula_compile(), in the same order.  The registers
+ *  and the digit pool live in the formula, so a formula must not be
+ *  evaluated by more than one thread at a time.  The only allocation in
+ *  steady state is the digit buffer of result.
+ */
+numeric_errcode_t
+numeric_formula_eval(numeric_formula *formula, const numeric *inputs,
+        numeric *result)
+{
+    digit_pool *prev;
+    numeric_errcode_t errcode;
+
+    /* A formula without instructions is a single input or constant */
+    if (formula->ninsns == 0)
+        return numeric_plus(operand_value(formula, inputs, formula->result),
+                            result);
+
+    prev = digit_pool_attach(formula->pool);
+    errcode = run_insns(formula, inputs, result);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_finalize(result);
+    digit_pool_detach(formula->pool, prev, formula->regs, formula->nregs);
+
+    return errcode;
+}
+
+/*
+ * numeric_formula_eval_into() -
+ *
+ *  Like numeric_formula_eval(), but the result digits are stored into the
+ *  caller's digits[0 .. ndigits-1], as numeric_add_into() does.  Returns
+ *  NUMERIC_ERRCODE_BUFFER_TOO_SMALL if the result does not fit.  Once the
+ *  formula's digit pool has grown to fit the values of the rows seen,
+ *  evaluation does not allocate memory.
+ */
+numeric_errcode_t
+numeric_formula_eval_into(numeric_formula *formula, const numeric *inputs,
+        NumericDigit *digits, int ndigits, numeric *result)
+{
+    digit_pool *prev;
+    const numeric *value;
+    numeric_errcode_t errcode;
+
+    prev = digit_pool_attach(formula->pool);
+    if (formula->ninsns == 0)
+    {
+        value = operand_value(formula, inputs, formula->result);
+        errcode = NUMERIC_ERRCODE_NO_ERROR;
+    }
+    else
+    {
+        /* Leave the value in its register and copy it out from there */
+        value = &formula->regs[formula->insns[formula->ninsns - 1].dst.index];
+        errcode = run_insns(formula, inputs, NULL);
+    }
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_finalize_into(value, digits, ndigits, result);
+    digit_pool_detach(formula->pool, prev, formula->regs, formula->nregs);
+
+    return errcode;
+}
+
+/*
+ * numeric_formula_eval_batch() -
+ *
+ *  Evaluate a formula for nrows rows.  inputs holds nrows rows of inputs
+ *  one after another, each laid out as for numeric_formula_eval(); the
+ *  results are stored into results[0 .. nrows-1].  Stops at the first row
+ *  that raises an error.
+ */
+numeric_errcode_t
+numeric_formula_eval_batch(numeric_formula *formula, const numeric *inputs,
+        int nrows, numeric *results)
+{
+    int         row;
+    numeric_errcode_t errcode;
+
+    for (row = 0; row < nrows; row++)
+    {
+        errcode = numeric_formula_eval(formula,
+                                       inputs + row * formula->ninputs,
+                                       &results[row]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+    }
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * run_insns() -
+ *
+ *  Run the instructions of a formula, the last one writing into result,
+ *  or into its register when result is NULL
+ */
+static numeric_errcode_t
+run_insns(numeric_formula *formula, const numeric *inputs, numeric *result)
+{
+    const numeric *args[FORMULA_MAX_ARGS];
+    int         i;
+    int         j;
+    numeric_errcode_t errcode;
+
+    for (i = 0; i < formula->ninsns; i++)
+    {
+        const formula_insn *insn = &formula->insns[i];
+        numeric    *dst;
+
+        for (j = 0; j < insn->nargs; j++)
+            args[j] = operand_value(formula, inputs, insn->arg[j]);
+
+        /* The last instruction computes the result; write it in place */
+        if (i == formula->ninsns - 1 && result != NULL)
+            dst = result;
+        else
+            dst = &formula->regs[insn->dst.index];
+
+        errcode = run_insn(insn, args, dst);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+    }
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * formula_mul() -
+ *
+ *  The '*' operator: an exact product, as numeric_mul() gives
+ */
+static numeric_errcode_t
+formula_mul(const numeric *num1, const numeric *num2, numeric *result)
+{
+    return numeric_var_mul(num1, num2, result, -1);
+}
+
+/*
+ * formula_div() -
+ *
+ *  The '/' operator: a quotient at the scale numeric_div() chooses
+ */
+static numeric_errcode_t
+formula_div(const numeric *num1, const numeric *num2, numeric *result)
+{
+    return numeric_var_div(num1, num2, result, -1, true);
+}
+
+/*
+ * operand_value() -
+ *
+ *  Return the value an operand refers to
+ */
+static const numeric *
+operand_value(const numeric_formula *formula, const numeric *inputs,
+        formula_operand op)
+{
+    switch (op.kind)
+    {
+        case OPERAND_INPUT:
+            return &inputs[op.index];
+        case OPERAND_CONST:
+            return &formula->consts[op.index];
+        case OPERAND_REG:
+            return &formula->regs[op.index];
+    }
+    return NULL;
+}
+
+/*
+ * run_insn() -
+ *
+ *  Apply an instruction's function to the argument values
+ */
+static numeric_errcode_t
+run_insn(const formula_insn *insn, const numeric *args[], numeric *dst)
+{
+    int32_t     scale;
+    numeric_errcode_t errcode;
+
+    switch (insn->kind)
+    {
+        case FORMULA_UNARY:
+            return insn->fn.unary(args[0], dst);
+        case FORMULA_BINARY:
+            return insn->fn.binary(args[0], args[1], dst);
+        case FORMULA_SCALE:
+            if (insn->const_scale)
+                scale = insn->scale;
+            else
+            {
+                errcode = numeric_to_int32(args[1], &scale);
+                if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                    return errcode;
+            }
+            return insn->fn.scale(args[0], scale, dst);
+    }
+    return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+}
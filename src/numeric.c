@@ -27,9 +27,20 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "numeric.h"
 
+/*
+ * Algorithm crossover thresholds.  pgnumeric-tuneup compiles this file with
+ * NUMERIC_TUNE defined, which turns them into variables it can vary.
+ */
+#ifdef NUMERIC_TUNE
+extern int  tune_div_checked_threshold;
+#define DIV_CHECKED_THRESHOLD   tune_div_checked_threshold
+#endif
+#include "numeric_tune.h"
+
 extern double get_double_nan(void);
 extern double get_float_nan(void);
 extern numeric_errcode_t float_in(const char *num, float *result);
@@ -59,6 +70,13 @@ extern int pg_strncasecmp(const char *s1, const char *s2, size_t n);
  */
 #define Abs(x)          ((x) >= 0 ? (x) : -(x))
 
+/*
+ * INT64_NBASE_DIGITS
+ *      NBASE digits needed for any int64 (at most 19 decimal digits), and
+ *      for a double's DBL_DIG significant digits aligned to NBASE.
+ */
+#define INT64_NBASE_DIGITS  (20 / DEC_DIGITS)
+
 
 /* ----------
  * Uncomment the following to enable compilation of dump_var()
@@ -147,6 +165,202 @@ static const int round_powers[4] = {0, 1000, 100, 10};
 #endif
 
 
+/* ----------
+ * Transcendental result cache
+ *
+ * An optional, bounded LRU cache in front of numeric_sqrt, numeric_exp,
+ * numeric_ln and numeric_power.  Entries are keyed by the function, the
+ * normalised operand(s) (sign, weight and digits; dscale is irrelevant
+ * since the result scale is part of the key) and the result scale.  There is
+ * at most one entry per function and operand: a result computed at a larger
+ * rscale replaces one computed at a smaller rscale, and answers requests
+ * for smaller rscales by rounding.
+ *
+ * All access goes through numeric_cache.lock; the computations themselves
+ * run outside the lock.
+ * ----------
+ */
+typedef struct cache_entry
+{
+    struct cache_entry *hash_next;  /* next entry in the same bucket */
+    struct cache_entry *lru_prev;   /* more recently used neighbour */
+    struct cache_entry *lru_next;   /* less recently used neighbour */
+    uint32_t    hash;
+    numeric_cache_op_t op;
+    int         rscale;
+    numeric     arg1;
+    numeric     arg2;               /* only used by NUMERIC_CACHE_POWER */
+    numeric     value;
+} cache_entry;
+
+static struct
+{
+    pthread_mutex_t lock;
+    int         capacity;           /* 0 means the cache is disabled */
+    int         nbuckets;           /* power of 2 */
+    cache_entry **buckets;
+    cache_entry *lru_head;          /* most recently used */
+    cache_entry *lru_tail;          /* least recently used */
+    numeric_cache_stats stats;
+} numeric_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL, NULL, NULL,
+                   {0, 0, 0, 0, 0}};
+
+/* ----------
+ * Cached value of pi
+ *
+ * pi_var() keeps the most precise value of pi computed so far, and serves
+ * any smaller scale from it by rounding.  Computing it happens under the
+ * lock, so concurrent callers never duplicate the work.
+ * ----------
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    int         rscale;             /* scale of value, -1 if none yet */
+    numeric     value;
+} pi_cache = {PTHREAD_MUTEX_INITIALIZER, -1, {0, 0, NUMERIC_POS, 0, NULL, NULL}};
+
+/* ----------
+ * Work budget attached to the current thread, if any
+ *
+ * mul_var() and the division routines charge their cost in digit
+ * operations with BUDGET_CHARGE(); once the budget is exhausted or
+ * cancelled they return a zero result immediately.  Loops whose progress
+ * depends on those results poll BUDGET_EXHAUSTED() so they cannot spin,
+ * and make_result_into() turns the condition into
+ * NUMERIC_ERRCODE_CANCELLED, so no garbage ever reaches the caller.
+ * ----------
+ */
+static __thread numeric_budget *current_budget = NULL;
+
+#define BUDGET_EXHAUSTED() \
+    (current_budget != NULL && \
+     __atomic_load_n(&current_budget->cancelled, __ATOMIC_RELAXED))
+#define BUDGET_CHARGE(units) \
+    (current_budget != NULL && budget_charge(current_budget, (units)))
+
+/* ----------
+ * Series divisor tables shared by the batch transcendental functions
+ *
+ * While a batch runs, current_series points at tables of k! for
+ * exp_var_internal() and of 2k+1 for ln_var(), plus the value of e at
+ * the working scale last asked for, so that the divisors are built and e
+ * is computed once per batch.  The divisors are exact integers and each
+ * series term is still one division at the caller's scale, so a batch
+ * gives exactly the results of the scalar functions, which the result
+ * cache relies on.
+ * ----------
+ */
+typedef struct series_table
+{
+    int         nterms;         /* terms[0 .. nterms-1] are valid */
+    int         capacity;       /* allocated length of terms[] */
+    numeric    *terms;
+} series_table;
+
+typedef struct series_tables
+{
+    series_table fact;          /* fact.terms[k] = k! */
+    series_table odd;           /* odd.terms[k] = 2k+1 */
+    int         e_rscale;       /* scale of e, -1 if not computed yet */
+    numeric     e;
+} series_tables;
+
+static __thread series_tables *current_series = NULL;
+
+/* ----------
+ * Digit buffer pool attached to the current thread, if any
+ *
+ * While a compiled formula is evaluated, digitbuf_alloc() and the scratch
+ * arrays of mul_var() and the division routines take their memory from
+ * the formula's pool, and freeing them hands the block back to it, so
+ * that repeated evaluation settles on a fixed set of blocks and stops
+ * calling malloc().  Values that outlive the evaluation (the shared
+ * result cache and the cached pi) are allocated with the pool suspended.
+ * ----------
+ */
+typedef struct digit_pool_block
+{
+    void       *ptr;
+    size_t      size;
+    bool        in_use;
+} digit_pool_block;
+
+typedef struct digit_pool
+{
+    int         nblocks;
+    int         capacity;       /* allocated length of blocks[] */
+    digit_pool_block *blocks;
+} digit_pool;
+
+#define DIGIT_POOL_MIN_SIZE     64
+#define DIGIT_POOL_MAX_BLOCKS   256
+
+static __thread digit_pool *current_pool = NULL;
+
+/* Type of numeric_accum.isum */
+#ifdef NUMERIC_HAVE_INT128
+typedef numeric_int128 accum_int;
+#else
+typedef int64_t accum_int;
+#endif
+
+/* ----------
+ * Grouped aggregation state: pending digit sums of one group, and the
+ * groups aggregated by one thread
+ * ----------
+ */
+typedef struct group_limbs
+{
+    int64_t    *limbs;          /* NBASE digit sums, most significant first */
+    int         weight;         /* weight of limbs[0] */
+    int         nlimbs;
+    int         dscale;         /* -1 if no value was added */
+} group_limbs;
+
+typedef enum
+{
+    GROUP_SUM,
+    GROUP_MIN,
+    GROUP_MAX
+} group_op_t;
+
+typedef struct group_task
+{
+    group_op_t  op;
+    const numeric *values;
+    const int  *group_ids;
+    int         n;
+    int         lo;             /* first group aggregated */
+    int         hi;             /* and one past the last */
+    numeric_accum *accums;      /* GROUP_SUM */
+    numeric    *results;        /* GROUP_MIN and GROUP_MAX */
+    bool       *found;
+    numeric_errcode_t errcode;
+} group_task;
+
+/* ----------
+ * Prefix sum state: the rows scanned by one thread
+ * ----------
+ */
+typedef struct prefix_task
+{
+    const numeric *values;
+    int         lo;             /* first row */
+    int         hi;             /* and one past the last */
+    group_limbs total;          /* first pass: sum of the rows */
+    bool        nan;            /* whether one of them is NaN */
+    int         maxweight;      /* highest and lowest weights of their */
+    int         minweight;      /* digits, maxweight < minweight if none */
+    numeric     offset;         /* second pass: sum of the rows before lo */
+    bool        offset_nan;     /* whether one of those is NaN */
+    numeric_array *result;
+    int         weight;         /* weight of the first digit of a slot */
+    int         slot;           /* digits per result */
+    numeric_errcode_t errcode;
+} prefix_task;
+
+
 /* ----------
  * Local functions
  * ----------
@@ -159,17 +373,25 @@ static void dump_var(const char *str, numeric *var);
 #endif
 
 #define digitbuf_alloc(ndigits)  \
-    ((NumericDigit *) malloc((ndigits) * sizeof(NumericDigit)))
+    ((NumericDigit *) pool_alloc((ndigits) * sizeof(NumericDigit)))
 #define digitbuf_free(buf)  \
     do { \
          if ((buf) != NULL) \
-             free(buf); \
+             pool_free(buf); \
     } while (0)
 
 
 #define NUMERIC_DIGITS(num) ((NumericDigit *)(num)->digits)
 #define NUMERIC_NDIGITS(num) ((num)->ndigits)
 
+static void *pool_alloc(size_t size);
+static void *pool_calloc(size_t n, size_t size);
+static void pool_free(void *ptr);
+digit_pool *digit_pool_create(void);
+void digit_pool_destroy(digit_pool *pool);
+digit_pool *digit_pool_attach(digit_pool *pool);
+void digit_pool_detach(digit_pool *pool, digit_pool *prev,
+                const numeric *keep, int nkeep);
 static void alloc_var(numeric *var, int ndigits);
 
 static numeric_errcode_t numeric_out(const numeric *num, char **result);
@@ -178,16 +400,30 @@ static numeric_errcode_t set_var_from_str(const char *str, const char *cp,
 static void copy_var(const numeric *value, numeric *dest);
 static void set_var_from_var(const numeric *value, numeric *dest);
 static char *get_str_from_var(numeric *var, int dscale);
+static size_t str_length_bound(const numeric *var, int dscale);
+static char *put_str_from_var(const numeric *var, int dscale, char *cp);
+static bool textbuf_reserve(numeric_textbuf *buf, size_t extra);
+static bool text_needs_quote(const char *text, const char *delimiter,
+                const char *newline, char quote);
+static char *put_quoted(const char *text, char quote, char *cp);
 static char *get_str_from_var_sci(numeric *var, int rscale);
 
 static numeric_errcode_t make_result(const numeric *var, numeric *result);
+static bool budget_charge(numeric_budget *budget, int64_t units);
+static numeric_errcode_t make_result_into(const numeric *var,
+                NumericDigit *digits_into, int capacity, numeric *result);
 
 static numeric_errcode_t check_bounds_and_round(numeric *var, int precision,
                 int scale);
+static bool round_adds_digit(const numeric *var, int rscale);
 
 static numeric_errcode_t numericvar_to_int32(numeric *var, int32_t *result);
 static bool numericvar_to_int64(numeric *var, int64_t *result);
 static void int64_to_numericvar(int64_t val, numeric *var);
+static void int64_to_view(int64_t val, NumericDigit *digits, numeric *view);
+static void double_to_view(double val, NumericDigit *digits, numeric *view);
+static numeric_errcode_t var_set_nan(numeric *var);
+static void var_prepare(const numeric *var, numeric *result);
 static numeric_errcode_t numericvar_to_double_no_overflow(const numeric *var,
                 double *result);
 
@@ -203,19 +439,52 @@ static void mul_var(const numeric *var1, const numeric *var2, numeric *result,
                 int rscale);
 static numeric_errcode_t div_var(const numeric *var1, const numeric *var2,
                 numeric *result, int rscale, bool round);
-static numeric_errcode_t div_var_fast(numeric *var1, numeric *var2,
-                numeric *result, int rscale, bool round);
+static numeric_errcode_t div_var_fast(const numeric *var1,
+                const numeric *var2, numeric *result, int rscale, bool round);
+static numeric_errcode_t div_var_checked(const numeric *var1,
+                const numeric *var2, numeric *result, int rscale, bool round);
 static int  select_div_scale(const numeric *var1, const numeric *var2);
+static int  select_sqrt_scale(const numeric *var);
+static int  get_min_scale(const numeric *var);
+static numeric_errcode_t select_exp_scale(const numeric *var, int *rscale);
+static int  select_ln_scale(const numeric *var);
+static int  select_trig_scale(const numeric *var, bool odd);
 static numeric_errcode_t mod_var(const numeric *var1, const numeric *var2,
                 numeric *result);
 static void ceil_var(const numeric *var, numeric *result);
 static void floor_var(const numeric *var, numeric *result);
+static void compute_bucket(const numeric *operand, const numeric *bound1,
+        const numeric *bound2, const numeric *count_var, numeric *result_var);
+static numeric_errcode_t gcd_var(const numeric *var1, const numeric *var2,
+                numeric *result);
+static void lehmer_combine(const numeric *a, const numeric *b, int64_t A,
+                int64_t B, numeric *result);
+static int  var_digit(const numeric *var, int exponent);
+static uint64_t gcd_uint64(uint64_t u, uint64_t v);
+
+static uint32_t cache_hash_var(uint32_t hash, const numeric *var);
+static cache_entry *cache_find(uint32_t hash, numeric_cache_op_t op,
+                const numeric *arg1, const numeric *arg2);
+static void cache_unlink(cache_entry *entry);
+static void cache_push_front(cache_entry *entry);
+static bool cache_lookup(numeric_cache_op_t op, const numeric *arg1,
+                const numeric *arg2, int rscale, numeric *result);
+static void cache_insert(numeric_cache_op_t op, const numeric *arg1,
+                const numeric *arg2, int rscale, const numeric *value);
+static numeric_errcode_t cache_make_result(numeric *var, numeric *result);
+static void cache_free_entries(void);
+
+static void rational_set_nan(numeric_rational *rat);
+static numeric_errcode_t rational_store(numeric *num, numeric *den,
+                numeric_rational *result);
+static numeric_errcode_t rational_reduce(numeric_rational *rat);
 
 static numeric_errcode_t sqrt_var(const numeric *arg, numeric *result,
                 int rscale);
 static numeric_errcode_t exp_var(const numeric *arg, numeric *result,
                 int rscale);
-static void exp_var_internal(const numeric *arg, numeric *result, int rscale);
+static numeric_errcode_t exp_var_internal(const numeric *arg,
+        numeric *result, int rscale);
 static numeric_errcode_t ln_var(const numeric *arg, numeric *result,
                 int rscale);
 static numeric_errcode_t log_var(const numeric *base, const numeric *num,
@@ -224,6 +493,78 @@ static numeric_errcode_t power_var(const numeric *base, const numeric *exp,
                 numeric *result);
 static void power_var_int(const numeric *base, int exp, numeric *result,
                 int rscale);
+static void pi_var(numeric *result, int rscale);
+static series_tables *series_attach(series_tables *tables);
+static void series_detach(series_tables *tables, series_tables *prev);
+static numeric_errcode_t series_term(series_table *table, bool odd, int k,
+        const numeric **term);
+static numeric_errcode_t series_e(int rscale, numeric *result);
+static void atan_inverse_int(int n, numeric *result, int rscale);
+static numeric_errcode_t sin_cos_var(const numeric *arg, numeric *result,
+                int rscale, bool cosine);
+static void sin_var_internal(const numeric *arg, numeric *result,
+                int rscale);
+static numeric_errcode_t atan_var(const numeric *arg, numeric *result,
+                int rscale);
+static numeric_errcode_t atan_var_internal(const numeric *arg,
+                numeric *result, int rscale);
+
+static numeric_errcode_t allocate_var(const numeric *total,
+                const numeric *weights, int n, int scale, numeric *parts,
+                numeric *remainders, int *order);
+static void allocate_select(const numeric *remainders, int *order, int n,
+                int k);
+
+static void accum_add_int(numeric_accum *acc, accum_int val);
+static void accum_spill(numeric_accum *acc);
+static void accum_var(numeric_accum *acc, numeric *result);
+static void accum_carry(numeric_accum *acc);
+static void accum_double_var(numeric_accum *acc, numeric *result);
+#ifdef NUMERIC_HAVE_INT128
+static void int128_to_numericvar(numeric_int128 val, numeric *var);
+#endif
+static void agg_minmax(numeric_agg *agg, const numeric *num);
+static numeric_errcode_t agg_variance_var(numeric_agg *agg, bool sample,
+        bool stddev, numeric *result);
+static unsigned char *agg_put_uint(unsigned char *p, uint64_t val,
+        int nbytes);
+static const unsigned char *agg_get_uint(const unsigned char *p,
+        const unsigned char *end, int nbytes, uint64_t *val);
+static size_t agg_var_size(const numeric *var);
+static unsigned char *agg_put_var(unsigned char *p, const numeric *var);
+static const unsigned char *agg_get_var(const unsigned char *p,
+        const unsigned char *end, numeric *var);
+static void agg_accum_range(const numeric_accum *acc, int *first,
+        int *nlimbs);
+static size_t agg_accum_size(const numeric_accum *acc);
+static unsigned char *agg_put_accum(unsigned char *p,
+        const numeric_accum *acc);
+static const unsigned char *agg_get_accum(const unsigned char *p,
+        const unsigned char *end, numeric_accum *acc);
+static bool group_ids_valid(const int *group_ids, int n, int n_groups);
+static numeric_errcode_t group_run(const group_task *proto, int n_groups,
+        int nthreads);
+static void run_tasks(void *(*worker) (void *), void *tasks, size_t size,
+        int ntasks);
+static void *group_worker(void *arg);
+static numeric_errcode_t group_sum_range(const group_task *task);
+static bool group_limbs_add(group_limbs *p, const numeric *num);
+static bool group_limbs_reserve(group_limbs *p, int hi, int lo);
+static void group_limbs_var(group_limbs *p, numeric *result);
+static numeric_errcode_t group_minmax_range(const group_task *task);
+static void *prefix_total(void *arg);
+static void *prefix_scan(void *arg);
+static int prefix_carry(const int64_t *limbs, int nlimbs,
+        NumericDigit *digits);
+static numeric_errcode_t compact_check(const numeric *num);
+static void compact_store(const numeric *num, NumericDigit *digits,
+        numeric_compact *result);
+static unsigned char *sortkey_put(unsigned char *p, unsigned int word);
+static bool sortkey_prefix(const numeric *num, uint64_t *prefix);
+static int  buckets_search(const numeric_buckets *buckets,
+        const numeric *num);
+static numeric_errcode_t buckets_alloc(int nbounds,
+        numeric_buckets **result);
 
 static int cmp_abs(const numeric *var1, const numeric *var2);
 static int cmp_abs_common(const NumericDigit *var1digits, int var1ndigits,
@@ -300,16 +641,19 @@ numeric_from_str(const char *str, int precision, int scale, numeric *result)
         while (*cp)
         {
             if (!isspace((unsigned char) *cp))
+            {
+                numeric_dispose(&value);
                 return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            }
             cp++;
         }
 
-        check_bounds_and_round(&value, precision, scale);
-
-        errcode = make_result(&value, result);
+        errcode = check_bounds_and_round(&value, precision, scale);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = make_result(&value, result);
+        numeric_dispose(&value);
         if (errcode != NUMERIC_ERRCODE_NO_ERROR)
             return errcode;
-        numeric_dispose(&value);
     }
 
     return NUMERIC_ERRCODE_NO_ERROR;
@@ -421,6 +765,61 @@ numeric_to_str_sci(const numeric *num, int scale, char **result)
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
+
+/*
+ * numeric_coerce() -
+ *
+ *  Round num to scale and check that it fits in precision digits, as
+ *  numeric_from_str() does and as storing into a NUMERIC(precision,
+ *  scale) column does.  A precision of -1 leaves num as it is.
+ *
+ *  num is rounded in its own digits, without allocating, so it must not
+ *  be a view.  If it does not fit, NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE
+ *  is returned and its value is unchanged.
+ */
+numeric_errcode_t
+numeric_coerce(numeric *num, int precision, int scale)
+{
+    if (precision == -1)
+        return NUMERIC_ERRCODE_NO_ERROR;
+    if (precision < 1 || precision > NUMERIC_MAX_PRECISION ||
+        scale < 0 || scale > precision)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    return check_bounds_and_round(num, precision, scale);
+}
+
+
+/*
+ * numeric_coerce_batch() -
+ *
+ *  numeric_coerce() each of nums[0 .. n-1], storing its error code into
+ *  errcodes[i].  Values that do not fit are left as they are and do not
+ *  stop the others.  Returns the first error code that is not
+ *  NUMERIC_ERRCODE_NO_ERROR, or NUMERIC_ERRCODE_INVALID_ARGUMENT without
+ *  touching nums or errcodes if precision and scale are invalid.
+ */
+numeric_errcode_t
+numeric_coerce_batch(numeric *nums, int n, int precision, int scale,
+        numeric_errcode_t *errcodes)
+{
+    numeric_errcode_t result = NUMERIC_ERRCODE_NO_ERROR;
+    int         i;
+
+    if (precision != -1 &&
+        (precision < 1 || precision > NUMERIC_MAX_PRECISION ||
+         scale < 0 || scale > precision))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    for (i = 0; i < n; i++)
+    {
+        errcodes[i] = check_bounds_and_round(&nums[i], precision, scale);
+        if (result == NUMERIC_ERRCODE_NO_ERROR)
+            result = errcodes[i];
+    }
+    return result;
+}
+
 /* ----------------------------------------------------------------------
  *
  * Sign manipulation, rounding and the like
@@ -558,11 +957,10 @@ numeric_round(const numeric *num, int scale, numeric *result)
      * Return the rounded result
      */
     errcode = make_result(&arg, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&arg);
-    return NUMERIC_ERRCODE_NO_ERROR;
+
+    return errcode;
 }
 
 
@@ -607,11 +1005,42 @@ numeric_trunc(const numeric *num, int scale, numeric *result)
      * Return the truncated result
      */
     errcode = make_result(&arg, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&arg);
-    return NUMERIC_ERRCODE_NO_ERROR;
+
+    return errcode;
+}
+
+
+/*
+ * numeric_trim_scale() -
+ *
+ *  Return num with its display scale reduced to the fewest digits that
+ *  show its value, dropping trailing fractional zeroes: 1.500 becomes 1.5
+ *  and 1.00 becomes 1.  Values equal under numeric_cmp() give identical
+ *  results.
+ */
+numeric_errcode_t
+numeric_trim_scale(const numeric *num, numeric *result)
+{
+    numeric  arg;
+    numeric_errcode_t errcode;
+
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(num))
+        return make_result(&const_nan, result);
+
+    numeric_init(&arg);
+    set_var_from_var(num, &arg);
+    arg.dscale = get_min_scale(&arg);
+
+    errcode = make_result(&arg, result);
+
+    numeric_dispose(&arg);
+
+    return errcode;
 }
 
 
@@ -635,11 +1064,10 @@ numeric_ceil(const numeric *num, numeric *result)
     ceil_var(&result_var, &result_var);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -663,14 +1091,121 @@ numeric_floor(const numeric *num, numeric *result)
     floor_var(&result_var, &result_var);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+
     numeric_dispose(&result_var);
 
+    return errcode;
+}
+
+
+/*
+ * numeric_width_bucket() -
+ *
+ *  'bound1' and 'bound2' are the lower and upper bounds of the
+ *  histogram's range, respectively. 'count' is the number of buckets
+ *  in the histogram. numeric_width_bucket() stores into *result the
+ *  bucket number to which the 'operand' belongs. If 'operand' falls
+ *  below the range, 0 is stored; above it, 'count' + 1.  bound1 may be
+ *  greater than bound2, in which case the buckets count downwards.
+ */
+numeric_errcode_t
+numeric_width_bucket(const numeric *operand, const numeric *bound1,
+        const numeric *bound2, int count, int *result)
+{
+    numeric     count_var;
+    numeric     result_var;
+    int64_t     val;
+    int         cmp;
+
+    if (count <= 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    if (NUMERIC_IS_NAN(operand) ||
+        NUMERIC_IS_NAN(bound1) ||
+        NUMERIC_IS_NAN(bound2))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    cmp = cmp_numerics(bound1, bound2);
+    if (cmp == 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    if ((cmp < 0 && cmp_numerics(operand, bound1) < 0) ||
+        (cmp > 0 && cmp_numerics(operand, bound1) > 0))
+    {
+        *result = 0;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+    if ((cmp < 0 && cmp_numerics(operand, bound2) >= 0) ||
+        (cmp > 0 && cmp_numerics(operand, bound2) <= 0))
+    {
+        if (count == INT_MAX)
+            return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+        *result = count + 1;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    numeric_init(&count_var);
+    numeric_init(&result_var);
+    int64_to_numericvar(count, &count_var);
+    compute_bucket(operand, bound1, bound2, &count_var, &result_var);
+
+    if (BUDGET_EXHAUSTED())
+    {
+        numeric_dispose(&result_var);
+        numeric_dispose(&count_var);
+        return NUMERIC_ERRCODE_CANCELLED;
+    }
+
+    /* the bucket lies in 1 .. count, so it always fits */
+    numericvar_to_int64(&result_var, &val);
+    *result = (int) val;
+
+    numeric_dispose(&result_var);
+    numeric_dispose(&count_var);
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
+/*
+ * compute_bucket() -
+ *
+ *  If 'operand' is not outside the bucket range, determine the correct
+ *  bucket for it to go in.  The calculations performed by this function
+ *  are derived directly from the SQL2003 spec.  The offset is multiplied
+ *  by the count before dividing, so that the quotient is exact before it
+ *  is truncated.
+ */
+static void
+compute_bucket(const numeric *operand, const numeric *bound1,
+        const numeric *bound2, const numeric *count_var, numeric *result_var)
+{
+    numeric     operand_var;
+    numeric     width_var;
+
+    numeric_init(&operand_var);
+    numeric_init(&width_var);
+
+    if (cmp_numerics(bound1, bound2) < 0)
+    {
+        sub_var(operand, bound1, &operand_var);
+        sub_var(bound2, bound1, &width_var);
+    }
+    else
+    {
+        sub_var(bound1, operand, &operand_var);
+        sub_var(bound1, bound2, &width_var);
+    }
+
+    mul_var(&operand_var, count_var, &operand_var,
+            operand_var.dscale + count_var->dscale);
+    div_var(&operand_var, &width_var, result_var, 0, false);
+    add_var(result_var, &const_one, result_var);
+
+    numeric_dispose(&width_var);
+    numeric_dispose(&operand_var);
+}
+
+
 /* ----------------------------------------------------------------------
  *
  * Comparison functions
@@ -790,12 +1325,10 @@ numeric_add(const numeric *num1, const numeric *num2, numeric *result)
     add_var(num1, num2, &result_var);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -824,12 +1357,10 @@ numeric_sub(const numeric *num1, const numeric *num2, numeric *result)
     sub_var(num1, num2, &result_var);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -862,12 +1393,10 @@ numeric_mul(const numeric *num1, const numeric *num2, numeric *result)
     mul_var(num1, num2, &result_var, num1->dscale + num2->dscale);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -902,17 +1431,13 @@ numeric_div(const numeric *num1, const numeric *num2, numeric *result)
     /*
      * Do the divide and return the result_var
      */
-    errcode = div_var(num1, num2, &result_var, rscale, true);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    errcode = div_var_checked(num1, num2, &result_var, rscale, true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -941,17 +1466,13 @@ numeric_div_trunc(const numeric *num1, const numeric *num2, numeric *result)
     /*
      * Do the divide and return the result_var
      */
-    errcode = div_var(num1, num2, &result_var, 0, false);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    errcode = div_var_checked(num1, num2, &result_var, 0, false);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -972,16 +1493,12 @@ numeric_mod(const numeric *num1, const numeric *num2, numeric *result)
     numeric_init(&result_var);
 
     errcode = mod_var(num1, num2, &result_var);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -1024,183 +1541,296 @@ numeric_max(const numeric *num1, const numeric *num2, numeric *result)
 }
 
 
-/* ----------------------------------------------------------------------
+/*
+ * numeric_cmp_int64() -
  *
- * Advanced math functions
+ *  Compare num with val, as numeric_cmp() would with val converted by
+ *  numeric_from_int64(), but without making a numeric for val.
+ */
+int
+numeric_cmp_int64(const numeric *num, int64_t val)
+{
+    NumericDigit digits[INT64_NBASE_DIGITS];
+    numeric     view;
+
+    int64_to_view(val, digits, &view);
+    return cmp_numerics(num, &view);
+}
+
+
+/*
+ * numeric_cmp_double() -
  *
- * ----------------------------------------------------------------------
+ *  Compare num with val, as numeric_cmp() would with val converted by
+ *  numeric_from_double().  A NaN val is the numeric NaN; infinities sort
+ *  beyond every other number, below the numeric NaN.
  */
+int
+numeric_cmp_double(const numeric *num, double val)
+{
+    NumericDigit digits[INT64_NBASE_DIGITS];
+    numeric     view;
+
+    if (isnan(val))
+        return NUMERIC_IS_NAN(num) ? 0 : -1;
+    if (NUMERIC_IS_NAN(num))
+        return 1;
+    if (isinf(val))
+        return (val > 0) ? -1 : 1;
+
+    double_to_view(val, digits, &view);
+    return cmp_numerics(num, &view);
+}
 
 
 /*
- * numeric_sqrt() -
+ * numeric_add_int64() -
  *
- *  Compute the square root of a numeric.
+ *  Add val to num, without making a numeric for val
  */
 numeric_errcode_t
-numeric_sqrt(const numeric *num, numeric *result)
+numeric_add_int64(const numeric *num, int64_t val, numeric *result)
 {
-    numeric  result_var;
-    int         sweight;
-    int         rscale;
+    NumericDigit digits[INT64_NBASE_DIGITS];
+    numeric     view;
+    numeric     result_var;
     numeric_errcode_t errcode;
 
-    /*
-     * Handle NaN
-     */
     if (NUMERIC_IS_NAN(num))
         return make_result(&const_nan, result);
 
-    /*
-     * Unpack the argument and determine the result_var scale.  We choose a scale
-     * to give at least NUMERIC_MIN_SIG_DIGITS significant digits; but in any
-     * case not less than the input's dscale.
-     */
+    int64_to_view(val, digits, &view);
     numeric_init(&result_var);
 
-    /* Assume the input was normalized, so arg.weight is accurate */
-    sweight = (num->weight + 1) * DEC_DIGITS / 2 - 1;
+    add_var(num, &view, &result_var);
 
-    rscale = NUMERIC_MIN_SIG_DIGITS - sweight;
-    rscale = Max(rscale, num->dscale);
-    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
-    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+    errcode = make_result(&result_var, result);
 
-    /*
-     * Let sqrt_var() do the calculation and return the result_var.
-     */
-    errcode = sqrt_var(num, &result_var, rscale);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_mul_int64() -
+ *
+ *  Multiply num by val, without making a numeric for val.  The product is
+ *  exact, as in numeric_mul().
+ */
+numeric_errcode_t
+numeric_mul_int64(const numeric *num, int64_t val, numeric *result)
+{
+    NumericDigit digits[INT64_NBASE_DIGITS];
+    numeric     view;
+    numeric     result_var;
+    numeric_errcode_t errcode;
+
+    if (NUMERIC_IS_NAN(num))
+        return make_result(&const_nan, result);
+
+    int64_to_view(val, digits, &view);
+    numeric_init(&result_var);
+
+    mul_var(num, &view, &result_var, num->dscale);
 
     errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
 /*
- * numeric_exp() -
+ * numeric_div_int64() -
  *
- *  Raise e to the power of x
+ *  Divide num by val, without making a numeric for val.  The result scale
+ *  is the one numeric_div() would choose.
  */
 numeric_errcode_t
-numeric_exp(const numeric *num, numeric *result)
+numeric_div_int64(const numeric *num, int64_t val, numeric *result)
 {
-    numeric  result_var;
+    NumericDigit digits[INT64_NBASE_DIGITS];
+    numeric     view;
+    numeric     result_var;
     int         rscale;
-    double      val;
     numeric_errcode_t errcode;
 
-    /*
-     * Handle NaN
-     */
     if (NUMERIC_IS_NAN(num))
         return make_result(&const_nan, result);
 
-    /*
-     * Unpack the argument and determine the result_var scale.  We choose a scale
-     * to give at least NUMERIC_MIN_SIG_DIGITS significant digits; but in any
-     * case not less than the input's dscale.
-     */
+    int64_to_view(val, digits, &view);
     numeric_init(&result_var);
 
-    /* convert input to double, ignoring overflow */
-    errcode = numericvar_to_double_no_overflow(num, &val);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    rscale = select_div_scale(num, &view);
 
-    /*
-     * log10(result_var) = num * log10(e), so this is approximately the decimal
-     * weight of the result_var:
-     */
-    val *= 0.434294481903252;
+    errcode = div_var(num, &view, &result_var, rscale, true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
-    /* limit to something that won't cause integer overflow */
-    val = Max(val, -NUMERIC_MAX_RESULT_SCALE);
-    val = Min(val, NUMERIC_MAX_RESULT_SCALE);
+    numeric_dispose(&result_var);
 
-    rscale = NUMERIC_MIN_SIG_DIGITS - (int) val;
-    rscale = Max(rscale, num->dscale);
-    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
-    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+    return errcode;
+}
+
+/*
+ * numeric_result_bound() -
+ *
+ *  Compute an upper bound on the number of NBASE digits (*ndigits) and on
+ *  the length of the numeric_to_str() output without its terminator
+ *  (*length) of the result of num1 op num2.  Either output pointer may be
+ *  NULL.  For NUMERIC_OP_MUL and NUMERIC_OP_DIV, rscale is the scale the
+ *  result is rounded to, or -1 for the scale numeric_mul() and
+ *  numeric_div() use; it is ignored for NUMERIC_OP_ADD and NUMERIC_OP_SUB.
+ *
+ *  Storage for *ndigits digits is always enough for the _into variants
+ *  below called with the same rscale, so a batch can size one buffer up
+ *  front.
+ */
+numeric_errcode_t
+numeric_result_bound(numeric_op_t op, const numeric *num1,
+        const numeric *num2, int rscale, int *ndigits, size_t *length)
+{
+    int         hi;             /* highest possible result NBASE exponent */
+    int         lo;             /* lowest possible result NBASE exponent */
+    int         dscale;
+    int         n;
+    bool        zero = false;   /* result is certainly zero */
+
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+    {
+        if (ndigits)
+            *ndigits = 0;
+        if (length)
+            *length = 3;        /* "NaN" */
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    switch (op)
+    {
+        case NUMERIC_OP_ADD:
+        case NUMERIC_OP_SUB:
+            dscale = Max(num1->dscale, num2->dscale);
+            if (NUMERIC_IS_ZERO(num1) && NUMERIC_IS_ZERO(num2))
+            {
+                zero = true;
+                hi = lo = 0;
+            }
+            else if (NUMERIC_IS_ZERO(num1) || NUMERIC_IS_ZERO(num2))
+            {
+                const numeric *num = NUMERIC_IS_ZERO(num1) ? num2 : num1;
+
+                hi = num->weight;
+                lo = num->weight - num->ndigits + 1;
+            }
+            else
+            {
+                /* one more digit at the top for the carry */
+                hi = Max(num1->weight, num2->weight) + 1;
+                lo = Min(num1->weight - num1->ndigits + 1,
+                         num2->weight - num2->ndigits + 1);
+            }
+            break;
+        case NUMERIC_OP_MUL:
+            dscale = (rscale < 0) ? num1->dscale + num2->dscale : rscale;
+            if (NUMERIC_IS_ZERO(num1) || NUMERIC_IS_ZERO(num2))
+            {
+                zero = true;
+                hi = lo = 0;
+            }
+            else
+            {
+                hi = num1->weight + num2->weight + 1;
+                lo = (num1->weight - num1->ndigits + 1) +
+                    (num2->weight - num2->ndigits + 1);
+                lo = Max(lo, -((dscale + DEC_DIGITS - 1) / DEC_DIGITS));
+            }
+            break;
+        case NUMERIC_OP_DIV:
+            if (NUMERIC_IS_ZERO(num2))
+                return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+            dscale = (rscale < 0) ? select_div_scale(num1, num2) : rscale;
+            if (NUMERIC_IS_ZERO(num1))
+            {
+                zero = true;
+                hi = lo = 0;
+            }
+            else
+            {
+                hi = num1->weight - num2->weight;
+                lo = -((dscale + DEC_DIGITS - 1) / DEC_DIGITS);
+            }
+            break;
+        default:
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
 
     /*
-     * Let exp_var() do the calculation and return the result_var.
+     * A result rounded up at the top (999.9 -> 1000) gains a digit above
+     * hi, but then all the others are zero, so hi - lo + 1 digits are
+     * still enough.
      */
-    errcode = exp_var(num, &result_var, rscale);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (zero)
+        n = 0;
+    else
+        n = Max(hi - lo + 1, 1);
 
-    numeric_dispose(&result_var);
+    if (ndigits)
+        *ndigits = n;
+    if (length)
+    {
+        /* sign, integral digits, decimal point and fractional digits */
+        *length = 1 + Max((hi + 2) * DEC_DIGITS, 1);
+        if (dscale > 0)
+            *length += 1 + dscale;
+    }
 
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
 /*
- * numeric_ln() -
+ * numeric_add_into() -
  *
- *  Compute the natural logarithm of x
+ *  Like numeric_add(), but the result digits are stored into the caller's
+ *  digits[0 .. ndigits-1] rather than newly allocated memory;
+ *  result->ndigits tells how many were used.  numeric_result_bound() gives
+ *  a sufficient size.  Returns NUMERIC_ERRCODE_BUFFER_TOO_SMALL if the
+ *  result does not fit.
  */
 numeric_errcode_t
-numeric_ln(const numeric *num, numeric *result)
+numeric_add_into(const numeric *num1, const numeric *num2,
+        NumericDigit *digits, int ndigits, numeric *result)
 {
     numeric  result_var;
-    int         dec_digits;
-    int         rscale;
     numeric_errcode_t errcode;
 
     /*
      * Handle NaN
      */
-    if (NUMERIC_IS_NAN(num))
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
         return make_result(&const_nan, result);
 
     numeric_init(&result_var);
 
-    /* Approx decimal digits before decimal point */
-    dec_digits = (num->weight + 1) * DEC_DIGITS;
-
-    if (dec_digits > 1)
-        rscale = NUMERIC_MIN_SIG_DIGITS - (int) log10(dec_digits - 1);
-    else if (dec_digits < 1)
-        rscale = NUMERIC_MIN_SIG_DIGITS - (int) log10(1 - dec_digits);
-    else
-        rscale = NUMERIC_MIN_SIG_DIGITS;
-
-    rscale = Max(rscale, num->dscale);
-    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
-    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
-
-    errcode = ln_var(num, &result_var, rscale);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    add_var(num1, num2, &result_var);
 
+    errcode = make_result_into(&result_var, digits, ndigits, result);
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
+
 /*
- * numeric_log10() -
+ * numeric_sub_into() -
  *
- *  Compute the logarithm of x in a base 10
+ *  Like numeric_sub(), storing the result as numeric_add_into() does
  */
 numeric_errcode_t
-numeric_log10(const numeric *num, numeric *result)
+numeric_sub_into(const numeric *num1, const numeric *num2,
+        NumericDigit *digits, int ndigits, numeric *result)
 {
     numeric  result_var;
     numeric_errcode_t errcode;
@@ -1208,41 +1838,31 @@ numeric_log10(const numeric *num, numeric *result)
     /*
      * Handle NaN
      */
-    if (NUMERIC_IS_NAN(num))
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
         return make_result(&const_nan, result);
 
-    /*
-     * Initialize things
-     */
     numeric_init(&result_var);
 
-    /*
-     * Call log_var() to compute and return the result_var; note it handles scale
-     * selection itself.
-     */
-    errcode = log_var(&const_ten, num, &result_var);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    sub_var(num1, num2, &result_var);
 
+    errcode = make_result_into(&result_var, digits, ndigits, result);
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
 /*
- * numeric_power() -
+ * numeric_mul_into() -
  *
- *  Raise b to the power of x
+ *  Like numeric_mul(), storing the result as numeric_add_into() does.  The
+ *  product is rounded to rscale digits, or exact if rscale is negative, as
+ *  numeric_result_bound() assumes for the same rscale.
  */
 numeric_errcode_t
-numeric_power(const numeric *num1, const numeric *num2, numeric *result)
+numeric_mul_into(const numeric *num1, const numeric *num2, int rscale,
+        NumericDigit *digits, int ndigits, numeric *result)
 {
-    numeric  arg2_trunc;
     numeric  result_var;
     numeric_errcode_t errcode;
 
@@ -1252,2195 +1872,8098 @@ numeric_power(const numeric *num1, const numeric *num2, numeric *result)
     if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
         return make_result(&const_nan, result);
 
-    /*
-     * Initialize things
-     */
-    numeric_init(&arg2_trunc);
+    if (rscale < 0)
+        rscale = num1->dscale + num2->dscale;
+
     numeric_init(&result_var);
 
-    set_var_from_var(num2, &arg2_trunc);
+    mul_var(num1, num2, &result_var, rscale);
 
-    trunc_var(&arg2_trunc, 0);
+    errcode = make_result_into(&result_var, digits, ndigits, result);
+    numeric_dispose(&result_var);
 
-    /*
-     * The SQL spec requires that we emit a particular SQLSTATE error code for
-     * certain error conditions.  Specifically, we don't return a
-     * divide-by-zero error code for 0 ^ -1.
-     */
-    if (cmp_var(num1, &const_zero) == 0 &&
-        cmp_var(num2, &const_zero) < 0)
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    return errcode;
+}
 
-    if (cmp_var(num1, &const_zero) < 0 &&
-        cmp_var(num2, &arg2_trunc) != 0)
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+/*
+ * numeric_div_into() -
+ *
+ *  Like numeric_div(), storing the result as numeric_add_into() does.  The
+ *  quotient is rounded to rscale digits, or to the scale numeric_div()
+ *  would choose if rscale is negative.
+ */
+numeric_errcode_t
+numeric_div_into(const numeric *num1, const numeric *num2, int rscale,
+        NumericDigit *digits, int ndigits, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
     /*
-     * Call power_var() to compute and return the result_var; note it handles
-     * scale selection itself.
+     * Handle NaN
      */
-    errcode = power_var(num1, num2, &result_var);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+        return make_result(&const_nan, result);
 
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (rscale < 0)
+        rscale = select_div_scale(num1, num2);
+
+    numeric_init(&result_var);
 
+    errcode = div_var_checked(num1, num2, &result_var, rscale, true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result_into(&result_var, digits, ndigits, result);
     numeric_dispose(&result_var);
-    numeric_dispose(&arg2_trunc);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
 /* ----------------------------------------------------------------------
  *
- * Type conversion functions
+ * Working variables
+ *
+ * These mirror add_var(), sub_var(), mul_var(), div_var(), round_var()
+ * and trunc_var(): the result is left in the buffer the computation
+ * produced, spare digit and all, instead of being copied into an
+ * exact-size numeric by make_result().  numeric_finalize() does the
+ * remaining checks in place.
  *
  * ----------------------------------------------------------------------
  */
 
 
+/*
+ * numeric_var_add() -
+ *
+ *  Add two values into the working variable result
+ */
 numeric_errcode_t
-numeric_from_int32(int32_t val, numeric *result)
+numeric_var_add(const numeric *var1, const numeric *var2, numeric *result)
 {
-    numeric  result_var;
-    numeric_errcode_t errcode;
-
-    numeric_init(&result_var);
+    if (NUMERIC_IS_NAN(var1) || NUMERIC_IS_NAN(var2))
+        return var_set_nan(result);
 
-    int64_to_numericvar((int64_t) val, &result_var);
+    add_var(var1, var2, result);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
 
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
 
-    numeric_dispose(&result_var);
+/*
+ * numeric_var_sub() -
+ *
+ *  Subtract var2 from var1 into the working variable result
+ */
+numeric_errcode_t
+numeric_var_sub(const numeric *var1, const numeric *var2, numeric *result)
+{
+    if (NUMERIC_IS_NAN(var1) || NUMERIC_IS_NAN(var2))
+        return var_set_nan(result);
 
+    sub_var(var1, var2, result);
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
+/*
+ * numeric_var_mul() -
+ *
+ *  Multiply two values into the working variable result, rounded to
+ *  rscale digits, or exactly as numeric_mul() does if rscale is negative.
+ */
 numeric_errcode_t
-numeric_to_int32(const numeric *num, int32_t *result)
+numeric_var_mul(const numeric *var1, const numeric *var2, numeric *result,
+        int rscale)
 {
-    numeric  x;
-    numeric_errcode_t errcode;
-
-    if (NUMERIC_IS_NAN(num))
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (NUMERIC_IS_NAN(var1) || NUMERIC_IS_NAN(var2))
+        return var_set_nan(result);
 
-    /* Convert to variable format, then convert to int4 */
-    numeric_init(&x);
-    set_var_from_var(num, &x);
-    errcode = numericvar_to_int32(&x, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-    numeric_dispose(&x);
-    return NUMERIC_ERRCODE_NO_ERROR;
+    if (rscale < 0)
+        rscale = var1->dscale + var2->dscale;
+    mul_var(var1, var2, result, rscale);
+    return BUDGET_EXHAUSTED() ? NUMERIC_ERRCODE_CANCELLED :
+        NUMERIC_ERRCODE_NO_ERROR;
 }
 
+
 /*
- * Given a numeric, convert it to an int32. If the numeric
- * exceeds the range of an int32, raise the appropriate error via
- * ereport(). The input numeric is *not* free'd.
+ * numeric_var_div() -
+ *
+ *  Divide var1 by var2 into the working variable result, to rscale digits
+ *  (rounded if round is set, else truncated), or to the scale numeric_div()
+ *  would choose if rscale is negative.
  */
-static numeric_errcode_t
-numericvar_to_int32(numeric *var, int32_t *result)
+numeric_errcode_t
+numeric_var_div(const numeric *var1, const numeric *var2, numeric *result,
+        int rscale, bool round)
 {
-    int64_t     val;
+    if (NUMERIC_IS_NAN(var1) || NUMERIC_IS_NAN(var2))
+        return var_set_nan(result);
 
-    if (!numericvar_to_int64(var, &val))
-        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+    if (rscale < 0)
+        rscale = select_div_scale(var1, var2);
+    return div_var_checked(var1, var2, result, rscale, round);
+}
 
-    /* Down-convert to int32_t */
-    *result = (int32_t) val;
 
-    /* Test for overflow by reverse-conversion. */
-    if ((int64_t) result != val)
-        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+/*
+ * numeric_var_round() -
+ *
+ *  Round var to rscale digits after the decimal point into the working
+ *  variable result, which may be var itself.
+ */
+numeric_errcode_t
+numeric_var_round(const numeric *var, int rscale, numeric *result)
+{
+    if (NUMERIC_IS_NAN(var))
+        return var_set_nan(result);
 
+    rscale = Max(rscale, -NUMERIC_MAX_RESULT_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_RESULT_SCALE);
+
+    var_prepare(var, result);
+    round_var(result, rscale);
+    if (rscale < 0)
+        result->dscale = 0;
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
+
+/*
+ * numeric_var_trunc() -
+ *
+ *  Truncate var to rscale digits after the decimal point into the working
+ *  variable result, which may be var itself.
+ */
 numeric_errcode_t
-numeric_from_int64(int64_t val, numeric *result)
+numeric_var_trunc(const numeric *var, int rscale, numeric *result)
 {
-    numeric  result_var;
-    numeric_errcode_t errcode;
-
-    numeric_init(&result_var);
-
-    int64_to_numericvar(val, &result_var);
-
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (NUMERIC_IS_NAN(var))
+        return var_set_nan(result);
 
-    numeric_dispose(&result_var);
+    rscale = Max(rscale, -NUMERIC_MAX_RESULT_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_RESULT_SCALE);
 
+    var_prepare(var, result);
+    trunc_var(result, rscale);
+    if (rscale < 0)
+        result->dscale = 0;
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
+/*
+ * numeric_finalize() -
+ *
+ *  Turn the working variable var into a normal numeric in place: strip
+ *  it and check that its weight and dscale fit.  The digits are not
+ *  copied; var keeps its working buffer.
+ */
 numeric_errcode_t
-numeric_to_int64(const numeric *num, int64_t *result)
+numeric_finalize(numeric *var)
 {
-    numeric  x;
+    if (BUDGET_EXHAUSTED())
+        return NUMERIC_ERRCODE_CANCELLED;
 
-    if (NUMERIC_IS_NAN(num))
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (NUMERIC_IS_NAN(var))
+        return NUMERIC_ERRCODE_NO_ERROR;
 
-    /* Convert to variable format and thence to int8 */
-    numeric_init(&x);
-    set_var_from_var(num, &x);
+    strip_var(var);
 
-    if (!numericvar_to_int64(&x, result))
+    if (var->weight < INT16_MIN || INT16_MAX < var->weight
+        || var->dscale < INT16_MIN || INT16_MAX < var->dscale)
         return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
 
-    numeric_dispose(&x);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * numeric_finalize_into() -
+ *
+ *  Like numeric_finalize(), but the checked value of var is copied into
+ *  the caller's digits[0 .. ndigits-1], as numeric_add_into() stores its
+ *  result; var is left as it is.
+ */
+numeric_errcode_t
+numeric_finalize_into(const numeric *var, NumericDigit *digits, int ndigits,
+        numeric *result)
+{
+    return make_result_into(var, digits, ndigits, result);
+}
 
+
+/*
+ * var_set_nan() -
+ *
+ *  Make the working variable var a NaN
+ */
+static numeric_errcode_t
+var_set_nan(numeric *var)
+{
+    digitbuf_free(var->buf);
+    *var = const_nan;
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
+/*
+ * var_prepare() -
+ *
+ *  Make result hold the value of var in a buffer of its own, which
+ *  round_var() and trunc_var() may modify.  A working variable that
+ *  already has one is left as it is.
+ */
+static void
+var_prepare(const numeric *var, numeric *result)
+{
+    if (result == var && var->buf != NULL)
+        return;
+    set_var_from_var(var, result);
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Advanced math functions
+ *
+ * ----------------------------------------------------------------------
+ */
 
+
+/*
+ * numeric_sqrt() -
+ *
+ *  Compute the square root of a numeric.
+ */
 numeric_errcode_t
-numeric_from_double(double val, numeric *result)
+numeric_sqrt(const numeric *num, numeric *result)
 {
     numeric  result_var;
-    char        buf[DBL_DIG + 100];
+    int         rscale;
     numeric_errcode_t errcode;
 
-    if (isnan(val))
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(num))
         return make_result(&const_nan, result);
 
-    sprintf(buf, "%.*g", DBL_DIG, val);
-
     numeric_init(&result_var);
 
-    /* Assume we need not worry about leading/trailing spaces */
-    errcode = set_var_from_str(buf, buf, &result_var, NULL);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    rscale = select_sqrt_scale(num);
 
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (cache_lookup(NUMERIC_CACHE_SQRT, num, NULL, rscale, &result_var))
+        return cache_make_result(&result_var, result);
+
+    /*
+     * Let sqrt_var() do the calculation and return the result_var.
+     */
+    errcode = sqrt_var(num, &result_var, rscale);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        cache_insert(NUMERIC_CACHE_SQRT, num, NULL, rscale, &result_var);
+        errcode = make_result(&result_var, result);
+    }
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
+/*
+ * numeric_exp() -
+ *
+ *  Raise e to the power of x
+ */
 numeric_errcode_t
-numeric_to_double(const numeric *num, double *result)
+numeric_exp(const numeric *num, numeric *result)
 {
-    char       *tmp;
-    double      val;
+    numeric  result_var;
+    int         rscale;
     numeric_errcode_t errcode;
 
+    /*
+     * Handle NaN
+     */
     if (NUMERIC_IS_NAN(num))
-    {
-        *result = get_double_nan();
-        return NUMERIC_ERRCODE_NO_ERROR;
-    }
+        return make_result(&const_nan, result);
 
-    errcode = numeric_out(num, &tmp);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    numeric_init(&result_var);
 
-    errcode = double_in(tmp, &val);
+    errcode = select_exp_scale(num, &rscale);
     if (errcode != NUMERIC_ERRCODE_NO_ERROR)
         return errcode;
 
-    free(tmp);
+    if (cache_lookup(NUMERIC_CACHE_EXP, num, NULL, rscale, &result_var))
+        return cache_make_result(&result_var, result);
 
-    *result = val;
-    return NUMERIC_ERRCODE_NO_ERROR;
+    /*
+     * Let exp_var() do the calculation and return the result_var.
+     */
+    errcode = exp_var(num, &result_var, rscale);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        cache_insert(NUMERIC_CACHE_EXP, num, NULL, rscale, &result_var);
+        errcode = make_result(&result_var, result);
+    }
+
+    numeric_dispose(&result_var);
+
+    return errcode;
 }
 
 
+/*
+ * numeric_ln() -
+ *
+ *  Compute the natural logarithm of x
+ */
 numeric_errcode_t
-numeric_from_float(float val, numeric *result)
+numeric_ln(const numeric *num, numeric *result)
 {
     numeric  result_var;
-    char        buf[FLT_DIG + 100];
+    int         rscale;
     numeric_errcode_t errcode;
 
-    if (isnan(val))
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(num))
         return make_result(&const_nan, result);
 
-    sprintf(buf, "%.*g", FLT_DIG, val);
-
     numeric_init(&result_var);
 
-    /* Assume we need not worry about leading/trailing spaces */
-    errcode = set_var_from_str(buf, buf, &result_var, NULL);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    rscale = select_ln_scale(num);
 
-    errcode = make_result(&result_var, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (cache_lookup(NUMERIC_CACHE_LN, num, NULL, rscale, &result_var))
+        return cache_make_result(&result_var, result);
+
+    errcode = ln_var(num, &result_var, rscale);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        cache_insert(NUMERIC_CACHE_LN, num, NULL, rscale, &result_var);
+        errcode = make_result(&result_var, result);
+    }
 
     numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
-
+/*
+ * numeric_log10() -
+ *
+ *  Compute the logarithm of x in a base 10
+ */
 numeric_errcode_t
-numeric_to_float(const numeric *num, float *result)
+numeric_log10(const numeric *num, numeric *result)
 {
-    char       *tmp;
+    numeric  result_var;
     numeric_errcode_t errcode;
 
+    /*
+     * Handle NaN
+     */
     if (NUMERIC_IS_NAN(num))
-    {
-        *result = get_float_nan();
-        return NUMERIC_ERRCODE_NO_ERROR;
-    }
+        return make_result(&const_nan, result);
 
-    errcode = numeric_out(num, &tmp);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    /*
+     * Initialize things
+     */
+    numeric_init(&result_var);
 
-    errcode = float_in(tmp, result);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    /*
+     * Call log_var() to compute and return the result_var; note it handles scale
+     * selection itself.
+     */
+    errcode = log_var(&const_ten, num, &result_var);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
-    free(tmp);
+    numeric_dispose(&result_var);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
-/* ----------------------------------------------------------------------
- *
- * Debug support
- *
- * ----------------------------------------------------------------------
- */
-
-#ifdef NUMERIC_DEBUG
 /*
- * dump_var() - Dump a value in the variable format for debugging
+ * numeric_power() -
+ *
+ *  Raise b to the power of x
  */
-static void
-dump_var(const char *str, numeric *var)
+numeric_errcode_t
+numeric_power(const numeric *num1, const numeric *num2, numeric *result)
 {
-    int         i;
-
-    printf("%s: numeric w=%d d=%d ", str, var->weight, var->dscale);
-    switch (var->sign)
-    {
-        case NUMERIC_POS:
-            printf("POS");
-            break;
-        case NUMERIC_NEG:
-            printf("NEG");
-            break;
-        case NUMERIC_NAN:
-            printf("NaN");
-            break;
-        default:
-            printf("SIGN=0x%x", var->sign);
-            break;
-    }
+    numeric  arg2_trunc;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
-    for (i = 0; i < var->ndigits; i++)
-        printf(" %0*d", DEC_DIGITS, var->digits[i]);
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+        return make_result(&const_nan, result);
 
-    printf("\n");
-}
-#endif   /* NUMERIC_DEBUG */
+    /*
+     * Initialize things
+     */
+    numeric_init(&arg2_trunc);
+    numeric_init(&result_var);
 
+    set_var_from_var(num2, &arg2_trunc);
 
-/* ----------------------------------------------------------------------
- *
- * Local functions follow
- *
- * In general, these do not support NaNs --- callers must eliminate
- * the possibility of NaN first.  (make_result() is an exception.)
- *
- * ----------------------------------------------------------------------
- */
+    trunc_var(&arg2_trunc, 0);
 
+    /*
+     * The SQL spec requires that we emit a particular SQLSTATE error code for
+     * certain error conditions.  Specifically, we don't return a
+     * divide-by-zero error code for 0 ^ -1.
+     */
+    if ((cmp_var(num1, &const_zero) == 0 &&
+         cmp_var(num2, &const_zero) < 0) ||
+        (cmp_var(num1, &const_zero) < 0 &&
+         cmp_var(num2, &arg2_trunc) != 0))
+    {
+        numeric_dispose(&arg2_trunc);
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
 
-/*
- * numeric_init() -
- *
- *  Initialize
- */
-void
-numeric_init(numeric *var)
-{
-    memset(var, 0, sizeof(numeric));
+    /*
+     * power_var() picks its own scale from the arguments, so power results
+     * are cached under rscale -1, meaning "whatever numeric_power would have
+     * chosen", and looked up by the arguments' dscales as well as values.
+     */
+    if (cache_lookup(NUMERIC_CACHE_POWER, num1, num2, -1, &result_var))
+    {
+        numeric_dispose(&arg2_trunc);
+        return cache_make_result(&result_var, result);
+    }
+
+    /*
+     * Call power_var() to compute and return the result_var; note it handles
+     * scale selection itself.
+     */
+    errcode = power_var(num1, num2, &result_var);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        cache_insert(NUMERIC_CACHE_POWER, num1, num2, -1, &result_var);
+        errcode = make_result(&result_var, result);
+    }
+
+    numeric_dispose(&result_var);
+    numeric_dispose(&arg2_trunc);
+
+    return errcode;
 }
 
+
 /*
- * numeric_dispose() -
+ * numeric_exp_batch() -
  *
- *  Return the digit buffer of a variable to the free pool
+ *  Compute numeric_exp() of nums[0 .. n-1] into results[0 .. n-1].  The
+ *  Taylor series divisors and the value of e are computed once for the
+ *  whole batch and shared; the results are exactly those of numeric_exp().
+ *  Stops at the first error.
  */
-void
-numeric_dispose(numeric *var)
+numeric_errcode_t
+numeric_exp_batch(const numeric *nums, int n, numeric *results)
 {
-    digitbuf_free(var->buf);
-    var->buf = NULL;
-    var->digits = NULL;
-    var->sign = NUMERIC_NAN;
+    series_tables tables;
+    series_tables *prev;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         i;
+
+    prev = series_attach(&tables);
+    for (i = 0; i < n && errcode == NUMERIC_ERRCODE_NO_ERROR; i++)
+        errcode = numeric_exp(&nums[i], &results[i]);
+    series_detach(&tables, prev);
+
+    return errcode;
 }
 
+
 /*
- * alloc_var() -
+ * numeric_ln_batch() -
  *
- *  Allocate a digit buffer of ndigits digits (plus a spare digit for rounding)
+ *  Compute numeric_ln() of nums[0 .. n-1] into results[0 .. n-1], sharing
+ *  the series divisors as numeric_exp_batch() does.
  */
-static void
-alloc_var(numeric *var, int ndigits)
+numeric_errcode_t
+numeric_ln_batch(const numeric *nums, int n, numeric *results)
 {
-    digitbuf_free(var->buf);
-    var->buf = digitbuf_alloc(ndigits + 1);
-    var->buf[0] = 0;            /* spare digit for rounding */
-    var->digits = var->buf + 1;
-    var->ndigits = ndigits;
-}
+    series_tables tables;
+    series_tables *prev;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         i;
 
+    prev = series_attach(&tables);
+    for (i = 0; i < n && errcode == NUMERIC_ERRCODE_NO_ERROR; i++)
+        errcode = numeric_ln(&nums[i], &results[i]);
+    series_detach(&tables, prev);
+
+    return errcode;
+}
 
 
 /*
- * zero_var() -
+ * numeric_power_batch() -
  *
- *  Set a variable to ZERO.
- *  Note: its dscale is not touched.
+ *  Compute numeric_power() of bases[i] and exps[i] into results[i] for
+ *  i in 0 .. n-1, sharing the series divisors of the underlying ln and exp
+ *  as numeric_exp_batch() does.
  */
-static void
-zero_var(numeric *var)
+numeric_errcode_t
+numeric_power_batch(const numeric *bases, const numeric *exps, int n,
+        numeric *results)
 {
-    digitbuf_free(var->buf);
-    var->buf = NULL;
-    var->digits = NULL;
-    var->ndigits = 0;
-    var->weight = 0;            /* by convention; doesn't really matter */
-    var->sign = NUMERIC_POS;    /* anything but NAN... */
+    series_tables tables;
+    series_tables *prev;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         i;
+
+    prev = series_attach(&tables);
+    for (i = 0; i < n && errcode == NUMERIC_ERRCODE_NO_ERROR; i++)
+        errcode = numeric_power(&bases[i], &exps[i], &results[i]);
+    series_detach(&tables, prev);
+
+    return errcode;
 }
 
 
 /*
- * set_var_from_str()
- *
- *  Parse a string and put the number into a variable
+ * numeric_gcd() -
  *
- * This function does not handle leading or trailing spaces, and it doesn't
- * accept "NaN" either.  It returns the end+1 position so that caller can
- * check for trailing spaces/garbage if deemed necessary.
- *
- * cp is the place to actually start parsing; str is what to use in error
- * reports.  (Typically cp would be the same except advanced over spaces.)
+ *  Calculate the greatest common divisor of two numerics.  The result is
+ *  the largest positive number that divides both inputs an integral number
+ *  of times, so non-integral inputs are allowed: gcd(1.5, 2.25) is 0.75.
+ *  gcd(0, 0) is 0.
  */
-static numeric_errcode_t
-set_var_from_str(const char *str, const char *cp, numeric *dest,
-    const char **result)
+numeric_errcode_t
+numeric_gcd(const numeric *num1, const numeric *num2, numeric *result)
 {
-    bool        have_dp = false;
-    int         i;
-    unsigned char *decdigits;
-    int         sign = NUMERIC_POS;
-    int         dweight = -1;
-    int         ddigits;
-    int         dscale = 0;
-    int         weight;
-    int         ndigits;
-    int         offset;
-    NumericDigit *digits;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
     /*
-     * We first parse the string to extract decimal digits and determine the
-     * correct decimal weight.  Then convert to NBASE representation.
+     * Handle NaN
      */
-    switch (*cp)
-    {
-        case '+':
-            sign = NUMERIC_POS;
-            cp++;
-            break;
-
-        case '-':
-            sign = NUMERIC_NEG;
-            cp++;
-            break;
-    }
-
-    if (*cp == '.')
-    {
-        have_dp = true;
-        cp++;
-    }
-
-    if (!isdigit((unsigned char) *cp))
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+        return make_result(&const_nan, result);
 
-    decdigits = (unsigned char *) malloc(strlen(cp) + DEC_DIGITS * 2);
+    numeric_init(&result_var);
 
-    /* leading padding for digit alignment later */
-    memset(decdigits, 0, DEC_DIGITS);
-    i = DEC_DIGITS;
+    errcode = gcd_var(num1, num2, &result_var);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
-    while (*cp)
-    {
-        if (isdigit((unsigned char) *cp))
-        {
-            decdigits[i++] = *cp++ - '0';
-            if (!have_dp)
-                dweight++;
-            else
-                dscale++;
-        }
-        else if (*cp == '.')
-        {
-            if (have_dp)
-                return NUMERIC_ERRCODE_INVALID_ARGUMENT;
-            have_dp = true;
-            cp++;
-        }
-        else
-            break;
-    }
+    numeric_dispose(&result_var);
 
-    ddigits = i - DEC_DIGITS;
-    /* trailing padding for digit alignment later */
-    memset(decdigits + i, 0, DEC_DIGITS - 1);
+    return errcode;
+}
 
-    /* Handle exponent, if any */
-    if (*cp == 'e' || *cp == 'E')
-    {
-        long        exponent;
-        char       *endptr;
 
-        cp++;
-        exponent = strtol(cp, &endptr, 10);
-        if (endptr == cp)
-            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
-        cp = endptr;
-        if (exponent > NUMERIC_MAX_PRECISION ||
-            exponent < -NUMERIC_MAX_PRECISION)
-            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
-        dweight += (int) exponent;
-        dscale -= (int) exponent;
-        if (dscale < 0)
-            dscale = 0;
-    }
+/*
+ * numeric_lcm() -
+ *
+ *  Calculate the least common multiple of two numerics: the smallest
+ *  positive number that both inputs divide an integral number of times.
+ *  lcm(x, 0) is 0.
+ */
+numeric_errcode_t
+numeric_lcm(const numeric *num1, const numeric *num2, numeric *result)
+{
+    numeric  gcd;
+    numeric  result_var;
+    int         rscale;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
 
     /*
-     * Okay, convert pure-decimal representation to base NBASE.  First we need
-     * to determine the converted weight and ndigits.  offset is the number of
-     * decimal zeroes to insert before the first given digit to have a
-     * correctly aligned first NBASE digit.
+     * Handle NaN
      */
-    if (dweight >= 0)
-        weight = (dweight + 1 + DEC_DIGITS - 1) / DEC_DIGITS - 1;
-    else
-        weight = -((-dweight - 1) / DEC_DIGITS + 1);
-    offset = (weight + 1) * DEC_DIGITS - (dweight + 1);
-    ndigits = (ddigits + offset + DEC_DIGITS - 1) / DEC_DIGITS;
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+        return make_result(&const_nan, result);
 
-    alloc_var(dest, ndigits);
-    dest->sign = sign;
-    dest->weight = weight;
-    dest->dscale = dscale;
+    numeric_init(&gcd);
+    numeric_init(&result_var);
 
-    i = DEC_DIGITS - offset;
-    digits = dest->digits;
+    rscale = Max(num1->dscale, num2->dscale);
 
-    while (ndigits-- > 0)
+    if (NUMERIC_IS_ZERO(num1) || NUMERIC_IS_ZERO(num2))
+        set_var_from_var(&const_zero, &result_var);
+    else
     {
-#if DEC_DIGITS == 4
-        *digits++ = ((decdigits[i] * 10 + decdigits[i + 1]) * 10 +
-                     decdigits[i + 2]) * 10 + decdigits[i + 3];
-#elif DEC_DIGITS == 2
-        *digits++ = decdigits[i] * 10 + decdigits[i + 1];
-#elif DEC_DIGITS == 1
-        *digits++ = decdigits[i];
-#else
-#error unsupported NBASE
-#endif
-        i += DEC_DIGITS;
+        /*
+         * lcm(x, y) = abs(x / gcd(x, y) * y).  The division is exact, so it
+         * is done at scale 0.
+         */
+        errcode = gcd_var(num1, num2, &gcd);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = div_var(num1, &gcd, &result_var, 0, false);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            mul_var(&result_var, num2, &result_var, num2->dscale);
+        result_var.sign = NUMERIC_POS;
     }
+    result_var.dscale = rscale;
 
-    free(decdigits);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
 
-    /* Strip any leading/trailing zeroes, and normalize weight if zero */
-    strip_var(dest);
+    numeric_dispose(&result_var);
+    numeric_dispose(&gcd);
 
-    /* Return end+1 position for caller */
-    if (result)
-        *result = cp;
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
 /*
- * set_var_from_var() -
+ * numeric_pi() -
  *
- *  Copy one variable into another with an extra digit space for carry.
+ *  Return pi.  Values are cached, so repeated calls are cheap.
  */
-static void
-set_var_from_var(const numeric *value, numeric *dest)
+numeric_errcode_t
+numeric_pi(numeric *result)
 {
-    NumericDigit *newbuf;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
-    newbuf = digitbuf_alloc(value->ndigits + 1);
-    newbuf[0] = 0;              /* spare digit for rounding */
-    memcpy(newbuf + 1, value->digits, value->ndigits * sizeof(NumericDigit));
+    numeric_init(&result_var);
 
-    digitbuf_free(dest->buf);
+    pi_var(&result_var, NUMERIC_MIN_SIG_DIGITS);
 
-    memmove(dest, value, sizeof(numeric));
-    dest->buf = newbuf;
-    dest->digits = newbuf + 1;
+    errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
 }
 
+
 /*
- * copy_var() -
+ * numeric_sin() -
  *
- *  Copy one variable into another without an extra digit space for carry.
+ *  Compute the sine of x, in radians
  */
-static void
-copy_var(const numeric *value, numeric *dest)
+numeric_errcode_t
+numeric_sin(const numeric *num, numeric *result)
 {
-    NumericDigit *newbuf;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
-    newbuf = digitbuf_alloc(value->ndigits);
-    memcpy(newbuf, value->digits, value->ndigits * sizeof(NumericDigit));
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(num))
+        return make_result(&const_nan, result);
 
-    digitbuf_free(dest->buf);
+    numeric_init(&result_var);
 
-    memmove(dest, value, sizeof(numeric));
-    dest->buf = newbuf;
-    dest->digits = newbuf;
+    errcode = sin_cos_var(num, &result_var, select_trig_scale(num, true),
+                          false);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
 }
 
 
 /*
- * get_str_from_var() -
+ * numeric_cos() -
  *
- *  Convert a var to text representation (guts of numeric_out).
- *  CAUTION: var's contents may be modified by rounding!
- *  Returns a malloc'd string.
+ *  Compute the cosine of x, in radians
  */
-static char *
-get_str_from_var(numeric *var, int dscale)
+numeric_errcode_t
+numeric_cos(const numeric *num, numeric *result)
 {
-    char       *str;
-    char       *cp;
-    char       *endcp;
-    int         i;
-    int         d;
-    NumericDigit dig;
-
-#if DEC_DIGITS > 1
-    NumericDigit d1;
-#endif
-
-    if (dscale < 0)
-        dscale = 0;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
     /*
-     * Check if we must round up before printing the value and do so.
+     * Handle NaN
      */
-    round_var(var, dscale);
+    if (NUMERIC_IS_NAN(num))
+        return make_result(&const_nan, result);
 
-    /*
-     * Allocate space for the result.
-     *
-     * i is set to to # of decimal digits before decimal point. dscale is the
-     * # of decimal digits we will print after decimal point. We may generate
-     * as many as DEC_DIGITS-1 excess digits at the end, and in addition we
-     * need room for sign, decimal point, null terminator.
-     */
-    i = (var->weight + 1) * DEC_DIGITS;
-    if (i <= 0)
-        i = 1;
+    numeric_init(&result_var);
 
-    str = malloc(i + dscale + DEC_DIGITS + 2);
-    cp = str;
+    errcode = sin_cos_var(num, &result_var, select_trig_scale(num, false),
+                          true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_atan() -
+ *
+ *  Compute the arc tangent of x, in radians
+ */
+numeric_errcode_t
+numeric_atan(const numeric *num, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
     /*
-     * Output a dash for negative values
+     * Handle NaN
      */
-    if (var->sign == NUMERIC_NEG)
-        *cp++ = '-';
+    if (NUMERIC_IS_NAN(num))
+        return make_result(&const_nan, result);
+
+    numeric_init(&result_var);
+
+    errcode = atan_var(num, &result_var, select_trig_scale(num, true));
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_atan2() -
+ *
+ *  Compute the arc tangent of y/x, in radians, using the signs of both
+ *  arguments to determine the quadrant of the result: the result lies in
+ *  [-pi, pi].  atan2(0, 0) is 0.
+ */
+numeric_errcode_t
+numeric_atan2(const numeric *num1, const numeric *num2, numeric *result)
+{
+    numeric  ratio;
+    numeric  pi;
+    numeric  result_var;
+    int         rscale;
+    int         local_rscale;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
 
     /*
-     * Output all digits before the decimal point
+     * Handle NaN
      */
-    if (var->weight < 0)
-    {
-        d = var->weight + 1;
-        *cp++ = '0';
-    }
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
+        return make_result(&const_nan, result);
+
+    rscale = Max(NUMERIC_MIN_SIG_DIGITS, Max(num1->dscale, num2->dscale));
+    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+    local_rscale = rscale + MUL_GUARD_DIGITS * 2;
+
+    numeric_init(&ratio);
+    numeric_init(&pi);
+    numeric_init(&result_var);
+
+    if (NUMERIC_IS_ZERO(num1) && NUMERIC_IS_ZERO(num2))
+        set_var_from_var(&const_zero, &result_var);
     else
     {
-        for (d = 0; d <= var->weight; d++)
+        pi_var(&pi, local_rscale);
+
+        /*
+         * Always take the arc tangent of a ratio of at most 1 in absolute
+         * value, so that it can be formed accurately:
+         * atan(y/x) = sign(y/x) * pi/2 - atan(x/y).
+         */
+        if (cmp_abs(num1, num2) <= 0)
         {
-            dig = (d < var->ndigits) ? var->digits[d] : 0;
-            /* In the first digit, suppress extra leading decimal zeroes */
-#if DEC_DIGITS == 4
-            {
-                bool        putit = (d > 0);
+            div_var(num1, num2, &ratio, local_rscale, true);
+            errcode = atan_var_internal(&ratio, &result_var, local_rscale);
 
-                d1 = dig / 1000;
-                dig -= d1 * 1000;
-                putit |= (d1 > 0);
-                if (putit)
-                    *cp++ = d1 + '0';
-                d1 = dig / 100;
-                dig -= d1 * 100;
-                putit |= (d1 > 0);
-                if (putit)
-                    *cp++ = d1 + '0';
-                d1 = dig / 10;
-                dig -= d1 * 10;
-                putit |= (d1 > 0);
-                if (putit)
-                    *cp++ = d1 + '0';
-                *cp++ = dig + '0';
+            /* x < 0: move to the left half-plane */
+            if (num2->sign == NUMERIC_NEG)
+            {
+                if (num1->sign == NUMERIC_NEG && !NUMERIC_IS_ZERO(num1))
+                    sub_var(&result_var, &pi, &result_var);
+                else
+                    add_var(&result_var, &pi, &result_var);
             }
-#elif DEC_DIGITS == 2
-            d1 = dig / 10;
-            dig -= d1 * 10;
-            if (d1 > 0 || d > 0)
-                *cp++ = d1 + '0';
-            *cp++ = dig + '0';
-#elif DEC_DIGITS == 1
-            *cp++ = dig + '0';
-#else
-#error unsupported NBASE
-#endif
         }
-    }
-
-    /*
-     * If requested, output a decimal point and all the digits that follow it.
-     * We initially put out a multiple of DEC_DIGITS digits, then truncate if
-     * needed.
-     */
-    if (dscale > 0)
-    {
-        *cp++ = '.';
-        endcp = cp + dscale;
-        for (i = 0; i < dscale; d++, i += DEC_DIGITS)
+        else
         {
-            dig = (d >= 0 && d < var->ndigits) ? var->digits[d] : 0;
-#if DEC_DIGITS == 4
-            d1 = dig / 1000;
-            dig -= d1 * 1000;
-            *cp++ = d1 + '0';
-            d1 = dig / 100;
-            dig -= d1 * 100;
-            *cp++ = d1 + '0';
-            d1 = dig / 10;
-            dig -= d1 * 10;
-            *cp++ = d1 + '0';
-            *cp++ = dig + '0';
-#elif DEC_DIGITS == 2
-            d1 = dig / 10;
-            dig -= d1 * 10;
-            *cp++ = d1 + '0';
-            *cp++ = dig + '0';
-#elif DEC_DIGITS == 1
-            *cp++ = dig + '0';
-#else
-#error unsupported NBASE
-#endif
+            div_var(num2, num1, &ratio, local_rscale, true);
+            errcode = atan_var_internal(&ratio, &result_var, local_rscale);
+
+            /* pi/2 - atan(x/y) for y > 0, -pi/2 - atan(x/y) for y < 0 */
+            mul_var(&pi, &const_zero_point_five, &pi, local_rscale + 1);
+            pi.sign = num1->sign;
+            sub_var(&pi, &result_var, &result_var);
         }
-        cp = endcp;
+        round_var(&result_var, rscale);
     }
 
-    /*
-     * terminate the string and return it
-     */
-    *cp = '\0';
-    return str;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+    numeric_dispose(&pi);
+    numeric_dispose(&ratio);
+
+    return errcode;
 }
 
-/*
- * get_str_from_var_sci() -
- *
- *  Convert a var to a normalised scientific notation text representation.
- *  This function does the heavy lifting for numeric_to_str_sci().
- *
- *  This notation has the general form a * 10^b, where a is known as the
- *  "significand" and b is known as the "exponent".
- *
- *  Because we can't do superscript in ASCII (and because we want to copy
- *  printf's behaviour) we display the exponent using E notation, with a
- *  minimum of two exponent digits.
- *
- *  For example, the value 1234 could be output as 1.2e+03.
- *
- *  We assume that the exponent can fit into an int32.
+
+/* ----------------------------------------------------------------------
  *
- *  rscale is the number of decimal digits desired after the decimal point in
- *  the output, negative values will be treated as meaning zero.
+ * Transcendental result cache
  *
- *  CAUTION: var's contents may be modified by rounding!
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * cache_free_entries() -
  *
- *  Returns a malloc'd string.
+ *  Drop every cached entry.  Caller must hold numeric_cache.lock.
  */
-static char *
-get_str_from_var_sci(numeric *var, int rscale)
+static void
+cache_free_entries(void)
 {
-    int32_t     exponent;
-    numeric  denominator;
-    numeric  significand;
-    int         denom_scale;
-    size_t      len;
-    char       *str;
-    char       *sig_out;
-
-    if (rscale < 0)
-        rscale = 0;
+    cache_entry *entry = numeric_cache.lru_head;
 
-    /*
-     * Determine the exponent of this number in normalised form.
-     *
-     * This is the exponent required to represent the number with only one
-     * significant digit before the decimal place.
-     */
-    if (var->ndigits > 0)
+    while (entry != NULL)
     {
-        exponent = (var->weight + 1) * DEC_DIGITS;
+        cache_entry *next = entry->lru_next;
 
-        /*
-         * Compensate for leading decimal zeroes in the first numeric digit by
-         * decrementing the exponent.
-         */
-        exponent -= DEC_DIGITS - (int) log10(var->digits[0]);
-    }
-    else
-    {
-        /*
-         * If var has no digits, then it must be zero.
-         *
-         * Zero doesn't technically have a meaningful exponent in normalised
-         * notation, but we just display the exponent as zero for consistency
-         * of output.
-         */
-        exponent = 0;
+        numeric_dispose(&entry->arg1);
+        numeric_dispose(&entry->arg2);
+        numeric_dispose(&entry->value);
+        free(entry);
+        entry = next;
     }
+    free(numeric_cache.buckets);
+    numeric_cache.buckets = NULL;
+    numeric_cache.nbuckets = 0;
+    numeric_cache.lru_head = NULL;
+    numeric_cache.lru_tail = NULL;
+    numeric_cache.stats.nentries = 0;
+}
 
-    /*
-     * The denominator is set to 10 raised to the power of the exponent.
-     *
-     * We then divide var by the denominator to get the significand, rounding
-     * to rscale decimal digits in the process.
-     */
-    if (exponent < 0)
-        denom_scale = -exponent;
-    else
-        denom_scale = 0;
 
-    numeric_init(&denominator);
-    numeric_init(&significand);
+/*
+ * numeric_cache_enable() -
+ *
+ *  Enable the transcendental result cache with room for capacity entries,
+ *  discarding anything cached so far and resetting the statistics.  A
+ *  capacity <= 0 disables the cache.
+ */
+numeric_errcode_t
+numeric_cache_enable(int capacity)
+{
+    cache_entry **buckets = NULL;
+    int         nbuckets = 0;
 
-    int64_to_numericvar((int64_t) 10, &denominator);
-    power_var_int(&denominator, exponent, &denominator, denom_scale);
-    div_var(var, &denominator, &significand, rscale, true);
-    sig_out = get_str_from_var(&significand, rscale);
+    if (capacity > 0)
+    {
+        /* Keep the load factor at or below 1/2 */
+        nbuckets = 16;
+        while (nbuckets < capacity * 2 && nbuckets < (INT_MAX >> 1))
+            nbuckets <<= 1;
+        buckets = (cache_entry **) calloc(nbuckets, sizeof(cache_entry *));
+        if (!buckets)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+    else
+        capacity = 0;
 
-    numeric_dispose(&denominator);
-    numeric_dispose(&significand);
+    pthread_mutex_lock(&numeric_cache.lock);
+    cache_free_entries();
+    memset(&numeric_cache.stats, 0, sizeof(numeric_cache_stats));
+    numeric_cache.buckets = buckets;
+    numeric_cache.nbuckets = nbuckets;
+    numeric_cache.capacity = capacity;
+    numeric_cache.stats.capacity = capacity;
+    pthread_mutex_unlock(&numeric_cache.lock);
 
-    /*
-     * Allocate space for the result.
-     *
-     * In addition to the significand, we need room for the exponent
-     * decoration ("e"), the sign of the exponent, up to 10 digits for the
-     * exponent itself, and of course the null terminator.
-     */
-    len = strlen(sig_out) + 13;
-    str = malloc(len);
-    snprintf(str, len, "%se%+03d", sig_out, exponent);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
 
-    free(sig_out);
+/*
+ * numeric_cache_disable() -
+ *
+ *  Disable the transcendental result cache and free its entries
+ */
+void
+numeric_cache_disable(void)
+{
+    numeric_cache_enable(0);
+}
 
-    return str;
+/*
+ * numeric_cache_get_stats() -
+ *
+ *  Return a snapshot of the cache's hit/miss statistics
+ */
+void
+numeric_cache_get_stats(numeric_cache_stats *stats)
+{
+    pthread_mutex_lock(&numeric_cache.lock);
+    *stats = numeric_cache.stats;
+    pthread_mutex_unlock(&numeric_cache.lock);
 }
 
 
 /*
- * make_result() -
+ * numeric_cache_prewarm() -
  *
- *  Create the numeric for the result whose digit buf malloc()'d memory from
- *  a variable.
+ *  Compute a function result and put it into the cache ahead of use.
+ *
+ *  For sqrt, exp and ln, rscale may be larger than the scale the public
+ *  function would select, in which case the entry serves every request up
+ *  to that scale; a negative rscale selects the function's default scale.
+ *  Power results are always cached at numeric_power's own scale, so rscale
+ *  is ignored for NUMERIC_CACHE_POWER.  num2 is only used by power.
  */
-static numeric_errcode_t
-make_result(const numeric *var, numeric *result)
+numeric_errcode_t
+numeric_cache_prewarm(numeric_cache_op_t op, const numeric *num1,
+        const numeric *num2, int rscale)
 {
-    NumericDigit *digits = var->digits;
-    int         weight = var->weight;
-    int         n = var->ndigits;
-    NumericDigit *res_digits;
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
-    if (NUMERIC_IS_NAN(var))
-    {
-        digitbuf_free(result->buf);
-        *result = const_nan;
-        dump_var("make_result()", result);
+    if (numeric_cache.capacity == 0)
         return NUMERIC_ERRCODE_NO_ERROR;
-    }
 
-    /* truncate leading zeroes */
-    while (n > 0 && *digits == 0)
+    if (op == NUMERIC_CACHE_POWER)
     {
-        digits++;
-        weight--;
-        n--;
+        /* Let numeric_power() validate the arguments and fill the cache */
+        numeric_init(&result_var);
+        errcode = numeric_power(num1, num2, &result_var);
+        numeric_dispose(&result_var);
+        return errcode;
     }
-    /* truncate trailing zeroes */
-    while (n > 0 && digits[n - 1] == 0)
-        n--;
 
-    /* If zero result, force to weight=0 and positive sign */
-    if (n == 0)
-    {
-        zero_var(result);
+    /* NaN results are never cached */
+    if (NUMERIC_IS_NAN(num1))
         return NUMERIC_ERRCODE_NO_ERROR;
+
+    numeric_init(&result_var);
+
+    switch (op)
+    {
+        case NUMERIC_CACHE_SQRT:
+            if (rscale < 0)
+                rscale = select_sqrt_scale(num1);
+            errcode = sqrt_var(num1, &result_var,
+                               Min(rscale, NUMERIC_MAX_RESULT_SCALE));
+            break;
+        case NUMERIC_CACHE_EXP:
+            errcode = NUMERIC_ERRCODE_NO_ERROR;
+            if (rscale < 0)
+                errcode = select_exp_scale(num1, &rscale);
+            if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+                errcode = exp_var(num1, &result_var,
+                                  Min(rscale, NUMERIC_MAX_RESULT_SCALE));
+            break;
+        case NUMERIC_CACHE_LN:
+            if (rscale < 0)
+                rscale = select_ln_scale(num1);
+            errcode = ln_var(num1, &result_var,
+                             Min(rscale, NUMERIC_MAX_RESULT_SCALE));
+            break;
+        default:
+            errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            break;
     }
 
-    /* Check for overflow of int16 fields */
-    if (weight < INT16_MIN || INT16_MAX < weight
-        || var->dscale < INT16_MIN || INT16_MAX < var->dscale)
-        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        cache_insert(op, num1, NULL, Min(rscale, NUMERIC_MAX_RESULT_SCALE),
+                     &result_var);
 
-    /* Build the result */
-    res_digits = (NumericDigit *)malloc(n * sizeof(NumericDigit));
-    if (!res_digits)
-        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    numeric_dispose(&result_var);
 
-    memcpy(res_digits, digits, n * sizeof(NumericDigit));
+    return errcode;
+}
 
-    digitbuf_free(result->buf);
-    result->ndigits = n;
-    result->weight = weight;
-    result->sign = var->sign;
-    result->dscale = var->dscale;
-    result->buf = result->digits = res_digits;
 
-    dump_var("make_result()", result);
-    return NUMERIC_ERRCODE_NO_ERROR;
+/* ----------------------------------------------------------------------
+ *
+ * Exact rational arithmetic
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_rational_init() -
+ *
+ *  Initialize a rational to 0 / 1
+ */
+void
+numeric_rational_init(numeric_rational *rat)
+{
+    numeric_init(&rat->num);
+    rat->den = const_one;
 }
 
 /*
- * check_bounds_and_round() -
+ * numeric_rational_dispose() -
  *
- *  Do bounds checking and rounding according to the precision and scale.
+ *  Return the digit buffers of a rational to the free pool
  */
-static numeric_errcode_t
-check_bounds_and_round(numeric *var, int precision, int scale)
+void
+numeric_rational_dispose(numeric_rational *rat)
 {
-    int         maxdigits;
-    int         ddigits;
-    int         i;
+    numeric_dispose(&rat->num);
+    numeric_dispose(&rat->den);
+}
 
-    /* Do nothing if we have a default precision (-1) */
-    if (precision < 0)
-        return NUMERIC_ERRCODE_NO_ERROR;
 
-    maxdigits = precision - scale;
+/*
+ * numeric_rational_from_numeric() -
+ *
+ *  Convert a numeric to an (exactly equal) rational
+ */
+numeric_errcode_t
+numeric_rational_from_numeric(const numeric *num, numeric_rational *result)
+{
+    return numeric_rational_from_quotient(num, &const_one, result);
+}
 
-    /* Round to target scale (and set var->dscale) */
-    round_var(var, scale);
+
+/*
+ * numeric_rational_from_quotient() -
+ *
+ *  Form the exact quotient num1 / num2 as a rational, without dividing
+ */
+numeric_errcode_t
+numeric_rational_from_quotient(const numeric *num1, const numeric *num2,
+        numeric_rational *result)
+{
+    numeric  num;
+    numeric  den;
+    int         shift;
 
     /*
-     * Check for overflow - note we can't do this before rounding, because
-     * rounding could raise the weight.  Also note that the var's weight could
-     * be inflated by leading zeroes, which will be stripped before storage
-     * but perhaps might not have been yet. In any case, we must recognize a
-     * true zero, whose weight doesn't mean anything.
+     * Handle NaN
      */
-    ddigits = (var->weight + 1) * DEC_DIGITS;
-    if (ddigits > maxdigits)
+    if (NUMERIC_IS_NAN(num1) || NUMERIC_IS_NAN(num2))
     {
-        /* Determine true weight; and check for all-zero result */
-        for (i = 0; i < var->ndigits; i++)
-        {
-            NumericDigit dig = var->digits[i];
-
-            if (dig)
-            {
-                /* Adjust for any high-order decimal zero digits */
-#if DEC_DIGITS == 4
-                if (dig < 10)
-                    ddigits -= 3;
-                else if (dig < 100)
-                    ddigits -= 2;
-                else if (dig < 1000)
-                    ddigits -= 1;
-#elif DEC_DIGITS == 2
-                if (dig < 10)
-                    ddigits -= 1;
-#elif DEC_DIGITS == 1
-                /* no adjustment */
-#else
-#error unsupported NBASE
-#endif
-                if (ddigits > maxdigits)
-                    return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
-                break;
-            }
-            ddigits -= DEC_DIGITS;
-        }
+        rational_set_nan(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
     }
-    return NUMERIC_ERRCODE_NO_ERROR;
+
+    if (NUMERIC_IS_ZERO(num2))
+        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+
+    numeric_init(&num);
+    numeric_init(&den);
+
+    set_var_from_var(num1, &num);
+    set_var_from_var(num2, &den);
+    strip_var(&num);
+    strip_var(&den);
+
+    /*
+     * Make both sides integral by scaling them with the same power of NBASE:
+     * that is just a matter of raising both weights by the number of
+     * fractional NBASE digits found in either operand.
+     */
+    shift = Max(num.ndigits - num.weight - 1, 0) +
+        Max(den.ndigits - den.weight - 1, 0);
+    num.weight += shift;
+    den.weight += shift;
+    num.dscale = 0;
+    den.dscale = 0;
+
+    return rational_store(&num, &den, result);
 }
 
 
 /*
- * Convert numeric to int8, rounding if needed.
- *
- * If overflow, return false (no error is raised).  Return true if okay.
+ * numeric_rational_to_numeric() -
  *
- *  CAUTION: var's contents may be modified by rounding!
+ *  Convert a rational to a numeric rounded to rscale fractional digits.
+ *  This is the only place where a rational is ever rounded.  A negative
+ *  rscale selects the same result scale numeric_div() would use.
  */
-static bool
-numericvar_to_int64(numeric *var, int64_t *result)
+numeric_errcode_t
+numeric_rational_to_numeric(const numeric_rational *rat, int rscale,
+        numeric *result)
 {
-    NumericDigit *digits;
-    int         ndigits;
-    int         weight;
-    int         i;
-    int64_t       val,
-                oldval;
-    bool        neg;
-
-    /* Round to nearest integer */
-    round_var(var, 0);
-
-    /* Check for zero input */
-    strip_var(var);
-    ndigits = var->ndigits;
-    if (ndigits == 0)
-    {
-        *result = 0;
-        return true;
-    }
+    numeric  result_var;
+    numeric_errcode_t errcode;
 
     /*
-     * For input like 10000000000, we must treat stripped digits as real. So
-     * the loop assumes there are weight+1 digits before the decimal point.
+     * Handle NaN
      */
-    weight = var->weight;
-    Assert(weight >= 0 && ndigits <= weight + 1);
+    if (NUMERIC_IS_NAN(&rat->num))
+        return make_result(&const_nan, result);
 
-    /* Construct the result */
-    digits = var->digits;
-    neg = (var->sign == NUMERIC_NEG);
-    val = digits[0];
-    for (i = 1; i <= weight; i++)
-    {
-        oldval = val;
-        val *= NBASE;
-        if (i < ndigits)
-            val += digits[i];
+    if (rscale < 0)
+        rscale = select_div_scale(&rat->num, &rat->den);
+    rscale = Min(rscale, NUMERIC_MAX_RESULT_SCALE);
 
-        /*
-         * The overflow check is a bit tricky because we want to accept
-         * INT64_MIN, which will overflow the positive accumulator.  We can
-         * detect this case easily though because INT64_MIN is the only
-         * nonzero value for which -val == val (on a two's complement machine,
-         * anyway).
-         */
-        if ((val / NBASE) != oldval)    /* possible overflow? */
-        {
-            if (!neg || (-val) != val || val == 0 || oldval < 0)
-                return false;
-        }
-    }
+    numeric_init(&result_var);
 
-    *result = neg ? -val : val;
-    return true;
+    errcode = div_var(&rat->num, &rat->den, &result_var, rscale, true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
 }
 
+
 /*
- * Convert int8 value to numeric.
+ * numeric_rational_add() -
+ *
+ *  Add two rationals exactly
  */
-static void
-int64_to_numericvar(int64_t val, numeric *var)
+numeric_errcode_t
+numeric_rational_add(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result)
 {
-    uint64_t      uval,
-                newuval;
-    NumericDigit *ptr;
-    int         ndigits;
+    numeric  num;
+    numeric  den;
+    numeric  tmp;
 
-    /* int8 can require at most 19 decimal digits; add one for safety */
-    alloc_var(var, 20 / DEC_DIGITS);
-    if (val < 0)
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(&rat1->num) || NUMERIC_IS_NAN(&rat2->num))
     {
-        var->sign = NUMERIC_NEG;
-        uval = -val;
+        rational_set_nan(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
     }
-    else
+
+    numeric_init(&num);
+    numeric_init(&den);
+    numeric_init(&tmp);
+
+    /*
+     * a/b + c/d = (a*d + c*b) / (b*d), but a running sum over terms sharing
+     * one denominator is common enough to be worth the comparison.
+     */
+    if (cmp_var(&rat1->den, &rat2->den) == 0)
     {
-        var->sign = NUMERIC_POS;
-        uval = val;
+        add_var(&rat1->num, &rat2->num, &num);
+        set_var_from_var(&rat1->den, &den);
     }
-    var->dscale = 0;
-    if (val == 0)
+    else
     {
-        var->ndigits = 0;
-        var->weight = 0;
-        return;
+        mul_var(&rat1->num, &rat2->den, &num, 0);
+        mul_var(&rat2->num, &rat1->den, &tmp, 0);
+        add_var(&num, &tmp, &num);
+        mul_var(&rat1->den, &rat2->den, &den, 0);
     }
-    ptr = var->digits + var->ndigits;
-    ndigits = 0;
-    do
-    {
-        ptr--;
-        ndigits++;
-        newuval = uval / NBASE;
-        *ptr = uval - newuval * NBASE;
-        uval = newuval;
-    } while (uval);
-    var->digits = ptr;
-    var->ndigits = ndigits;
-    var->weight = ndigits - 1;
+
+    numeric_dispose(&tmp);
+
+    return rational_store(&num, &den, result);
 }
 
-/* As above, but work from a numeric */
-static numeric_errcode_t
-numericvar_to_double_no_overflow(const numeric *var, double *result)
+
+/*
+ * numeric_rational_sub() -
+ *
+ *  Subtract one rational from another exactly
+ */
+numeric_errcode_t
+numeric_rational_sub(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result)
 {
-    numeric     num;
-    char       *tmp;
-    double      val;
-    char       *endptr;
+    numeric  num;
+    numeric  den;
+    numeric  tmp;
+
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(&rat1->num) || NUMERIC_IS_NAN(&rat2->num))
+    {
+        rational_set_nan(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
 
     numeric_init(&num);
-    set_var_from_var(var, &num);
-    tmp = get_str_from_var(&num, num.dscale);
-    numeric_dispose(&num);
+    numeric_init(&den);
+    numeric_init(&tmp);
 
-    /* unlike doublein, we ignore ERANGE from strtod */
-    val = strtod(tmp, &endptr);
-    if (*endptr != '\0')
+    /* a/b - c/d = (a*d - c*b) / (b*d), see numeric_rational_add() */
+    if (cmp_var(&rat1->den, &rat2->den) == 0)
     {
-        /* shouldn't happen ... */
-        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        sub_var(&rat1->num, &rat2->num, &num);
+        set_var_from_var(&rat1->den, &den);
+    }
+    else
+    {
+        mul_var(&rat1->num, &rat2->den, &num, 0);
+        mul_var(&rat2->num, &rat1->den, &tmp, 0);
+        sub_var(&num, &tmp, &num);
+        mul_var(&rat1->den, &rat2->den, &den, 0);
     }
 
-    free(tmp);
+    numeric_dispose(&tmp);
 
-    *result = val;
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return rational_store(&num, &den, result);
 }
 
 
 /*
- * cmp_var() -
+ * numeric_rational_mul() -
  *
- *  Compare two values on variable level.  We assume zeroes have been
- *  truncated to no digits.
+ *  Multiply two rationals exactly
  */
-static int
-cmp_var(const numeric *var1, const numeric *var2)
+numeric_errcode_t
+numeric_rational_mul(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result)
 {
-    return cmp_var_common(var1->digits, var1->ndigits,
-                          var1->weight, var1->sign,
-                          var2->digits, var2->ndigits,
-                          var2->weight, var2->sign);
+    numeric  num;
+    numeric  den;
+
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(&rat1->num) || NUMERIC_IS_NAN(&rat2->num))
+    {
+        rational_set_nan(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    numeric_init(&num);
+    numeric_init(&den);
+
+    /*
+     * Both sides are integral, so rscale 0 gives the exact products.
+     */
+    mul_var(&rat1->num, &rat2->num, &num, 0);
+    mul_var(&rat1->den, &rat2->den, &den, 0);
+
+    return rational_store(&num, &den, result);
 }
 
+
 /*
- * cmp_var_common() -
+ * numeric_rational_div() -
  *
- *  Main routine of cmp_var(). This function can be used by both
- *  numeric and Numeric.
+ *  Divide one rational by another exactly
  */
-static int
-cmp_var_common(const NumericDigit *var1digits, int var1ndigits,
-               int var1weight, int var1sign,
-               const NumericDigit *var2digits, int var2ndigits,
-               int var2weight, int var2sign)
+numeric_errcode_t
+numeric_rational_div(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result)
 {
-    if (var1ndigits == 0)
-    {
-        if (var2ndigits == 0)
-            return 0;
-        if (var2sign == NUMERIC_NEG)
-            return 1;
-        return -1;
-    }
-    if (var2ndigits == 0)
-    {
-        if (var1sign == NUMERIC_POS)
-            return 1;
-        return -1;
-    }
+    numeric  num;
+    numeric  den;
 
-    if (var1sign == NUMERIC_POS)
+    /*
+     * Handle NaN
+     */
+    if (NUMERIC_IS_NAN(&rat1->num) || NUMERIC_IS_NAN(&rat2->num))
     {
-        if (var2sign == NUMERIC_NEG)
-            return 1;
-        return cmp_abs_common(var1digits, var1ndigits, var1weight,
-                              var2digits, var2ndigits, var2weight);
+        rational_set_nan(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
     }
 
-    if (var2sign == NUMERIC_POS)
-        return -1;
+    if (NUMERIC_IS_ZERO(&rat2->num))
+        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
 
-    return cmp_abs_common(var2digits, var2ndigits, var2weight,
-                          var1digits, var1ndigits, var1weight);
+    numeric_init(&num);
+    numeric_init(&den);
+
+    /* (a/b) / (c/d) = (a*d) / (b*c); rational_store() fixes up the sign */
+    mul_var(&rat1->num, &rat2->den, &num, 0);
+    mul_var(&rat1->den, &rat2->num, &den, 0);
+
+    return rational_store(&num, &den, result);
 }
 
 
+/* ----------------------------------------------------------------------
+ *
+ * Proportional allocation
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
 /*
- * add_var() -
+ * numeric_allocate() -
  *
- *  Full version of add functionality on variable level (handling signs).
- *  result might point to one of the operands too without danger.
+ *  Split total into n parts proportional to weights[], each rounded to
+ *  scale fractional digits, such that the parts add up exactly to total
+ *  rounded to scale.  Each part is first truncated; the units of 10^-scale
+ *  left over are then handed out one each to the parts with the largest
+ *  truncation remainders (largest remainder method), ties going to the
+ *  lower index.  The n parts are stored into result[], which must hold n
+ *  initialized numerics.
+ *
+ *  Weights must not be negative and must not all be zero.
  */
-static void
-add_var(const numeric *var1, const numeric *var2, numeric *result)
+numeric_errcode_t
+numeric_allocate(const numeric *total, const numeric *weights, int n,
+        int scale, numeric *result)
 {
+    numeric    *parts;
+    numeric    *remainders;
+    int        *order;
+    int         i;
+    numeric_errcode_t errcode;
+
+    if (n <= 0 || scale < 0 || scale > NUMERIC_MAX_DISPLAY_SCALE)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
     /*
-     * Decide on the signs of the two variables what to do
+     * Handle NaN
      */
-    if (var1->sign == NUMERIC_POS)
+    for (i = 0; i < n; i++)
     {
-        if (var2->sign == NUMERIC_POS)
+        if (NUMERIC_IS_NAN(&weights[i]))
+            break;
+    }
+    if (NUMERIC_IS_NAN(total) || i < n)
+    {
+        for (i = 0; i < n; i++)
         {
-            /*
-             * Both are positive result = +(ABS(var1) + ABS(var2))
-             */
-            add_abs(var1, var2, result);
-            result->sign = NUMERIC_POS;
+            errcode = make_result(&const_nan, &result[i]);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                return errcode;
         }
-        else
-        {
-            /*
-             * var1 is positive, var2 is negative Must compare absolute values
-             */
-            switch (cmp_abs(var1, var2))
-            {
-                case 0:
-                    /* ----------
-                     * ABS(var1) == ABS(var2)
-                     * result = ZERO
-                     * ----------
-                     */
-                    zero_var(result);
-                    result->dscale = Max(var1->dscale, var2->dscale);
-                    break;
-
-                case 1:
-                    /* ----------
-                     * ABS(var1) > ABS(var2)
-                     * result = +(ABS(var1) - ABS(var2))
-                     * ----------
-                     */
-                    sub_abs(var1, var2, result);
-                    result->sign = NUMERIC_POS;
-                    break;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
 
-                case -1:
-                    /* ----------
-                     * ABS(var1) < ABS(var2)
-                     * result = -(ABS(var2) - ABS(var1))
-                     * ----------
-                     */
-                    sub_abs(var2, var1, result);
-                    result->sign = NUMERIC_NEG;
-                    break;
-            }
-        }
+    parts = (numeric *) malloc(n * sizeof(numeric));
+    remainders = (numeric *) malloc(n * sizeof(numeric));
+    order = (int *) malloc(n * sizeof(int));
+    if (!parts || !remainders || !order)
+    {
+        free(parts);
+        free(remainders);
+        free(order);
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
     }
-    else
+    for (i = 0; i < n; i++)
     {
-        if (var2->sign == NUMERIC_POS)
-        {
-            /* ----------
-             * var1 is negative, var2 is positive
-             * Must compare absolute values
-             * ----------
-             */
-            switch (cmp_abs(var1, var2))
-            {
-                case 0:
-                    /* ----------
-                     * ABS(var1) == ABS(var2)
-                     * result = ZERO
-                     * ----------
-                     */
-                    zero_var(result);
-                    result->dscale = Max(var1->dscale, var2->dscale);
-                    break;
+        numeric_init(&parts[i]);
+        numeric_init(&remainders[i]);
+    }
 
-                case 1:
-                    /* ----------
-                     * ABS(var1) > ABS(var2)
-                     * result = -(ABS(var1) - ABS(var2))
-                     * ----------
-                     */
-                    sub_abs(var1, var2, result);
-                    result->sign = NUMERIC_NEG;
-                    break;
+    errcode = allocate_var(total, weights, n, scale, parts, remainders,
+                           order);
 
-                case -1:
-                    /* ----------
-                     * ABS(var1) < ABS(var2)
-                     * result = +(ABS(var2) - ABS(var1))
-                     * ----------
-                     */
-                    sub_abs(var2, var1, result);
-                    result->sign = NUMERIC_POS;
-                    break;
-            }
-        }
-        else
-        {
-            /* ----------
-             * Both are negative
-             * result = -(ABS(var1) + ABS(var2))
-             * ----------
-             */
-            add_abs(var1, var2, result);
-            result->sign = NUMERIC_NEG;
-        }
+    for (i = 0; i < n; i++)
+    {
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = make_result(&parts[i], &result[i]);
+        numeric_dispose(&parts[i]);
+        numeric_dispose(&remainders[i]);
     }
+    free(parts);
+    free(remainders);
+    free(order);
+
+    return errcode;
 }
 
 
+/* ----------------------------------------------------------------------
+ *
+ * Work budgets
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
 /*
- * sub_var() -
+ * numeric_budget_init() -
  *
- *  Full version of sub functionality on variable level (handling signs).
- *  result might point to one of the operands too without danger.
+ *  Prepare budget to allow units digit operations, or any number of them
+ *  if units is negative.
  */
-static void
-sub_var(const numeric *var1, const numeric *var2, numeric *result)
+void
+numeric_budget_init(numeric_budget *budget, int64_t units)
 {
-    /*
-     * Decide on the signs of the two variables what to do
-     */
-    if (var1->sign == NUMERIC_POS)
+    __atomic_store_n(&budget->cancelled, 0, __ATOMIC_RELAXED);
+    budget->remaining = units < 0 ? -1 : units;
+}
+
+
+/*
+ * numeric_budget_cancel() -
+ *
+ *  Ask the thread the budget is attached to to give up.  This only sets a
+ *  flag, atomically, so it is safe to call from any thread or a signal
+ *  handler; the worker notices it at its next multiplication, division or
+ *  series step.
+ */
+void
+numeric_budget_cancel(numeric_budget *budget)
+{
+    __atomic_store_n(&budget->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * numeric_budget_attach() -
+ *
+ *  Make budget govern the calling thread and return the previously
+ *  attached one, so that callers can nest and restore.  A NULL budget
+ *  detaches.
+ */
+numeric_budget *
+numeric_budget_attach(numeric_budget *budget)
+{
+    numeric_budget *prev = current_budget;
+
+    current_budget = budget;
+    return prev;
+}
+
+
+/*
+ * budget_charge() -
+ *
+ *  Deduct units from budget.  Returns true if the budget is cancelled or
+ *  has just run out, in which case the caller should abandon its work.
+ */
+static bool
+budget_charge(numeric_budget *budget, int64_t units)
+{
+    if (__atomic_load_n(&budget->cancelled, __ATOMIC_RELAXED))
+        return true;
+    if (budget->remaining < 0)
+        return false;
+    if (units > budget->remaining)
     {
-        if (var2->sign == NUMERIC_NEG)
-        {
-            /* ----------
-             * var1 is positive, var2 is negative
-             * result = +(ABS(var1) + ABS(var2))
-             * ----------
-             */
-            add_abs(var1, var2, result);
-            result->sign = NUMERIC_POS;
-        }
-        else
-        {
-            /* ----------
-             * Both are positive
-             * Must compare absolute values
-             * ----------
-             */
-            switch (cmp_abs(var1, var2))
-            {
-                case 0:
-                    /* ----------
-                     * ABS(var1) == ABS(var2)
-                     * result = ZERO
-                     * ----------
-                     */
-                    zero_var(result);
-                    result->dscale = Max(var1->dscale, var2->dscale);
-                    break;
+        budget->remaining = 0;
+        __atomic_store_n(&budget->cancelled, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    budget->remaining -= units;
+    return false;
+}
 
-                case 1:
-                    /* ----------
-                     * ABS(var1) > ABS(var2)
-                     * result = +(ABS(var1) - ABS(var2))
-                     * ----------
-                     */
-                    sub_abs(var1, var2, result);
-                    result->sign = NUMERIC_POS;
-                    break;
 
-                case -1:
-                    /* ----------
-                     * ABS(var1) < ABS(var2)
-                     * result = -(ABS(var2) - ABS(var1))
-                     * ----------
-                     */
-                    sub_abs(var2, var1, result);
-                    result->sign = NUMERIC_NEG;
-                    break;
-            }
-        }
+/* ----------------------------------------------------------------------
+ *
+ * Exact accumulators
+ *
+ * ----------------------------------------------------------------------
+ */
+
+/* Binary exponent of the lowest bit of numeric_accum.dbl[0] */
+#define ACCUM_DBL_EMIN      (-1074)
+/* Additions after which numeric_accum.dbl[] carries must be propagated */
+#define ACCUM_DBL_PENDING_MAX   (1 << 30)
+
+
+/*
+ * numeric_accum_init() -
+ *
+ *  Initialize acc to an empty (zero) sum.
+ */
+void
+numeric_accum_init(numeric_accum *acc)
+{
+    acc->isum = 0;
+    numeric_init(&acc->sum);
+    set_var_from_var(&const_zero, &acc->sum);
+    memset(acc->dbl, 0, sizeof(acc->dbl));
+    acc->dbl_pending = 0;
+    acc->nan = false;
+}
+
+
+/*
+ * numeric_accum_dispose() -
+ *
+ *  Release the memory held by acc.
+ */
+void
+numeric_accum_dispose(numeric_accum *acc)
+{
+    numeric_dispose(&acc->sum);
+}
+
+
+/*
+ * numeric_accum_add_int64() -
+ *
+ *  Add val to acc.
+ */
+void
+numeric_accum_add_int64(numeric_accum *acc, int64_t val)
+{
+    accum_add_int(acc, val);
+}
+
+
+#ifdef NUMERIC_HAVE_INT128
+/*
+ * numeric_accum_add_int128() -
+ *
+ *  Add val to acc.
+ */
+void
+numeric_accum_add_int128(numeric_accum *acc, numeric_int128 val)
+{
+    accum_add_int(acc, val);
+}
+#endif
+
+
+/*
+ * numeric_accum_add_double() -
+ *
+ *  Add the exact binary value of val to acc.  A NaN makes the sum NaN;
+ *  infinities cannot be represented and are rejected.
+ */
+numeric_errcode_t
+numeric_accum_add_double(numeric_accum *acc, double val)
+{
+    uint64_t    mant;
+    uint64_t    high;
+    int         exp;
+    int         pos;
+    int64_t    *limb;
+
+    if (isnan(val))
+    {
+        acc->nan = true;
+        return NUMERIC_ERRCODE_NO_ERROR;
     }
-    else
+    if (isinf(val))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (val == 0.0)
+        return NUMERIC_ERRCODE_NO_ERROR;
+
+    /* |val| = mant * 2^exp with mant a 53-bit integer */
+    mant = (uint64_t) ldexp(frexp(fabs(val), &exp), DBL_MANT_DIG);
+    exp -= DBL_MANT_DIG;
+    if (exp < ACCUM_DBL_EMIN)
     {
-        if (var2->sign == NUMERIC_NEG)
-        {
-            /* ----------
-             * Both are negative
-             * Must compare absolute values
-             * ----------
-             */
-            switch (cmp_abs(var1, var2))
-            {
-                case 0:
-                    /* ----------
-                     * ABS(var1) == ABS(var2)
-                     * result = ZERO
-                     * ----------
-                     */
-                    zero_var(result);
-                    result->dscale = Max(var1->dscale, var2->dscale);
-                    break;
+        /* subnormal; the bits shifted out are known to be zero */
+        mant >>= ACCUM_DBL_EMIN - exp;
+        exp = ACCUM_DBL_EMIN;
+    }
 
-                case 1:
-                    /* ----------
-                     * ABS(var1) > ABS(var2)
-                     * result = -(ABS(var1) - ABS(var2))
-                     * ----------
-                     */
-                    sub_abs(var1, var2, result);
-                    result->sign = NUMERIC_NEG;
-                    break;
+    /* Split mant << (pos % 32) into three 32-bit limbs */
+    pos = exp - ACCUM_DBL_EMIN;
+    limb = &acc->dbl[pos / 32];
+    high = (mant >> 1) >> (31 - pos % 32);
+    mant = (mant << (pos % 32)) & UINT32_MAX;
 
-                case -1:
-                    /* ----------
-                     * ABS(var1) < ABS(var2)
-                     * result = +(ABS(var2) - ABS(var1))
-                     * ----------
-                     */
-                    sub_abs(var2, var1, result);
-                    result->sign = NUMERIC_POS;
-                    break;
-            }
-        }
-        else
-        {
-            /* ----------
-             * var1 is negative, var2 is positive
-             * result = -(ABS(var1) + ABS(var2))
-             * ----------
-             */
-            add_abs(var1, var2, result);
-            result->sign = NUMERIC_NEG;
-        }
+    if (val > 0)
+    {
+        limb[0] += (int64_t) mant;
+        limb[1] += (int64_t) (high & UINT32_MAX);
+        limb[2] += (int64_t) (high >> 32);
+    }
+    else
+    {
+        limb[0] -= (int64_t) mant;
+        limb[1] -= (int64_t) (high & UINT32_MAX);
+        limb[2] -= (int64_t) (high >> 32);
     }
+
+    if (++acc->dbl_pending == ACCUM_DBL_PENDING_MAX)
+        accum_carry(acc);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
 /*
- * mul_var() -
+ * numeric_accum_add_numeric() -
  *
- *  Multiplication on variable level. Product of var1 * var2 is stored
- *  in result.  Result is rounded to no more than rscale fractional digits.
+ *  Add num to acc.
  */
-static void
-mul_var(const numeric *var1, const numeric *var2, numeric *result,
-        int rscale)
+void
+numeric_accum_add_numeric(numeric_accum *acc, const numeric *num)
 {
-    int         res_ndigits;
-    int         res_sign;
-    int         res_weight;
-    int         maxdigits;
-    int        *dig;
-    int         carry;
-    int         maxdig;
-    int         newdig;
-    NumericDigit *res_digits;
-    int         i,
-                ri,
-                i1,
-                i2;
-
-    /* copy these values into local vars for speed in inner loop */
-    int         var1ndigits = var1->ndigits;
-    int         var2ndigits = var2->ndigits;
-    NumericDigit *var1digits = var1->digits;
-    NumericDigit *var2digits = var2->digits;
-
-    if (var1ndigits == 0 || var2ndigits == 0)
+    if (NUMERIC_IS_NAN(num))
     {
-        /* one or both inputs is zero; so is result */
-        zero_var(result);
-        result->dscale = rscale;
+        acc->nan = true;
         return;
     }
+    add_var(&acc->sum, num, &acc->sum);
+}
 
-    /* Determine result sign and (maximum possible) weight */
-    if (var1->sign == var2->sign)
-        res_sign = NUMERIC_POS;
-    else
-        res_sign = NUMERIC_NEG;
-    res_weight = var1->weight + var2->weight + 2;
 
-    /*
-     * Determine number of result digits to compute.  If the exact result
-     * would have more than rscale fractional digits, truncate the computation
-     * with MUL_GUARD_DIGITS guard digits.  We do that by pretending that one
-     * or both inputs have fewer digits than they really do.
-     */
-    res_ndigits = var1ndigits + var2ndigits + 1;
-    maxdigits = res_weight + 1 + (rscale * DEC_DIGITS) + MUL_GUARD_DIGITS;
-    if (res_ndigits > maxdigits)
-    {
-        if (maxdigits < 3)
-        {
-            /* no useful precision at all in the result... */
-            zero_var(result);
-            result->dscale = rscale;
-            return;
-        }
-        /* force maxdigits odd so that input ndigits can be equal */
-        if ((maxdigits & 1) == 0)
-            maxdigits++;
-        if (var1ndigits > var2ndigits)
-        {
-            var1ndigits -= res_ndigits - maxdigits;
-            if (var1ndigits < var2ndigits)
-                var1ndigits = var2ndigits = (var1ndigits + var2ndigits) / 2;
-        }
-        else
-        {
-            var2ndigits -= res_ndigits - maxdigits;
-            if (var2ndigits < var1ndigits)
-                var1ndigits = var2ndigits = (var1ndigits + var2ndigits) / 2;
-        }
-        res_ndigits = maxdigits;
-        Assert(res_ndigits == var1ndigits + var2ndigits + 1);
-    }
+/*
+ * numeric_accum_finalize() -
+ *
+ *  Store the exact sum of everything added to acc into result.  acc is
+ *  left valid, so accumulation may continue afterwards.
+ */
+numeric_errcode_t
+numeric_accum_finalize(numeric_accum *acc, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    numeric_init(&result_var);
+
+    accum_var(acc, &result_var);
+
+    errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_accum_merge() -
+ *
+ *  Add everything accumulated in other to acc.  Merging is exact, so
+ *  partial sums may be merged in any order.
+ */
+void
+numeric_accum_merge(numeric_accum *acc, const numeric_accum *other)
+{
+    int         i;
+
+    acc->nan = acc->nan || other->nan;
+
+    accum_add_int(acc, other->isum);
+    add_var(&acc->sum, &other->sum, &acc->sum);
 
     /*
-     * We do the arithmetic in an array "dig[]" of signed int's.  Since
-     * INT_MAX is noticeably larger than NBASE*NBASE, this gives us headroom
-     * to avoid normalizing carries immediately.
-     *
-     * maxdig tracks the maximum possible value of any dig[] entry; when this
-     * threatens to exceed INT_MAX, we take the time to propagate carries. To
-     * avoid overflow in maxdig itself, it actually represents the max
-     * possible value divided by NBASE-1.
+     * Our limbs are below 2^32 after carrying and other's below 2^62
+     * whatever its pending count, so the limb-wise sums cannot overflow.
      */
-    dig = (int *) calloc(sizeof(int), res_ndigits);
-    maxdig = 0;
+    accum_carry(acc);
+    for (i = 0; i < NUMERIC_ACCUM_DBL_LIMBS; i++)
+        acc->dbl[i] += other->dbl[i];
+    accum_carry(acc);
+}
 
-    ri = res_ndigits - 1;
-    for (i1 = var1ndigits - 1; i1 >= 0; ri--, i1--)
+
+/*
+ * accum_var() -
+ *
+ *  Set result to the exact sum held by acc.
+ */
+static void
+accum_var(numeric_accum *acc, numeric *result)
+{
+    numeric  tmp;
+
+    if (acc->nan)
     {
-        int         var1digit = var1digits[i1];
+        set_var_from_var(&const_nan, result);
+        return;
+    }
 
-        if (var1digit == 0)
-            continue;
+    numeric_init(&tmp);
 
-        /* Time to normalize? */
-        maxdig += var1digit;
-        if (maxdig > INT_MAX / (NBASE - 1))
-        {
-            /* Yes, do it */
-            carry = 0;
-            for (i = res_ndigits - 1; i >= 0; i--)
-            {
-                newdig = dig[i] + carry;
-                if (newdig >= NBASE)
-                {
-                    carry = newdig / NBASE;
-                    newdig -= carry * NBASE;
-                }
-                else
-                    carry = 0;
-                dig[i] = newdig;
-            }
-            Assert(carry == 0);
-            /* Reset maxdig to indicate new worst-case */
-            maxdig = 1 + var1digit;
-        }
+#ifdef NUMERIC_HAVE_INT128
+    int128_to_numericvar(acc->isum, &tmp);
+#else
+    int64_to_numericvar(acc->isum, &tmp);
+#endif
+    add_var(&acc->sum, &tmp, result);
 
-        /* Add appropriate multiple of var2 into the accumulator */
-        i = ri;
-        for (i2 = var2ndigits - 1; i2 >= 0; i2--)
-            dig[i--] += var1digit * var2digits[i2];
-    }
+    accum_double_var(acc, &tmp);
+    add_var(result, &tmp, result);
 
-    /*
-     * Now we do a final carry propagation pass to normalize the result, which
-     * we combine with storing the result digits into the output. Note that
-     * this is still done at full precision w/guard digits.
-     */
-    alloc_var(result, res_ndigits);
-    res_digits = result->digits;
-    carry = 0;
-    for (i = res_ndigits - 1; i >= 0; i--)
+    numeric_dispose(&tmp);
+}
+
+
+/*
+ * accum_add_int() -
+ *
+ *  Add val to the pending integer sum of acc, spilling that into the
+ *  numeric sum first if the addition would overflow.
+ */
+static void
+accum_add_int(numeric_accum *acc, accum_int val)
+{
+    accum_int   sum;
+
+    if (__builtin_add_overflow(acc->isum, val, &sum))
     {
-        newdig = dig[i] + carry;
-        if (newdig >= NBASE)
-        {
-            carry = newdig / NBASE;
-            newdig -= carry * NBASE;
-        }
-        else
-            carry = 0;
-        res_digits[i] = newdig;
+        accum_spill(acc);
+        sum = val;
     }
-    Assert(carry == 0);
+    acc->isum = sum;
+}
 
-    free(dig);
 
-    /*
-     * Finally, round the result to the requested precision.
-     */
-    result->weight = res_weight;
-    result->sign = res_sign;
+/*
+ * accum_spill() -
+ *
+ *  Move the pending integer sum of acc into its numeric sum.
+ */
+static void
+accum_spill(numeric_accum *acc)
+{
+    numeric  tmp;
 
-    /* Round to target rscale (and set result->dscale) */
-    round_var(result, rscale);
+    numeric_init(&tmp);
+#ifdef NUMERIC_HAVE_INT128
+    int128_to_numericvar(acc->isum, &tmp);
+#else
+    int64_to_numericvar(acc->isum, &tmp);
+#endif
+    add_var(&acc->sum, &tmp, &acc->sum);
+    numeric_dispose(&tmp);
 
-    /* Strip leading and trailing zeroes */
-    strip_var(result);
+    acc->isum = 0;
 }
 
 
 /*
- * div_var() -
+ * accum_carry() -
  *
- *  Division on variable level. Quotient of var1 / var2 is stored in result.
- *  The quotient is figured to exactly rscale fractional digits.
- *  If round is true, it is rounded at the rscale'th digit; if false, it
- *  is truncated (towards zero) at that digit.
+ *  Propagate carries through acc->dbl[] so that every limb but the top one
+ *  is in [0, 2^32).  The top limb carries the sign.
  */
-static numeric_errcode_t
-div_var(const numeric *var1, const numeric *var2, numeric *result,
-        int rscale, bool round)
+static void
+accum_carry(numeric_accum *acc)
 {
-    int         div_ndigits;
-    int         res_ndigits;
-    int         res_sign;
-    int         res_weight;
-    int         carry;
-    int         borrow;
-    int         divisor1;
-    int         divisor2;
-    NumericDigit *dividend;
-    NumericDigit *divisor;
-    NumericDigit *res_digits;
+    int64_t     carry;
     int         i;
-    int         j;
 
-    /* copy these values into local vars for speed in inner loop */
-    int         var1ndigits = var1->ndigits;
-    int         var2ndigits = var2->ndigits;
+    for (i = 0; i < NUMERIC_ACCUM_DBL_LIMBS - 1; i++)
+    {
+        carry = acc->dbl[i] >> 32;      /* arithmetic shift: floor */
+        acc->dbl[i] -= carry * ((int64_t) 1 << 32);
+        acc->dbl[i + 1] += carry;
+    }
+    acc->dbl_pending = 0;
+}
 
-    /*
-     * First of all division by zero check; we must not be handed an
-     * unnormalized divisor.
-     */
-    if (var2ndigits == 0 || var2->digits[0] == 0)
-        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
 
-    /*
-     * Now result zero check
-     */
-    if (var1ndigits == 0)
+/*
+ * accum_double_var() -
+ *
+ *  Convert the double part of acc to numeric, exactly.  The limbs form an
+ *  integer L times 2^e; for negative e that is L * 5^-e / 10^-e, so the
+ *  result has exactly -e fractional digits, trimmed to those actually
+ *  needed.
+ */
+static void
+accum_double_var(numeric_accum *acc, numeric *result)
+{
+    numeric  limb;
+    numeric  two32;
+    numeric  factor;
+    int         lo;
+    int         hi;
+    int         exp;
+    int         i;
+
+    accum_carry(acc);
+
+    for (lo = 0; lo < NUMERIC_ACCUM_DBL_LIMBS && acc->dbl[lo] == 0; lo++)
+        ;
+    if (lo == NUMERIC_ACCUM_DBL_LIMBS)
     {
-        zero_var(result);
-        result->dscale = rscale;
-        return NUMERIC_ERRCODE_NO_ERROR;
+        set_var_from_var(&const_zero, result);
+        return;
     }
+    for (hi = NUMERIC_ACCUM_DBL_LIMBS - 1; acc->dbl[hi] == 0; hi--)
+        ;
 
-    /*
-     * Determine the result sign, weight and number of digits to calculate.
-     * The weight figured here is correct if the emitted quotient has no
-     * leading zero digits; otherwise strip_var() will fix things up.
-     */
-    if (var1->sign == var2->sign)
-        res_sign = NUMERIC_POS;
+    numeric_init(&limb);
+    numeric_init(&two32);
+    numeric_init(&factor);
+
+    /* L by Horner's rule in base 2^32 */
+    int64_to_numericvar((int64_t) 1 << 32, &two32);
+    int64_to_numericvar(acc->dbl[hi], result);
+    for (i = hi - 1; i >= lo; i--)
+    {
+        mul_var(result, &two32, result, 0);
+        int64_to_numericvar(acc->dbl[i], &limb);
+        add_var(result, &limb, result);
+    }
+
+    exp = lo * 32 + ACCUM_DBL_EMIN;
+    if (exp >= 0)
+    {
+        int64_to_numericvar(2, &limb);
+        power_var_int(&limb, exp, &factor, 0);
+        mul_var(result, &factor, result, 0);
+    }
     else
-        res_sign = NUMERIC_NEG;
-    res_weight = var1->weight - var2->weight;
-    /* The number of accurate result digits we need to produce: */
-    res_ndigits = res_weight + 1 + (rscale + DEC_DIGITS - 1) / DEC_DIGITS;
-    /* ... but always at least 1 */
-    res_ndigits = Max(res_ndigits, 1);
-    /* If rounding needed, figure one more digit to ensure correct result */
-    if (round)
-        res_ndigits++;
+    {
+        int64_to_numericvar(5, &limb);
+        power_var_int(&limb, -exp, &factor, 0);
+        mul_var(result, &factor, result, 0);
+
+        /* factor = 10^exp, a single NBASE digit */
+        alloc_var(&factor, 1);
+        factor.digits[0] = (-exp) % DEC_DIGITS == 0 ?
+            1 : round_powers[(-exp) % DEC_DIGITS];
+        factor.weight = -((-exp + DEC_DIGITS - 1) / DEC_DIGITS);
+        factor.sign = NUMERIC_POS;
+        factor.dscale = -exp;
+        mul_var(result, &factor, result, -exp);
+
+        /* keep only the fractional digits that are nonzero */
+        if (result->ndigits == 0)
+            result->dscale = 0;
+        else
+        {
+            int         last = result->digits[result->ndigits - 1];
+            int         dscale;
 
-    /*
-     * The working dividend normally requires res_ndigits + var2ndigits
-     * digits, but make it at least var1ndigits so we can load all of var1
-     * into it.  (There will be an additional digit dividend[0] in the
-     * dividend space, but for consistency with Knuth's notation we don't
-     * count that in div_ndigits.)
-     */
-    div_ndigits = res_ndigits + var2ndigits;
-    div_ndigits = Max(div_ndigits, var1ndigits);
+            dscale = (result->ndigits - result->weight - 1) * DEC_DIGITS;
+            while (dscale > 0 && last % 10 == 0)
+            {
+                last /= 10;
+                dscale--;
+            }
+            result->dscale = Max(dscale, 0);
+        }
+    }
 
-    /*
-     * We need a workspace with room for the working dividend (div_ndigits+1
-     * digits) plus room for the possibly-normalized divisor (var2ndigits
-     * digits).  It is convenient also to have a zero at divisor[0] with the
-     * actual divisor data in divisor[1 .. var2ndigits].  Transferring the
-     * digits into the workspace also allows us to realloc the result (which
-     * might be the same as either input var) before we begin the main loop.
+    numeric_dispose(&limb);
+    numeric_dispose(&two32);
+    numeric_dispose(&factor);
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Aggregate states
+ *
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * Serialized numeric_agg layout; all integers are little-endian.
+ *
+ *  "NAG1"  magic and format version
+ *  int64   count
+ *  accum   sum, then sumsq:
+ *      uint8   nan flag
+ *      int64   isum, high half
+ *      uint64  isum, low half
+ *      var     spilled numeric sum
+ *      uint16  index of the first limb stored
+ *      uint16  number of limbs stored, lo to hi
+ *      int64   limbs, not carried
+ *  var     min, then max, only if count > 0
+ *
+ * and each var is
+ *
+ *      uint8   0 = positive, 1 = negative, 2 = NaN
+ *      int32   weight
+ *      uint16  dscale
+ *      int32   ndigits
+ *      uint16  digits
+ */
+#define AGG_MAGIC           "NAG1"
+#define AGG_MAGIC_LEN       4
+#define AGG_VAR_HEADER_LEN  11
+#define AGG_ACCUM_HEADER_LEN    21
+/* Largest limb magnitude accepted from a serialized state */
+#define AGG_LIMB_MAX        ((int64_t) 1 << 62)
+
+
+/*
+ * numeric_agg_init() -
+ *
+ *  Initialize agg to the state of an empty set of rows.
+ */
+void
+numeric_agg_init(numeric_agg *agg)
+{
+    agg->count = 0;
+    numeric_accum_init(&agg->sum);
+    numeric_accum_init(&agg->sumsq);
+    numeric_init(&agg->min);
+    numeric_init(&agg->max);
+}
+
+
+/*
+ * numeric_agg_dispose() -
+ *
+ *  Release the memory held by agg.
+ */
+void
+numeric_agg_dispose(numeric_agg *agg)
+{
+    numeric_accum_dispose(&agg->sum);
+    numeric_accum_dispose(&agg->sumsq);
+    numeric_dispose(&agg->min);
+    numeric_dispose(&agg->max);
+}
+
+
+/*
+ * numeric_agg_add() -
+ *
+ *  Add one row with value num to agg.
+ */
+void
+numeric_agg_add(numeric_agg *agg, const numeric *num)
+{
+    numeric  square;
+
+    agg_minmax(agg, num);
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        agg->sum.nan = true;
+        agg->sumsq.nan = true;
+        return;
+    }
+
+    numeric_init(&square);
+    mul_var(num, num, &square, num->dscale * 2);
+
+    add_var(&agg->sum.sum, num, &agg->sum.sum);
+    add_var(&agg->sumsq.sum, &square, &agg->sumsq.sum);
+
+    numeric_dispose(&square);
+}
+
+
+/*
+ * numeric_agg_add_int64() -
+ *
+ *  Add one row with value val to agg.  The sums stay in native integers
+ *  as far as possible.
+ */
+void
+numeric_agg_add_int64(numeric_agg *agg, int64_t val)
+{
+    numeric  var;
+
+    numeric_init(&var);
+    int64_to_numericvar(val, &var);
+    agg_minmax(agg, &var);
+
+    accum_add_int(&agg->sum, val);
+#ifdef NUMERIC_HAVE_INT128
+    accum_add_int(&agg->sumsq, (accum_int) val * val);
+#else
+    mul_var(&var, &var, &var, 0);
+    add_var(&agg->sumsq.sum, &var, &agg->sumsq.sum);
+#endif
+
+    numeric_dispose(&var);
+}
+
+
+/*
+ * numeric_agg_merge() -
+ *
+ *  Combine the partial aggregate other into agg.  The merge is exact, so
+ *  partial states may be merged in any order and grouping.
+ */
+void
+numeric_agg_merge(numeric_agg *agg, const numeric_agg *other)
+{
+    if (other->count == 0)
+        return;
+
+    if (agg->count == 0)
+    {
+        set_var_from_var(&other->min, &agg->min);
+        set_var_from_var(&other->max, &agg->max);
+    }
+    else
+    {
+        if (cmp_numerics(&other->min, &agg->min) < 0)
+            set_var_from_var(&other->min, &agg->min);
+        if (cmp_numerics(&other->max, &agg->max) > 0)
+            set_var_from_var(&other->max, &agg->max);
+    }
+    agg->count += other->count;
+
+    numeric_accum_merge(&agg->sum, &other->sum);
+    numeric_accum_merge(&agg->sumsq, &other->sumsq);
+}
+
+
+/*
+ * numeric_agg_serialize() -
+ *
+ *  Encode agg into a newly malloc'd buffer, returned in *result with its
+ *  size in *length.
+ */
+numeric_errcode_t
+numeric_agg_serialize(const numeric_agg *agg, unsigned char **result,
+        size_t *length)
+{
+    unsigned char *buf;
+    unsigned char *p;
+    size_t      size;
+
+    size = AGG_MAGIC_LEN + 8 + agg_accum_size(&agg->sum) +
+        agg_accum_size(&agg->sumsq);
+    if (agg->count > 0)
+        size += agg_var_size(&agg->min) + agg_var_size(&agg->max);
+
+    buf = (unsigned char *) malloc(size);
+    if (buf == NULL)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+
+    memcpy(buf, AGG_MAGIC, AGG_MAGIC_LEN);
+    p = agg_put_uint(buf + AGG_MAGIC_LEN, (uint64_t) agg->count, 8);
+    p = agg_put_accum(p, &agg->sum);
+    p = agg_put_accum(p, &agg->sumsq);
+    if (agg->count > 0)
+    {
+        p = agg_put_var(p, &agg->min);
+        p = agg_put_var(p, &agg->max);
+    }
+    Assert(p == buf + size);
+
+    *result = buf;
+    *length = size;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_agg_deserialize() -
+ *
+ *  Decode a state encoded by numeric_agg_serialize() into result, which
+ *  must have been initialized.  Malformed input is rejected with
+ *  NUMERIC_ERRCODE_INVALID_ARGUMENT.
+ */
+numeric_errcode_t
+numeric_agg_deserialize(const unsigned char *data, size_t length,
+        numeric_agg *result)
+{
+    const unsigned char *end = data + length;
+    const unsigned char *p;
+    uint64_t    count;
+
+    if (length < AGG_MAGIC_LEN + 8 ||
+        memcmp(data, AGG_MAGIC, AGG_MAGIC_LEN) != 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    p = agg_get_uint(data + AGG_MAGIC_LEN, end, 8, &count);
+    if ((int64_t) count < 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    result->count = (int64_t) count;
+
+    p = agg_get_accum(p, end, &result->sum);
+    p = agg_get_accum(p, end, &result->sumsq);
+    if (p != NULL && result->count > 0)
+    {
+        p = agg_get_var(p, end, &result->min);
+        p = agg_get_var(p, end, &result->max);
+    }
+    if (p != end)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_agg_sum() -
+ *
+ *  Store the sum of the rows added to agg into result.  There is no sum
+ *  of no rows.
+ */
+numeric_errcode_t
+numeric_agg_sum(numeric_agg *agg, numeric *result)
+{
+    if (agg->count == 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    return numeric_accum_finalize(&agg->sum, result);
+}
+
+
+/*
+ * numeric_agg_avg() -
+ *
+ *  Store the mean of the rows added to agg into result, with the scale
+ *  numeric_div() would choose.
+ */
+numeric_errcode_t
+numeric_agg_avg(numeric_agg *agg, numeric *result)
+{
+    numeric  sum_var;
+    numeric  count_var;
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    if (agg->count == 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (agg->sum.nan)
+        return make_result(&const_nan, result);
+
+    numeric_init(&sum_var);
+    numeric_init(&count_var);
+    numeric_init(&result_var);
+
+    accum_var(&agg->sum, &sum_var);
+    int64_to_numericvar(agg->count, &count_var);
+
+    errcode = div_var(&sum_var, &count_var, &result_var,
+                      select_div_scale(&sum_var, &count_var), true);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&sum_var);
+    numeric_dispose(&count_var);
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_agg_variance() -
+ *
+ *  Store the sample (var_samp) or population (var_pop) variance of the
+ *  rows added to agg into result.  The sample variance needs two rows.
+ */
+numeric_errcode_t
+numeric_agg_variance(numeric_agg *agg, bool sample, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    numeric_init(&result_var);
+
+    errcode = agg_variance_var(agg, sample, false, &result_var);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * numeric_agg_stddev() -
+ *
+ *  Store the sample (stddev_samp) or population (stddev_pop) standard
+ *  deviation of the rows added to agg into result.
+ */
+numeric_errcode_t
+numeric_agg_stddev(numeric_agg *agg, bool sample, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    numeric_init(&result_var);
+
+    errcode = agg_variance_var(agg, sample, true, &result_var);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+/*
+ * agg_minmax() -
+ *
+ *  Count one more row with value num, updating the extremes of agg.
+ */
+static void
+agg_minmax(numeric_agg *agg, const numeric *num)
+{
+    if (agg->count++ == 0)
+    {
+        set_var_from_var(num, &agg->min);
+        set_var_from_var(num, &agg->max);
+        return;
+    }
+    if (cmp_numerics(num, &agg->min) < 0)
+        set_var_from_var(num, &agg->min);
+    else if (cmp_numerics(num, &agg->max) > 0)
+        set_var_from_var(num, &agg->max);
+}
+
+
+/*
+ * agg_variance_var() -
+ *
+ *  Compute the variance, or its square root if stddev, as
+ *
+ *      (N * sum(x^2) - sum(x)^2) / (N * (N - 1))
+ *
+ *  or with N * N for the population variance.  Both sums are exact, so
+ *  the only rounding is in the final division.
+ */
+static numeric_errcode_t
+agg_variance_var(numeric_agg *agg, bool sample, bool stddev,
+        numeric *result)
+{
+    numeric  vN;
+    numeric  vNminus1;
+    numeric  vsumX;
+    numeric  vsumX2;
+    int         rscale;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+
+    if (agg->count == 0 || (sample && agg->count == 1))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    if (agg->sum.nan)
+    {
+        set_var_from_var(&const_nan, result);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    numeric_init(&vN);
+    numeric_init(&vNminus1);
+    numeric_init(&vsumX);
+    numeric_init(&vsumX2);
+
+    int64_to_numericvar(agg->count, &vN);
+    accum_var(&agg->sum, &vsumX);
+    accum_var(&agg->sumsq, &vsumX2);
+
+    rscale = vsumX.dscale * 2;
+
+    mul_var(&vsumX, &vsumX, &vsumX, rscale);    /* vsumX = sumX * sumX */
+    mul_var(&vN, &vsumX2, &vsumX2, rscale);     /* vsumX2 = N * sumX2 */
+    sub_var(&vsumX2, &vsumX, &vsumX2);  /* N * sumX2 - sumX * sumX */
+
+    if (cmp_var(&vsumX2, &const_zero) <= 0)
+    {
+        /* Watch out for roundoff error producing a negative numerator */
+        set_var_from_var(&const_zero, result);
+    }
+    else
+    {
+        if (sample)
+            sub_var(&vN, &const_one, &vNminus1);
+        else
+            set_var_from_var(&vN, &vNminus1);
+        mul_var(&vN, &vNminus1, &vNminus1, 0);  /* N * (N - 1) or N * N */
+        rscale = select_div_scale(&vsumX2, &vNminus1);
+        errcode = div_var(&vsumX2, &vNminus1, result, rscale, true);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR && stddev)
+            errcode = sqrt_var(result, result, rscale);
+    }
+
+    numeric_dispose(&vN);
+    numeric_dispose(&vNminus1);
+    numeric_dispose(&vsumX);
+    numeric_dispose(&vsumX2);
+
+    return errcode;
+}
+
+
+/*
+ * agg_put_uint() -
+ *
+ *  Store the low nbytes bytes of val at p, little-endian, and return the
+ *  position after them.
+ */
+static unsigned char *
+agg_put_uint(unsigned char *p, uint64_t val, int nbytes)
+{
+    int         i;
+
+    for (i = 0; i < nbytes; i++)
+    {
+        *p++ = (unsigned char) (val & 0xFF);
+        val >>= 8;
+    }
+    return p;
+}
+
+
+/*
+ * agg_get_uint() -
+ *
+ *  Load an nbytes little-endian unsigned integer from p into *val and
+ *  return the position after it, or NULL if p is NULL or fewer than
+ *  nbytes bytes remain before end.
+ */
+static const unsigned char *
+agg_get_uint(const unsigned char *p, const unsigned char *end, int nbytes,
+        uint64_t *val)
+{
+    int         i;
+
+    *val = 0;
+    if (p == NULL || end - p < nbytes)
+        return NULL;
+    for (i = nbytes - 1; i >= 0; i--)
+        *val = (*val << 8) | p[i];
+    return p + nbytes;
+}
+
+
+/*
+ * agg_var_size() -
+ *
+ *  Bytes needed to serialize var.
+ */
+static size_t
+agg_var_size(const numeric *var)
+{
+    return AGG_VAR_HEADER_LEN + 2 * (size_t) var->ndigits;
+}
+
+
+/*
+ * agg_put_var() -
+ *
+ *  Serialize var at p and return the position after it.
+ */
+static unsigned char *
+agg_put_var(unsigned char *p, const numeric *var)
+{
+    int         i;
+
+    if (NUMERIC_IS_NAN(var))
+        *p++ = 2;
+    else
+        *p++ = (var->sign == NUMERIC_NEG) ? 1 : 0;
+    p = agg_put_uint(p, (uint32_t) var->weight, 4);
+    p = agg_put_uint(p, (uint16_t) var->dscale, 2);
+    p = agg_put_uint(p, (uint32_t) var->ndigits, 4);
+    for (i = 0; i < var->ndigits; i++)
+        p = agg_put_uint(p, (uint16_t) var->digits[i], 2);
+    return p;
+}
+
+
+/*
+ * agg_get_var() -
+ *
+ *  Load a serialized var from p into var and return the position after it,
+ *  or NULL if the input is truncated or malformed.
+ */
+static const unsigned char *
+agg_get_var(const unsigned char *p, const unsigned char *end, numeric *var)
+{
+    uint64_t    sign;
+    uint64_t    weight;
+    uint64_t    dscale;
+    uint64_t    ndigits;
+    uint64_t    digit;
+    int         i;
+
+    p = agg_get_uint(p, end, 1, &sign);
+    p = agg_get_uint(p, end, 4, &weight);
+    p = agg_get_uint(p, end, 2, &dscale);
+    p = agg_get_uint(p, end, 4, &ndigits);
+    if (p == NULL || sign > 2 || dscale > INT16_MAX ||
+        ndigits > (uint64_t) (end - p) / 2)
+        return NULL;
+
+    if (sign == 2)
+    {
+        if (ndigits != 0)
+            return NULL;
+        set_var_from_var(&const_nan, var);
+        return p;
+    }
+
+    alloc_var(var, (int) ndigits);
+    var->sign = (sign == 1) ? NUMERIC_NEG : NUMERIC_POS;
+    var->weight = (int32_t) (uint32_t) weight;
+    var->dscale = (int) dscale;
+    for (i = 0; i < (int) ndigits; i++)
+    {
+        p = agg_get_uint(p, end, 2, &digit);
+        if (digit >= NBASE)
+            return NULL;
+        var->digits[i] = (NumericDigit) digit;
+    }
+    return p;
+}
+
+
+/*
+ * agg_accum_range() -
+ *
+ *  Find the nonzero limbs of acc: *nlimbs of them starting at *first.
+ */
+static void
+agg_accum_range(const numeric_accum *acc, int *first, int *nlimbs)
+{
+    int         lo;
+    int         hi;
+
+    for (lo = 0; lo < NUMERIC_ACCUM_DBL_LIMBS && acc->dbl[lo] == 0; lo++)
+        ;
+    for (hi = NUMERIC_ACCUM_DBL_LIMBS; hi > lo && acc->dbl[hi - 1] == 0; hi--)
+        ;
+    *first = (lo < hi) ? lo : 0;
+    *nlimbs = hi - lo;
+}
+
+
+/*
+ * agg_accum_size() -
+ *
+ *  Bytes needed to serialize acc.
+ */
+static size_t
+agg_accum_size(const numeric_accum *acc)
+{
+    int         first;
+    int         nlimbs;
+
+    agg_accum_range(acc, &first, &nlimbs);
+    return AGG_ACCUM_HEADER_LEN + agg_var_size(&acc->sum) + 8 * nlimbs;
+}
+
+
+/*
+ * agg_put_accum() -
+ *
+ *  Serialize acc at p and return the position after it.  Only the nonzero
+ *  limbs are written, and they are written as they are, without carrying.
+ */
+static unsigned char *
+agg_put_accum(unsigned char *p, const numeric_accum *acc)
+{
+    int         first;
+    int         nlimbs;
+    int         i;
+
+    *p++ = acc->nan ? 1 : 0;
+#ifdef NUMERIC_HAVE_INT128
+    p = agg_put_uint(p, (uint64_t) (acc->isum >> 64), 8);
+#else
+    p = agg_put_uint(p, acc->isum < 0 ? UINT64_MAX : 0, 8);
+#endif
+    p = agg_put_uint(p, (uint64_t) acc->isum, 8);
+    p = agg_put_var(p, &acc->sum);
+
+    agg_accum_range(acc, &first, &nlimbs);
+    p = agg_put_uint(p, first, 2);
+    p = agg_put_uint(p, nlimbs, 2);
+    for (i = first; i < first + nlimbs; i++)
+        p = agg_put_uint(p, (uint64_t) acc->dbl[i], 8);
+    return p;
+}
+
+
+/*
+ * agg_get_accum() -
+ *
+ *  Load a serialized accumulator from p into acc and return the position
+ *  after it, or NULL if the input is truncated or malformed.
+ */
+static const unsigned char *
+agg_get_accum(const unsigned char *p, const unsigned char *end,
+        numeric_accum *acc)
+{
+    uint64_t    nan;
+    uint64_t    hi;
+    uint64_t    lo;
+    uint64_t    first;
+    uint64_t    nlimbs;
+    uint64_t    limb;
+    int         i;
+
+    p = agg_get_uint(p, end, 1, &nan);
+    p = agg_get_uint(p, end, 8, &hi);
+    p = agg_get_uint(p, end, 8, &lo);
+    if (p == NULL || nan > 1)
+        return NULL;
+    p = agg_get_var(p, end, &acc->sum);
+    if (p == NULL || NUMERIC_IS_NAN(&acc->sum))
+        return NULL;
+    acc->nan = (nan == 1);
+
+#ifdef NUMERIC_HAVE_INT128
+    acc->isum = (numeric_int128) (((unsigned __int128) hi << 64) | lo);
+#else
+    if (hi == ((int64_t) lo < 0 ? UINT64_MAX : 0))
+        acc->isum = (int64_t) lo;
+    else
+    {
+        numeric  tmp;
+        numeric  two32;
+
+        /* too wide for us; fold hi * 2^64 + lo into the numeric sum */
+        numeric_init(&tmp);
+        numeric_init(&two32);
+        int64_to_numericvar((int64_t) 1 << 32, &two32);
+        int64_to_numericvar((int64_t) hi, &tmp);
+        mul_var(&tmp, &two32, &tmp, 0);
+        int64_to_numericvar((int64_t) (lo >> 32), &two32);
+        add_var(&tmp, &two32, &tmp);
+        int64_to_numericvar((int64_t) 1 << 32, &two32);
+        mul_var(&tmp, &two32, &tmp, 0);
+        int64_to_numericvar((int64_t) (lo & UINT32_MAX), &two32);
+        add_var(&tmp, &two32, &tmp);
+        add_var(&acc->sum, &tmp, &acc->sum);
+        numeric_dispose(&tmp);
+        numeric_dispose(&two32);
+        acc->isum = 0;
+    }
+#endif
+
+    p = agg_get_uint(p, end, 2, &first);
+    p = agg_get_uint(p, end, 2, &nlimbs);
+    if (p == NULL || first + nlimbs > NUMERIC_ACCUM_DBL_LIMBS)
+        return NULL;
+    memset(acc->dbl, 0, sizeof(acc->dbl));
+    for (i = (int) first; i < (int) (first + nlimbs); i++)
+    {
+        p = agg_get_uint(p, end, 8, &limb);
+        if (p == NULL ||
+            (int64_t) limb > AGG_LIMB_MAX || (int64_t) limb < -AGG_LIMB_MAX)
+            return NULL;
+        acc->dbl[i] = (int64_t) limb;
+    }
+    accum_carry(acc);
+    return p;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Grouped aggregation
+ *
+ * The numeric_group_* functions aggregate values[i] into the state of
+ * group group_ids[i], for group ids assigned densely by the caller.
+ *
+ * numeric_group_sum() adds the digits of each value into a window of
+ * int64_t limbs kept for its group, without carrying: a limb grows by less
+ * than NBASE per row, so fewer than INT_MAX rows cannot overflow it.  At
+ * the end of the call each group's limbs are carried once and added into
+ * its numeric_accum, so the numeric arithmetic is per group, not per row.
+ * numeric_group_min() and numeric_group_max() likewise remember the best
+ * row of each group and copy it once.
+ *
+ * With nthreads > 1 the groups are split into that many ranges of ids,
+ * each aggregated by its own thread over all the rows.  No two threads
+ * touch the same group, so no merging or locking is needed, and the
+ * results do not depend on nthreads.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * numeric_group_sum() -
+ *
+ *  Add each of values[0 .. n-1] into accums[group_ids[i]], as
+ *  numeric_accum_add_numeric() does.  Rows whose group id is negative are
+ *  skipped.  accums[0 .. n_groups-1] must have been initialized.
+ */
+numeric_errcode_t
+numeric_group_sum(const numeric *values, const int *group_ids, int n,
+        int n_groups, numeric_accum *accums, int nthreads)
+{
+    group_task  task;
+
+    memset(&task, 0, sizeof(task));
+    task.op = GROUP_SUM;
+    task.values = values;
+    task.group_ids = group_ids;
+    task.n = n;
+    task.accums = accums;
+    return group_run(&task, n_groups, nthreads);
+}
+
+
+/*
+ * numeric_group_min() -
+ *
+ *  Set results[g] to the smallest of the values of group g, for each
+ *  group g with found[g] false or with a smaller value than results[g],
+ *  and set found[g].  Start with found[0 .. n_groups-1] all false and
+ *  every results[g] initialized with numeric_init(), since the values are
+ *  copied over whatever results[] holds; then later calls continue the
+ *  same aggregation.  NaN sorts above everything, as in numeric_cmp().
+ *  Rows whose group id is negative are skipped.
+ */
+numeric_errcode_t
+numeric_group_min(const numeric *values, const int *group_ids, int n,
+        int n_groups, numeric *results, bool *found, int nthreads)
+{
+    group_task  task;
+
+    memset(&task, 0, sizeof(task));
+    task.op = GROUP_MIN;
+    task.values = values;
+    task.group_ids = group_ids;
+    task.n = n;
+    task.results = results;
+    task.found = found;
+    return group_run(&task, n_groups, nthreads);
+}
+
+
+/*
+ * numeric_group_max() -
+ *
+ *  Like numeric_group_min(), for the largest value of each group.
+ */
+numeric_errcode_t
+numeric_group_max(const numeric *values, const int *group_ids, int n,
+        int n_groups, numeric *results, bool *found, int nthreads)
+{
+    group_task  task;
+
+    memset(&task, 0, sizeof(task));
+    task.op = GROUP_MAX;
+    task.values = values;
+    task.group_ids = group_ids;
+    task.n = n;
+    task.results = results;
+    task.found = found;
+    return group_run(&task, n_groups, nthreads);
+}
+
+
+/*
+ * numeric_group_count() -
+ *
+ *  Add to counts[g] the number of rows of group_ids[0 .. n-1] in group g.
+ *  Rows whose group id is negative are skipped.
+ */
+numeric_errcode_t
+numeric_group_count(const int *group_ids, int n, int n_groups,
+        int64_t *counts)
+{
+    int         i;
+
+    if (!group_ids_valid(group_ids, n, n_groups))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    for (i = 0; i < n; i++)
+    {
+        if (group_ids[i] >= 0)
+            counts[group_ids[i]]++;
+    }
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * group_ids_valid() -
+ *
+ *  Check that every group id is below n_groups.
+ */
+static bool
+group_ids_valid(const int *group_ids, int n, int n_groups)
+{
+    int         max = -1;
+    int         i;
+
+    if (n < 0 || n_groups < 0)
+        return false;
+    for (i = 0; i < n; i++)
+        max = Max(max, group_ids[i]);
+    return max < n_groups;
+}
+
+
+/*
+ * group_run() -
+ *
+ *  Run the aggregation described by proto over the groups [0, n_groups),
+ *  split into nthreads ranges run by run_tasks().
+ */
+static numeric_errcode_t
+group_run(const group_task *proto, int n_groups, int nthreads)
+{
+    group_task *tasks;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         ntasks;
+    int         i;
+
+    if (!group_ids_valid(proto->group_ids, proto->n, n_groups))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    ntasks = Min(Max(nthreads, 1), Max(n_groups, 1));
+    tasks = (group_task *) malloc(ntasks * sizeof(group_task));
+    if (!tasks)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+
+    for (i = 0; i < ntasks; i++)
+    {
+        tasks[i] = *proto;
+        tasks[i].lo = (int) ((int64_t) n_groups * i / ntasks);
+        tasks[i].hi = (int) ((int64_t) n_groups * (i + 1) / ntasks);
+    }
+    run_tasks(group_worker, tasks, sizeof(group_task), ntasks);
+    for (i = 0; i < ntasks; i++)
+    {
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = tasks[i].errcode;
+    }
+
+    free(tasks);
+    return errcode;
+}
+
+
+/*
+ * run_tasks() -
+ *
+ *  Call worker on each of the ntasks elements, size bytes apart, of tasks,
+ *  each in its own thread.  The calling thread takes the first task; a
+ *  task whose thread cannot be started is run there as well.
+ */
+static void
+run_tasks(void *(*worker) (void *), void *tasks, size_t size, int ntasks)
+{
+    char       *task = (char *) tasks;
+    pthread_t  *threads;
+    bool       *started;
+    int         i;
+
+    threads = (pthread_t *) malloc(ntasks * sizeof(pthread_t));
+    started = (bool *) calloc(ntasks, sizeof(bool));
+    if (threads && started)
+    {
+        for (i = 1; i < ntasks; i++)
+            started[i] = pthread_create(&threads[i], NULL, worker,
+                                        task + i * size) == 0;
+    }
+    for (i = 0; i < ntasks; i++)
+    {
+        if (started && started[i])
+            pthread_join(threads[i], NULL);
+        else
+            worker(task + i * size);
+    }
+
+    free(threads);
+    free(started);
+}
+
+
+/*
+ * group_worker() -
+ *
+ *  Aggregate the rows of the groups [task->lo, task->hi) and store the
+ *  outcome into task->errcode.
+ */
+static void *
+group_worker(void *arg)
+{
+    group_task *task = (group_task *) arg;
+
+    if (task->op == GROUP_SUM)
+        task->errcode = group_sum_range(task);
+    else
+        task->errcode = group_minmax_range(task);
+    return NULL;
+}
+
+
+/*
+ * group_sum_range() -
+ *
+ *  numeric_group_sum() for the groups of task.
+ */
+static numeric_errcode_t
+group_sum_range(const group_task *task)
+{
+    group_limbs *pending;
+    numeric     sum;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         ngroups = task->hi - task->lo;
+    int         i;
+
+    pending = (group_limbs *) calloc(Max(ngroups, 1), sizeof(group_limbs));
+    if (!pending)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    for (i = 0; i < ngroups; i++)
+        pending[i].dscale = -1;
+
+    for (i = 0; i < task->n; i++)
+    {
+        const numeric *num = &task->values[i];
+        unsigned int g = (unsigned int) (task->group_ids[i] - task->lo);
+
+        if (g >= (unsigned int) ngroups)
+            continue;
+        if (NUMERIC_IS_NAN(num))
+        {
+            task->accums[task->lo + g].nan = true;
+            continue;
+        }
+
+        if (!group_limbs_add(&pending[g], num))
+        {
+            errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+            break;
+        }
+    }
+
+    numeric_init(&sum);
+    for (i = 0; i < ngroups; i++)
+    {
+        numeric_accum *acc = &task->accums[task->lo + i];
+
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR && pending[i].dscale >= 0)
+        {
+            group_limbs_var(&pending[i], &sum);
+            add_var(&acc->sum, &sum, &acc->sum);
+        }
+        free(pending[i].limbs);
+    }
+    numeric_dispose(&sum);
+    free(pending);
+
+    return errcode;
+}
+
+
+/*
+ * group_limbs_add() -
+ *
+ *  Add the digits of num, which is not NaN, into p.  Returns false if out
+ *  of memory.
+ */
+static bool
+group_limbs_add(group_limbs *p, const numeric *num)
+{
+    int64_t    *limbs;
+    int         i;
+
+    p->dscale = Max(p->dscale, num->dscale);
+    if (num->ndigits == 0)
+        return true;
+    if (!group_limbs_reserve(p, num->weight, num->weight - num->ndigits + 1))
+        return false;
+
+    limbs = p->limbs + (p->weight - num->weight);
+    if (num->sign == NUMERIC_NEG)
+    {
+        for (i = 0; i < num->ndigits; i++)
+            limbs[i] -= num->digits[i];
+    }
+    else
+    {
+        for (i = 0; i < num->ndigits; i++)
+            limbs[i] += num->digits[i];
+    }
+    return true;
+}
+
+
+/*
+ * group_limbs_reserve() -
+ *
+ *  Make the limbs of p cover the weights from hi down to lo.
+ */
+static bool
+group_limbs_reserve(group_limbs *p, int hi, int lo)
+{
+    int64_t    *limbs;
+    int         weight;
+    int         nlimbs;
+
+    if (p->limbs != NULL)
+    {
+        if (hi <= p->weight && lo > p->weight - p->nlimbs)
+            return true;
+        hi = Max(hi, p->weight);
+        lo = Min(lo, p->weight - p->nlimbs + 1);
+    }
+
+    /* leave a digit of room on either side for values close by */
+    weight = hi + 1;
+    nlimbs = weight - lo + 2;
+    limbs = (int64_t *) calloc(nlimbs, sizeof(int64_t));
+    if (!limbs)
+        return false;
+    if (p->limbs != NULL)
+    {
+        memcpy(limbs + (weight - p->weight), p->limbs,
+               p->nlimbs * sizeof(int64_t));
+        free(p->limbs);
+    }
+    p->limbs = limbs;
+    p->weight = weight;
+    p->nlimbs = nlimbs;
+    return true;
+}
+
+
+/*
+ * group_limbs_var() -
+ *
+ *  Set result to the sum held by p, carrying its limbs.  The limbs are
+ *  consumed.
+ */
+static void
+group_limbs_var(group_limbs *p, numeric *result)
+{
+    int64_t     carry;
+    int64_t     x;
+    int         extra = 0;
+    int         sign = NUMERIC_POS;
+    int         i;
+
+    /* room for the carry out of the top limb, as large as an int64_t */
+    for (x = INT64_MAX; x > 0; x /= NBASE)
+        extra++;
+
+    alloc_var(result, p->nlimbs + extra);
+    result->weight = p->weight + extra;
+    result->dscale = p->dscale;
+
+    for (;;)
+    {
+        carry = 0;
+        for (i = p->nlimbs - 1; i >= 0; i--)
+        {
+            x = p->limbs[i] + carry;
+            carry = x / NBASE;
+            x -= carry * NBASE;
+            if (x < 0)
+            {
+                x += NBASE;
+                carry--;
+            }
+            result->digits[extra + i] = (NumericDigit) x;
+        }
+        for (i = extra - 1; i >= 0; i--)
+        {
+            x = carry % NBASE;
+            carry /= NBASE;
+            if (x < 0)
+            {
+                x += NBASE;
+                carry--;
+            }
+            result->digits[i] = (NumericDigit) x;
+        }
+        if (carry >= 0)
+            break;
+
+        /* The sum is negative: carry its magnitude instead */
+        for (i = 0; i < p->nlimbs; i++)
+            p->limbs[i] = -p->limbs[i];
+        sign = NUMERIC_NEG;
+    }
+
+    result->sign = sign;
+    strip_var(result);
+}
+
+
+/*
+ * group_minmax_range() -
+ *
+ *  numeric_group_min() or numeric_group_max() for the groups of task.
+ */
+static numeric_errcode_t
+group_minmax_range(const group_task *task)
+{
+    const numeric **best;
+    int         ngroups = task->hi - task->lo;
+    int         sign = task->op == GROUP_MIN ? -1 : 1;
+    int         i;
+
+    best = (const numeric **) malloc(Max(ngroups, 1) *
+                                     sizeof(const numeric *));
+    if (!best)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    for (i = 0; i < ngroups; i++)
+        best[i] = task->found[task->lo + i] ?
+            &task->results[task->lo + i] : NULL;
+
+    for (i = 0; i < task->n; i++)
+    {
+        const numeric *num = &task->values[i];
+        unsigned int g = (unsigned int) (task->group_ids[i] - task->lo);
+
+        if (g >= (unsigned int) ngroups)
+            continue;
+        if (best[g] == NULL || cmp_numerics(num, best[g]) * sign > 0)
+            best[g] = num;
+    }
+
+    for (i = 0; i < ngroups; i++)
+    {
+        numeric    *result = &task->results[task->lo + i];
+
+        if (best[i] == NULL || best[i] == result)
+            continue;
+        set_var_from_var(best[i], result);
+        task->found[task->lo + i] = true;
+    }
+    free(best);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Prefix sums
+ *
+ * numeric_prefix_sum() computes the running totals of a column in two
+ * passes over nthreads ranges of rows.  The first pass sums each range
+ * into deferred-carry limbs, as numeric_group_sum() does; the range sums
+ * are then added up in order to give the total of the rows before each
+ * range.  The second pass starts every range from that total and adds its
+ * rows one by one into a window of limbs wide enough for any of the
+ * results, carrying the window into the result slot of each row.
+ *
+ * All arithmetic is exact and the slot size only depends on the values,
+ * so the results do not depend on nthreads.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * numeric_array_init() -
+ *
+ *  Initialize arr to an empty array.
+ */
+void
+numeric_array_init(numeric_array *arr)
+{
+    arr->n = 0;
+    arr->values = NULL;
+    arr->digitbuf = NULL;
+}
+
+
+/*
+ * numeric_array_dispose() -
+ *
+ *  Free the values of arr and leave it empty.
+ */
+void
+numeric_array_dispose(numeric_array *arr)
+{
+    free(arr->values);
+    free(arr->digitbuf);
+    numeric_array_init(arr);
+}
+
+
+/*
+ * numeric_prefix_sum() -
+ *
+ *  Replace the contents of result with the running totals of
+ *  values[0 .. n-1]: result->values[i] is the exact sum of values[0 .. i],
+ *  with the largest dscale among them.  From the first NaN on, the totals
+ *  are NaN.  result must have been initialized.
+ */
+numeric_errcode_t
+numeric_prefix_sum(const numeric *values, int n, numeric_array *result,
+                   int nthreads)
+{
+    prefix_task *tasks;
+    numeric_array arr;
+    numeric     sum;
+    numeric     total;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    bool        nan = false;
+    int         maxweight = INT_MIN;
+    int         minweight = INT_MAX;
+    int         weight = 0;
+    int         slot = 0;
+    int         ntasks;
+    int         i;
+
+    if (n < 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    ntasks = Min(Max(nthreads, 1), Max(n, 1));
+    tasks = (prefix_task *) calloc(ntasks, sizeof(prefix_task));
+    if (!tasks)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    for (i = 0; i < ntasks; i++)
+    {
+        tasks[i].values = values;
+        tasks[i].lo = (int) ((int64_t) n * i / ntasks);
+        tasks[i].hi = (int) ((int64_t) n * (i + 1) / ntasks);
+        tasks[i].total.dscale = -1;
+        numeric_init(&tasks[i].offset);
+    }
+
+    /* Sum each range, then give every range the sum of those before it */
+    run_tasks(prefix_total, tasks, sizeof(prefix_task), ntasks);
+
+    numeric_init(&sum);
+    numeric_init(&total);
+    for (i = 0; i < ntasks; i++)
+    {
+        prefix_task *task = &tasks[i];
+
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = task->errcode;
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            break;
+
+        set_var_from_var(&sum, &task->offset);
+        task->offset_nan = nan;
+        nan = nan || task->nan;
+        if (task->maxweight >= task->minweight)
+        {
+            maxweight = Max(maxweight, task->maxweight);
+            minweight = Min(minweight, task->minweight);
+        }
+        if (task->total.dscale >= 0)
+        {
+            group_limbs_var(&task->total, &total);
+            add_var(&sum, &total, &sum);
+        }
+    }
+    numeric_dispose(&total);
+    numeric_dispose(&sum);
+
+    /*
+     * No total exceeds n times the largest value, so a slot needs as many
+     * digits above the highest weight of the values as n has.
+     */
+    if (maxweight >= minweight)
+    {
+        weight = maxweight + 1;
+        for (i = n; i >= NBASE; i /= NBASE)
+            weight++;
+        slot = weight - minweight + 1;
+        if (weight > INT16_MAX)
+            errcode = NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+    }
+
+    numeric_array_init(&arr);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        arr.n = n;
+        arr.values = (numeric *) malloc(Max(n, 1) * sizeof(numeric));
+        arr.digitbuf = (NumericDigit *)
+            malloc(Max((size_t) n * slot, 1) * sizeof(NumericDigit));
+        if (!arr.values || !arr.digitbuf)
+            errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        for (i = 0; i < ntasks; i++)
+        {
+            tasks[i].result = &arr;
+            tasks[i].weight = weight;
+            tasks[i].slot = slot;
+        }
+        run_tasks(prefix_scan, tasks, sizeof(prefix_task), ntasks);
+        for (i = 0; i < ntasks; i++)
+        {
+            if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+                errcode = tasks[i].errcode;
+        }
+    }
+
+    for (i = 0; i < ntasks; i++)
+    {
+        free(tasks[i].total.limbs);
+        numeric_dispose(&tasks[i].offset);
+    }
+    free(tasks);
+
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_array_dispose(&arr);
+        return errcode;
+    }
+    numeric_array_dispose(result);
+    *result = arr;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * prefix_total() -
+ *
+ *  First pass of numeric_prefix_sum(): sum the rows of a task.
+ */
+static void *
+prefix_total(void *arg)
+{
+    prefix_task *task = (prefix_task *) arg;
+    int         i;
+
+    task->maxweight = INT_MIN;
+    task->minweight = INT_MAX;
+    for (i = task->lo; i < task->hi; i++)
+    {
+        const numeric *num = &task->values[i];
+
+        if (NUMERIC_IS_NAN(num))
+        {
+            task->nan = true;
+            continue;
+        }
+        if (!group_limbs_add(&task->total, num))
+        {
+            task->errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+            break;
+        }
+        if (num->ndigits > 0)
+        {
+            task->maxweight = Max(task->maxweight, num->weight);
+            task->minweight = Min(task->minweight,
+                                  num->weight - num->ndigits + 1);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * prefix_scan() -
+ *
+ *  Second pass of numeric_prefix_sum(): store the running totals of the
+ *  rows of a task, starting from its offset.
+ */
+static void *
+prefix_scan(void *arg)
+{
+    prefix_task *task = (prefix_task *) arg;
+    numeric_array *result = task->result;
+    int64_t    *limbs;
+    bool        nan = task->offset_nan;
+    int         dscale = task->offset.dscale;
+    int         i;
+    int         j;
+
+    limbs = (int64_t *) calloc(Max(task->slot, 1), sizeof(int64_t));
+    if (!limbs)
+    {
+        task->errcode = NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        return NULL;
+    }
+    for (j = 0; j < task->offset.ndigits; j++)
+        limbs[task->weight - task->offset.weight + j] =
+            task->offset.sign == NUMERIC_NEG ?
+            -task->offset.digits[j] : task->offset.digits[j];
+
+    for (i = task->lo; i < task->hi; i++)
+    {
+        const numeric *num = &task->values[i];
+        numeric    *res = &result->values[i];
+        int64_t    *p;
+
+        if (nan || NUMERIC_IS_NAN(num))
+        {
+            nan = true;
+            *res = const_nan;
+            continue;
+        }
+
+        p = limbs + (task->weight - num->weight);
+        if (num->sign == NUMERIC_NEG)
+        {
+            for (j = 0; j < num->ndigits; j++)
+                p[j] -= num->digits[j];
+        }
+        else
+        {
+            for (j = 0; j < num->ndigits; j++)
+                p[j] += num->digits[j];
+        }
+        dscale = Max(dscale, num->dscale);
+
+        res->buf = NULL;
+        res->digits = result->digitbuf + (size_t) i * task->slot;
+        res->ndigits = task->slot;
+        res->weight = task->weight;
+        res->dscale = dscale;
+        res->sign = prefix_carry(limbs, task->slot, res->digits);
+        strip_var(res);
+    }
+
+    free(limbs);
+    return NULL;
+}
+
+
+/*
+ * prefix_carry() -
+ *
+ *  Carry nlimbs limbs into as many digits, which must be enough to hold
+ *  the magnitude of their sum, and return its sign.
+ */
+static int
+prefix_carry(const int64_t *limbs, int nlimbs, NumericDigit *digits)
+{
+    int64_t     sign = 1;
+    int64_t     carry;
+    int64_t     x;
+    int         i;
+
+    for (;;)
+    {
+        carry = 0;
+        for (i = nlimbs - 1; i >= 0; i--)
+        {
+            x = sign * limbs[i] + carry;
+            carry = x / NBASE;
+            x -= carry * NBASE;
+            if (x < 0)
+            {
+                x += NBASE;
+                carry--;
+            }
+            digits[i] = (NumericDigit) x;
+        }
+        if (carry >= 0 || sign < 0)
+            break;
+
+        /* The sum is negative: carry its magnitude instead */
+        sign = -1;
+    }
+    return sign > 0 ? NUMERIC_POS : NUMERIC_NEG;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Compact storage
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_compact_init() -
+ *
+ *  Initialize c to an empty NaN that owns no digits.
+ */
+void
+numeric_compact_init(numeric_compact *c)
+{
+    c->digits = NULL;
+    c->ndigits = 0;
+    c->weight = 0;
+    c->sign_dscale = NUMERIC_NAN;
+}
+
+
+/*
+ * numeric_compact_dispose() -
+ *
+ *  Release the digits owned by c, which must have come from
+ *  numeric_compact_pack().
+ */
+void
+numeric_compact_dispose(numeric_compact *c)
+{
+    free(c->digits);
+    numeric_compact_init(c);
+}
+
+
+/*
+ * numeric_compact_pack() -
+ *
+ *  Store num into result in compact form, with a digit array of its own.
+ *  Values whose weight or dscale do not fit are rejected.
+ */
+numeric_errcode_t
+numeric_compact_pack(const numeric *num, numeric_compact *result)
+{
+    NumericDigit *digits = NULL;
+    numeric_errcode_t errcode;
+
+    errcode = compact_check(num);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    if (!NUMERIC_IS_NAN(num) && num->ndigits > 0)
+    {
+        digits = (NumericDigit *) malloc(num->ndigits * sizeof(NumericDigit));
+        if (digits == NULL)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+
+    free(result->digits);
+    compact_store(num, digits, result);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_compact_pack_array() -
+ *
+ *  Pack nums[0 .. n-1] into result[0 .. n-1] with all their digits in a
+ *  single malloc'd array, returned in *digitbuf.  The caller frees just
+ *  *digitbuf; the packed values must not be disposed one by one.
+ */
+numeric_errcode_t
+numeric_compact_pack_array(const numeric *nums, int n,
+        numeric_compact *result, NumericDigit **digitbuf)
+{
+    NumericDigit *digits;
+    size_t      total = 0;
+    numeric_errcode_t errcode;
+    int         i;
+
+    if (n < 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    for (i = 0; i < n; i++)
+    {
+        errcode = compact_check(&nums[i]);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        if (!NUMERIC_IS_NAN(&nums[i]))
+            total += nums[i].ndigits;
+    }
+
+    digits = (NumericDigit *) malloc(Max(total, 1) * sizeof(NumericDigit));
+    if (digits == NULL)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+
+    total = 0;
+    for (i = 0; i < n; i++)
+    {
+        compact_store(&nums[i], digits + total, &result[i]);
+        total += result[i].ndigits;
+    }
+
+    *digitbuf = digits;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_compact_view() -
+ *
+ *  Make view a read-only numeric sharing the digits of c.  view has a NULL
+ *  buf, so disposing it is harmless, but it must not be used as a result.
+ */
+void
+numeric_compact_view(const numeric_compact *c, numeric *view)
+{
+    view->ndigits = c->ndigits;
+    view->weight = c->weight;
+    view->sign = c->sign_dscale & NUMERIC_COMPACT_SIGN_MASK;
+    view->dscale = c->sign_dscale & NUMERIC_COMPACT_DSCALE_MASK;
+    view->buf = NULL;
+    view->digits = c->digits;
+}
+
+
+/*
+ * numeric_compact_unpack() -
+ *
+ *  Copy c into result as an ordinary numeric.
+ */
+numeric_errcode_t
+numeric_compact_unpack(const numeric_compact *c, numeric *result)
+{
+    numeric  view;
+
+    numeric_compact_view(c, &view);
+    return make_result(&view, result);
+}
+
+
+/*
+ * numeric_compact_cmp() -
+ *
+ *  Compare two compact values, ordering them as numeric_cmp() does,
+ *  without unpacking them.
+ */
+int
+numeric_compact_cmp(const numeric_compact *c1, const numeric_compact *c2)
+{
+    numeric  view1;
+    numeric  view2;
+
+    numeric_compact_view(c1, &view1);
+    numeric_compact_view(c2, &view2);
+    return cmp_numerics(&view1, &view2);
+}
+
+
+/*
+ * compact_check() -
+ *
+ *  Check that num fits in a numeric_compact.
+ */
+static numeric_errcode_t
+compact_check(const numeric *num)
+{
+    if (NUMERIC_IS_NAN(num))
+        return NUMERIC_ERRCODE_NO_ERROR;
+
+    if (num->weight < INT16_MIN || num->weight > INT16_MAX ||
+        num->dscale < 0 || num->dscale > NUMERIC_COMPACT_DSCALE_MASK)
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * compact_store() -
+ *
+ *  Pack num, already checked by compact_check(), into result, copying its
+ *  digits to digits.
+ */
+static void
+compact_store(const numeric *num, NumericDigit *digits,
+        numeric_compact *result)
+{
+    if (NUMERIC_IS_NAN(num))
+    {
+        result->digits = NULL;
+        result->ndigits = 0;
+        result->weight = 0;
+        result->sign_dscale = NUMERIC_NAN;
+        return;
+    }
+
+    if (num->ndigits > 0)
+        memcpy(digits, num->digits, num->ndigits * sizeof(NumericDigit));
+    result->digits = num->ndigits > 0 ? digits : NULL;
+    result->ndigits = num->ndigits;
+    result->weight = (int16_t) num->weight;
+    result->sign_dscale = (uint16_t) (num->sign | num->dscale);
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Sort keys
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+#define SORTKEY_NEG         0x01
+#define SORTKEY_ZERO        0x02
+#define SORTKEY_POS         0x03
+#define SORTKEY_NAN         0x04
+#define SORTKEY_WEIGHT_BIAS 0x8000
+
+
+/*
+ * numeric_sortkey_max_length() -
+ *
+ *  Return the buffer size numeric_sortkey() needs for num.
+ */
+size_t
+numeric_sortkey_max_length(const numeric *num)
+{
+    if (NUMERIC_IS_NAN(num))
+        return 1;
+    return 1 + 2 * (num->ndigits + 2);
+}
+
+
+/*
+ * numeric_sortkey() -
+ *
+ *  Encode num into buf as a sort key and store its length into *length.
+ *  buf must hold numeric_sortkey_max_length(num) bytes.
+ */
+numeric_errcode_t
+numeric_sortkey(const numeric *num, unsigned char *buf, size_t buflen,
+        size_t *length)
+{
+    const NumericDigit *digits = num->digits;
+    int         ndigits = num->ndigits;
+    int         weight = num->weight;
+    unsigned int flip;
+    unsigned char *p = buf;
+    int         i;
+
+    if (buflen < numeric_sortkey_max_length(num))
+        return NUMERIC_ERRCODE_BUFFER_TOO_SMALL;
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        *p++ = SORTKEY_NAN;
+        *length = p - buf;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /* Views need not be stripped, but equal values must get equal keys */
+    while (ndigits > 0 && digits[0] == 0)
+    {
+        digits++;
+        ndigits--;
+        weight--;
+    }
+    while (ndigits > 0 && digits[ndigits - 1] == 0)
+        ndigits--;
+
+    if (ndigits == 0)
+    {
+        *p++ = SORTKEY_ZERO;
+        *length = p - buf;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    if (weight < INT16_MIN || weight > INT16_MAX)
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    /*
+     * Digits are stored plus one so that the terminator sorts below them:
+     * a longer key for the same leading digits is a larger magnitude.
+     */
+    flip = (num->sign == NUMERIC_NEG) ? 0xFFFF : 0;
+    *p++ = flip ? SORTKEY_NEG : SORTKEY_POS;
+    p = sortkey_put(p, (weight + SORTKEY_WEIGHT_BIAS) ^ flip);
+    for (i = 0; i < ndigits; i++)
+        p = sortkey_put(p, (digits[i] + 1) ^ flip);
+    p = sortkey_put(p, flip);
+
+    *length = p - buf;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_from_sortkey() -
+ *
+ *  Decode the sort key key[0 .. length-1] into result.  Keys do not record
+ *  the display scale: result gets dscale, or if that is negative the
+ *  least scale that shows all its digits.
+ */
+numeric_errcode_t
+numeric_from_sortkey(const unsigned char *key, size_t length, int dscale,
+        numeric *result)
+{
+    numeric     var;
+    unsigned int flip;
+    int         ndigits;
+    int         i;
+    numeric_errcode_t errcode;
+
+    if (length == 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    if (key[0] == SORTKEY_NAN || key[0] == SORTKEY_ZERO)
+    {
+        if (length != 1)
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        if (key[0] == SORTKEY_NAN)
+            return make_result(&const_nan, result);
+
+        numeric_init(&var);
+        set_var_from_var(&const_zero, &var);
+        var.dscale = Max(dscale, 0);
+        errcode = make_result(&var, result);
+        numeric_dispose(&var);
+        return errcode;
+    }
+
+    if ((key[0] != SORTKEY_NEG && key[0] != SORTKEY_POS) ||
+        length < 7 || (length - 1) % 2 != 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    flip = (key[0] == SORTKEY_NEG) ? 0xFFFF : 0;
+    if ((((key[length - 2] << 8) | key[length - 1]) ^ flip) != 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    ndigits = (int) (length - 5) / 2;
+    numeric_init(&var);
+    alloc_var(&var, ndigits);
+    var.sign = flip ? NUMERIC_NEG : NUMERIC_POS;
+    var.weight = (int) (((key[1] << 8) | key[2]) ^ flip) - SORTKEY_WEIGHT_BIAS;
+    for (i = 0; i < ndigits; i++)
+    {
+        unsigned int word = ((key[3 + 2 * i] << 8) | key[4 + 2 * i]) ^ flip;
+
+        if (word == 0 || word > NBASE)
+        {
+            numeric_dispose(&var);
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        }
+        var.digits[i] = (NumericDigit) (word - 1);
+    }
+
+    if (dscale < 0)
+    {
+        NumericDigit last = var.digits[ndigits - 1];
+
+        dscale = (ndigits - 1 - var.weight) * DEC_DIGITS;
+        while (dscale > 0 && last % 10 == 0)
+        {
+            last /= 10;
+            dscale--;
+        }
+        dscale = Max(dscale, 0);
+    }
+    var.dscale = dscale;
+
+    errcode = make_result(&var, result);
+    numeric_dispose(&var);
+    return errcode;
+}
+
+
+/*
+ * sortkey_put() -
+ *
+ *  Store word big-endian at p and return the position after it.
+ */
+static unsigned char *
+sortkey_put(unsigned char *p, unsigned int word)
+{
+    p[0] = (unsigned char) ((word >> 8) & 0xFF);
+    p[1] = (unsigned char) (word & 0xFF);
+    return p + 2;
+}
+
+
+/*
+ * sortkey_prefix() -
+ *
+ *  Store into *prefix the first 8 bytes of the sort key of num, padded
+ *  with zeroes, as a big-endian integer.  If the prefixes of two numerics
+ *  differ, so do the numerics and in the same order; if they are equal,
+ *  the numerics need comparing.  Returns false if num has no sort key.
+ */
+static bool
+sortkey_prefix(const numeric *num, uint64_t *prefix)
+{
+    const NumericDigit *digits = num->digits;
+    int         ndigits = num->ndigits;
+    int         weight = num->weight;
+    unsigned int flip;
+    unsigned int word[3];
+    int         i;
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        *prefix = (uint64_t) SORTKEY_NAN << 56;
+        return true;
+    }
+
+    while (ndigits > 0 && digits[0] == 0)
+    {
+        digits++;
+        ndigits--;
+        weight--;
+    }
+    while (ndigits > 0 && digits[ndigits - 1] == 0)
+        ndigits--;
+
+    if (ndigits == 0)
+    {
+        *prefix = (uint64_t) SORTKEY_ZERO << 56;
+        return true;
+    }
+
+    if (weight < INT16_MIN || weight > INT16_MAX)
+        return false;
+
+    /* Digits, the terminator, then zeroes as numeric_sortkey() pads */
+    flip = (num->sign == NUMERIC_NEG) ? 0xFFFF : 0;
+    for (i = 0; i < 3; i++)
+        word[i] = i < ndigits ? (digits[i] + 1) ^ flip :
+            i == ndigits ? flip : 0;
+
+    *prefix = (uint64_t) (flip ? SORTKEY_NEG : SORTKEY_POS) << 56 |
+        (uint64_t) ((weight + SORTKEY_WEIGHT_BIAS) ^ flip) << 40 |
+        (uint64_t) word[0] << 24 |
+        (uint64_t) word[1] << 8 |
+        word[2] >> 8;
+    return true;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Histogram buckets
+ *
+ * A numeric_buckets holds ascending thresholds and the sort key prefixes
+ * of them, so that the bucket of an operand, the number of thresholds
+ * less than or equal to it, is found with a binary search over integers.
+ * Only operands whose prefix equals that of a threshold are compared as
+ * numerics.
+ *
+ * The equal-width form compares the operand, or its negation when the
+ * range is descending, with the bucket boundaries rounded up to a grid
+ * of 10^-grid.  For an operand on that grid, x >= b is the same as
+ * x >= ceil(b), so the result is exact; other operands are passed to
+ * numeric_width_bucket().  Boundaries that are exact need no grid.
+ *
+ * ----------------------------------------------------------------------
+ */
+
+struct numeric_buckets
+{
+    int         nbounds;
+    uint64_t   *prefixes;       /* sort key prefixes of bounds */
+    numeric    *bounds;         /* thresholds, ascending */
+
+    /* Equal-width form only */
+    bool        equal_width;
+    bool        negate;         /* range is descending */
+    int         grid;           /* in NBASE digits, INT_MAX if exact */
+    int         count;
+    numeric     bound1;
+    numeric     bound2;
+};
+
+
+/*
+ * numeric_buckets_from_bounds() -
+ *
+ *  Prepare bucket assignment by the thresholds bounds[0 .. nbounds-1],
+ *  which must be in ascending order; NaN sorts above other values.  An
+ *  operand below bounds[0] goes to bucket 0, one at or above bounds[i]
+ *  but below bounds[i+1] to bucket i+1, as PostgreSQL's width_bucket()
+ *  does for an array of thresholds.
+ */
+numeric_errcode_t
+numeric_buckets_from_bounds(const numeric *bounds, int nbounds,
+        numeric_buckets **result)
+{
+    numeric_buckets *buckets;
+    numeric_errcode_t errcode;
+    int         i;
+
+    if (nbounds < 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    for (i = 1; i < nbounds; i++)
+    {
+        if (cmp_numerics(&bounds[i - 1], &bounds[i]) > 0)
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
+
+    errcode = buckets_alloc(nbounds, &buckets);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    for (i = 0; i < nbounds; i++)
+    {
+        errcode = make_result(&bounds[i], &buckets->bounds[i]);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR &&
+            !sortkey_prefix(&buckets->bounds[i], &buckets->prefixes[i]))
+            errcode = NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            numeric_buckets_free(buckets);
+            return errcode;
+        }
+    }
+
+    *result = buckets;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_buckets_from_range() -
+ *
+ *  Prepare bucket assignment as numeric_width_bucket() does for bound1,
+ *  bound2 and count.  The count + 1 bucket boundaries are computed here
+ *  once, so assigning an operand takes no division.
+ */
+numeric_errcode_t
+numeric_buckets_from_range(const numeric *bound1, const numeric *bound2,
+        int count, numeric_buckets **result)
+{
+    numeric_buckets *buckets;
+    numeric     count_var;
+    numeric     width_var;
+    numeric     offset_var;
+    numeric     quot_var;
+    numeric     check_var;
+    numeric     low_var;
+    numeric     ulp;
+    NumericDigit ulp_digit = 1;
+    int         scale;
+    int         cmp;
+    int         i;
+    numeric_errcode_t errcode;
+
+    if (count <= 0 || count == INT_MAX)
+        return count <= 0 ? NUMERIC_ERRCODE_INVALID_ARGUMENT :
+            NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+    if (NUMERIC_IS_NAN(bound1) || NUMERIC_IS_NAN(bound2))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    cmp = cmp_numerics(bound1, bound2);
+    if (cmp == 0)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    errcode = buckets_alloc(count + 1, &buckets);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+    buckets->equal_width = true;
+    buckets->negate = cmp > 0;
+    buckets->grid = INT_MAX;
+    buckets->count = count;
+    errcode = make_result(bound1, &buckets->bound1);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(bound2, &buckets->bound2);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_buckets_free(buckets);
+        return errcode;
+    }
+
+    /*
+     * Inexact boundaries are rounded to enough places for operands with
+     * NUMERIC_MIN_SIG_DIGITS more fractional digits than the bounds.
+     */
+    scale = (Max(bound1->dscale, bound2->dscale) + NUMERIC_MIN_SIG_DIGITS +
+             DEC_DIGITS - 1) / DEC_DIGITS;
+    ulp.ndigits = 1;
+    ulp.weight = -scale;
+    ulp.sign = NUMERIC_POS;
+    ulp.dscale = scale * DEC_DIGITS;
+    ulp.buf = NULL;
+    ulp.digits = &ulp_digit;
+
+    numeric_init(&count_var);
+    numeric_init(&width_var);
+    numeric_init(&offset_var);
+    numeric_init(&quot_var);
+    numeric_init(&check_var);
+    numeric_init(&low_var);
+    int64_to_numericvar(count, &count_var);
+
+    /* boundary i is low + ceil(i * width / count), all ascending */
+    if (buckets->negate)
+    {
+        sub_var(bound1, bound2, &width_var);
+        sub_var(&const_zero, bound1, &low_var);
+    }
+    else
+    {
+        sub_var(bound2, bound1, &width_var);
+        set_var_from_var(bound1, &low_var);
+    }
+
+    for (i = 0; i <= count && errcode == NUMERIC_ERRCODE_NO_ERROR; i++)
+    {
+        int64_to_numericvar(i, &offset_var);
+        mul_var(&offset_var, &width_var, &offset_var, width_var.dscale);
+        div_var(&offset_var, &count_var, &quot_var, ulp.dscale, false);
+        mul_var(&quot_var, &count_var, &check_var, ulp.dscale);
+        if (cmp_var(&check_var, &offset_var) != 0)
+        {
+            add_var(&quot_var, &ulp, &quot_var);
+            buckets->grid = scale;
+        }
+        add_var(&low_var, &quot_var, &quot_var);
+
+        errcode = make_result(&quot_var, &buckets->bounds[i]);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR &&
+            !sortkey_prefix(&buckets->bounds[i], &buckets->prefixes[i]))
+            errcode = NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+    }
+
+    numeric_dispose(&low_var);
+    numeric_dispose(&check_var);
+    numeric_dispose(&quot_var);
+    numeric_dispose(&offset_var);
+    numeric_dispose(&width_var);
+    numeric_dispose(&count_var);
+
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_buckets_free(buckets);
+        return errcode;
+    }
+    *result = buckets;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * numeric_buckets_free() -
+ */
+void
+numeric_buckets_free(numeric_buckets *buckets)
+{
+    int         i;
+
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < buckets->nbounds; i++)
+        numeric_dispose(&buckets->bounds[i]);
+    numeric_dispose(&buckets->bound1);
+    numeric_dispose(&buckets->bound2);
+    free(buckets->bounds);
+    free(buckets->prefixes);
+    free(buckets);
+}
+
+
+/*
+ * numeric_buckets_assign() -
+ *
+ *  Store the buckets of operands[0 .. n-1] into results[0 .. n-1].  For
+ *  the equal-width form, a NaN operand is an error as in
+ *  numeric_width_bucket(); results before it are stored.
+ */
+numeric_errcode_t
+numeric_buckets_assign(const numeric_buckets *buckets,
+        const numeric *operands, int n, int *results)
+{
+    numeric     view;
+    numeric_errcode_t errcode;
+    int         i;
+
+    for (i = 0; i < n; i++)
+    {
+        view = operands[i];
+        if (buckets->equal_width)
+        {
+            if (NUMERIC_IS_NAN(&view))
+                return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            if (view.ndigits - 1 - view.weight > buckets->grid)
+            {
+                errcode = numeric_width_bucket(&view, &buckets->bound1,
+                                               &buckets->bound2,
+                                               buckets->count, &results[i]);
+                if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                    return errcode;
+                continue;
+            }
+            if (buckets->negate)
+                view.sign = (view.sign == NUMERIC_NEG) ? NUMERIC_POS :
+                    NUMERIC_NEG;
+        }
+        results[i] = buckets_search(buckets, &view);
+    }
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * buckets_search() -
+ *
+ *  Return the number of thresholds less than or equal to num.
+ *
+ *  The search over the prefixes keeps the step taken free of branches,
+ *  so that the compiler can use a conditional move: whether an operand
+ *  goes left or right is not predictable.
+ */
+static int
+buckets_search(const numeric_buckets *buckets, const numeric *num)
+{
+    const uint64_t *prefixes = buckets->prefixes;
+    const uint64_t *base = prefixes;
+    uint64_t    prefix;
+    int         len = buckets->nbounds;
+    int         lo;
+    int         hi;
+    int         half;
+
+    if (len == 0)
+        return 0;
+
+    if (!sortkey_prefix(num, &prefix))
+    {
+        lo = 0;
+        hi = len;
+    }
+    else
+    {
+        while (len > 1)
+        {
+            half = len / 2;
+            base = (base[half] <= prefix) ? base + half : base;
+            len -= half;
+        }
+        hi = (int) (base - prefixes) + (*base <= prefix);
+        if (hi == 0 || prefixes[hi - 1] != prefix)
+            return hi;
+
+        /* Thresholds sharing num's prefix are settled by comparing */
+        lo = hi - 1;
+        while (lo > 0 && prefixes[lo - 1] == prefix)
+            lo--;
+    }
+
+    while (lo < hi)
+    {
+        half = lo + (hi - lo) / 2;
+        if (cmp_numerics(&buckets->bounds[half], num) <= 0)
+            lo = half + 1;
+        else
+            hi = half;
+    }
+    return lo;
+}
+
+
+/*
+ * buckets_alloc() -
+ *
+ *  Allocate a numeric_buckets with room for nbounds thresholds.
+ */
+static numeric_errcode_t
+buckets_alloc(int nbounds, numeric_buckets **result)
+{
+    numeric_buckets *buckets;
+    int         i;
+
+    buckets = (numeric_buckets *) calloc(1, sizeof(numeric_buckets));
+    if (!buckets)
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    numeric_init(&buckets->bound1);
+    numeric_init(&buckets->bound2);
+    buckets->prefixes = (uint64_t *) malloc(Max(nbounds, 1) *
+                                            sizeof(uint64_t));
+    buckets->bounds = (numeric *) malloc(Max(nbounds, 1) * sizeof(numeric));
+    if (!buckets->prefixes || !buckets->bounds)
+    {
+        numeric_buckets_free(buckets);
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+    buckets->nbounds = nbounds;
+    for (i = 0; i < nbounds; i++)
+        numeric_init(&buckets->bounds[i]);
+
+    *result = buckets;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Text export
+ *
+ * ----------------------------------------------------------------------
+ */
+
+/* Characters that can appear in put_str_from_var() output */
+#define NUMBER_CHARS        "-.0123456789"
+
+
+/*
+ * numeric_write_text() -
+ *
+ *  Append nrows rows of ncols fields taken row by row from values to buf,
+ *  each value printed as numeric_to_str() would at scales[col] (or its own
+ *  display scale if scales is NULL or the entry is negative).  If nulls is
+ *  not NULL, fields whose entry is set are NULL.  If row_offsets is not
+ *  NULL, it receives nrows + 1 offsets into buf->data: where each row
+ *  starts, then where the last one ends.
+ *
+ *  Values that need no rounding are printed straight from their digits;
+ *  the others are rounded in one scratch buffer reused for the whole call.
+ *  On error buf is left as it was.
+ */
+numeric_errcode_t
+numeric_write_text(numeric_textbuf *buf, const numeric *values,
+        const bool *nulls, int nrows, int ncols, const int *scales,
+        const numeric_text_options *options, size_t *row_offsets)
+{
+    const char *delimiter = ",";
+    const char *newline = "\n";
+    const char *nan_text = "NaN";
+    const char *null_text = "";
+    char        quote = '\0';
+    bool        force_quote = false;
+    size_t      delimiter_len;
+    size_t      newline_len;
+    size_t      nan_len;
+    size_t      null_len;
+    bool        quote_numbers;
+    bool        quote_nan;
+    size_t      start = buf->len;
+    NumericDigit *scratch = NULL;
+    int         scratch_size = 0;
+    numeric     rounded;
+    int         row;
+    int         col;
+
+    if (nrows < 0 || ncols < 1 || (nrows > 0 && values == NULL))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    if (options != NULL)
+    {
+        if (options->delimiter != NULL)
+            delimiter = options->delimiter;
+        if (options->newline != NULL)
+            newline = options->newline;
+        if (options->nan_text != NULL)
+            nan_text = options->nan_text;
+        if (options->null_text != NULL)
+            null_text = options->null_text;
+        quote = options->quote;
+        force_quote = options->force_quote;
+    }
+
+    /* A quote that can occur in a number could not be told apart */
+    if (quote != '\0' && strchr(NUMBER_CHARS, quote) != NULL)
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    delimiter_len = strlen(delimiter);
+    newline_len = strlen(newline);
+    nan_len = strlen(nan_text);
+    null_len = strlen(null_text);
+
+    /*
+     * Numbers only need a look when a separator shares a character with
+     * them, which is never the case for the usual "," "\t" and "\n".
+     */
+    quote_numbers = quote != '\0' &&
+        (force_quote || strpbrk(delimiter, NUMBER_CHARS) != NULL ||
+         strpbrk(newline, NUMBER_CHARS) != NULL);
+    quote_nan = quote != '\0' &&
+        (force_quote ||
+         text_needs_quote(nan_text, delimiter, newline, quote));
+
+    if (!textbuf_reserve(buf, 0))
+        return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+
+    for (row = 0; row < nrows; row++)
+    {
+        if (row_offsets != NULL)
+            row_offsets[row] = buf->len;
+
+        for (col = 0; col < ncols; col++)
+        {
+            const numeric *num = &values[(size_t) row * ncols + col];
+            int         scale = (scales != NULL) ? scales[col] : -1;
+            size_t      bound;
+            char       *cp;
+            char       *end;
+
+            if (col > 0)
+            {
+                if (!textbuf_reserve(buf, delimiter_len))
+                    goto out_of_memory;
+                memcpy(buf->data + buf->len, delimiter, delimiter_len);
+                buf->len += delimiter_len;
+            }
+
+            if (nulls != NULL && nulls[(size_t) row * ncols + col])
+            {
+                if (!textbuf_reserve(buf, null_len))
+                    goto out_of_memory;
+                memcpy(buf->data + buf->len, null_text, null_len);
+                buf->len += null_len;
+                continue;
+            }
+
+            if (NUMERIC_IS_NAN(num))
+            {
+                if (!textbuf_reserve(buf, 2 * nan_len + 2))
+                    goto out_of_memory;
+                cp = buf->data + buf->len;
+                if (quote_nan)
+                    cp = put_quoted(nan_text, quote, cp);
+                else
+                {
+                    memcpy(cp, nan_text, nan_len);
+                    cp += nan_len;
+                }
+                buf->len = cp - buf->data;
+                continue;
+            }
+
+            if (scale < 0)
+                scale = num->dscale;
+
+            /*
+             * Digits past scale must be rounded off in a copy.  Digits past
+             * the display scale are always zero, so the usual case of
+             * printing at the display scale needs none.
+             */
+            if (scale < num->dscale &&
+                (num->ndigits - num->weight - 1) * DEC_DIGITS > scale)
+            {
+                if (num->ndigits + 1 > scratch_size)
+                {
+                    NumericDigit *grown;
+
+                    grown = realloc(scratch,
+                                    (num->ndigits + 1) * sizeof(NumericDigit));
+                    if (grown == NULL)
+                        goto out_of_memory;
+                    scratch = grown;
+                    scratch_size = num->ndigits + 1;
+                }
+                scratch[0] = 0;     /* spare digit for rounding */
+                memcpy(scratch + 1, num->digits,
+                       num->ndigits * sizeof(NumericDigit));
+                rounded = *num;
+                rounded.buf = NULL;
+                rounded.digits = scratch + 1;
+                round_var(&rounded, scale);
+                num = &rounded;
+            }
+
+            /* Leave room for quotes around the number */
+            bound = str_length_bound(num, scale) + 2;
+            if (!textbuf_reserve(buf, bound))
+                goto out_of_memory;
+            cp = buf->data + buf->len;
+            if (!quote_numbers)
+            {
+                end = put_str_from_var(num, scale, cp);
+                buf->len = end - buf->data;
+                continue;
+            }
+
+            /* Print after a placeholder for the opening quote, then look */
+            end = put_str_from_var(num, scale, cp + 1);
+            *end = '\0';
+            if (force_quote ||
+                text_needs_quote(cp + 1, delimiter, newline, quote))
+            {
+                *cp = quote;
+                *end++ = quote;
+            }
+            else
+            {
+                memmove(cp, cp + 1, end - (cp + 1));
+                end--;
+            }
+            buf->len = end - buf->data;
+        }
+
+        if (!textbuf_reserve(buf, newline_len))
+            goto out_of_memory;
+        memcpy(buf->data + buf->len, newline, newline_len);
+        buf->len += newline_len;
+    }
+    if (row_offsets != NULL)
+        row_offsets[nrows] = buf->len;
+
+    buf->data[buf->len] = '\0';
+    free(scratch);
+    return NUMERIC_ERRCODE_NO_ERROR;
+
+out_of_memory:
+    buf->len = start;
+    buf->data[buf->len] = '\0';
+    free(scratch);
+    return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+}
+
+
+/*
+ * textbuf_reserve() -
+ *
+ *  Make room in buf for extra more bytes and a terminator.
+ */
+static bool
+textbuf_reserve(numeric_textbuf *buf, size_t extra)
+{
+    size_t      cap;
+    char       *data;
+
+    if (buf->data != NULL && buf->len + extra < buf->cap)
+        return true;
+
+    cap = Max(buf->cap, 256);
+    while (cap <= buf->len + extra)
+        cap *= 2;
+    data = realloc(buf->data, cap);
+    if (data == NULL)
+        return false;
+    buf->data = data;
+    buf->cap = cap;
+    return true;
+}
+
+
+/*
+ * text_needs_quote() -
+ *
+ *  Return true if the NUL-terminated text has to be quoted as a field.
+ */
+static bool
+text_needs_quote(const char *text, const char *delimiter,
+                 const char *newline, char quote)
+{
+    return strchr(text, quote) != NULL || strpbrk(text, "\r\n") != NULL ||
+        (delimiter[0] != '\0' && strstr(text, delimiter) != NULL) ||
+        (newline[0] != '\0' && strstr(text, newline) != NULL);
+}
+
+
+/*
+ * put_quoted() -
+ *
+ *  Write text at cp in quotes, doubling any quotes inside it, and return
+ *  the end of what was written.
+ */
+static char *
+put_quoted(const char *text, char quote, char *cp)
+{
+    *cp++ = quote;
+    for (; *text != '\0'; text++)
+    {
+        if (*text == quote)
+            *cp++ = quote;
+        *cp++ = *text;
+    }
+    *cp++ = quote;
+    return cp;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Type conversion functions
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+numeric_errcode_t
+numeric_from_int32(int32_t val, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    numeric_init(&result_var);
+
+    int64_to_numericvar((int64_t) val, &result_var);
+
+    errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+numeric_errcode_t
+numeric_to_int32(const numeric *num, int32_t *result)
+{
+    numeric  x;
+    numeric_errcode_t errcode;
+
+    if (NUMERIC_IS_NAN(num))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    /* Convert to variable format, then convert to int4 */
+    numeric_init(&x);
+    set_var_from_var(num, &x);
+    errcode = numericvar_to_int32(&x, result);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+    numeric_dispose(&x);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * Given a numeric, convert it to an int32. If the numeric
+ * exceeds the range of an int32, raise the appropriate error via
+ * ereport(). The input numeric is *not* free'd.
+ */
+static numeric_errcode_t
+numericvar_to_int32(numeric *var, int32_t *result)
+{
+    int64_t     val;
+
+    if (!numericvar_to_int64(var, &val))
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    /* Down-convert to int32_t */
+    *result = (int32_t) val;
+
+    /* Test for overflow by reverse-conversion. */
+    if ((int64_t) *result != val)
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+numeric_errcode_t
+numeric_from_int64(int64_t val, numeric *result)
+{
+    numeric  result_var;
+    numeric_errcode_t errcode;
+
+    numeric_init(&result_var);
+
+    int64_to_numericvar(val, &result_var);
+
+    errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+numeric_errcode_t
+numeric_to_int64(const numeric *num, int64_t *result)
+{
+    numeric  x;
+
+    if (NUMERIC_IS_NAN(num))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    /* Convert to variable format and thence to int8 */
+    numeric_init(&x);
+    set_var_from_var(num, &x);
+
+    if (!numericvar_to_int64(&x, result))
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    numeric_dispose(&x);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+
+numeric_errcode_t
+numeric_from_double(double val, numeric *result)
+{
+    numeric  result_var;
+    char        buf[DBL_DIG + 100];
+    numeric_errcode_t errcode;
+
+    if (isnan(val))
+        return make_result(&const_nan, result);
+
+    sprintf(buf, "%.*g", DBL_DIG, val);
+
+    numeric_init(&result_var);
+
+    /* Assume we need not worry about leading/trailing spaces */
+    errcode = set_var_from_str(buf, buf, &result_var, NULL);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+numeric_errcode_t
+numeric_to_double(const numeric *num, double *result)
+{
+    char       *tmp;
+    double      val;
+    numeric_errcode_t errcode;
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        *result = get_double_nan();
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    errcode = numeric_out(num, &tmp);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    errcode = double_in(tmp, &val);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    free(tmp);
+
+    *result = val;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+numeric_errcode_t
+numeric_from_float(float val, numeric *result)
+{
+    numeric  result_var;
+    char        buf[FLT_DIG + 100];
+    numeric_errcode_t errcode;
+
+    if (isnan(val))
+        return make_result(&const_nan, result);
+
+    sprintf(buf, "%.*g", FLT_DIG, val);
+
+    numeric_init(&result_var);
+
+    /* Assume we need not worry about leading/trailing spaces */
+    errcode = set_var_from_str(buf, buf, &result_var, NULL);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = make_result(&result_var, result);
+
+    numeric_dispose(&result_var);
+
+    return errcode;
+}
+
+
+numeric_errcode_t
+numeric_to_float(const numeric *num, float *result)
+{
+    char       *tmp;
+    numeric_errcode_t errcode;
+
+    if (NUMERIC_IS_NAN(num))
+    {
+        *result = get_float_nan();
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    errcode = numeric_out(num, &tmp);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    errcode = float_in(tmp, result);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    free(tmp);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Debug support
+ *
+ * ----------------------------------------------------------------------
+ */
+
+#ifdef NUMERIC_DEBUG
+/*
+ * dump_var() - Dump a value in the variable format for debugging
+ */
+static void
+dump_var(const char *str, numeric *var)
+{
+    int         i;
+
+    printf("%s: numeric w=%d d=%d ", str, var->weight, var->dscale);
+    switch (var->sign)
+    {
+        case NUMERIC_POS:
+            printf("POS");
+            break;
+        case NUMERIC_NEG:
+            printf("NEG");
+            break;
+        case NUMERIC_NAN:
+            printf("NaN");
+            break;
+        default:
+            printf("SIGN=0x%x", var->sign);
+            break;
+    }
+
+    for (i = 0; i < var->ndigits; i++)
+        printf(" %0*d", DEC_DIGITS, var->digits[i]);
+
+    printf("\n");
+}
+#endif   /* NUMERIC_DEBUG */
+
+
+/* ----------------------------------------------------------------------
+ *
+ * Local functions follow
+ *
+ * In general, these do not support NaNs --- callers must eliminate
+ * the possibility of NaN first.  (make_result() is an exception.)
+ *
+ * ----------------------------------------------------------------------
+ */
+
+
+/*
+ * numeric_init() -
+ *
+ *  Initialize
+ */
+void
+numeric_init(numeric *var)
+{
+    memset(var, 0, sizeof(numeric));
+}
+
+/*
+ * numeric_dispose() -
+ *
+ *  Return the digit buffer of a variable to the free pool
+ */
+void
+numeric_dispose(numeric *var)
+{
+    digitbuf_free(var->buf);
+    var->buf = NULL;
+    var->digits = NULL;
+    var->sign = NUMERIC_NAN;
+}
+
+/*
+ * alloc_var() -
+ *
+ *  Allocate a digit buffer of ndigits digits (plus a spare digit for rounding)
+ */
+static void
+alloc_var(numeric *var, int ndigits)
+{
+    digitbuf_free(var->buf);
+    var->buf = digitbuf_alloc(ndigits + 1);
+    var->buf[0] = 0;            /* spare digit for rounding */
+    var->digits = var->buf + 1;
+    var->ndigits = ndigits;
+}
+
+
+/*
+ * pool_alloc() -
+ *
+ *  Allocate size bytes, from the digit pool of the calling thread if one
+ *  is attached.  The smallest free block that is large enough is reused;
+ *  otherwise a new block, rounded up to a power of two, is added to the
+ *  pool.  Once the pool holds DIGIT_POOL_MAX_BLOCKS blocks, further
+ *  allocations are plain malloc() calls.
+ */
+static void *
+pool_alloc(size_t size)
+{
+    digit_pool *pool = current_pool;
+    digit_pool_block *block;
+    int         best = -1;
+    int         i;
+
+    if (pool == NULL)
+        return malloc(size);
+
+    for (i = 0; i < pool->nblocks; i++)
+    {
+        block = &pool->blocks[i];
+        if (!block->in_use && block->size >= size &&
+            (best < 0 || block->size < pool->blocks[best].size))
+            best = i;
+    }
+    if (best >= 0)
+    {
+        pool->blocks[best].in_use = true;
+        return pool->blocks[best].ptr;
+    }
+
+    if (pool->nblocks >= pool->capacity)
+    {
+        int         newsize = Max(pool->capacity * 2, 16);
+        digit_pool_block *blocks;
+
+        if (pool->capacity >= DIGIT_POOL_MAX_BLOCKS)
+            return malloc(size);
+        blocks = (digit_pool_block *)
+            realloc(pool->blocks, newsize * sizeof(digit_pool_block));
+        if (!blocks)
+            return malloc(size);
+        pool->blocks = blocks;
+        pool->capacity = newsize;
+    }
+
+    block = &pool->blocks[pool->nblocks];
+    block->size = DIGIT_POOL_MIN_SIZE;
+    while (block->size < size)
+        block->size *= 2;
+    block->ptr = malloc(block->size);
+    if (!block->ptr)
+        return NULL;
+    block->in_use = true;
+    pool->nblocks++;
+    return block->ptr;
+}
+
+/*
+ * pool_calloc() -
+ *
+ *  Allocate a zeroed array of n elements of size bytes, as pool_alloc()
+ */
+static void *
+pool_calloc(size_t n, size_t size)
+{
+    void       *ptr = pool_alloc(n * size);
+
+    if (ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+/*
+ * pool_free() -
+ *
+ *  Release memory from pool_alloc().  A block of the attached pool is
+ *  only marked free; anything else is passed to free().
+ */
+static void
+pool_free(void *ptr)
+{
+    digit_pool *pool = current_pool;
+    int         i;
+
+    if (pool != NULL)
+    {
+        for (i = pool->nblocks - 1; i >= 0; i--)
+        {
+            if (pool->blocks[i].ptr == ptr)
+            {
+                pool->blocks[i].in_use = false;
+                return;
+            }
+        }
+    }
+    free(ptr);
+}
+
+/*
+ * digit_pool_create() -
+ *
+ *  Create an empty digit pool, for formula.c.  Returns NULL when out of
+ *  memory.
+ */
+digit_pool *
+digit_pool_create(void)
+{
+    return (digit_pool *) calloc(1, sizeof(digit_pool));
+}
+
+/*
+ * digit_pool_destroy() -
+ *
+ *  Free pool and its free blocks.  Blocks still in use belong to the
+ *  variables holding them, which free them as usual.
+ */
+void
+digit_pool_destroy(digit_pool *pool)
+{
+    int         i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i < pool->nblocks; i++)
+    {
+        if (!pool->blocks[i].in_use)
+            free(pool->blocks[i].ptr);
+    }
+    free(pool->blocks);
+    free(pool);
+}
+
+/*
+ * digit_pool_attach() -
+ *
+ *  Make pool the digit pool of the calling thread and return the previous
+ *  one, which may be NULL.
+ */
+digit_pool *
+digit_pool_attach(digit_pool *pool)
+{
+    digit_pool *prev = current_pool;
+
+    current_pool = pool;
+    return prev;
+}
+
+/*
+ * digit_pool_detach() -
+ *
+ *  Restore the digit pool prev.  Blocks of pool still in use, except the
+ *  buffers of keep[0 .. nkeep-1], are handed over to whoever holds them:
+ *  the pool forgets them, so they are freed with free() later.  The kept
+ *  variables are to be disposed of with pool attached again, which hands
+ *  their blocks back for digit_pool_destroy() to free.
+ */
+void
+digit_pool_detach(digit_pool *pool, digit_pool *prev, const numeric *keep,
+        int nkeep)
+{
+    int         i;
+    int         j;
+    int         n = 0;
+
+    current_pool = prev;
+
+    for (i = 0; i < pool->nblocks; i++)
+    {
+        digit_pool_block *block = &pool->blocks[i];
+
+        if (block->in_use)
+        {
+            for (j = 0; j < nkeep; j++)
+            {
+                if ((void *) keep[j].buf == block->ptr)
+                    break;
+            }
+            if (j == nkeep)
+                continue;
+        }
+        pool->blocks[n++] = *block;
+    }
+    pool->nblocks = n;
+}
+
+
+
+/*
+ * zero_var() -
+ *
+ *  Set a variable to ZERO.
+ *  Note: its dscale is not touched.
+ */
+static void
+zero_var(numeric *var)
+{
+    digitbuf_free(var->buf);
+    var->buf = NULL;
+    var->digits = NULL;
+    var->ndigits = 0;
+    var->weight = 0;            /* by convention; doesn't really matter */
+    var->sign = NUMERIC_POS;    /* anything but NAN... */
+}
+
+
+/*
+ * set_var_from_str()
+ *
+ *  Parse a string and put the number into a variable
+ *
+ * This function does not handle leading or trailing spaces, and it doesn't
+ * accept "NaN" either.  It returns the end+1 position so that caller can
+ * check for trailing spaces/garbage if deemed necessary.
+ *
+ * cp is the place to actually start parsing; str is what to use in error
+ * reports.  (Typically cp would be the same except advanced over spaces.)
+ */
+static numeric_errcode_t
+set_var_from_str(const char *str, const char *cp, numeric *dest,
+    const char **result)
+{
+    bool        have_dp = false;
+    int         i;
+    unsigned char *decdigits;
+    int         sign = NUMERIC_POS;
+    int         dweight = -1;
+    int         ddigits;
+    int         dscale = 0;
+    int         weight;
+    int         ndigits;
+    int         offset;
+    NumericDigit *digits;
+
+    /*
+     * We first parse the string to extract decimal digits and determine the
+     * correct decimal weight.  Then convert to NBASE representation.
+     */
+    switch (*cp)
+    {
+        case '+':
+            sign = NUMERIC_POS;
+            cp++;
+            break;
+
+        case '-':
+            sign = NUMERIC_NEG;
+            cp++;
+            break;
+    }
+
+    if (*cp == '.')
+    {
+        have_dp = true;
+        cp++;
+    }
+
+    if (!isdigit((unsigned char) *cp))
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+
+    decdigits = (unsigned char *) malloc(strlen(cp) + DEC_DIGITS * 2);
+
+    /* leading padding for digit alignment later */
+    memset(decdigits, 0, DEC_DIGITS);
+    i = DEC_DIGITS;
+
+    while (*cp)
+    {
+        if (isdigit((unsigned char) *cp))
+        {
+            decdigits[i++] = *cp++ - '0';
+            if (!have_dp)
+                dweight++;
+            else
+                dscale++;
+        }
+        else if (*cp == '.')
+        {
+            if (have_dp)
+                return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            have_dp = true;
+            cp++;
+        }
+        else
+            break;
+    }
+
+    ddigits = i - DEC_DIGITS;
+    /* trailing padding for digit alignment later */
+    memset(decdigits + i, 0, DEC_DIGITS - 1);
+
+    /* Handle exponent, if any */
+    if (*cp == 'e' || *cp == 'E')
+    {
+        long        exponent;
+        char       *endptr;
+
+        cp++;
+        exponent = strtol(cp, &endptr, 10);
+        if (endptr == cp)
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        cp = endptr;
+        if (exponent > NUMERIC_MAX_PRECISION ||
+            exponent < -NUMERIC_MAX_PRECISION)
+            return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+        dweight += (int) exponent;
+        dscale -= (int) exponent;
+        if (dscale < 0)
+            dscale = 0;
+    }
+
+    /*
+     * Okay, convert pure-decimal representation to base NBASE.  First we need
+     * to determine the converted weight and ndigits.  offset is the number of
+     * decimal zeroes to insert before the first given digit to have a
+     * correctly aligned first NBASE digit.
+     */
+    if (dweight >= 0)
+        weight = (dweight + 1 + DEC_DIGITS - 1) / DEC_DIGITS - 1;
+    else
+        weight = -((-dweight - 1) / DEC_DIGITS + 1);
+    offset = (weight + 1) * DEC_DIGITS - (dweight + 1);
+    ndigits = (ddigits + offset + DEC_DIGITS - 1) / DEC_DIGITS;
+
+    alloc_var(dest, ndigits);
+    dest->sign = sign;
+    dest->weight = weight;
+    dest->dscale = dscale;
+
+    i = DEC_DIGITS - offset;
+    digits = dest->digits;
+
+    while (ndigits-- > 0)
+    {
+#if DEC_DIGITS == 4
+        *digits++ = ((decdigits[i] * 10 + decdigits[i + 1]) * 10 +
+                     decdigits[i + 2]) * 10 + decdigits[i + 3];
+#elif DEC_DIGITS == 2
+        *digits++ = decdigits[i] * 10 + decdigits[i + 1];
+#elif DEC_DIGITS == 1
+        *digits++ = decdigits[i];
+#else
+#error unsupported NBASE
+#endif
+        i += DEC_DIGITS;
+    }
+
+    free(decdigits);
+
+    /* Strip any leading/trailing zeroes, and normalize weight if zero */
+    strip_var(dest);
+
+    /* Return end+1 position for caller */
+    if (result)
+        *result = cp;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * set_var_from_var() -
+ *
+ *  Copy one variable into another with an extra digit space for carry.
+ */
+static void
+set_var_from_var(const numeric *value, numeric *dest)
+{
+    NumericDigit *newbuf;
+
+    newbuf = digitbuf_alloc(value->ndigits + 1);
+    newbuf[0] = 0;              /* spare digit for rounding */
+    memcpy(newbuf + 1, value->digits, value->ndigits * sizeof(NumericDigit));
+
+    digitbuf_free(dest->buf);
+
+    memmove(dest, value, sizeof(numeric));
+    dest->buf = newbuf;
+    dest->digits = newbuf + 1;
+}
+
+/*
+ * copy_var() -
+ *
+ *  Copy one variable into another without an extra digit space for carry.
+ */
+static void
+copy_var(const numeric *value, numeric *dest)
+{
+    NumericDigit *newbuf;
+
+    newbuf = digitbuf_alloc(value->ndigits);
+    memcpy(newbuf, value->digits, value->ndigits * sizeof(NumericDigit));
+
+    digitbuf_free(dest->buf);
+
+    memmove(dest, value, sizeof(numeric));
+    dest->buf = newbuf;
+    dest->digits = newbuf;
+}
+
+
+/*
+ * get_str_from_var() -
+ *
+ *  Convert a var to text representation (guts of numeric_out).
+ *  CAUTION: var's contents may be modified by rounding!
+ *  Returns a malloc'd string, from the digit pool if one is attached.
+ */
+static char *
+get_str_from_var(numeric *var, int dscale)
+{
+    char       *str;
+    char       *cp;
+
+    if (dscale < 0)
+        dscale = 0;
+
+    /*
+     * Check if we must round up before printing the value and do so.
+     */
+    round_var(var, dscale);
+
+    str = (char *) pool_alloc(str_length_bound(var, dscale));
+    cp = put_str_from_var(var, dscale, str);
+
+    /*
+     * terminate the string and return it
+     */
+    *cp = '\0';
+    return str;
+}
+
+/*
+ * str_length_bound() -
+ *
+ *  Return the space put_str_from_var() needs for var at dscale, including
+ *  a null terminator.
+ */
+static size_t
+str_length_bound(const numeric *var, int dscale)
+{
+    int         i;
+
+    /*
+     * i is set to to # of decimal digits before decimal point. dscale is the
+     * # of decimal digits we will print after decimal point. We may generate
+     * as many as DEC_DIGITS-1 excess digits at the end, and in addition we
+     * need room for sign, decimal point, null terminator.
+     */
+    i = (var->weight + 1) * DEC_DIGITS;
+    if (i <= 0)
+        i = 1;
+
+    return i + dscale + DEC_DIGITS + 2;
+}
+
+/*
+ * put_str_from_var() -
+ *
+ *  Write the text representation of var, which must already be rounded to
+ *  dscale, at cp and return the end of what was written.  No terminator is
+ *  added.  cp must have room for str_length_bound() bytes.
+ */
+static char *
+put_str_from_var(const numeric *var, int dscale, char *cp)
+{
+    char       *endcp;
+    int         i;
+    int         d;
+    NumericDigit dig;
+
+#if DEC_DIGITS > 1
+    NumericDigit d1;
+#endif
+
+    /*
+     * Output a dash for negative values
+     */
+    if (var->sign == NUMERIC_NEG)
+        *cp++ = '-';
+
+    /*
+     * Output all digits before the decimal point
+     */
+    if (var->weight < 0)
+    {
+        d = var->weight + 1;
+        *cp++ = '0';
+    }
+    else
+    {
+        for (d = 0; d <= var->weight; d++)
+        {
+            dig = (d < var->ndigits) ? var->digits[d] : 0;
+            /* In the first digit, suppress extra leading decimal zeroes */
+#if DEC_DIGITS == 4
+            {
+                bool        putit = (d > 0);
+
+                d1 = dig / 1000;
+                dig -= d1 * 1000;
+                putit |= (d1 > 0);
+                if (putit)
+                    *cp++ = d1 + '0';
+                d1 = dig / 100;
+                dig -= d1 * 100;
+                putit |= (d1 > 0);
+                if (putit)
+                    *cp++ = d1 + '0';
+                d1 = dig / 10;
+                dig -= d1 * 10;
+                putit |= (d1 > 0);
+                if (putit)
+                    *cp++ = d1 + '0';
+                *cp++ = dig + '0';
+            }
+#elif DEC_DIGITS == 2
+            d1 = dig / 10;
+            dig -= d1 * 10;
+            if (d1 > 0 || d > 0)
+                *cp++ = d1 + '0';
+            *cp++ = dig + '0';
+#elif DEC_DIGITS == 1
+            *cp++ = dig + '0';
+#else
+#error unsupported NBASE
+#endif
+        }
+    }
+
+    /*
+     * If requested, output a decimal point and all the digits that follow it.
+     * We initially put out a multiple of DEC_DIGITS digits, then truncate if
+     * needed.
+     */
+    if (dscale > 0)
+    {
+        *cp++ = '.';
+        endcp = cp + dscale;
+        for (i = 0; i < dscale; d++, i += DEC_DIGITS)
+        {
+            dig = (d >= 0 && d < var->ndigits) ? var->digits[d] : 0;
+#if DEC_DIGITS == 4
+            d1 = dig / 1000;
+            dig -= d1 * 1000;
+            *cp++ = d1 + '0';
+            d1 = dig / 100;
+            dig -= d1 * 100;
+            *cp++ = d1 + '0';
+            d1 = dig / 10;
+            dig -= d1 * 10;
+            *cp++ = d1 + '0';
+            *cp++ = dig + '0';
+#elif DEC_DIGITS == 2
+            d1 = dig / 10;
+            dig -= d1 * 10;
+            *cp++ = d1 + '0';
+            *cp++ = dig + '0';
+#elif DEC_DIGITS == 1
+            *cp++ = dig + '0';
+#else
+#error unsupported NBASE
+#endif
+        }
+        cp = endcp;
+    }
+
+    return cp;
+}
+
+/*
+ * get_str_from_var_sci() -
+ *
+ *  Convert a var to a normalised scientific notation text representation.
+ *  This function does the heavy lifting for numeric_to_str_sci().
+ *
+ *  This notation has the general form a * 10^b, where a is known as the
+ *  "significand" and b is known as the "exponent".
+ *
+ *  Because we can't do superscript in ASCII (and because we want to copy
+ *  printf's behaviour) we display the exponent using E notation, with a
+ *  minimum of two exponent digits.
+ *
+ *  For example, the value 1234 could be output as 1.2e+03.
+ *
+ *  We assume that the exponent can fit into an int32.
+ *
+ *  rscale is the number of decimal digits desired after the decimal point in
+ *  the output, negative values will be treated as meaning zero.
+ *
+ *  CAUTION: var's contents may be modified by rounding!
+ *
+ *  Returns a malloc'd string.
+ */
+static char *
+get_str_from_var_sci(numeric *var, int rscale)
+{
+    int32_t     exponent;
+    numeric  denominator;
+    numeric  significand;
+    int         denom_scale;
+    size_t      len;
+    char       *str;
+    char       *sig_out;
+
+    if (rscale < 0)
+        rscale = 0;
+
+    /*
+     * Determine the exponent of this number in normalised form.
+     *
+     * This is the exponent required to represent the number with only one
+     * significant digit before the decimal place.
+     */
+    if (var->ndigits > 0)
+    {
+        exponent = (var->weight + 1) * DEC_DIGITS;
+
+        /*
+         * Compensate for leading decimal zeroes in the first numeric digit by
+         * decrementing the exponent.
+         */
+        exponent -= DEC_DIGITS - (int) log10(var->digits[0]);
+    }
+    else
+    {
+        /*
+         * If var has no digits, then it must be zero.
+         *
+         * Zero doesn't technically have a meaningful exponent in normalised
+         * notation, but we just display the exponent as zero for consistency
+         * of output.
+         */
+        exponent = 0;
+    }
+
+    /*
+     * The denominator is set to 10 raised to the power of the exponent.
+     *
+     * We then divide var by the denominator to get the significand, rounding
+     * to rscale decimal digits in the process.
+     */
+    if (exponent < 0)
+        denom_scale = -exponent;
+    else
+        denom_scale = 0;
+
+    numeric_init(&denominator);
+    numeric_init(&significand);
+
+    int64_to_numericvar((int64_t) 10, &denominator);
+    power_var_int(&denominator, exponent, &denominator, denom_scale);
+    div_var(var, &denominator, &significand, rscale, true);
+    sig_out = get_str_from_var(&significand, rscale);
+
+    numeric_dispose(&denominator);
+    numeric_dispose(&significand);
+
+    /*
+     * Allocate space for the result.
+     *
+     * In addition to the significand, we need room for the exponent
+     * decoration ("e"), the sign of the exponent, up to 10 digits for the
+     * exponent itself, and of course the null terminator.
+     */
+    len = strlen(sig_out) + 13;
+    str = malloc(len);
+    snprintf(str, len, "%se%+03d", sig_out, exponent);
+
+    pool_free(sig_out);
+
+    return str;
+}
+
+
+/*
+ * make_result() -
+ *
+ *  Create the numeric for the result whose digit buf malloc()'d memory from
+ *  a variable.
+ */
+static numeric_errcode_t
+make_result(const numeric *var, numeric *result)
+{
+    return make_result_into(var, NULL, 0, result);
+}
+
+
+/*
+ * make_result_into() -
+ *
+ *  Like make_result(), but if digits is not NULL, store the result digits
+ *  into the caller's digits[0 .. capacity-1] rather than malloc()'d memory.
+ *  Such a result has buf NULL, so numeric_dispose() leaves the storage
+ *  alone.  Returns NUMERIC_ERRCODE_BUFFER_TOO_SMALL if the digits do not
+ *  fit; result is unchanged then.
+ */
+static numeric_errcode_t
+make_result_into(const numeric *var, NumericDigit *digits_into, int capacity,
+        numeric *result)
+{
+    NumericDigit *digits = var->digits;
+    int         weight = var->weight;
+    int         n = var->ndigits;
+    NumericDigit *res_digits;
+
+    if (BUDGET_EXHAUSTED())
+        return NUMERIC_ERRCODE_CANCELLED;
+
+    if (NUMERIC_IS_NAN(var))
+    {
+        digitbuf_free(result->buf);
+        *result = const_nan;
+        dump_var("make_result()", result);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /* truncate leading zeroes */
+    while (n > 0 && *digits == 0)
+    {
+        digits++;
+        weight--;
+        n--;
+    }
+    /* truncate trailing zeroes */
+    while (n > 0 && digits[n - 1] == 0)
+        n--;
+
+    /* If zero result, force to weight=0 and positive sign */
+    if (n == 0)
+    {
+        zero_var(result);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /* Check for overflow of int16 fields */
+    if (weight < INT16_MIN || INT16_MAX < weight
+        || var->dscale < INT16_MIN || INT16_MAX < var->dscale)
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    /* Build the result */
+    if (digits_into)
+    {
+        if (n > capacity)
+            return NUMERIC_ERRCODE_BUFFER_TOO_SMALL;
+        res_digits = digits_into;
+    }
+    else
+    {
+        res_digits = digitbuf_alloc(n);
+        if (!res_digits)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+    }
+
+    memcpy(res_digits, digits, n * sizeof(NumericDigit));
+
+    digitbuf_free(result->buf);
+    result->ndigits = n;
+    result->weight = weight;
+    result->sign = var->sign;
+    result->dscale = var->dscale;
+    result->buf = digits_into ? NULL : res_digits;
+    result->digits = res_digits;
+
+    dump_var("make_result()", result);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * check_bounds_and_round() -
+ *
+ *  Do bounds checking and rounding according to the precision and scale.
+ *
+ *  Overflow is told from the weight and the first digit before rounding,
+ *  rounding up to a new digit being the one case that needs a look at
+ *  the others, so var is unchanged but for stripping on error.  var is
+ *  rounded in its own digits, which need no spare digit in front.
+ */
+static numeric_errcode_t
+check_bounds_and_round(numeric *var, int precision, int scale)
+{
+    int         maxdigits;
+    int         ddigits;
+    int         pow10;
+
+    /* Do nothing if we have a default precision (-1) */
+    if (precision < 0 || NUMERIC_IS_NAN(var))
+        return NUMERIC_ERRCODE_NO_ERROR;
+
+    maxdigits = precision - scale;
+
+    /*
+     * We must recognize a true zero, whose weight doesn't mean anything,
+     * and not count leading zeroes into the weight.
+     */
+    strip_var(var);
+    if (var->ndigits == 0)
+    {
+        var->dscale = scale;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /* Count the integral decimal digits, less those zero in digits[0] */
+    ddigits = (var->weight + 1) * DEC_DIGITS;
+    for (pow10 = NBASE / 10; var->digits[0] < pow10; pow10 /= 10)
+        ddigits--;
+
+    if (ddigits > maxdigits ||
+        (ddigits == maxdigits && round_adds_digit(var, scale)))
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    /* Round to target scale (and set var->dscale) */
+    round_var(var, scale);
+    strip_var(var);
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * round_adds_digit() -
+ *
+ *  Return true if rounding var to rscale carries into a new decimal
+ *  digit: its digits from the first nonzero one to the last one kept are
+ *  all 9, and the next one is 5 or more.  var must be stripped and not
+ *  zero.
+ */
+static bool
+round_adds_digit(const numeric *var, int rscale)
+{
+    int         kept = (var->weight + 1) * DEC_DIGITS + rscale;
+    int         pos = 0;
+    int         dig;
+    int         i;
+
+    /* decimal digits are numbered from the top of digits[0] */
+    for (dig = NBASE / 10; var->digits[0] < dig; dig /= 10)
+        pos++;
+
+    for (; pos <= kept; pos++)
+    {
+        dig = 0;
+        if (pos / DEC_DIGITS < var->ndigits)
+        {
+            dig = var->digits[pos / DEC_DIGITS];
+            for (i = pos % DEC_DIGITS; i < DEC_DIGITS - 1; i++)
+                dig /= 10;
+            dig %= 10;
+        }
+        if (pos == kept)
+            return dig >= 5;
+        if (dig != 9)
+            return false;
+    }
+    return false;
+}
+
+
+/*
+ * Convert numeric to int8, rounding if needed.
+ *
+ * If overflow, return false (no error is raised).  Return true if okay.
+ *
+ *  CAUTION: var's contents may be modified by rounding!
+ */
+static bool
+numericvar_to_int64(numeric *var, int64_t *result)
+{
+    NumericDigit *digits;
+    int         ndigits;
+    int         weight;
+    int         i;
+    int64_t       val,
+                oldval;
+    bool        neg;
+
+    /* Round to nearest integer */
+    round_var(var, 0);
+
+    /* Check for zero input */
+    strip_var(var);
+    ndigits = var->ndigits;
+    if (ndigits == 0)
+    {
+        *result = 0;
+        return true;
+    }
+
+    /*
+     * For input like 10000000000, we must treat stripped digits as real. So
+     * the loop assumes there are weight+1 digits before the decimal point.
+     */
+    weight = var->weight;
+    Assert(weight >= 0 && ndigits <= weight + 1);
+
+    /* Construct the result */
+    digits = var->digits;
+    neg = (var->sign == NUMERIC_NEG);
+    val = digits[0];
+    for (i = 1; i <= weight; i++)
+    {
+        oldval = val;
+        val *= NBASE;
+        if (i < ndigits)
+            val += digits[i];
+
+        /*
+         * The overflow check is a bit tricky because we want to accept
+         * INT64_MIN, which will overflow the positive accumulator.  We can
+         * detect this case easily though because INT64_MIN is the only
+         * nonzero value for which -val == val (on a two's complement machine,
+         * anyway).
+         */
+        if ((val / NBASE) != oldval)    /* possible overflow? */
+        {
+            if (!neg || (-val) != val || val == 0 || oldval < 0)
+                return false;
+        }
+    }
+
+    *result = neg ? -val : val;
+    return true;
+}
+
+/*
+ * Convert int8 value to numeric.
+ */
+static void
+int64_to_numericvar(int64_t val, numeric *var)
+{
+    uint64_t      uval,
+                newuval;
+    NumericDigit *ptr;
+    int         ndigits;
+
+    /* int8 can require at most 19 decimal digits; add one for safety */
+    alloc_var(var, 20 / DEC_DIGITS);
+    if (val < 0)
+    {
+        var->sign = NUMERIC_NEG;
+        uval = -val;
+    }
+    else
+    {
+        var->sign = NUMERIC_POS;
+        uval = val;
+    }
+    var->dscale = 0;
+    if (val == 0)
+    {
+        var->ndigits = 0;
+        var->weight = 0;
+        return;
+    }
+    ptr = var->digits + var->ndigits;
+    ndigits = 0;
+    do
+    {
+        ptr--;
+        ndigits++;
+        newuval = uval / NBASE;
+        *ptr = uval - newuval * NBASE;
+        uval = newuval;
+    } while (uval);
+    var->digits = ptr;
+    var->ndigits = ndigits;
+    var->weight = ndigits - 1;
+}
+
+/*
+ * int64_to_view() -
+ *
+ *  Make view a read-only numeric for val, with its digits in digits[],
+ *  which holds INT64_NBASE_DIGITS digits.  Nothing is allocated, so view
+ *  may be used as an input but never as a result.
+ */
+static void
+int64_to_view(int64_t val, NumericDigit *digits, numeric *view)
+{
+    uint64_t    uval = (val < 0) ? -(uint64_t) val : (uint64_t) val;
+    NumericDigit *ptr = digits + INT64_NBASE_DIGITS;
+
+    while (uval)
+    {
+        *--ptr = (NumericDigit) (uval % NBASE);
+        uval /= NBASE;
+    }
+    view->ndigits = (int) (digits + INT64_NBASE_DIGITS - ptr);
+    view->weight = (view->ndigits > 0) ? view->ndigits - 1 : 0;
+    view->sign = (val < 0) ? NUMERIC_NEG : NUMERIC_POS;
+    view->dscale = 0;
+    view->buf = NULL;
+    view->digits = ptr;
+}
+
+/*
+ * double_to_view() -
+ *
+ *  Make view a read-only numeric for the finite val, rounded to DBL_DIG
+ *  significant digits as numeric_from_double() does, with its digits in
+ *  digits[], which holds INT64_NBASE_DIGITS digits.
+ */
+static void
+double_to_view(double val, NumericDigit *digits, numeric *view)
+{
+    char        buf[DBL_DIG + 16];
+    const char *cp;
+    int64_t     mantissa = 0;
+    int         exponent;
+    int         shift;
+
+    /* Integers of up to DBL_DIG digits need no rounding */
+    if (val > -1e15 && val < 1e15 && val == (double) (int64_t) val)
+    {
+        int64_to_view((int64_t) val, digits, view);
+        return;
+    }
+
+    /* "d.ddd...e+XX": DBL_DIG significant digits and a decimal exponent */
+    snprintf(buf, sizeof(buf), "%.*e", DBL_DIG - 1, fabs(val));
+    for (cp = buf; *cp != 'e'; cp++)
+    {
+        if (*cp != '.')
+            mantissa = mantissa * 10 + (*cp - '0');
+    }
+    exponent = atoi(cp + 1) - (DBL_DIG - 1);
+
+    /*
+     * val is mantissa * 10^exponent.  Scale the mantissa so that the
+     * exponent is a multiple of DEC_DIGITS; it still fits in an int64.
+     */
+    shift = ((exponent % DEC_DIGITS) + DEC_DIGITS) % DEC_DIGITS;
+    exponent -= shift;
+    while (shift-- > 0)
+        mantissa *= 10;
+
+    int64_to_view((val < 0) ? -mantissa : mantissa, digits, view);
+    view->weight += exponent / DEC_DIGITS;
+    view->dscale = Max(0, -exponent);
+}
+
+#ifdef NUMERIC_HAVE_INT128
+/*
+ * Convert int128 value to numeric.
+ */
+static void
+int128_to_numericvar(numeric_int128 val, numeric *var)
+{
+    unsigned __int128 uval,
+                newuval;
+    NumericDigit *ptr;
+    int         ndigits;
+
+    /* int128 can require at most 39 decimal digits; add one for safety */
+    alloc_var(var, 40 / DEC_DIGITS);
+    if (val < 0)
+    {
+        var->sign = NUMERIC_NEG;
+        uval = -(unsigned __int128) val;
+    }
+    else
+    {
+        var->sign = NUMERIC_POS;
+        uval = val;
+    }
+    var->dscale = 0;
+    if (val == 0)
+    {
+        var->ndigits = 0;
+        var->weight = 0;
+        return;
+    }
+    ptr = var->digits + var->ndigits;
+    ndigits = 0;
+    do
+    {
+        ptr--;
+        ndigits++;
+        newuval = uval / NBASE;
+        *ptr = uval - newuval * NBASE;
+        uval = newuval;
+    } while (uval);
+    var->digits = ptr;
+    var->ndigits = ndigits;
+    var->weight = ndigits - 1;
+}
+#endif
+
+/* As above, but work from a numeric */
+static numeric_errcode_t
+numericvar_to_double_no_overflow(const numeric *var, double *result)
+{
+    numeric     num;
+    char       *tmp;
+    double      val;
+    char       *endptr;
+
+    numeric_init(&num);
+    set_var_from_var(var, &num);
+    tmp = get_str_from_var(&num, num.dscale);
+    numeric_dispose(&num);
+
+    /* unlike doublein, we ignore ERANGE from strtod */
+    val = strtod(tmp, &endptr);
+    if (*endptr != '\0')
+    {
+        /* shouldn't happen ... */
+        pool_free(tmp);
+        return NUMERIC_ERRCODE_INVALID_ARGUMENT;
+    }
+
+    pool_free(tmp);
+
+    *result = val;
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * cmp_var() -
+ *
+ *  Compare two values on variable level.  We assume zeroes have been
+ *  truncated to no digits.
+ */
+static int
+cmp_var(const numeric *var1, const numeric *var2)
+{
+    return cmp_var_common(var1->digits, var1->ndigits,
+                          var1->weight, var1->sign,
+                          var2->digits, var2->ndigits,
+                          var2->weight, var2->sign);
+}
+
+/*
+ * cmp_var_common() -
+ *
+ *  Main routine of cmp_var(). This function can be used by both
+ *  numeric and Numeric.
+ */
+static int
+cmp_var_common(const NumericDigit *var1digits, int var1ndigits,
+               int var1weight, int var1sign,
+               const NumericDigit *var2digits, int var2ndigits,
+               int var2weight, int var2sign)
+{
+    if (var1ndigits == 0)
+    {
+        if (var2ndigits == 0)
+            return 0;
+        if (var2sign == NUMERIC_NEG)
+            return 1;
+        return -1;
+    }
+    if (var2ndigits == 0)
+    {
+        if (var1sign == NUMERIC_POS)
+            return 1;
+        return -1;
+    }
+
+    if (var1sign == NUMERIC_POS)
+    {
+        if (var2sign == NUMERIC_NEG)
+            return 1;
+        return cmp_abs_common(var1digits, var1ndigits, var1weight,
+                              var2digits, var2ndigits, var2weight);
+    }
+
+    if (var2sign == NUMERIC_POS)
+        return -1;
+
+    return cmp_abs_common(var2digits, var2ndigits, var2weight,
+                          var1digits, var1ndigits, var1weight);
+}
+
+
+/*
+ * add_var() -
+ *
+ *  Full version of add functionality on variable level (handling signs).
+ *  result might point to one of the operands too without danger.
+ */
+static void
+add_var(const numeric *var1, const numeric *var2, numeric *result)
+{
+    /*
+     * Decide on the signs of the two variables what to do
+     */
+    if (var1->sign == NUMERIC_POS)
+    {
+        if (var2->sign == NUMERIC_POS)
+        {
+            /*
+             * Both are positive result = +(ABS(var1) + ABS(var2))
+             */
+            add_abs(var1, var2, result);
+            result->sign = NUMERIC_POS;
+        }
+        else
+        {
+            /*
+             * var1 is positive, var2 is negative Must compare absolute values
+             */
+            switch (cmp_abs(var1, var2))
+            {
+                case 0:
+                    /* ----------
+                     * ABS(var1) == ABS(var2)
+                     * result = ZERO
+                     * ----------
+                     */
+                    zero_var(result);
+                    result->dscale = Max(var1->dscale, var2->dscale);
+                    break;
+
+                case 1:
+                    /* ----------
+                     * ABS(var1) > ABS(var2)
+                     * result = +(ABS(var1) - ABS(var2))
+                     * ----------
+                     */
+                    sub_abs(var1, var2, result);
+                    result->sign = NUMERIC_POS;
+                    break;
+
+                case -1:
+                    /* ----------
+                     * ABS(var1) < ABS(var2)
+                     * result = -(ABS(var2) - ABS(var1))
+                     * ----------
+                     */
+                    sub_abs(var2, var1, result);
+                    result->sign = NUMERIC_NEG;
+                    break;
+            }
+        }
+    }
+    else
+    {
+        if (var2->sign == NUMERIC_POS)
+        {
+            /* ----------
+             * var1 is negative, var2 is positive
+             * Must compare absolute values
+             * ----------
+             */
+            switch (cmp_abs(var1, var2))
+            {
+                case 0:
+                    /* ----------
+                     * ABS(var1) == ABS(var2)
+                     * result = ZERO
+                     * ----------
+                     */
+                    zero_var(result);
+                    result->dscale = Max(var1->dscale, var2->dscale);
+                    break;
+
+                case 1:
+                    /* ----------
+                     * ABS(var1) > ABS(var2)
+                     * result = -(ABS(var1) - ABS(var2))
+                     * ----------
+                     */
+                    sub_abs(var1, var2, result);
+                    result->sign = NUMERIC_NEG;
+                    break;
+
+                case -1:
+                    /* ----------
+                     * ABS(var1) < ABS(var2)
+                     * result = +(ABS(var2) - ABS(var1))
+                     * ----------
+                     */
+                    sub_abs(var2, var1, result);
+                    result->sign = NUMERIC_POS;
+                    break;
+            }
+        }
+        else
+        {
+            /* ----------
+             * Both are negative
+             * result = -(ABS(var1) + ABS(var2))
+             * ----------
+             */
+            add_abs(var1, var2, result);
+            result->sign = NUMERIC_NEG;
+        }
+    }
+}
+
+
+/*
+ * sub_var() -
+ *
+ *  Full version of sub functionality on variable level (handling signs).
+ *  result might point to one of the operands too without danger.
+ */
+static void
+sub_var(const numeric *var1, const numeric *var2, numeric *result)
+{
+    /*
+     * Decide on the signs of the two variables what to do
+     */
+    if (var1->sign == NUMERIC_POS)
+    {
+        if (var2->sign == NUMERIC_NEG)
+        {
+            /* ----------
+             * var1 is positive, var2 is negative
+             * result = +(ABS(var1) + ABS(var2))
+             * ----------
+             */
+            add_abs(var1, var2, result);
+            result->sign = NUMERIC_POS;
+        }
+        else
+        {
+            /* ----------
+             * Both are positive
+             * Must compare absolute values
+             * ----------
+             */
+            switch (cmp_abs(var1, var2))
+            {
+                case 0:
+                    /* ----------
+                     * ABS(var1) == ABS(var2)
+                     * result = ZERO
+                     * ----------
+                     */
+                    zero_var(result);
+                    result->dscale = Max(var1->dscale, var2->dscale);
+                    break;
+
+                case 1:
+                    /* ----------
+                     * ABS(var1) > ABS(var2)
+                     * result = +(ABS(var1) - ABS(var2))
+                     * ----------
+                     */
+                    sub_abs(var1, var2, result);
+                    result->sign = NUMERIC_POS;
+                    break;
+
+                case -1:
+                    /* ----------
+                     * ABS(var1) < ABS(var2)
+                     * result = -(ABS(var2) - ABS(var1))
+                     * ----------
+                     */
+                    sub_abs(var2, var1, result);
+                    result->sign = NUMERIC_NEG;
+                    break;
+            }
+        }
+    }
+    else
+    {
+        if (var2->sign == NUMERIC_NEG)
+        {
+            /* ----------
+             * Both are negative
+             * Must compare absolute values
+             * ----------
+             */
+            switch (cmp_abs(var1, var2))
+            {
+                case 0:
+                    /* ----------
+                     * ABS(var1) == ABS(var2)
+                     * result = ZERO
+                     * ----------
+                     */
+                    zero_var(result);
+                    result->dscale = Max(var1->dscale, var2->dscale);
+                    break;
+
+                case 1:
+                    /* ----------
+                     * ABS(var1) > ABS(var2)
+                     * result = -(ABS(var1) - ABS(var2))
+                     * ----------
+                     */
+                    sub_abs(var1, var2, result);
+                    result->sign = NUMERIC_NEG;
+                    break;
+
+                case -1:
+                    /* ----------
+                     * ABS(var1) < ABS(var2)
+                     * result = +(ABS(var2) - ABS(var1))
+                     * ----------
+                     */
+                    sub_abs(var2, var1, result);
+                    result->sign = NUMERIC_POS;
+                    break;
+            }
+        }
+        else
+        {
+            /* ----------
+             * var1 is negative, var2 is positive
+             * result = -(ABS(var1) + ABS(var2))
+             * ----------
+             */
+            add_abs(var1, var2, result);
+            result->sign = NUMERIC_NEG;
+        }
+    }
+}
+
+
+/*
+ * Multiplication kernels for short operands
+ *
+ * mul_small_AxB multiplies an A-digit by a B-digit magnitude into the
+ * A+B+1 digits mul_var produces (the first always zero), summing each
+ * column of partial products in a local int.  Operands this short cannot
+ * overflow a column (MUL_SMALL_NDIGITS * (NBASE-1)^2 < INT_MAX), and with
+ * constant bounds the compiler turns the loops into straight-line code.
+ */
+#define MUL_SMALL_NDIGITS   6
+
+#define MUL_SMALL_KERNEL(n1, n2) \
+static void \
+mul_small_##n1##x##n2(const NumericDigit *var1digits, \
+                      const NumericDigit *var2digits, \
+                      NumericDigit *res_digits) \
+{ \
+    int         carry = 0; \
+    int         i; \
+    int         k; \
+ \
+    for (k = n1 + n2 - 2; k >= 0; k--) \
+    { \
+        for (i = Max(0, k - (n2 - 1)); i <= Min(k, n1 - 1); i++) \
+            carry += var1digits[i] * var2digits[k - i]; \
+        res_digits[k + 2] = carry % NBASE; \
+        carry /= NBASE; \
+    } \
+    res_digits[1] = carry; \
+    res_digits[0] = 0; \
+}
+
+#define MUL_SMALL_KERNELS(n1) \
+    MUL_SMALL_KERNEL(n1, 1) \
+    MUL_SMALL_KERNEL(n1, 2) \
+    MUL_SMALL_KERNEL(n1, 3) \
+    MUL_SMALL_KERNEL(n1, 4) \
+    MUL_SMALL_KERNEL(n1, 5) \
+    MUL_SMALL_KERNEL(n1, 6)
+
+MUL_SMALL_KERNELS(1)
+MUL_SMALL_KERNELS(2)
+MUL_SMALL_KERNELS(3)
+MUL_SMALL_KERNELS(4)
+MUL_SMALL_KERNELS(5)
+MUL_SMALL_KERNELS(6)
+
+#define MUL_SMALL_ROW(n1) \
+    { mul_small_##n1##x1, mul_small_##n1##x2, mul_small_##n1##x3, \
+      mul_small_##n1##x4, mul_small_##n1##x5, mul_small_##n1##x6 }
+
+static void (*const mul_small_kernels[MUL_SMALL_NDIGITS][MUL_SMALL_NDIGITS])
+            (const NumericDigit *, const NumericDigit *, NumericDigit *) =
+{
+    MUL_SMALL_ROW(1),
+    MUL_SMALL_ROW(2),
+    MUL_SMALL_ROW(3),
+    MUL_SMALL_ROW(4),
+    MUL_SMALL_ROW(5),
+    MUL_SMALL_ROW(6)
+};
+
+
+/*
+ * mul_var() -
+ *
+ *  Multiplication on variable level. Product of var1 * var2 is stored
+ *  in result.  Result is rounded to no more than rscale fractional digits.
+ */
+static void
+mul_var(const numeric *var1, const numeric *var2, numeric *result,
+        int rscale)
+{
+    int         res_ndigits;
+    int         res_sign;
+    int         res_weight;
+    int         maxdigits;
+    int        *dig;
+    int         carry;
+    int         maxdig;
+    int         newdig;
+    NumericDigit *res_digits;
+    int         i,
+                ri,
+                i1,
+                i2;
+
+    /* copy these values into local vars for speed in inner loop */
+    int         var1ndigits = var1->ndigits;
+    int         var2ndigits = var2->ndigits;
+    NumericDigit *var1digits = var1->digits;
+    NumericDigit *var2digits = var2->digits;
+
+    if (var1ndigits == 0 || var2ndigits == 0)
+    {
+        /* one or both inputs is zero; so is result */
+        zero_var(result);
+        result->dscale = rscale;
+        return;
+    }
+
+    /* Determine result sign and (maximum possible) weight */
+    if (var1->sign == var2->sign)
+        res_sign = NUMERIC_POS;
+    else
+        res_sign = NUMERIC_NEG;
+    res_weight = var1->weight + var2->weight + 2;
+
+    /*
+     * Determine number of result digits to compute.  If the exact result
+     * would have more than rscale fractional digits, truncate the computation
+     * with MUL_GUARD_DIGITS guard digits.  We do that by pretending that one
+     * or both inputs have fewer digits than they really do.
+     */
+    res_ndigits = var1ndigits + var2ndigits + 1;
+    maxdigits = res_weight + 1 + (rscale * DEC_DIGITS) + MUL_GUARD_DIGITS;
+    if (res_ndigits > maxdigits)
+    {
+        if (maxdigits < 3)
+        {
+            /* no useful precision at all in the result... */
+            zero_var(result);
+            result->dscale = rscale;
+            return;
+        }
+        /* force maxdigits odd so that input ndigits can be equal */
+        if ((maxdigits & 1) == 0)
+            maxdigits++;
+        if (var1ndigits > var2ndigits)
+        {
+            var1ndigits -= res_ndigits - maxdigits;
+            if (var1ndigits < var2ndigits)
+                var1ndigits = var2ndigits = (var1ndigits + var2ndigits) / 2;
+        }
+        else
+        {
+            var2ndigits -= res_ndigits - maxdigits;
+            if (var2ndigits < var1ndigits)
+                var1ndigits = var2ndigits = (var1ndigits + var2ndigits) / 2;
+        }
+        res_ndigits = maxdigits;
+        Assert(res_ndigits == var1ndigits + var2ndigits + 1);
+    }
+
+    /* Charge the work budget; once it is spent the result is just zero */
+    if (BUDGET_CHARGE((int64_t) var1ndigits * var2ndigits))
+    {
+        zero_var(result);
+        result->dscale = rscale;
+        return;
+    }
+
+    /*
+     * Short operands go to the kernel for their lengths, which needs no
+     * scratch space.  The inputs are read before the old result buffer is
+     * freed, since result may be one of them.
+     */
+    if (var1ndigits <= MUL_SMALL_NDIGITS && var2ndigits <= MUL_SMALL_NDIGITS)
+    {
+        NumericDigit *res_buf = digitbuf_alloc(res_ndigits + 1);
+
+        res_buf[0] = 0;         /* spare digit for rounding */
+        mul_small_kernels[var1ndigits - 1][var2ndigits - 1]
+            (var1digits, var2digits, res_buf + 1);
+        digitbuf_free(result->buf);
+        result->buf = res_buf;
+        result->digits = res_buf + 1;
+        result->ndigits = res_ndigits;
+        result->weight = res_weight;
+        result->sign = res_sign;
+        round_var(result, rscale);
+        strip_var(result);
+        return;
+    }
+
+    /*
+     * We do the arithmetic in an array "dig[]" of signed int's.  Since
+     * INT_MAX is noticeably larger than NBASE*NBASE, this gives us headroom
+     * to avoid normalizing carries immediately.
+     *
+     * maxdig tracks the maximum possible value of any dig[] entry; when this
+     * threatens to exceed INT_MAX, we take the time to propagate carries.
+     * The carry pass itself adds up to INT_MAX/NBASE to a digit, so we must
+     * normalize once digits threaten to exceed INT_MAX - INT_MAX/NBASE. To
+     * avoid overflow in maxdig itself, it actually represents the max
+     * possible value divided by NBASE-1.
+     */
+    dig = (int *) pool_calloc(res_ndigits, sizeof(int));
+    maxdig = 0;
+
+    ri = res_ndigits - 1;
+    for (i1 = var1ndigits - 1; i1 >= 0; ri--, i1--)
+    {
+        int         var1digit = var1digits[i1];
+
+        if (var1digit == 0)
+            continue;
+
+        /* Time to normalize? */
+        maxdig += var1digit;
+        if (maxdig > (INT_MAX - INT_MAX / NBASE) / (NBASE - 1))
+        {
+            /* Yes, do it */
+            carry = 0;
+            for (i = res_ndigits - 1; i >= 0; i--)
+            {
+                newdig = dig[i] + carry;
+                if (newdig >= NBASE)
+                {
+                    carry = newdig / NBASE;
+                    newdig -= carry * NBASE;
+                }
+                else
+                    carry = 0;
+                dig[i] = newdig;
+            }
+            Assert(carry == 0);
+            /* Reset maxdig to indicate new worst-case */
+            maxdig = 1 + var1digit;
+        }
+
+        /* Add appropriate multiple of var2 into the accumulator */
+        i = ri;
+        for (i2 = var2ndigits - 1; i2 >= 0; i2--)
+            dig[i--] += var1digit * var2digits[i2];
+    }
+
+    /*
+     * Now we do a final carry propagation pass to normalize the result, which
+     * we combine with storing the result digits into the output. Note that
+     * this is still done at full precision w/guard digits.
+     */
+    alloc_var(result, res_ndigits);
+    res_digits = result->digits;
+    carry = 0;
+    for (i = res_ndigits - 1; i >= 0; i--)
+    {
+        newdig = dig[i] + carry;
+        if (newdig >= NBASE)
+        {
+            carry = newdig / NBASE;
+            newdig -= carry * NBASE;
+        }
+        else
+            carry = 0;
+        res_digits[i] = newdig;
+    }
+    Assert(carry == 0);
+
+    pool_free(dig);
+
+    /*
+     * Finally, round the result to the requested precision.
+     */
+    result->weight = res_weight;
+    result->sign = res_sign;
+
+    /* Round to target rscale (and set result->dscale) */
+    round_var(result, rscale);
+
+    /* Strip leading and trailing zeroes */
+    strip_var(result);
+}
+
+
+/*
+ * div_var() -
+ *
+ *  Division on variable level. Quotient of var1 / var2 is stored in result.
+ *  The quotient is figured to exactly rscale fractional digits.
+ *  If round is true, it is rounded at the rscale'th digit; if false, it
+ *  is truncated (towards zero) at that digit.
+ */
+static numeric_errcode_t
+div_var(const numeric *var1, const numeric *var2, numeric *result,
+        int rscale, bool round)
+{
+    int         div_ndigits;
+    int         res_ndigits;
+    int         res_sign;
+    int         res_weight;
+    int         carry;
+    int         borrow;
+    int         divisor1;
+    int         divisor2;
+    NumericDigit *dividend;
+    NumericDigit *divisor;
+    NumericDigit *res_digits;
+    int         i;
+    int         j;
+
+    /* copy these values into local vars for speed in inner loop */
+    int         var1ndigits = var1->ndigits;
+    int         var2ndigits = var2->ndigits;
+
+    /*
+     * First of all division by zero check; we must not be handed an
+     * unnormalized divisor.
+     */
+    if (var2ndigits == 0 || var2->digits[0] == 0)
+        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+
+    /*
+     * Now result zero check
+     */
+    if (var1ndigits == 0)
+    {
+        zero_var(result);
+        result->dscale = rscale;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /*
+     * Determine the result sign, weight and number of digits to calculate.
+     * The weight figured here is correct if the emitted quotient has no
+     * leading zero digits; otherwise strip_var() will fix things up.
+     */
+    if (var1->sign == var2->sign)
+        res_sign = NUMERIC_POS;
+    else
+        res_sign = NUMERIC_NEG;
+    res_weight = var1->weight - var2->weight;
+    /* The number of accurate result digits we need to produce: */
+    res_ndigits = res_weight + 1 + (rscale + DEC_DIGITS - 1) / DEC_DIGITS;
+    /* ... but always at least 1 */
+    res_ndigits = Max(res_ndigits, 1);
+    /* If rounding needed, figure one more digit to ensure correct result */
+    if (round)
+        res_ndigits++;
+
+    /*
+     * The working dividend normally requires res_ndigits + var2ndigits
+     * digits, but make it at least var1ndigits so we can load all of var1
+     * into it.  (There will be an additional digit dividend[0] in the
+     * dividend space, but for consistency with Knuth's notation we don't
+     * count that in div_ndigits.)
+     */
+    div_ndigits = res_ndigits + var2ndigits;
+    div_ndigits = Max(div_ndigits, var1ndigits);
+
+    if (BUDGET_CHARGE((int64_t) res_ndigits * var2ndigits))
+    {
+        zero_var(result);
+        result->dscale = rscale;
+        return NUMERIC_ERRCODE_CANCELLED;
+    }
+
+    /*
+     * We need a workspace with room for the working dividend (div_ndigits+1
+     * digits) plus room for the possibly-normalized divisor (var2ndigits
+     * digits).  It is convenient also to have a zero at divisor[0] with the
+     * actual divisor data in divisor[1 .. var2ndigits].  Transferring the
+     * digits into the workspace also allows us to realloc the result (which
+     * might be the same as either input var) before we begin the main loop.
      * Note that we use palloc0 to ensure that divisor[0], dividend[0], and
      * any additional dividend positions beyond var1ndigits, start out 0.
      */
-    dividend = (NumericDigit *)
-        calloc(sizeof(NumericDigit), div_ndigits + var2ndigits + 2);
-    divisor = dividend + (div_ndigits + 1);
-    memcpy(dividend + 1, var1->digits, var1ndigits * sizeof(NumericDigit));
-    memcpy(divisor + 1, var2->digits, var2ndigits * sizeof(NumericDigit));
+    dividend = (NumericDigit *)
+        pool_calloc(div_ndigits + var2ndigits + 2, sizeof(NumericDigit));
+    divisor = dividend + (div_ndigits + 1);
+    memcpy(dividend + 1, var1->digits, var1ndigits * sizeof(NumericDigit));
+    memcpy(divisor + 1, var2->digits, var2ndigits * sizeof(NumericDigit));
+
+    /*
+     * Now we can realloc the result to hold the generated quotient digits.
+     */
+    alloc_var(result, res_ndigits);
+    res_digits = result->digits;
+
+    if (var2ndigits == 1)
+    {
+        /*
+         * If there's only a single divisor digit, we can use a fast path (cf.
+         * Knuth section 4.3.1 exercise 16).
+         */
+        divisor1 = divisor[1];
+        carry = 0;
+        for (i = 0; i < res_ndigits; i++)
+        {
+            carry = carry * NBASE + dividend[i + 1];
+            res_digits[i] = carry / divisor1;
+            carry = carry % divisor1;
+        }
+    }
+    else
+    {
+        /*
+         * The full multiple-place algorithm is taken from Knuth volume 2,
+         * Algorithm 4.3.1D.
+         *
+         * We need the first divisor digit to be >= NBASE/2.  If it isn't,
+         * make it so by scaling up both the divisor and dividend by the
+         * factor "d".  (The reason for allocating dividend[0] above is to
+         * leave room for possible carry here.)
+         */
+        if (divisor[1] < HALF_NBASE)
+        {
+            int         d = NBASE / (divisor[1] + 1);
+
+            carry = 0;
+            for (i = var2ndigits; i > 0; i--)
+            {
+                carry += divisor[i] * d;
+                divisor[i] = carry % NBASE;
+                carry = carry / NBASE;
+            }
+            Assert(carry == 0);
+            carry = 0;
+            /* at this point only var1ndigits of dividend can be nonzero */
+            for (i = var1ndigits; i >= 0; i--)
+            {
+                carry += dividend[i] * d;
+                dividend[i] = carry % NBASE;
+                carry = carry / NBASE;
+            }
+            Assert(carry == 0);
+            Assert(divisor[1] >= HALF_NBASE);
+        }
+        /* First 2 divisor digits are used repeatedly in main loop */
+        divisor1 = divisor[1];
+        divisor2 = divisor[2];
+
+        /*
+         * Begin the main loop.  Each iteration of this loop produces the j'th
+         * quotient digit by dividing dividend[j .. j + var2ndigits] by the
+         * divisor; this is essentially the same as the common manual
+         * procedure for long division.
+         */
+        for (j = 0; j < res_ndigits; j++)
+        {
+            /* Estimate quotient digit from the first two dividend digits */
+            int         next2digits = dividend[j] * NBASE + dividend[j + 1];
+            int         qhat;
+
+            /*
+             * If next2digits are 0, then quotient digit must be 0 and there's
+             * no need to adjust the working dividend.  It's worth testing
+             * here to fall out ASAP when processing trailing zeroes in a
+             * dividend.
+             */
+            if (next2digits == 0)
+            {
+                res_digits[j] = 0;
+                continue;
+            }
+
+            if (dividend[j] == divisor1)
+                qhat = NBASE - 1;
+            else
+                qhat = next2digits / divisor1;
+
+            /*
+             * Adjust quotient digit if it's too large.  Knuth proves that
+             * after this step, the quotient digit will be either correct or
+             * just one too large.  (Note: it's OK to use dividend[j+2] here
+             * because we know the divisor length is at least 2.)
+             */
+            while (divisor2 * qhat >
+                   (next2digits - qhat * divisor1) * NBASE + dividend[j + 2])
+                qhat--;
+
+            /* As above, need do nothing more when quotient digit is 0 */
+            if (qhat > 0)
+            {
+                /*
+                 * Multiply the divisor by qhat, and subtract that from the
+                 * working dividend.  "carry" tracks the multiplication,
+                 * "borrow" the subtraction (could we fold these together?)
+                 */
+                carry = 0;
+                borrow = 0;
+                for (i = var2ndigits; i >= 0; i--)
+                {
+                    carry += divisor[i] * qhat;
+                    borrow -= carry % NBASE;
+                    carry = carry / NBASE;
+                    borrow += dividend[j + i];
+                    if (borrow < 0)
+                    {
+                        dividend[j + i] = borrow + NBASE;
+                        borrow = -1;
+                    }
+                    else
+                    {
+                        dividend[j + i] = borrow;
+                        borrow = 0;
+                    }
+                }
+                Assert(carry == 0);
+
+                /*
+                 * If we got a borrow out of the top dividend digit, then
+                 * indeed qhat was one too large.  Fix it, and add back the
+                 * divisor to correct the working dividend.  (Knuth proves
+                 * that this will occur only about 3/NBASE of the time; hence,
+                 * it's a good idea to test this code with small NBASE to be
+                 * sure this section gets exercised.)
+                 */
+                if (borrow)
+                {
+                    qhat--;
+                    carry = 0;
+                    for (i = var2ndigits; i >= 0; i--)
+                    {
+                        carry += dividend[j + i] + divisor[i];
+                        if (carry >= NBASE)
+                        {
+                            dividend[j + i] = carry - NBASE;
+                            carry = 1;
+                        }
+                        else
+                        {
+                            dividend[j + i] = carry;
+                            carry = 0;
+                        }
+                    }
+                    /* A carry should occur here to cancel the borrow above */
+                    Assert(carry == 1);
+                }
+            }
+
+            /* And we're done with this quotient digit */
+            res_digits[j] = qhat;
+        }
+    }
+
+    pool_free(dividend);
+
+    /*
+     * Finally, round or truncate the result to the requested precision.
+     */
+    result->weight = res_weight;
+    result->sign = res_sign;
+
+    /* Round or truncate to target rscale (and set result->dscale) */
+    if (round)
+        round_var(result, rscale);
+    else
+        trunc_var(result, rscale);
+
+    /* Strip leading and trailing zeroes */
+    strip_var(result);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * div_var_fast() -
+ *
+ *  This has the same API as div_var, but is implemented using the division
+ *  algorithm from the "FM" library, rather than Knuth's schoolbook-division
+ *  approach.  This is significantly faster but can produce inaccurate
+ *  results, because it sometimes has to propagate rounding to the left,
+ *  and so we can never be entirely sure that we know the requested digits
+ *  exactly.  We compute DIV_GUARD_DIGITS extra digits, but there is
+ *  no certainty that that's enough.  We use this only in the transcendental
+ *  function calculation routines, where everything is approximate anyway.
+ */
+static numeric_errcode_t
+div_var_fast(const numeric *var1, const numeric *var2, numeric *result,
+             int rscale, bool round)
+{
+    int         div_ndigits;
+    int         res_sign;
+    int         res_weight;
+    int        *div;
+    int         qdigit;
+    int         carry;
+    int         maxdiv;
+    int         newdig;
+    NumericDigit *res_digits;
+    double      fdividend,
+                fdivisor,
+                fdivisorinverse,
+                fquotient;
+    int         qi;
+    int         i;
+
+    /* copy these values into local vars for speed in inner loop */
+    int         var1ndigits = var1->ndigits;
+    int         var2ndigits = var2->ndigits;
+    NumericDigit *var1digits = var1->digits;
+    NumericDigit *var2digits = var2->digits;
+
+    /*
+     * First of all division by zero check; we must not be handed an
+     * unnormalized divisor.
+     */
+    if (var2ndigits == 0 || var2digits[0] == 0)
+        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+
+    /*
+     * Now result zero check
+     */
+    if (var1ndigits == 0)
+    {
+        zero_var(result);
+        result->dscale = rscale;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    /*
+     * Determine the result sign, weight and number of digits to calculate
+     */
+    if (var1->sign == var2->sign)
+        res_sign = NUMERIC_POS;
+    else
+        res_sign = NUMERIC_NEG;
+    res_weight = var1->weight - var2->weight + 1;
+    /* The number of accurate result digits we need to produce: */
+    div_ndigits = res_weight + 1 + (rscale + DEC_DIGITS - 1) / DEC_DIGITS;
+    /* Add guard digits for roundoff error */
+    div_ndigits += DIV_GUARD_DIGITS;
+    if (div_ndigits < DIV_GUARD_DIGITS)
+        div_ndigits = DIV_GUARD_DIGITS;
+    /* Must be at least var1ndigits, too, to simplify data-loading loop */
+    if (div_ndigits < var1ndigits)
+        div_ndigits = var1ndigits;
+
+    if (BUDGET_CHARGE((int64_t) div_ndigits * var2ndigits))
+    {
+        zero_var(result);
+        result->dscale = rscale;
+        return NUMERIC_ERRCODE_CANCELLED;
+    }
+
+    /*
+     * We do the arithmetic in an array "div[]" of signed int's.  Since
+     * INT_MAX is noticeably larger than NBASE*NBASE, this gives us headroom
+     * to avoid normalizing carries immediately.
+     *
+     * We start with div[] containing one zero digit followed by the
+     * dividend's digits (plus appended zeroes to reach the desired precision
+     * including guard digits).  Each step of the main loop computes an
+     * (approximate) quotient digit and stores it into div[], removing one
+     * position of dividend space.  A final pass of carry propagation takes
+     * care of any mistaken quotient digits.
+     */
+    div = (int *) pool_calloc(div_ndigits + 1, sizeof(int));
+    for (i = 0; i < var1ndigits; i++)
+        div[i + 1] = var1digits[i];
+
+    /*
+     * We estimate each quotient digit using floating-point arithmetic, taking
+     * the first four digits of the (current) dividend and divisor. This must
+     * be float to avoid overflow.
+     */
+    fdivisor = (double) var2digits[0];
+    for (i = 1; i < 4; i++)
+    {
+        fdivisor *= NBASE;
+        if (i < var2ndigits)
+            fdivisor += (double) var2digits[i];
+    }
+    fdivisorinverse = 1.0 / fdivisor;
+
+    /*
+     * maxdiv tracks the maximum possible absolute value of any div[] entry;
+     * when this threatens to exceed INT_MAX, we take the time to propagate
+     * carries.  Carrying, and folding a digit into the next one, can add up
+     * to INT_MAX/NBASE to an entry, so the limit is really INT_MAX -
+     * INT_MAX/NBASE.  To avoid overflow in maxdiv itself, it actually
+     * represents the max possible abs. value divided by NBASE-1.
+     */
+    maxdiv = 1;
+
+    /*
+     * Outer loop computes next quotient digit, which will go into div[qi]
+     */
+    for (qi = 0; qi < div_ndigits; qi++)
+    {
+        /* Approximate the current dividend value */
+        fdividend = (double) div[qi];
+        for (i = 1; i < 4; i++)
+        {
+            fdividend *= NBASE;
+            if (qi + i <= div_ndigits)
+                fdividend += (double) div[qi + i];
+        }
+        /* Compute the (approximate) quotient digit */
+        fquotient = fdividend * fdivisorinverse;
+        qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
+            (((int) fquotient) - 1);    /* truncate towards -infinity */
+
+        if (qdigit != 0)
+        {
+            /* Do we need to normalize now? */
+            maxdiv += Abs(qdigit);
+            if (maxdiv > (INT_MAX - INT_MAX / NBASE - 1) / (NBASE - 1))
+            {
+                /* Yes, do it */
+                carry = 0;
+                for (i = div_ndigits; i > qi; i--)
+                {
+                    newdig = div[i] + carry;
+                    if (newdig < 0)
+                    {
+                        carry = -((-newdig - 1) / NBASE) - 1;
+                        newdig -= carry * NBASE;
+                    }
+                    else if (newdig >= NBASE)
+                    {
+                        carry = newdig / NBASE;
+                        newdig -= carry * NBASE;
+                    }
+                    else
+                        carry = 0;
+                    div[i] = newdig;
+                }
+                newdig = div[qi] + carry;
+                div[qi] = newdig;
+
+                /*
+                 * All the div[] digits except possibly div[qi] are now in the
+                 * range 0..NBASE-1.
+                 */
+                maxdiv = Abs(newdig) / (NBASE - 1);
+                maxdiv = Max(maxdiv, 1);
+
+                /*
+                 * Recompute the quotient digit since new info may have
+                 * propagated into the top four dividend digits
+                 */
+                fdividend = (double) div[qi];
+                for (i = 1; i < 4; i++)
+                {
+                    fdividend *= NBASE;
+                    if (qi + i <= div_ndigits)
+                        fdividend += (double) div[qi + i];
+                }
+                /* Compute the (approximate) quotient digit */
+                fquotient = fdividend * fdivisorinverse;
+                qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
+                    (((int) fquotient) - 1);    /* truncate towards -infinity */
+                maxdiv += Abs(qdigit);
+            }
+
+            /* Subtract off the appropriate multiple of the divisor */
+            if (qdigit != 0)
+            {
+                int         istop = Min(var2ndigits, div_ndigits - qi + 1);
+
+                for (i = 0; i < istop; i++)
+                    div[qi + i] -= qdigit * var2digits[i];
+            }
+        }
+
+        /*
+         * The dividend digit we are about to replace might still be nonzero.
+         * Fold it into the next digit position.  The folded value nearly
+         * cancels with the subtraction of the divisor, but div[qi] * NBASE
+         * alone need not fit in an int, so form the sum in 64 bits.
+         */
+        div[qi + 1] = (int) ((int64_t) div[qi] * NBASE + div[qi + 1]);
+
+        div[qi] = qdigit;
+    }
+
+    /*
+     * Approximate and store the last quotient digit (div[div_ndigits])
+     */
+    fdividend = (double) div[qi];
+    for (i = 1; i < 4; i++)
+        fdividend *= NBASE;
+    fquotient = fdividend * fdivisorinverse;
+    qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
+        (((int) fquotient) - 1);    /* truncate towards -infinity */
+    div[qi] = qdigit;
+
+    /*
+     * Now we do a final carry propagation pass to normalize the result, which
+     * we combine with storing the result digits into the output. Note that
+     * this is still done at full precision w/guard digits.
+     */
+    alloc_var(result, div_ndigits + 1);
+    res_digits = result->digits;
+    carry = 0;
+    for (i = div_ndigits; i >= 0; i--)
+    {
+        newdig = div[i] + carry;
+        if (newdig < 0)
+        {
+            carry = -((-newdig - 1) / NBASE) - 1;
+            newdig -= carry * NBASE;
+        }
+        else if (newdig >= NBASE)
+        {
+            carry = newdig / NBASE;
+            newdig -= carry * NBASE;
+        }
+        else
+            carry = 0;
+        res_digits[i] = newdig;
+    }
+    Assert(carry == 0);
+
+    pool_free(div);
+
+    /*
+     * Finally, round the result to the requested precision.
+     */
+    result->weight = res_weight;
+    result->sign = res_sign;
+
+    /* Round to target rscale (and set result->dscale) */
+    if (round)
+        round_var(result, rscale);
+    else
+        trunc_var(result, rscale);
+
+    /* Strip leading and trailing zeroes */
+    strip_var(result);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * div_var_checked() -
+ *
+ *  This has the same API and gives exactly the same results as div_var,
+ *  but computes the quotient with div_var_fast and then proves it.  The
+ *  fast quotient is truncated one decimal digit past rscale (or at rscale
+ *  if we are truncating), which is all round_var looks at.  That candidate
+ *  is correct iff the remainder var1 - quot * var2 has the sign of var1
+ *  and is smaller in magnitude than one unit of the last digit times
+ *  var2.  If it is off by one unit, which happens when the true quotient
+ *  ends near a digit boundary (notably when it is exact), we step it and
+ *  the remainder once; anything worse falls back to div_var.
+ */
+static numeric_errcode_t
+div_var_checked(const numeric *var1, const numeric *var2, numeric *result,
+                int rscale, bool round)
+{
+    numeric     quot;
+    numeric     rem;
+    numeric     bound;
+    numeric     ulp;
+    NumericDigit ulp_digit;
+    int         scale = round ? rscale + 1 : rscale;
+    int         res_ndigits;
+    int         res_sign;
+    int         step;
+    int         direction;
+    int         i;
+    numeric_errcode_t errcode;
+
+    /*
+     * div_var_fast's float estimates and the verifying multiplication only
+     * pay for themselves once both the divisor and the quotient are long
+     * (see numeric_tune.h); below that Knuth's algorithm is faster.
+     */
+    res_ndigits = var1->weight - var2->weight + 1 +
+        (rscale + DEC_DIGITS - 1) / DEC_DIGITS;
+    if (var1->ndigits == 0 || scale < 0 ||
+        var2->ndigits < DIV_CHECKED_THRESHOLD ||
+        res_ndigits < DIV_CHECKED_THRESHOLD)
+        return div_var(var1, var2, result, rscale, round);
+
+    res_sign = (var1->sign == var2->sign) ? NUMERIC_POS : NUMERIC_NEG;
+
+    numeric_init(&quot);
+    errcode = div_var_fast((numeric *) var1, (numeric *) var2, &quot,
+                           scale, false);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_dispose(&quot);
+        return errcode;
+    }
+
+    /* One unit in the last place of the candidate, 10^-scale */
+    ulp.ndigits = 1;
+    ulp.weight = -((scale + DEC_DIGITS - 1) / DEC_DIGITS);
+    ulp.sign = res_sign;
+    ulp.dscale = scale;
+    ulp.buf = NULL;
+    ulp.digits = &ulp_digit;
+    ulp_digit = 1;
+    for (i = -ulp.weight * DEC_DIGITS - scale; i > 0; i--)
+        ulp_digit *= 10;
+
+    /* rem = var1 - quot * var2 and bound = ulp * var2, both exact */
+    numeric_init(&rem);
+    numeric_init(&bound);
+    mul_var(&quot, var2, &rem, quot.dscale + var2->dscale);
+    sub_var(var1, &rem, &rem);
+    mul_var(&ulp, var2, &bound, scale + var2->dscale);
+
+    for (step = 0;; step++)
+    {
+        if (rem.ndigits > 0 && rem.sign != var1->sign)
+            direction = -1;     /* candidate is one unit too far from zero */
+        else if (cmp_abs(&rem, &bound) >= 0)
+            direction = 1;      /* candidate is one unit too close to zero */
+        else
+            break;
+
+        if (step > 0)
+        {
+            numeric_dispose(&bound);
+            numeric_dispose(&rem);
+            numeric_dispose(&quot);
+            return div_var(var1, var2, result, rscale, round);
+        }
+
+        if (direction > 0)
+        {
+            add_var(&quot, &ulp, &quot);
+            sub_var(&rem, &bound, &rem);
+        }
+        else
+        {
+            sub_var(&quot, &ulp, &quot);
+            add_var(&rem, &bound, &rem);
+        }
+    }
+
+    numeric_dispose(&bound);
+    numeric_dispose(&rem);
+
+    numeric_dispose(result);
+    *result = quot;
+
+    if (round)
+        round_var(result, rscale);
+    strip_var(result);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+/*
+ * Default scale selection for division
+ *
+ * Returns the appropriate result scale for the division result.
+ */
+static int
+select_div_scale(const numeric *var1, const numeric *var2)
+{
+    int         weight1,
+                weight2,
+                qweight,
+                i;
+    NumericDigit firstdigit1,
+                firstdigit2;
+    int         rscale;
+
+    /*
+     * The result scale of a division isn't specified in any SQL standard. For
+     * PostgreSQL we select a result scale that will give at least
+     * NUMERIC_MIN_SIG_DIGITS significant digits, so that numeric gives a
+     * result no less accurate than double; but use a scale not less than
+     * either input's display scale.
+     */
+
+    /* Get the actual (normalized) weight and first digit of each input */
+
+    weight1 = 0;                /* values to use if var1 is zero */
+    firstdigit1 = 0;
+    for (i = 0; i < var1->ndigits; i++)
+    {
+        firstdigit1 = var1->digits[i];
+        if (firstdigit1 != 0)
+        {
+            weight1 = var1->weight - i;
+            break;
+        }
+    }
+
+    weight2 = 0;                /* values to use if var2 is zero */
+    firstdigit2 = 0;
+    for (i = 0; i < var2->ndigits; i++)
+    {
+        firstdigit2 = var2->digits[i];
+        if (firstdigit2 != 0)
+        {
+            weight2 = var2->weight - i;
+            break;
+        }
+    }
+
+    /*
+     * Estimate weight of quotient.  If the two first digits are equal, we
+     * can't be sure, but assume that var1 is less than var2.
+     */
+    qweight = weight1 - weight2;
+    if (firstdigit1 <= firstdigit2)
+        qweight--;
+
+    /* Select result scale */
+    rscale = NUMERIC_MIN_SIG_DIGITS - qweight * DEC_DIGITS;
+    rscale = Max(rscale, var1->dscale);
+    rscale = Max(rscale, var2->dscale);
+    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+
+    return rscale;
+}
+
+
+/*
+ * get_min_scale() -
+ *
+ *  The smallest display scale that shows every nonzero fractional digit of
+ *  var, as in PostgreSQL.
+ */
+static int
+get_min_scale(const numeric *var)
+{
+    int         last_digit_pos = var->ndigits - 1;
+    int         min_scale;
+    NumericDigit last_digit;
+
+    while (last_digit_pos >= 0 && var->digits[last_digit_pos] == 0)
+        last_digit_pos--;
+    if (last_digit_pos < 0)
+        return 0;
+
+    min_scale = (last_digit_pos - var->weight) * DEC_DIGITS;
+    if (min_scale <= 0)
+        return 0;
+
+    /* drop the trailing decimal zeroes of the last NBASE digit */
+    last_digit = var->digits[last_digit_pos];
+    while (last_digit % 10 == 0)
+    {
+        min_scale--;
+        last_digit /= 10;
+    }
+    return min_scale;
+}
+
+
+/*
+ * Default scale selection for square root
+ *
+ * We choose a scale to give at least NUMERIC_MIN_SIG_DIGITS significant
+ * digits; but in any case not less than the input's dscale.
+ */
+static int
+select_sqrt_scale(const numeric *var)
+{
+    int         sweight;
+    int         rscale;
+
+    /* Assume the input was normalized, so var->weight is accurate */
+    sweight = (var->weight + 1) * DEC_DIGITS / 2 - 1;
+
+    rscale = NUMERIC_MIN_SIG_DIGITS - sweight;
+    rscale = Max(rscale, var->dscale);
+    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+
+    return rscale;
+}
+
+
+/*
+ * Default scale selection for exp
+ *
+ * We choose a scale to give at least NUMERIC_MIN_SIG_DIGITS significant
+ * digits; but in any case not less than the input's dscale.
+ */
+static numeric_errcode_t
+select_exp_scale(const numeric *var, int *rscale)
+{
+    double      val;
+    numeric_errcode_t errcode;
+
+    /* convert input to double, ignoring overflow */
+    errcode = numericvar_to_double_no_overflow(var, &val);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    /*
+     * log10(result) = num * log10(e), so this is approximately the decimal
+     * weight of the result:
+     */
+    val *= 0.434294481903252;
+
+    /* limit to something that won't cause integer overflow */
+    val = Max(val, -NUMERIC_MAX_RESULT_SCALE);
+    val = Min(val, NUMERIC_MAX_RESULT_SCALE);
+
+    *rscale = NUMERIC_MIN_SIG_DIGITS - (int) val;
+    *rscale = Max(*rscale, var->dscale);
+    *rscale = Max(*rscale, NUMERIC_MIN_DISPLAY_SCALE);
+    *rscale = Min(*rscale, NUMERIC_MAX_DISPLAY_SCALE);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * Default scale selection for ln
+ */
+static int
+select_ln_scale(const numeric *var)
+{
+    int         dec_digits;
+    int         rscale;
+
+    /* Approx decimal digits before decimal point */
+    dec_digits = (var->weight + 1) * DEC_DIGITS;
+
+    if (dec_digits > 1)
+        rscale = NUMERIC_MIN_SIG_DIGITS - (int) log10(dec_digits - 1);
+    else if (dec_digits < 1)
+        rscale = NUMERIC_MIN_SIG_DIGITS - (int) log10(1 - dec_digits);
+    else
+        rscale = NUMERIC_MIN_SIG_DIGITS;
+
+    rscale = Max(rscale, var->dscale);
+    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+
+    return rscale;
+}
+
+
+/*
+ * Default scale selection for trigonometric functions
+ *
+ * The results of sin, cos and atan are at most pi/2 in absolute value, so
+ * NUMERIC_MIN_SIG_DIGITS fractional digits usually do.  For odd functions
+ * (sin, atan) of small arguments the result is about as small as the
+ * argument, so the scale is raised to keep the significant digits.
+ */
+static int
+select_trig_scale(const numeric *var, bool odd)
+{
+    int         rscale = NUMERIC_MIN_SIG_DIGITS;
 
-    /*
-     * Now we can realloc the result to hold the generated quotient digits.
-     */
-    alloc_var(result, res_ndigits);
-    res_digits = result->digits;
+    if (odd && var->ndigits > 0 && var->weight < 0)
+        rscale -= (var->weight + 1) * DEC_DIGITS;
 
-    if (var2ndigits == 1)
+    rscale = Max(rscale, var->dscale);
+    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
+    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+
+    return rscale;
+}
+
+
+/*
+ * cache_hash_var() -
+ *
+ *  Fold the normalised value of var into a running FNV-1a hash.  Leading
+ *  and trailing zero digits are skipped so that equal values hash equally.
+ */
+static uint32_t
+cache_hash_var(uint32_t hash, const numeric *var)
+{
+    const NumericDigit *digits = var->digits;
+    int         ndigits = var->ndigits;
+    int         weight = var->weight;
+    int         i;
+
+    while (ndigits > 0 && *digits == 0)
     {
-        /*
-         * If there's only a single divisor digit, we can use a fast path (cf.
-         * Knuth section 4.3.1 exercise 16).
-         */
-        divisor1 = divisor[1];
-        carry = 0;
-        for (i = 0; i < res_ndigits; i++)
-        {
-            carry = carry * NBASE + dividend[i + 1];
-            res_digits[i] = carry / divisor1;
-            carry = carry % divisor1;
-        }
+        digits++;
+        ndigits--;
+        weight--;
+    }
+    while (ndigits > 0 && digits[ndigits - 1] == 0)
+        ndigits--;
+
+    if (ndigits == 0)
+        return (hash ^ 0xffff) * 16777619;
+
+    hash = (hash ^ (uint32_t) var->sign) * 16777619;
+    hash = (hash ^ (uint32_t) weight) * 16777619;
+    for (i = 0; i < ndigits; i++)
+        hash = (hash ^ (uint32_t) digits[i]) * 16777619;
+
+    return hash;
+}
+
+/*
+ * cache_find() -
+ *
+ *  Find the entry for op applied to arg1 (and arg2), or NULL.  Power
+ *  results are cached at the scale numeric_power() selects, which depends
+ *  on the dscales of the arguments, so those must match too.
+ *  Caller must hold numeric_cache.lock.
+ */
+static cache_entry *
+cache_find(uint32_t hash, numeric_cache_op_t op, const numeric *arg1,
+           const numeric *arg2)
+{
+    cache_entry *entry;
+
+    entry = numeric_cache.buckets[hash & (numeric_cache.nbuckets - 1)];
+    for (; entry != NULL; entry = entry->hash_next)
+    {
+        if (entry->hash == hash && entry->op == op &&
+            cmp_var(&entry->arg1, arg1) == 0 &&
+            (arg2 == NULL || cmp_var(&entry->arg2, arg2) == 0) &&
+            (op != NUMERIC_CACHE_POWER ||
+             (entry->arg1.dscale == arg1->dscale &&
+              entry->arg2.dscale == arg2->dscale)))
+            return entry;
     }
+    return NULL;
+}
+
+/*
+ * cache_unlink() -
+ *
+ *  Remove an entry from the LRU list.  Caller must hold numeric_cache.lock.
+ */
+static void
+cache_unlink(cache_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        numeric_cache.lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
     else
+        numeric_cache.lru_tail = entry->lru_prev;
+}
+
+/*
+ * cache_push_front() -
+ *
+ *  Make an entry the most recently used one.
+ *  Caller must hold numeric_cache.lock.
+ */
+static void
+cache_push_front(cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = numeric_cache.lru_head;
+    if (numeric_cache.lru_head)
+        numeric_cache.lru_head->lru_prev = entry;
+    else
+        numeric_cache.lru_tail = entry;
+    numeric_cache.lru_head = entry;
+}
+
+/*
+ * cache_lookup() -
+ *
+ *  Look for a cached result of op applied to arg1 (and arg2) at rscale.
+ *  On a hit the result is copied into the variable result, rounded to
+ *  rscale if it was cached at a larger scale, and true is returned.
+ */
+static bool
+cache_lookup(numeric_cache_op_t op, const numeric *arg1, const numeric *arg2,
+             int rscale, numeric *result)
+{
+    cache_entry *entry;
+    uint32_t    hash;
+
+    /* Unlocked peek: the common case is that nobody enabled the cache */
+    if (numeric_cache.capacity == 0)
+        return false;
+
+    hash = cache_hash_var(cache_hash_var(2166136261U ^ op, arg1),
+                          arg2 ? arg2 : &const_zero);
+
+    pthread_mutex_lock(&numeric_cache.lock);
+
+    if (numeric_cache.capacity == 0)
     {
-        /*
-         * The full multiple-place algorithm is taken from Knuth volume 2,
-         * Algorithm 4.3.1D.
-         *
-         * We need the first divisor digit to be >= NBASE/2.  If it isn't,
-         * make it so by scaling up both the divisor and dividend by the
-         * factor "d".  (The reason for allocating dividend[0] above is to
-         * leave room for possible carry here.)
-         */
-        if (divisor[1] < HALF_NBASE)
-        {
-            int         d = NBASE / (divisor[1] + 1);
+        pthread_mutex_unlock(&numeric_cache.lock);
+        return false;
+    }
 
-            carry = 0;
-            for (i = var2ndigits; i > 0; i--)
-            {
-                carry += divisor[i] * d;
-                divisor[i] = carry % NBASE;
-                carry = carry / NBASE;
-            }
-            Assert(carry == 0);
-            carry = 0;
-            /* at this point only var1ndigits of dividend can be nonzero */
-            for (i = var1ndigits; i >= 0; i--)
-            {
-                carry += dividend[i] * d;
-                dividend[i] = carry % NBASE;
-                carry = carry / NBASE;
-            }
-            Assert(carry == 0);
-            Assert(divisor[1] >= HALF_NBASE);
-        }
-        /* First 2 divisor digits are used repeatedly in main loop */
-        divisor1 = divisor[1];
-        divisor2 = divisor[2];
+    entry = cache_find(hash, op, arg1, arg2);
+    if (entry == NULL || entry->rscale < rscale ||
+        (rscale < 0 && entry->rscale != rscale))
+    {
+        numeric_cache.stats.misses++;
+        pthread_mutex_unlock(&numeric_cache.lock);
+        return false;
+    }
 
-        /*
-         * Begin the main loop.  Each iteration of this loop produces the j'th
-         * quotient digit by dividing dividend[j .. j + var2ndigits] by the
-         * divisor; this is essentially the same as the common manual
-         * procedure for long division.
-         */
-        for (j = 0; j < res_ndigits; j++)
-        {
-            /* Estimate quotient digit from the first two dividend digits */
-            int         next2digits = dividend[j] * NBASE + dividend[j + 1];
-            int         qhat;
+    numeric_cache.stats.hits++;
+    cache_unlink(entry);
+    cache_push_front(entry);
+    set_var_from_var(&entry->value, result);
 
-            /*
-             * If next2digits are 0, then quotient digit must be 0 and there's
-             * no need to adjust the working dividend.  It's worth testing
-             * here to fall out ASAP when processing trailing zeroes in a
-             * dividend.
-             */
-            if (next2digits == 0)
-            {
-                res_digits[j] = 0;
-                continue;
-            }
+    pthread_mutex_unlock(&numeric_cache.lock);
 
-            if (dividend[j] == divisor1)
-                qhat = NBASE - 1;
-            else
-                qhat = next2digits / divisor1;
+    if (rscale >= 0 && rscale < result->dscale)
+    {
+        round_var(result, rscale);
+        strip_var(result);
+    }
 
-            /*
-             * Adjust quotient digit if it's too large.  Knuth proves that
-             * after this step, the quotient digit will be either correct or
-             * just one too large.  (Note: it's OK to use dividend[j+2] here
-             * because we know the divisor length is at least 2.)
-             */
-            while (divisor2 * qhat >
-                   (next2digits - qhat * divisor1) * NBASE + dividend[j + 2])
-                qhat--;
+    return true;
+}
 
-            /* As above, need do nothing more when quotient digit is 0 */
-            if (qhat > 0)
-            {
-                /*
-                 * Multiply the divisor by qhat, and subtract that from the
-                 * working dividend.  "carry" tracks the multiplication,
-                 * "borrow" the subtraction (could we fold these together?)
-                 */
-                carry = 0;
-                borrow = 0;
-                for (i = var2ndigits; i >= 0; i--)
-                {
-                    carry += divisor[i] * qhat;
-                    borrow -= carry % NBASE;
-                    carry = carry / NBASE;
-                    borrow += dividend[j + i];
-                    if (borrow < 0)
-                    {
-                        dividend[j + i] = borrow + NBASE;
-                        borrow = -1;
-                    }
-                    else
-                    {
-                        dividend[j + i] = borrow;
-                        borrow = 0;
-                    }
-                }
-                Assert(carry == 0);
+/*
+ * cache_insert() -
+ *
+ *  Remember value as the result of op applied to arg1 (and arg2) at
+ *  rscale, evicting the least recently used entry if the cache is full.
+ *  An existing entry is only replaced by one of a larger rscale.  Failure
+ *  to allocate memory just leaves the cache unchanged.
+ */
+static void
+cache_insert(numeric_cache_op_t op, const numeric *arg1, const numeric *arg2,
+             int rscale, const numeric *value)
+{
+    cache_entry *entry;
+    cache_entry **bucket;
+    uint32_t    hash;
+    digit_pool *pool;
 
-                /*
-                 * If we got a borrow out of the top dividend digit, then
-                 * indeed qhat was one too large.  Fix it, and add back the
-                 * divisor to correct the working dividend.  (Knuth proves
-                 * that this will occur only about 3/NBASE of the time; hence,
-                 * it's a good idea to test this code with small NBASE to be
-                 * sure this section gets exercised.)
-                 */
-                if (borrow)
-                {
-                    qhat--;
-                    carry = 0;
-                    for (i = var2ndigits; i >= 0; i--)
-                    {
-                        carry += dividend[j + i] + divisor[i];
-                        if (carry >= NBASE)
-                        {
-                            dividend[j + i] = carry - NBASE;
-                            carry = 1;
-                        }
-                        else
-                        {
-                            dividend[j + i] = carry;
-                            carry = 0;
-                        }
-                    }
-                    /* A carry should occur here to cancel the borrow above */
-                    Assert(carry == 1);
-                }
-            }
+    /* never remember a result cut short by the work budget */
+    if (numeric_cache.capacity == 0 || BUDGET_EXHAUSTED())
+        return;
 
-            /* And we're done with this quotient digit */
-            res_digits[j] = qhat;
+    hash = cache_hash_var(cache_hash_var(2166136261U ^ op, arg1),
+                          arg2 ? arg2 : &const_zero);
+
+    pthread_mutex_lock(&numeric_cache.lock);
+
+    if (numeric_cache.capacity == 0)
+    {
+        pthread_mutex_unlock(&numeric_cache.lock);
+        return;
+    }
+
+    entry = cache_find(hash, op, arg1, arg2);
+    if (entry != NULL)
+    {
+        /* Someone beat us to it, or we have a more precise value now */
+        if (rscale > entry->rscale)
+        {
+            pool = digit_pool_attach(NULL);
+            set_var_from_var(value, &entry->value);
+            digit_pool_attach(pool);
+            entry->rscale = rscale;
+        }
+        cache_unlink(entry);
+        cache_push_front(entry);
+        pthread_mutex_unlock(&numeric_cache.lock);
+        return;
+    }
+
+    if (numeric_cache.stats.nentries >= numeric_cache.capacity)
+    {
+        /* Evict the least recently used entry and recycle it */
+        entry = numeric_cache.lru_tail;
+        cache_unlink(entry);
+        bucket = &numeric_cache.buckets[entry->hash &
+                                        (numeric_cache.nbuckets - 1)];
+        while (*bucket != entry)
+            bucket = &(*bucket)->hash_next;
+        *bucket = entry->hash_next;
+        numeric_cache.stats.nentries--;
+        numeric_cache.stats.evictions++;
+    }
+    else
+    {
+        entry = (cache_entry *) calloc(1, sizeof(cache_entry));
+        if (!entry)
+        {
+            pthread_mutex_unlock(&numeric_cache.lock);
+            return;
         }
     }
 
-    free(dividend);
+    entry->hash = hash;
+    entry->op = op;
+    entry->rscale = rscale;
+    /* the entry outlives any formula evaluation running on this thread */
+    pool = digit_pool_attach(NULL);
+    set_var_from_var(arg1, &entry->arg1);
+    set_var_from_var(arg2 ? arg2 : &const_zero, &entry->arg2);
+    set_var_from_var(value, &entry->value);
+    digit_pool_attach(pool);
+
+    bucket = &numeric_cache.buckets[hash & (numeric_cache.nbuckets - 1)];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_push_front(entry);
+    numeric_cache.stats.nentries++;
+
+    pthread_mutex_unlock(&numeric_cache.lock);
+}
+
+/*
+ * cache_make_result() -
+ *
+ *  make_result() for a variable filled in by cache_lookup(), which is
+ *  disposed of afterwards.
+ */
+static numeric_errcode_t
+cache_make_result(numeric *var, numeric *result)
+{
+    numeric_errcode_t errcode;
+
+    errcode = make_result(var, result);
+    numeric_dispose(var);
+
+    return errcode;
+}
+
 
-    /*
-     * Finally, round or truncate the result to the requested precision.
+/*
+ * mod_var() -
+ *
+ *  Calculate the modulo of two numerics at variable level
+ */
+static numeric_errcode_t
+mod_var(const numeric *var1, const numeric *var2, numeric *result)
+{
+    numeric  tmp;
+    numeric_errcode_t errcode;
+
+    numeric_init(&tmp);
+
+    /* ---------
+     * We do this using the equation
+     *      mod(x,y) = x - trunc(x/y)*y
+     * div_var can be persuaded to give us trunc(x/y) directly.
+     * ----------
      */
-    result->weight = res_weight;
-    result->sign = res_sign;
+    errcode = div_var(var1, var2, &tmp, 0, false);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
 
-    /* Round or truncate to target rscale (and set result->dscale) */
-    if (round)
-        round_var(result, rscale);
-    else
-        trunc_var(result, rscale);
+    mul_var(var2, &tmp, &tmp, var2->dscale);
 
-    /* Strip leading and trailing zeroes */
-    strip_var(result);
+    sub_var(var1, &tmp, result);
 
+    numeric_dispose(&tmp);
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
 
 /*
- * div_var_fast() -
+ * allocate_var() -
  *
- *  This has the same API as div_var, but is implemented using the division
- *  algorithm from the "FM" library, rather than Knuth's schoolbook-division
- *  approach.  This is significantly faster but can produce inaccurate
- *  results, because it sometimes has to propagate rounding to the left,
- *  and so we can never be entirely sure that we know the requested digits
- *  exactly.  We compute DIV_GUARD_DIGITS extra digits, but there is
- *  no certainty that that's enough.  We use this only in the transcendental
- *  function calculation routines, where everything is approximate anyway.
+ *  Body of numeric_allocate().  parts[] and remainders[] are n initialized
+ *  work variables, order[] is scratch space for n ints.
+ *
+ *  With T the total rounded to scale and W the sum of the weights, each
+ *  part starts out as T * w / W truncated at scale, and its remainder
+ *  T * w - part * W is kept exactly, so the leftover T - SUM(parts) is an
+ *  exact whole number k of units, 0 <= k < n.  Only the k largest
+ *  remainders have to be found, which a partial selection does in linear
+ *  expected time; there is no need to sort them.
  */
 static numeric_errcode_t
-div_var_fast(numeric *var1, numeric *var2, numeric *result,
-             int rscale, bool round)
+allocate_var(const numeric *total, const numeric *weights, int n, int scale,
+        numeric *parts, numeric *remainders, int *order)
 {
-    int         div_ndigits;
-    int         res_sign;
-    int         res_weight;
-    int        *div;
-    int         qdigit;
-    int         carry;
-    int         maxdiv;
-    int         newdig;
-    NumericDigit *res_digits;
-    double      fdividend,
-                fdivisor,
-                fdivisorinverse,
-                fquotient;
-    int         qi;
+    numeric     rounded_total;
+    numeric     weight_sum;
+    numeric     product;
+    numeric     tmp;
+    numeric     unit;
+    NumericDigit unit_digit;
+    int64_t     k = 0;
     int         i;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
 
-    /* copy these values into local vars for speed in inner loop */
-    int         var1ndigits = var1->ndigits;
-    int         var2ndigits = var2->ndigits;
-    NumericDigit *var1digits = var1->digits;
-    NumericDigit *var2digits = var2->digits;
-
-    /*
-     * First of all division by zero check; we must not be handed an
-     * unnormalized divisor.
-     */
-    if (var2ndigits == 0 || var2digits[0] == 0)
-        return NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+    numeric_init(&rounded_total);
+    numeric_init(&weight_sum);
+    numeric_init(&product);
+    numeric_init(&tmp);
 
-    /*
-     * Now result zero check
-     */
-    if (var1ndigits == 0)
+    zero_var(&weight_sum);
+    for (i = 0; i < n; i++)
     {
-        zero_var(result);
-        result->dscale = rscale;
-        return NUMERIC_ERRCODE_NO_ERROR;
+        if (weights[i].sign == NUMERIC_NEG && weights[i].ndigits > 0)
+        {
+            errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            break;
+        }
+        add_var(&weight_sum, &weights[i], &weight_sum);
     }
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR && weight_sum.ndigits == 0)
+        errcode = NUMERIC_ERRCODE_DIVISION_BY_ZERO;
 
-    /*
-     * Determine the result sign, weight and number of digits to calculate
-     */
-    if (var1->sign == var2->sign)
-        res_sign = NUMERIC_POS;
-    else
-        res_sign = NUMERIC_NEG;
-    res_weight = var1->weight - var2->weight + 1;
-    /* The number of accurate result digits we need to produce: */
-    div_ndigits = res_weight + 1 + (rscale + DEC_DIGITS - 1) / DEC_DIGITS;
-    /* Add guard digits for roundoff error */
-    div_ndigits += DIV_GUARD_DIGITS;
-    if (div_ndigits < DIV_GUARD_DIGITS)
-        div_ndigits = DIV_GUARD_DIGITS;
-    /* Must be at least var1ndigits, too, to simplify data-loading loop */
-    if (div_ndigits < var1ndigits)
-        div_ndigits = var1ndigits;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        set_var_from_var(total, &rounded_total);
+        round_var(&rounded_total, scale);
 
-    /*
-     * We do the arithmetic in an array "div[]" of signed int's.  Since
-     * INT_MAX is noticeably larger than NBASE*NBASE, this gives us headroom
-     * to avoid normalizing carries immediately.
-     *
-     * We start with div[] containing one zero digit followed by the
-     * dividend's digits (plus appended zeroes to reach the desired precision
-     * including guard digits).  Each step of the main loop computes an
-     * (approximate) quotient digit and stores it into div[], removing one
-     * position of dividend space.  A final pass of carry propagation takes
-     * care of any mistaken quotient digits.
-     */
-    div = (int *) calloc(sizeof(int), div_ndigits + 1);
-    for (i = 0; i < var1ndigits; i++)
-        div[i + 1] = var1digits[i];
+        /*
+         * Single pass: truncated parts, exact remainders, and the running
+         * total of what has been handed out so far (in tmp).
+         */
+        zero_var(&tmp);
+        for (i = 0; i < n; i++)
+        {
+            mul_var(&rounded_total, &weights[i], &product,
+                    rounded_total.dscale + weights[i].dscale);
+            errcode = div_var(&product, &weight_sum, &parts[i], scale, false);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                break;
+            mul_var(&parts[i], &weight_sum, &remainders[i],
+                    parts[i].dscale + weight_sum.dscale);
+            sub_var(&product, &remainders[i], &remainders[i]);
+            add_var(&tmp, &parts[i], &tmp);
+            order[i] = i;
+        }
+    }
 
-    /*
-     * We estimate each quotient digit using floating-point arithmetic, taking
-     * the first four digits of the (current) dividend and divisor. This must
-     * be float to avoid overflow.
-     */
-    fdivisor = (double) var2digits[0];
-    for (i = 1; i < 4; i++)
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
     {
-        fdivisor *= NBASE;
-        if (i < var2ndigits)
-            fdivisor += (double) var2digits[i];
+        /* unit = 10^-scale, the smallest amount a part can differ by */
+        unit.ndigits = 1;
+        unit.weight = -((scale + DEC_DIGITS - 1) / DEC_DIGITS);
+        unit.sign = rounded_total.sign;
+        unit.dscale = scale;
+        unit.buf = NULL;
+        unit.digits = &unit_digit;
+        unit_digit = 1;
+        for (i = -scale - unit.weight * DEC_DIGITS; i > 0; i--)
+            unit_digit *= 10;
+
+        /* k = (T - SUM(parts)) / unit, which divides exactly */
+        sub_var(&rounded_total, &tmp, &tmp);
+        errcode = div_var(&tmp, &unit, &product, 0, false);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR &&
+            !numericvar_to_int64(&product, &k))
+            errcode = NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
     }
-    fdivisorinverse = 1.0 / fdivisor;
-
-    /*
-     * maxdiv tracks the maximum possible absolute value of any div[] entry;
-     * when this threatens to exceed INT_MAX, we take the time to propagate
-     * carries.  To avoid overflow in maxdiv itself, it actually represents
-     * the max possible abs. value divided by NBASE-1.
-     */
-    maxdiv = 1;
 
-    /*
-     * Outer loop computes next quotient digit, which will go into div[qi]
-     */
-    for (qi = 0; qi < div_ndigits; qi++)
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR && k > 0)
     {
-        /* Approximate the current dividend value */
-        fdividend = (double) div[qi];
-        for (i = 1; i < 4; i++)
-        {
-            fdividend *= NBASE;
-            if (qi + i <= div_ndigits)
-                fdividend += (double) div[qi + i];
-        }
-        /* Compute the (approximate) quotient digit */
-        fquotient = fdividend * fdivisorinverse;
-        qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
-            (((int) fquotient) - 1);    /* truncate towards -infinity */
+        allocate_select(remainders, order, n, (int) k);
+        for (i = 0; i < k; i++)
+            add_var(&parts[order[i]], &unit, &parts[order[i]]);
+    }
 
-        if (qdigit != 0)
-        {
-            /* Do we need to normalize now? */
-            maxdiv += Abs(qdigit);
-            if (maxdiv > INT_MAX / (NBASE - 1))
-            {
-                /* Yes, do it */
-                carry = 0;
-                for (i = div_ndigits; i > qi; i--)
-                {
-                    newdig = div[i] + carry;
-                    if (newdig < 0)
-                    {
-                        carry = -((-newdig - 1) / NBASE) - 1;
-                        newdig -= carry * NBASE;
-                    }
-                    else if (newdig >= NBASE)
-                    {
-                        carry = newdig / NBASE;
-                        newdig -= carry * NBASE;
-                    }
-                    else
-                        carry = 0;
-                    div[i] = newdig;
-                }
-                newdig = div[qi] + carry;
-                div[qi] = newdig;
+    numeric_dispose(&tmp);
+    numeric_dispose(&product);
+    numeric_dispose(&weight_sum);
+    numeric_dispose(&rounded_total);
 
-                /*
-                 * All the div[] digits except possibly div[qi] are now in the
-                 * range 0..NBASE-1.
-                 */
-                maxdiv = Abs(newdig) / (NBASE - 1);
-                maxdiv = Max(maxdiv, 1);
+    return errcode;
+}
 
-                /*
-                 * Recompute the quotient digit since new info may have
-                 * propagated into the top four dividend digits
-                 */
-                fdividend = (double) div[qi];
-                for (i = 1; i < 4; i++)
-                {
-                    fdividend *= NBASE;
-                    if (qi + i <= div_ndigits)
-                        fdividend += (double) div[qi + i];
-                }
-                /* Compute the (approximate) quotient digit */
-                fquotient = fdividend * fdivisorinverse;
-                qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
-                    (((int) fquotient) - 1);    /* truncate towards -infinity */
-                maxdiv += Abs(qdigit);
-            }
 
-            /* Subtract off the appropriate multiple of the divisor */
-            if (qdigit != 0)
+/*
+ * allocate_select() -
+ *
+ *  Partially order order[0 .. n-1], indexes into remainders[], so that its
+ *  first k entries are those of the k remainders largest in absolute value,
+ *  ties ranking the lower index first.  Quickselect; since no two entries
+ *  compare equal, a middle pivot does not degrade on presorted input.
+ */
+static void
+allocate_select(const numeric *remainders, int *order, int n, int k)
+{
+    int         lo = 0;
+    int         hi = n - 1;
+
+    while (lo < hi)
+    {
+        int         mid = lo + (hi - lo) / 2;
+        int         pivot = order[mid];
+        int         store = lo;
+        int         i;
+
+        order[mid] = order[hi];
+        order[hi] = pivot;
+        for (i = lo; i < hi; i++)
+        {
+            int         c = cmp_abs(&remainders[order[i]], &remainders[pivot]);
+
+            if (c > 0 || (c == 0 && order[i] < pivot))
             {
-                int         istop = Min(var2ndigits, div_ndigits - qi + 1);
+                int         swap = order[i];
 
-                for (i = 0; i < istop; i++)
-                    div[qi + i] -= qdigit * var2digits[i];
+                order[i] = order[store];
+                order[store++] = swap;
             }
         }
+        order[hi] = order[store];
+        order[store] = pivot;
 
-        /*
-         * The dividend digit we are about to replace might still be nonzero.
-         * Fold it into the next digit position.  We don't need to worry about
-         * overflow here since this should nearly cancel with the subtraction
-         * of the divisor.
-         */
-        div[qi + 1] += div[qi] * NBASE;
-
-        div[qi] = qdigit;
+        /* order[0 .. store] now holds the store + 1 largest */
+        if (store == k || store + 1 == k)
+            return;
+        if (k < store)
+            hi = store - 1;
+        else
+            lo = store + 1;
     }
+}
 
-    /*
-     * Approximate and store the last quotient digit (div[div_ndigits])
-     */
-    fdividend = (double) div[qi];
-    for (i = 1; i < 4; i++)
-        fdividend *= NBASE;
-    fquotient = fdividend * fdivisorinverse;
-    qdigit = (fquotient >= 0.0) ? ((int) fquotient) :
-        (((int) fquotient) - 1);    /* truncate towards -infinity */
-    div[qi] = qdigit;
 
-    /*
-     * Now we do a final carry propagation pass to normalize the result, which
-     * we combine with storing the result digits into the output. Note that
-     * this is still done at full precision w/guard digits.
-     */
-    alloc_var(result, div_ndigits + 1);
-    res_digits = result->digits;
-    carry = 0;
-    for (i = div_ndigits; i >= 0; i--)
+/*
+ * gcd_var() -
+ *
+ *  Calculate the greatest common divisor of two numerics at variable
+ *  level.  The result is positive unless both inputs are zero, and its
+ *  dscale is the larger of the inputs' dscales.
+ *
+ *  Non-integral inputs are scaled up by a common power of NBASE first, so
+ *  the real work is always done on integers.  That uses Lehmer's algorithm
+ *  (Knuth vol. 2, 4.5.2, Algorithm L): the Euclid quotient sequence is
+ *  simulated on the leading two NBASE digits of both values, and a whole
+ *  run of steps is then applied at full precision as one linear
+ *  combination.  Only when the run is empty does a full mod_var() step
+ *  happen.  Once the values fit in an int64, the binary algorithm
+ *  finishes the job.
+ */
+static numeric_errcode_t
+gcd_var(const numeric *var1, const numeric *var2, numeric *result)
+{
+    numeric  a;
+    numeric  b;
+    numeric  t;
+    numeric  u;
+    numeric  tmp;
+    int         shift;
+    int         rscale = Max(var1->dscale, var2->dscale);
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+
+    numeric_init(&a);
+    numeric_init(&b);
+    numeric_init(&t);
+    numeric_init(&u);
+
+    set_var_from_var(var1, &a);
+    set_var_from_var(var2, &b);
+    strip_var(&a);
+    strip_var(&b);
+    a.sign = NUMERIC_POS;
+    b.sign = NUMERIC_POS;
+
+    /* make both integral */
+    shift = Max(Max(a.ndigits - a.weight - 1, 0),
+                Max(b.ndigits - b.weight - 1, 0));
+    a.weight += shift;
+    b.weight += shift;
+
+    /* keep a >= b throughout */
+    if (cmp_abs(&a, &b) < 0)
+    {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    while (b.ndigits != 0 && !BUDGET_EXHAUSTED())
     {
-        newdig = div[i] + carry;
-        if (newdig < 0)
+        int64_t     x;
+        int64_t     y;
+        int64_t     A = 1;
+        int64_t     B = 0;
+        int64_t     C = 0;
+        int64_t     D = 1;
+
+        if ((a.weight + 1) * DEC_DIGITS <= 18)
         {
-            carry = -((-newdig - 1) / NBASE) - 1;
-            newdig -= carry * NBASE;
+            int64_t     ia;
+            int64_t     ib;
+
+            numericvar_to_int64(&a, &ia);
+            numericvar_to_int64(&b, &ib);
+            int64_to_numericvar((int64_t) gcd_uint64((uint64_t) ia,
+                                                     (uint64_t) ib), &a);
+            break;
         }
-        else if (newdig >= NBASE)
+
+        /* leading two digits of a, and the digits of b in the same place */
+        x = (int64_t) var_digit(&a, a.weight) * NBASE +
+            var_digit(&a, a.weight - 1);
+        y = (int64_t) var_digit(&b, a.weight) * NBASE +
+            var_digit(&b, a.weight - 1);
+
+        /*
+         * Run Euclid on the approximations for as long as the quotients
+         * they yield are certain to be the true ones.
+         */
+        while (y + C != 0 && y + D != 0)
         {
-            carry = newdig / NBASE;
-            newdig -= carry * NBASE;
+            int64_t     q = (x + A) / (y + C);
+            int64_t     r;
+
+            if (q != (x + B) / (y + D))
+                break;
+            r = A - q * C;
+            A = C;
+            C = r;
+            r = B - q * D;
+            B = D;
+            D = r;
+            r = x - q * y;
+            x = y;
+            y = r;
+        }
+
+        if (B == 0)
+        {
+            /* no step could be simulated; do one at full precision */
+            errcode = mod_var(&a, &b, &t);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                break;
+            tmp = a;
+            a = b;
+            b = t;
+            t = tmp;
         }
         else
-            carry = 0;
-        res_digits[i] = newdig;
+        {
+            /* (a, b) = (A*a + B*b, C*a + D*b) */
+            lehmer_combine(&a, &b, A, B, &t);
+            lehmer_combine(&a, &b, C, D, &u);
+            tmp = a;
+            a = t;
+            t = tmp;
+            tmp = b;
+            b = u;
+            u = tmp;
+        }
     }
-    Assert(carry == 0);
 
-    free(div);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        if (a.ndigits != 0)
+            a.weight -= shift;
+        a.dscale = rscale;
+        set_var_from_var(&a, result);
+    }
 
-    /*
-     * Finally, round the result to the requested precision.
-     */
-    result->weight = res_weight;
-    result->sign = res_sign;
+    numeric_dispose(&a);
+    numeric_dispose(&b);
+    numeric_dispose(&t);
+    numeric_dispose(&u);
 
-    /* Round to target rscale (and set result->dscale) */
-    if (round)
-        round_var(result, rscale);
-    else
-        trunc_var(result, rscale);
+    return errcode;
+}
 
-    /* Strip leading and trailing zeroes */
-    strip_var(result);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+/*
+ * lehmer_combine() -
+ *
+ *  Compute result = A * a + B * b for non-negative integers a >= b, where
+ *  the caller guarantees that the result is non-negative and not larger
+ *  than a.  |A| and |B| must be below NBASE^2, so that every product of a
+ *  coefficient and a digit fits comfortably in an int64.
+ */
+static void
+lehmer_combine(const numeric *a, const numeric *b, int64_t A, int64_t B,
+        numeric *result)
+{
+    int         ndigits = a->weight + 1;
+    int64_t     carry = 0;
+    int         i;
+
+    alloc_var(result, ndigits);
+    for (i = ndigits - 1; i >= 0; i--)
+    {
+        int         exponent = ndigits - 1 - i;
+        int64_t     val;
+
+        val = A * var_digit(a, exponent) + B * var_digit(b, exponent) + carry;
+        carry = val / NBASE;
+        val -= carry * NBASE;
+        if (val < 0)
+        {
+            val += NBASE;
+            carry--;
+        }
+        result->digits[i] = (NumericDigit) val;
+    }
+    Assert(carry == 0);
+
+    result->weight = a->weight;
+    result->sign = NUMERIC_POS;
+    result->dscale = 0;
+    strip_var(result);
 }
 
 
 /*
- * Default scale selection for division
+ * var_digit() -
  *
- * Returns the appropriate result scale for the division result.
+ *  Return the NBASE digit of var at the given NBASE exponent
  */
 static int
-select_div_scale(const numeric *var1, const numeric *var2)
+var_digit(const numeric *var, int exponent)
 {
-    int         weight1,
-                weight2,
-                qweight,
-                i;
-    NumericDigit firstdigit1,
-                firstdigit2;
-    int         rscale;
+    int         i = var->weight - exponent;
 
-    /*
-     * The result scale of a division isn't specified in any SQL standard. For
-     * PostgreSQL we select a result scale that will give at least
-     * NUMERIC_MIN_SIG_DIGITS significant digits, so that numeric gives a
-     * result no less accurate than double; but use a scale not less than
-     * either input's display scale.
-     */
+    if (i < 0 || i >= var->ndigits)
+        return 0;
+    return var->digits[i];
+}
 
-    /* Get the actual (normalized) weight and first digit of each input */
 
-    weight1 = 0;                /* values to use if var1 is zero */
-    firstdigit1 = 0;
-    for (i = 0; i < var1->ndigits; i++)
+/*
+ * gcd_uint64() -
+ *
+ *  Binary (Stein's) GCD of two unsigned 64-bit integers
+ */
+static uint64_t
+gcd_uint64(uint64_t u, uint64_t v)
+{
+    int         shift = 0;
+
+    if (u == 0)
+        return v;
+    if (v == 0)
+        return u;
+
+    while (((u | v) & 1) == 0)
     {
-        firstdigit1 = var1->digits[i];
-        if (firstdigit1 != 0)
-        {
-            weight1 = var1->weight - i;
-            break;
-        }
+        u >>= 1;
+        v >>= 1;
+        shift++;
     }
-
-    weight2 = 0;                /* values to use if var2 is zero */
-    firstdigit2 = 0;
-    for (i = 0; i < var2->ndigits; i++)
+    while ((u & 1) == 0)
+        u >>= 1;
+    do
     {
-        firstdigit2 = var2->digits[i];
-        if (firstdigit2 != 0)
+        while ((v & 1) == 0)
+            v >>= 1;
+        if (u > v)
         {
-            weight2 = var2->weight - i;
-            break;
+            uint64_t    tmp = u;
+
+            u = v;
+            v = tmp;
         }
+        v -= u;
+    } while (v != 0);
+
+    return u << shift;
+}
+
+
+/*
+ * rational_set_nan() -
+ *
+ *  Set a rational to NaN
+ */
+static void
+rational_set_nan(numeric_rational *rat)
+{
+    numeric_rational_dispose(rat);
+    rat->num = const_nan;
+    rat->den = const_one;
+}
+
+
+/*
+ * rational_store() -
+ *
+ *  Move num / den into result, taking over their digit buffers, and bring
+ *  the fraction into canonical form.  result may be one of the operands the
+ *  caller computed num and den from.
+ */
+static numeric_errcode_t
+rational_store(numeric *num, numeric *den, numeric_rational *result)
+{
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+
+    if (BUDGET_EXHAUSTED())
+        errcode = NUMERIC_ERRCODE_CANCELLED;
+    else if (den->ndigits == 0)
+        errcode = NUMERIC_ERRCODE_DIVISION_BY_ZERO;
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_dispose(num);
+        numeric_dispose(den);
+        return errcode;
     }
 
-    /*
-     * Estimate weight of quotient.  If the two first digits are equal, we
-     * can't be sure, but assume that var1 is less than var2.
-     */
-    qweight = weight1 - weight2;
-    if (firstdigit1 <= firstdigit2)
-        qweight--;
+    /* Keep the denominator positive */
+    if (den->sign == NUMERIC_NEG)
+    {
+        den->sign = NUMERIC_POS;
+        if (num->sign == NUMERIC_POS)
+            num->sign = NUMERIC_NEG;
+        else
+            num->sign = NUMERIC_POS;
+    }
 
-    /* Select result scale */
-    rscale = NUMERIC_MIN_SIG_DIGITS - qweight * DEC_DIGITS;
-    rscale = Max(rscale, var1->dscale);
-    rscale = Max(rscale, var2->dscale);
-    rscale = Max(rscale, NUMERIC_MIN_DISPLAY_SCALE);
-    rscale = Min(rscale, NUMERIC_MAX_DISPLAY_SCALE);
+    numeric_rational_dispose(result);
+    result->num = *num;
+    result->den = *den;
 
-    return rscale;
+    return rational_reduce(result);
 }
 
 
 /*
- * mod_var() -
+ * rational_reduce() -
  *
- *  Calculate the modulo of two numerics at variable level
+ *  Cancel common factors of a rational's numerator and denominator.
+ *
+ *  Common powers of NBASE show up as trailing zero digits and are cancelled
+ *  by adjusting the weights alone.  The GCD is computed only once the
+ *  fraction has grown past NUMERIC_RATIONAL_REDUCE_DIGITS digits, since for
+ *  small fractions it costs more than it saves.
  */
 static numeric_errcode_t
-mod_var(const numeric *var1, const numeric *var2, numeric *result)
+rational_reduce(numeric_rational *rat)
 {
-    numeric  tmp;
+    numeric  gcd;
+    int         shift;
     numeric_errcode_t errcode;
 
-    numeric_init(&tmp);
+    strip_var(&rat->num);
+    strip_var(&rat->den);
+    rat->num.dscale = 0;
+    rat->den.dscale = 0;
 
-    /* ---------
-     * We do this using the equation
-     *      mod(x,y) = x - trunc(x/y)*y
-     * div_var can be persuaded to give us trunc(x/y) directly.
-     * ----------
-     */
-    errcode = div_var(var1, var2, &tmp, 0, false);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (rat->num.ndigits == 0)
+    {
+        digitbuf_free(rat->den.buf);
+        rat->den = const_one;
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
 
-    mul_var(var2, &tmp, &tmp, var2->dscale);
+    shift = Min(rat->num.weight + 1 - rat->num.ndigits,
+                rat->den.weight + 1 - rat->den.ndigits);
+    rat->num.weight -= shift;
+    rat->den.weight -= shift;
 
-    sub_var(var1, &tmp, result);
+    if (rat->num.ndigits + rat->den.ndigits <= NUMERIC_RATIONAL_REDUCE_DIGITS)
+        return NUMERIC_ERRCODE_NO_ERROR;
 
-    numeric_dispose(&tmp);
-    return NUMERIC_ERRCODE_NO_ERROR;
+    numeric_init(&gcd);
+
+    errcode = gcd_var(&rat->num, &rat->den, &gcd);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR &&
+        cmp_var(&gcd, &const_one) != 0)
+    {
+        errcode = div_var(&rat->num, &gcd, &rat->num, 0, false);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = div_var(&rat->den, &gcd, &rat->den, 0, false);
+    }
+
+    numeric_dispose(&gcd);
+
+    return errcode;
 }
 
 
@@ -3549,7 +10072,7 @@ sqrt_var(const numeric *arg, numeric *result, int rscale)
         add_var(result, &tmp_val, result);
         mul_var(result, &const_zero_point_five, result, local_rscale);
 
-        if (cmp_var(&last_val, result) == 0)
+        if (cmp_var(&last_val, result) == 0 || BUDGET_EXHAUSTED())
             break;
         set_var_from_var(result, &last_val);
     }
@@ -3558,6 +10081,9 @@ sqrt_var(const numeric *arg, numeric *result, int rscale)
     numeric_dispose(&tmp_val);
     numeric_dispose(&tmp_arg);
 
+    if (BUDGET_EXHAUSTED())
+        return NUMERIC_ERRCODE_CANCELLED;
+
     /* Round to requested precision */
     round_var(result, rscale);
 
@@ -3574,6 +10100,7 @@ static numeric_errcode_t
 exp_var(const numeric *arg, numeric *result, int rscale)
 {
     numeric  x;
+    numeric_errcode_t errcode;
     int         xintval;
     bool        xneg = false;
     int         local_rscale;
@@ -3611,26 +10138,40 @@ exp_var(const numeric *arg, numeric *result, int rscale)
         x.weight--;
         /* Guard against overflow */
         if (xintval >= NUMERIC_MAX_RESULT_SCALE * 3)
+        {
+            numeric_dispose(&x);
             return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+        }
     }
 
     /* Select an appropriate scale for internal calculation */
     local_rscale = rscale + MUL_GUARD_DIGITS * 2;
 
     /* Compute e^xfrac */
-    exp_var_internal(&x, result, local_rscale);
+    errcode = exp_var_internal(&x, result, local_rscale);
 
     /* If there's an integer part, multiply by e^xint */
-    if (xintval > 0)
+    if (xintval > 0 && errcode == NUMERIC_ERRCODE_NO_ERROR)
     {
         numeric  e;
 
         numeric_init(&e);
-        exp_var_internal(&const_one, &e, local_rscale);
-        power_var_int(&e, xintval, &e, local_rscale);
-        mul_var(&e, result, result, local_rscale);
+        if (current_series != NULL)
+            errcode = series_e(local_rscale, &e);
+        else
+            errcode = exp_var_internal(&const_one, &e, local_rscale);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        {
+            power_var_int(&e, xintval, &e, local_rscale);
+            mul_var(&e, result, result, local_rscale);
+        }
         numeric_dispose(&e);
     }
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        numeric_dispose(&x);
+        return errcode;
+    }
 
     /* Compensate for input sign, and round to requested rscale */
     if (xneg)
@@ -3652,7 +10193,7 @@ exp_var(const numeric *arg, numeric *result, int rscale)
  * NB: the result should be good to at least rscale digits, but it has
  * *not* been rounded off; the caller must do that if wanted.
  */
-static void
+static numeric_errcode_t
 exp_var_internal(const numeric *arg, numeric *result, int rscale)
 {
     numeric  x;
@@ -3660,6 +10201,8 @@ exp_var_internal(const numeric *arg, numeric *result, int rscale)
     numeric  ifac;
     numeric  elem;
     numeric  ni;
+    const numeric *term;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
     int         ndiv2 = 0;
     int         local_rscale;
 
@@ -3696,21 +10239,43 @@ exp_var_internal(const numeric *arg, numeric *result, int rscale)
     set_var_from_var(&const_one, &ifac);
     set_var_from_var(&const_one, &ni);
 
-    for (;;)
+    if (current_series != NULL)
     {
-        add_var(&ni, &const_one, &ni);
-        mul_var(&xpow, &x, &xpow, local_rscale);
-        mul_var(&ifac, &ni, &ifac, 0);
-        div_var_fast(&xpow, &ifac, &elem, local_rscale, true);
+        /* In a batch, divide by the shared k! instead of building it */
+        int         k;
 
-        if (elem.ndigits == 0)
-            break;
+        for (k = 2;; k++)
+        {
+            mul_var(&xpow, &x, &xpow, local_rscale);
+            errcode = series_term(&current_series->fact, false, k, &term);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                break;
+            div_var_fast(&xpow, term, &elem, local_rscale, true);
 
-        add_var(result, &elem, result);
+            if (elem.ndigits == 0)
+                break;
+
+            add_var(result, &elem, result);
+        }
+    }
+    else
+    {
+        for (;;)
+        {
+            add_var(&ni, &const_one, &ni);
+            mul_var(&xpow, &x, &xpow, local_rscale);
+            mul_var(&ifac, &ni, &ifac, 0);
+            div_var_fast(&xpow, &ifac, &elem, local_rscale, true);
+
+            if (elem.ndigits == 0)
+                break;
+
+            add_var(result, &elem, result);
+        }
     }
 
     /* Compensate for argument range reduction */
-    while (ndiv2-- > 0)
+    while (ndiv2-- > 0 && errcode == NUMERIC_ERRCODE_NO_ERROR)
         mul_var(result, result, result, local_rscale);
 
     numeric_dispose(&x);
@@ -3718,6 +10283,8 @@ exp_var_internal(const numeric *arg, numeric *result, int rscale)
     numeric_dispose(&ifac);
     numeric_dispose(&elem);
     numeric_dispose(&ni);
+
+    return errcode;
 }
 
 
@@ -3734,8 +10301,11 @@ ln_var(const numeric *arg, numeric *result, int rscale)
     numeric  ni;
     numeric  elem;
     numeric  fact;
+    const numeric *term;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
     int         local_rscale;
     int         cmp;
+    int         k;
 
     cmp = cmp_var(arg, &const_zero);
     if (cmp <= 0)
@@ -3752,14 +10322,17 @@ ln_var(const numeric *arg, numeric *result, int rscale)
     set_var_from_var(arg, &x);
     set_var_from_var(&const_two, &fact);
 
-    /* Reduce input into range 0.9 < x < 1.1 */
-    while (cmp_var(&x, &const_zero_point_nine) <= 0)
+    /*
+     * Reduce input into range 0.9 < x < 1.1.  A cancelled sqrt_var() leaves
+     * x meaningless, so stop as soon as the work budget runs out.
+     */
+    while (cmp_var(&x, &const_zero_point_nine) <= 0 && !BUDGET_EXHAUSTED())
     {
         local_rscale++;
         sqrt_var(&x, &x, local_rscale);
         mul_var(&fact, &const_two, &fact, 0);
     }
-    while (cmp_var(&x, &const_one_point_one) >= 0)
+    while (cmp_var(&x, &const_one_point_one) >= 0 && !BUDGET_EXHAUSTED())
     {
         local_rscale++;
         sqrt_var(&x, &x, local_rscale);
@@ -3785,30 +10358,161 @@ ln_var(const numeric *arg, numeric *result, int rscale)
 
     set_var_from_var(&const_one, &ni);
 
-    for (;;)
+    for (k = 1;; k++)
     {
-        add_var(&ni, &const_two, &ni);
         mul_var(&xx, &x, &xx, local_rscale);
-        div_var_fast(&xx, &ni, &elem, local_rscale, true);
+        if (current_series != NULL)
+        {
+            /* In a batch, divide by the shared 2k+1 */
+            errcode = series_term(&current_series->odd, true, k, &term);
+            if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+                break;
+            div_var_fast(&xx, term, &elem, local_rscale, true);
+        }
+        else
+        {
+            add_var(&ni, &const_two, &ni);
+            div_var_fast(&xx, &ni, &elem, local_rscale, true);
+        }
 
         if (elem.ndigits == 0)
             break;
 
-        add_var(result, &elem, result);
+        add_var(result, &elem, result);
+
+        if (elem.weight < (result->weight - local_rscale * 2 / DEC_DIGITS))
+            break;
+    }
+
+    /* Compensate for argument range reduction, round to requested rscale */
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        mul_var(result, &fact, result, rscale);
+
+    numeric_dispose(&x);
+    numeric_dispose(&xx);
+    numeric_dispose(&ni);
+    numeric_dispose(&elem);
+    numeric_dispose(&fact);
+
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+    if (BUDGET_EXHAUSTED())
+        return NUMERIC_ERRCODE_CANCELLED;
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * series_attach() -
+ *
+ *  Make tables, freshly initialized, the series tables of the calling
+ *  thread and return the previous ones.
+ */
+static series_tables *
+series_attach(series_tables *tables)
+{
+    series_tables *prev = current_series;
+
+    memset(tables, 0, sizeof(*tables));
+    tables->e_rscale = -1;
+    numeric_init(&tables->e);
+
+    current_series = tables;
+    return prev;
+}
+
+
+/*
+ * series_detach() -
+ *
+ *  Restore the series tables prev and free tables.
+ */
+static void
+series_detach(series_tables *tables, series_tables *prev)
+{
+    series_table *table;
+    int         i;
+
+    current_series = prev;
+
+    for (table = &tables->fact; table <= &tables->odd; table++)
+    {
+        for (i = 0; i < table->nterms; i++)
+            numeric_dispose(&table->terms[i]);
+        free(table->terms);
+    }
+    numeric_dispose(&tables->e);
+}
+
+
+/*
+ * series_term() -
+ *
+ *  Set *term to term k of table, 2k+1 if odd or else k!
+ */
+static numeric_errcode_t
+series_term(series_table *table, bool odd, int k, const numeric **term)
+{
+    numeric  factor;
+    numeric    *terms;
+    int         capacity;
+    int         n;
+
+    if (k >= table->capacity)
+    {
+        capacity = Max(k + 1, table->capacity * 2);
+        terms = (numeric *) realloc(table->terms, capacity * sizeof(numeric));
+        if (!terms)
+            return NUMERIC_ERRCODE_OUT_OF_MEMORY;
+        table->terms = terms;
+        table->capacity = capacity;
+    }
 
-        if (elem.weight < (result->weight - local_rscale * 2 / DEC_DIGITS))
-            break;
+    numeric_init(&factor);
+    while (table->nterms <= k)
+    {
+        n = table->nterms++;
+        numeric_init(&table->terms[n]);
+        if (odd)
+            int64_to_numericvar(2 * (int64_t) n + 1, &table->terms[n]);
+        else if (n == 0)
+            set_var_from_var(&const_one, &table->terms[n]);
+        else
+        {
+            /* n! = (n-1)! * n, exactly */
+            int64_to_numericvar(n, &factor);
+            mul_var(&table->terms[n - 1], &factor, &table->terms[n], 0);
+        }
     }
+    numeric_dispose(&factor);
 
-    /* Compensate for argument range reduction, round to requested rscale */
-    mul_var(result, &fact, result, rscale);
+    *term = &table->terms[k];
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
 
-    numeric_dispose(&x);
-    numeric_dispose(&xx);
-    numeric_dispose(&ni);
-    numeric_dispose(&elem);
-    numeric_dispose(&fact);
 
+/*
+ * series_e() -
+ *
+ *  Set result to e, from the current series tables, computed as
+ *  exp_var_internal() would at rscale.
+ */
+static numeric_errcode_t
+series_e(int rscale, numeric *result)
+{
+    series_tables *tables = current_series;
+    numeric_errcode_t errcode;
+
+    if (tables->e_rscale != rscale)
+    {
+        tables->e_rscale = -1;
+        errcode = exp_var_internal(&const_one, &tables->e, rscale);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        tables->e_rscale = rscale;
+    }
+    set_var_from_var(&tables->e, result);
     return NUMERIC_ERRCODE_NO_ERROR;
 }
 
@@ -3854,24 +10558,24 @@ log_var(const numeric *base, const numeric *num, numeric *result)
 
     /* Form natural logarithms */
     errcode = ln_var(base, &ln_base, local_rscale);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
-    errcode = ln_var(num, &ln_num, local_rscale);
-    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
-        return errcode;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = ln_var(num, &ln_num, local_rscale);
 
-    ln_base.dscale = rscale;
-    ln_num.dscale = rscale;
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        ln_base.dscale = rscale;
+        ln_num.dscale = rscale;
 
-    /* Select scale for division result */
-    rscale = select_div_scale(&ln_num, &ln_base);
+        /* Select scale for division result */
+        rscale = select_div_scale(&ln_num, &ln_base);
 
-    div_var_fast(&ln_num, &ln_base, result, rscale, true);
+        div_var_fast(&ln_num, &ln_base, result, rscale, true);
+    }
 
     numeric_dispose(&ln_num);
     numeric_dispose(&ln_base);
 
-    return NUMERIC_ERRCODE_NO_ERROR;
+    return errcode;
 }
 
 
@@ -4070,6 +10774,428 @@ power_var_int(const numeric *base, int exp, numeric *result, int rscale)
 }
 
 
+/*
+ * pi_var() -
+ *
+ *  Set result to pi rounded to rscale digits, from pi_cache if possible.
+ *  Otherwise pi is computed with Machin's formula
+ *
+ *      pi = 16 * atan(1/5) - 4 * atan(1/239)
+ *
+ *  and the new value replaces the cached one.
+ */
+static void
+pi_var(numeric *result, int rscale)
+{
+    pthread_mutex_lock(&pi_cache.lock);
+
+    if (pi_cache.rscale < rscale)
+    {
+        numeric  a5;
+        numeric  a239;
+        int         local_rscale = rscale + MUL_GUARD_DIGITS * 2;
+        digit_pool *pool;
+
+        numeric_init(&a5);
+        numeric_init(&a239);
+
+        atan_inverse_int(5, &a5, local_rscale);
+        atan_inverse_int(239, &a239, local_rscale);
+
+        /* 4 * (4 * atan(1/5) - atan(1/239)) */
+        add_var(&a5, &a5, &a5);
+        add_var(&a5, &a5, &a5);
+        sub_var(&a5, &a239, &a5);
+        add_var(&a5, &a5, &a5);
+        add_var(&a5, &a5, &a5);
+        round_var(&a5, rscale);
+
+        /* a value cut short by the work budget must not be cached */
+        if (BUDGET_EXHAUSTED())
+        {
+            set_var_from_var(&a5, result);
+            numeric_dispose(&a5);
+            numeric_dispose(&a239);
+            pthread_mutex_unlock(&pi_cache.lock);
+            return;
+        }
+
+        pool = digit_pool_attach(NULL);
+        set_var_from_var(&a5, &pi_cache.value);
+        digit_pool_attach(pool);
+        pi_cache.rscale = rscale;
+
+        numeric_dispose(&a5);
+        numeric_dispose(&a239);
+    }
+
+    set_var_from_var(&pi_cache.value, result);
+    round_var(result, rscale);
+
+    pthread_mutex_unlock(&pi_cache.lock);
+}
+
+
+/*
+ * atan_inverse_int() -
+ *
+ *  Compute atan(1/n) for an integer n > 1 using the Taylor series
+ *
+ *      atan(1/n) = 1/n - 1/(3 n^3) + 1/(5 n^5) - ...
+ *
+ *  Each term only takes divisions by small integers.
+ *
+ * NB: the result is not rounded; the caller must do that if wanted.
+ */
+static void
+atan_inverse_int(int n, numeric *result, int rscale)
+{
+    numeric  power;
+    numeric  nsquare;
+    numeric  ni;
+    numeric  elem;
+    int         local_rscale = rscale + 8;
+    int         i;
+
+    numeric_init(&power);
+    numeric_init(&nsquare);
+    numeric_init(&ni);
+    numeric_init(&elem);
+
+    int64_to_numericvar((int64_t) n * n, &nsquare);
+    int64_to_numericvar(n, &ni);
+
+    /* power = 1 / n^(2i+1) */
+    div_var(&const_one, &ni, &power, local_rscale, false);
+    set_var_from_var(&power, result);
+
+    for (i = 1;; i++)
+    {
+        div_var(&power, &nsquare, &power, local_rscale, false);
+        int64_to_numericvar(2 * i + 1, &ni);
+        div_var(&power, &ni, &elem, local_rscale, false);
+
+        if (elem.ndigits == 0)
+            break;
+
+        if (i % 2)
+            sub_var(result, &elem, result);
+        else
+            add_var(result, &elem, result);
+    }
+
+    numeric_dispose(&power);
+    numeric_dispose(&nsquare);
+    numeric_dispose(&ni);
+    numeric_dispose(&elem);
+}
+
+
+/*
+ * sin_cos_var() -
+ *
+ *  Compute sin(x), or cos(x) if cosine is true
+ *
+ *  x is first reduced by the nearest multiple k of pi/2 to r, with
+ *  |r| <= pi/4; pi is taken with enough extra digits to cover the integral
+ *  digits of x.  Depending on k mod 4 the result is then +/- sin(r) or
+ *  +/- cos(r), where cos(r) = sqrt(1 - sin(r)^2) is well conditioned in
+ *  that range.
+ */
+static numeric_errcode_t
+sin_cos_var(const numeric *arg, numeric *result, int rscale, bool cosine)
+{
+    numeric  half_pi;
+    numeric  k;
+    numeric  r;
+    numeric  tmp;
+    int         xdigits;
+    int         local_rscale;
+    int         quadrant;
+    numeric_errcode_t errcode;
+
+    xdigits = (arg->ndigits > 0) ? Max((arg->weight + 1) * DEC_DIGITS, 0) : 0;
+    if (xdigits > NUMERIC_MAX_PRECISION)
+        return NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE;
+
+    local_rscale = rscale + MUL_GUARD_DIGITS * 2;
+
+    numeric_init(&half_pi);
+    numeric_init(&k);
+    numeric_init(&r);
+    numeric_init(&tmp);
+
+    /* k = round(x / (pi/2)), r = x - k * pi/2 */
+    pi_var(&half_pi, local_rscale + xdigits + DEC_DIGITS);
+    mul_var(&half_pi, &const_zero_point_five, &half_pi, half_pi.dscale + 1);
+    div_var(arg, &half_pi, &k, 0, true);
+    mul_var(&k, &half_pi, &tmp, half_pi.dscale);
+    sub_var(arg, &tmp, &r);
+
+    /* k mod 4, from the last two decimal digits since 4 divides 100 */
+    quadrant = (int) (((int64_t) var_digit(&k, 1) * NBASE +
+                       var_digit(&k, 0)) % 4);
+    if (k.sign == NUMERIC_NEG)
+        quadrant = (4 - quadrant) % 4;
+    if (cosine)
+        quadrant = (quadrant + 1) % 4;
+
+    sin_var_internal(&r, &tmp, local_rscale);
+    if (quadrant % 2)
+    {
+        /* we need cos(r) */
+        mul_var(&tmp, &tmp, &r, local_rscale);
+        sub_var(&const_one, &r, &r);
+        errcode = sqrt_var(&r, &tmp, local_rscale);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+    }
+    if (quadrant >= 2 && tmp.ndigits > 0)
+        tmp.sign = (tmp.sign == NUMERIC_POS) ? NUMERIC_NEG : NUMERIC_POS;
+
+    round_var(&tmp, rscale);
+    set_var_from_var(&tmp, result);
+
+    numeric_dispose(&half_pi);
+    numeric_dispose(&k);
+    numeric_dispose(&r);
+    numeric_dispose(&tmp);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * sin_var_internal() -
+ *
+ *  Compute sin(x), where |x| <= 1
+ *
+ *  x is divided by 3 until it is below 0.01, the Taylor series
+ *
+ *      sin(x) = x - x^3/3! + x^5/5! - ...
+ *
+ *  is summed, and the triple-angle formula sin(3x) = 3 sin(x) - 4 sin(x)^3
+ *  undoes the reduction.  Each tripling can magnify the error by 3, which
+ *  costs a guard digit per step.
+ *
+ * NB: the result is not rounded; the caller must do that if wanted.
+ */
+static void
+sin_var_internal(const numeric *arg, numeric *result, int rscale)
+{
+    numeric  x;
+    numeric  xsquare;
+    numeric  xpow;
+    numeric  ifac;
+    numeric  elem;
+    numeric  ni;
+    numeric  three;
+    int         ntriple = 0;
+    int         local_rscale;
+    bool        subtract = true;
+
+    numeric_init(&x);
+    numeric_init(&xsquare);
+    numeric_init(&xpow);
+    numeric_init(&ifac);
+    numeric_init(&elem);
+    numeric_init(&ni);
+    numeric_init(&three);
+
+    set_var_from_var(arg, &x);
+    int64_to_numericvar(3, &three);
+
+    local_rscale = rscale + 8;
+
+    /* Reduce input into range |x| <= 0.01 */
+    while (cmp_abs(&x, &const_zero_point_01) > 0)
+    {
+        ntriple++;
+        local_rscale++;
+        div_var(&x, &three, &x, local_rscale, false);
+    }
+
+    set_var_from_var(&x, result);
+    set_var_from_var(&x, &xpow);
+    mul_var(&x, &x, &xsquare, local_rscale);
+    set_var_from_var(&const_one, &ifac);
+    set_var_from_var(&const_one, &ni);
+
+    for (;;)
+    {
+        mul_var(&xpow, &xsquare, &xpow, local_rscale);
+        add_var(&ni, &const_one, &ni);
+        mul_var(&ifac, &ni, &ifac, 0);
+        add_var(&ni, &const_one, &ni);
+        mul_var(&ifac, &ni, &ifac, 0);
+        div_var(&xpow, &ifac, &elem, local_rscale, true);
+
+        if (elem.ndigits == 0)
+            break;
+
+        if (subtract)
+            sub_var(result, &elem, result);
+        else
+            add_var(result, &elem, result);
+        subtract = !subtract;
+    }
+
+    /* Compensate for argument range reduction: s = 3s - 4s^3 */
+    while (ntriple-- > 0)
+    {
+        mul_var(result, result, &xsquare, local_rscale);
+        mul_var(&xsquare, result, &xsquare, local_rscale);
+        add_var(&xsquare, &xsquare, &xsquare);
+        add_var(&xsquare, &xsquare, &xsquare);
+        mul_var(result, &three, result, result->dscale);
+        sub_var(result, &xsquare, result);
+    }
+
+    numeric_dispose(&x);
+    numeric_dispose(&xsquare);
+    numeric_dispose(&xpow);
+    numeric_dispose(&ifac);
+    numeric_dispose(&elem);
+    numeric_dispose(&ni);
+    numeric_dispose(&three);
+}
+
+
+/*
+ * atan_var() -
+ *
+ *  Compute atan(x)
+ *
+ *  Arguments beyond 1 in absolute value use
+ *  atan(x) = sign(x) * pi/2 - atan(1/x).
+ */
+static numeric_errcode_t
+atan_var(const numeric *arg, numeric *result, int rscale)
+{
+    numeric  x;
+    numeric  half_pi;
+    int         local_rscale = rscale + MUL_GUARD_DIGITS * 2;
+    numeric_errcode_t errcode;
+
+    if (cmp_abs(arg, &const_one) <= 0)
+    {
+        errcode = atan_var_internal(arg, result, local_rscale);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            return errcode;
+        round_var(result, rscale);
+        return NUMERIC_ERRCODE_NO_ERROR;
+    }
+
+    numeric_init(&x);
+    numeric_init(&half_pi);
+
+    div_var(&const_one, arg, &x, local_rscale, false);
+    errcode = atan_var_internal(&x, &x, local_rscale);
+    if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        return errcode;
+
+    pi_var(&half_pi, local_rscale);
+    mul_var(&half_pi, &const_zero_point_five, &half_pi, local_rscale + 1);
+    half_pi.sign = arg->sign;
+    sub_var(&half_pi, &x, result);
+    round_var(result, rscale);
+
+    numeric_dispose(&x);
+    numeric_dispose(&half_pi);
+
+    return NUMERIC_ERRCODE_NO_ERROR;
+}
+
+
+/*
+ * atan_var_internal() -
+ *
+ *  Compute atan(x), where |x| <= 1
+ *
+ *  x is reduced below 0.01 with the half-angle identity
+ *
+ *      atan(x) = 2 * atan(x / (1 + sqrt(1 + x^2)))
+ *
+ *  and the Taylor series atan(x) = x - x^3/3 + x^5/5 - ... is summed.  Each
+ *  halving doubles the error, which costs a guard digit per step.
+ *
+ * NB: the result is not rounded; the caller must do that if wanted.
+ */
+static numeric_errcode_t
+atan_var_internal(const numeric *arg, numeric *result, int rscale)
+{
+    numeric  x;
+    numeric  xsquare;
+    numeric  xpow;
+    numeric  elem;
+    numeric  ni;
+    int         nhalve = 0;
+    int         local_rscale;
+    bool        subtract = true;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+
+    numeric_init(&x);
+    numeric_init(&xsquare);
+    numeric_init(&xpow);
+    numeric_init(&elem);
+    numeric_init(&ni);
+
+    set_var_from_var(arg, &x);
+
+    local_rscale = rscale + 8;
+
+    /* Reduce input into range |x| <= 0.01 */
+    while (cmp_abs(&x, &const_zero_point_01) > 0)
+    {
+        nhalve++;
+        local_rscale++;
+        mul_var(&x, &x, &xsquare, local_rscale);
+        add_var(&xsquare, &const_one, &xsquare);
+        errcode = sqrt_var(&xsquare, &elem, local_rscale);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+            break;
+        add_var(&elem, &const_one, &elem);
+        div_var(&x, &elem, &x, local_rscale, true);
+    }
+
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+    {
+        set_var_from_var(&x, result);
+        set_var_from_var(&x, &xpow);
+        mul_var(&x, &x, &xsquare, local_rscale);
+        set_var_from_var(&const_one, &ni);
+
+        for (;;)
+        {
+            mul_var(&xpow, &xsquare, &xpow, local_rscale);
+            add_var(&ni, &const_two, &ni);
+            div_var(&xpow, &ni, &elem, local_rscale, true);
+
+            if (elem.ndigits == 0)
+                break;
+
+            if (subtract)
+                sub_var(result, &elem, result);
+            else
+                add_var(result, &elem, result);
+            subtract = !subtract;
+        }
+
+        /* Compensate for argument range reduction */
+        while (nhalve-- > 0)
+            add_var(result, result, result);
+    }
+
+    numeric_dispose(&x);
+    numeric_dispose(&xsquare);
+    numeric_dispose(&xpow);
+    numeric_dispose(&elem);
+    numeric_dispose(&ni);
+
+    return errcode;
+}
+
+
 /* ----------------------------------------------------------------------
  *
  * Following are the lowest level functions that operate unsigned
@@ -4405,7 +11531,7 @@ round_var(numeric *var, int rscale)
 #endif
 
             /* Propagate carry if needed */
-            while (carry)
+            while (carry && ndigits > 0)
             {
                 carry += digits[--ndigits];
                 if (carry >= NBASE)
@@ -4420,12 +11546,15 @@ round_var(numeric *var, int rscale)
                 }
             }
 
-            if (ndigits < 0)
+            /*
+             * A carry out of the first digit leaves the kept digits all
+             * zero, so the value is a power of NBASE and needs no digit in
+             * front of them: var may be rounded in a buffer of exact size.
+             */
+            if (carry)
             {
-                Assert(ndigits == -1);  /* better not have added > 1 digit */
-                Assert(var->digits > var->buf);
-                var->digits--;
-                var->ndigits++;
+                digits[0] = 1;
+                var->ndigits = 1;
                 var->weight++;
             }
         }
@@ -14,6 +14,7 @@
 #ifndef _PG_NUMERIC_H_
 #define _PG_NUMERIC_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include "bool.h"
 
@@ -150,14 +151,257 @@ typedef struct numeric
 #define NUMERIC_IS_ZERO(n)  ((n)->ndigits == 0)
 
 
+/* ----------
+ * numeric_compact is a 16-byte (on LP64) storage form of a numeric, for
+ * big in-memory tables.  weight is kept in an int16, the range make_result
+ * already enforces, and sign and dscale share one uint16 as in the
+ * PostgreSQL on-disk header, which limits dscale to
+ * NUMERIC_COMPACT_DSCALE_MASK.  There is no buf: digits is the start of
+ * the allocation, with no spare digit in front.
+ *
+ * Compact values are fed to the arithmetic through numeric_compact_view(),
+ * which makes a numeric sharing the same digits without copying them.
+ * A view may be passed as an input to any function, but never as a result.
+ * ----------
+ */
+typedef struct numeric_compact
+{
+    NumericDigit *digits;       /* base-NBASE digits */
+    int32_t     ndigits;        /* # of digits in digits[] - can be 0! */
+    int16_t     weight;         /* weight of first digit */
+    uint16_t    sign_dscale;    /* sign | display scale */
+} numeric_compact;
+
+#define NUMERIC_COMPACT_SIGN_MASK   0xC000
+#define NUMERIC_COMPACT_DSCALE_MASK 0x3FFF
+
+
+/* ----------
+ * Sort keys are byte strings whose memcmp() order is the numeric_cmp()
+ * order, for storage engines and collations that only compare bytes.
+ * Equal values get equal keys whatever their dscale, and a key that is a
+ * prefix of another is the smaller, so keys may be compared as a whole
+ * or within a longer composite key.
+ *
+ * A key is a class byte (negative, zero, positive, NaN), then for nonzero
+ * values the weight and each base-NBASE digit as big-endian 16-bit words
+ * and a terminating word, all bit-inverted for negative values.
+ * ----------
+ */
+
+
+/* ----------
+ * numeric_rational is an exact fraction num / den of two integral numerics.
+ *
+ * It lets a chain of additions, subtractions, multiplications and divisions
+ * be carried out without any rounding; the single rounding division happens
+ * only in numeric_rational_to_numeric().  den is always positive, so the
+ * sign of the value is the sign of num.  A NaN rational has a NaN num.
+ *
+ * The fraction is kept in lowest terms only lazily: common powers of NBASE
+ * are always cancelled (that is free), but a full GCD reduction is done only
+ * once num and den together grow beyond NUMERIC_RATIONAL_REDUCE_DIGITS
+ * NBASE digits.
+ * ----------
+ */
+typedef struct numeric_rational
+{
+    numeric     num;            /* numerator, integral */
+    numeric     den;            /* denominator, integral and > 0 */
+} numeric_rational;
+
+#define NUMERIC_RATIONAL_REDUCE_DIGITS  32
+
+
 typedef enum {
     NUMERIC_ERRCODE_NO_ERROR,
     NUMERIC_ERRCODE_DIVISION_BY_ZERO,
     NUMERIC_ERRCODE_INVALID_ARGUMENT,
     NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE,
-    NUMERIC_ERRCODE_OUT_OF_MEMORY
+    NUMERIC_ERRCODE_OUT_OF_MEMORY,
+    NUMERIC_ERRCODE_BUFFER_TOO_SMALL,
+    NUMERIC_ERRCODE_CANCELLED
 } numeric_errcode_t;
 
+/*
+ * Operations understood by numeric_result_bound()
+ */
+typedef enum {
+    NUMERIC_OP_ADD,
+    NUMERIC_OP_SUB,
+    NUMERIC_OP_MUL,
+    NUMERIC_OP_DIV
+} numeric_op_t;
+
+/*
+ * Functions whose results can be memoised by the transcendental cache
+ */
+typedef enum {
+    NUMERIC_CACHE_SQRT,
+    NUMERIC_CACHE_EXP,
+    NUMERIC_CACHE_LN,
+    NUMERIC_CACHE_POWER
+} numeric_cache_op_t;
+
+/* ----------
+ * to_char-style output formats (formatting.c)
+ *
+ * A numeric_format is a compiled pattern; it is immutable once compiled and
+ * may be shared between threads.  NULL strings in a numeric_format_locale
+ * are not allowed; pass a NULL locale to get "$", "." and ",".
+ * ----------
+ */
+typedef struct numeric_format numeric_format;
+
+typedef struct numeric_format_locale
+{
+    const char *currency_symbol;    /* L */
+    const char *decimal_point;      /* D */
+    const char *thousands_sep;      /* G */
+} numeric_format_locale;
+
+/* ----------
+ * Text export
+ *
+ * numeric_write_text() appends rows of numerics as delimited text, such
+ * as CSV or TSV, to a numeric_textbuf and grows it as needed.  Start from
+ * a zeroed numeric_textbuf, reuse it by resetting len, and free data when
+ * done.  data is kept NUL-terminated.
+ *
+ * When quote is set, a field is quoted if it contains the quote, the
+ * delimiter, the newline, a CR or a LF, or always if force_quote is set;
+ * quotes inside it are doubled.  NULL fields are never quoted, so that
+ * they can be told apart from an empty null_text.
+ * ----------
+ */
+typedef struct numeric_textbuf
+{
+    char       *data;
+    size_t      len;            /* bytes used, not counting the NUL */
+    size_t      cap;            /* bytes allocated */
+} numeric_textbuf;
+
+typedef struct numeric_text_options
+{
+    const char *delimiter;      /* between fields; "," if NULL */
+    const char *newline;        /* after each row; "\n" if NULL */
+    char        quote;          /* quote character, or '\0' for none */
+    bool        force_quote;    /* quote every non-NULL field */
+    const char *nan_text;       /* "NaN" if NULL */
+    const char *null_text;      /* "" if NULL */
+} numeric_text_options;
+
+/* ----------
+ * Histogram buckets
+ *
+ * A numeric_buckets assigns operands to buckets the way width_bucket()
+ * does, without arithmetic per operand.  It is immutable once prepared
+ * and may be shared between threads.
+ * ----------
+ */
+typedef struct numeric_buckets numeric_buckets;
+
+/* ----------
+ * Compiled formulas (formula.c)
+ * ----------
+ */
+typedef struct numeric_formula numeric_formula;
+
+/* ----------
+ * Work budgets
+ *
+ * A numeric_budget bounds the work done by the calling thread while it is
+ * attached with numeric_budget_attach().  remaining counts digit
+ * operations (roughly one NBASE digit multiply-add each), -1 meaning no
+ * limit.  Once it runs out, or numeric_budget_cancel() is called from any
+ * thread, the operation in progress and every later one return
+ * NUMERIC_ERRCODE_CANCELLED until the budget is detached.
+ * ----------
+ */
+typedef struct numeric_budget
+{
+    int         cancelled;      /* sticky; set by cancel or exhaustion, and
+                                 * only accessed atomically */
+    int64_t     remaining;      /* digit operations left, -1 if unlimited */
+} numeric_budget;
+
+/* ----------
+ * Exact accumulators
+ *
+ * A numeric_accum sums native integers, doubles and numerics without
+ * rounding.  Integers are added into a 128-bit running sum (64-bit where
+ * the compiler has no 128-bit type) that is spilled into the numeric sum
+ * only when it would overflow.  Doubles are added by their exact binary
+ * value into dbl[], a fixed-point superaccumulator of 32-bit limbs
+ * starting at 2^-1074, the smallest subnormal; each limb is an int64_t so
+ * carries need to be propagated only every 2^30 additions.
+ * ----------
+ */
+#ifdef __SIZEOF_INT128__
+#define NUMERIC_HAVE_INT128
+typedef __int128 numeric_int128;
+#endif
+
+#define NUMERIC_ACCUM_DBL_LIMBS     68
+
+typedef struct numeric_accum
+{
+#ifdef NUMERIC_HAVE_INT128
+    numeric_int128 isum;        /* pending integer sum */
+#else
+    int64_t     isum;
+#endif
+    numeric     sum;            /* spilled integers and added numerics */
+    int64_t     dbl[NUMERIC_ACCUM_DBL_LIMBS];   /* doubles, LSB first */
+    int32_t     dbl_pending;    /* additions since carries were propagated */
+    bool        nan;            /* a NaN was added */
+} numeric_accum;
+
+/* ----------
+ * Aggregate states
+ *
+ * A numeric_agg holds what sum(), avg(), variance() and friends need:
+ * the row count, exact sums of the values and of their squares, and the
+ * extremes.  Partial states built on different workers can be combined
+ * with numeric_agg_merge() in any order, and shipped between processes
+ * with numeric_agg_serialize()/numeric_agg_deserialize(), whose byte
+ * format does not depend on the host.  min and max are only meaningful
+ * when count > 0; NaN inputs sort above everything, as in numeric_cmp().
+ * ----------
+ */
+typedef struct numeric_agg
+{
+    int64_t     count;          /* number of values added */
+    numeric_accum sum;          /* sum of the values */
+    numeric_accum sumsq;        /* sum of their squares */
+    numeric     min;            /* smallest value */
+    numeric     max;            /* largest value */
+} numeric_agg;
+
+/* ----------
+ * numeric_array is a column of n values whose digits all live in one
+ * allocation, digitbuf.  The values are views into it (their buf is
+ * NULL): read them, or copy them with numeric_plus(), but do not dispose
+ * of them or pass them as results.  numeric_array_dispose() frees the
+ * whole array.
+ * ----------
+ */
+typedef struct numeric_array
+{
+    int         n;
+    numeric    *values;
+    NumericDigit *digitbuf;
+} numeric_array;
+
+typedef struct numeric_cache_stats
+{
+    uint64_t    hits;           /* lookups answered from the cache */
+    uint64_t    misses;         /* lookups that had to compute */
+    uint64_t    evictions;      /* entries dropped to stay within capacity */
+    int         nentries;       /* entries currently cached */
+    int         capacity;       /* maximum entries, 0 if disabled */
+} numeric_cache_stats;
+
 void numeric_init(numeric *var);
 void numeric_dispose(numeric *var);
 
@@ -167,6 +411,9 @@ numeric_errcode_t numeric_to_str(const numeric *num, int scale,
         char **result);
 numeric_errcode_t numeric_to_str_sci(const numeric *num, int scale,
         char **result);
+numeric_errcode_t numeric_coerce(numeric *num, int precision, int scale);
+numeric_errcode_t numeric_coerce_batch(numeric *nums, int n, int precision,
+        int scale, numeric_errcode_t *errcodes);
 
 numeric_errcode_t numeric_from_int32(int32_t val, numeric *result);
 numeric_errcode_t numeric_to_int32(const numeric *num, int32_t *result);
@@ -184,9 +431,13 @@ numeric_errcode_t numeric_sign(const numeric *num, numeric *result);
 
 numeric_errcode_t numeric_round(const numeric *num, int scale, numeric *result);
 numeric_errcode_t numeric_trunc(const numeric *num, int scale, numeric *result);
+numeric_errcode_t numeric_trim_scale(const numeric *num, numeric *result);
 
 numeric_errcode_t numeric_ceil(const numeric *num, numeric *result);
 numeric_errcode_t numeric_floor(const numeric *num, numeric *result);
+numeric_errcode_t numeric_width_bucket(const numeric *operand,
+        const numeric *bound1, const numeric *bound2, int count,
+        int *result);
 
 int numeric_cmp(const numeric *num1, const numeric *num2);
 bool numeric_eq(const numeric *num1, const numeric *num2);
@@ -195,6 +446,8 @@ bool numeric_gt(const numeric *num1, const numeric *num2);
 bool numeric_ge(const numeric *num1, const numeric *num2);
 bool numeric_lt(const numeric *num1, const numeric *num2);
 bool numeric_le(const numeric *num1, const numeric *num2);
+int numeric_cmp_int64(const numeric *num, int64_t val);
+int numeric_cmp_double(const numeric *num, double val);
 
 numeric_errcode_t numeric_add(const numeric *num1, const numeric *num2,
         numeric *result);
@@ -212,6 +465,53 @@ numeric_errcode_t numeric_min(const numeric *num1, const numeric *num2,
         numeric *result);
 numeric_errcode_t numeric_max(const numeric *num1, const numeric *num2,
         numeric *result);
+numeric_errcode_t numeric_add_int64(const numeric *num, int64_t val,
+        numeric *result);
+numeric_errcode_t numeric_mul_int64(const numeric *num, int64_t val,
+        numeric *result);
+numeric_errcode_t numeric_div_int64(const numeric *num, int64_t val,
+        numeric *result);
+
+/* ----------
+ * Working variables.  The numeric_var_* functions compute into result the
+ * way the internal add_var(), mul_var() and friends do, leaving it in the
+ * buffer the computation produced.  The numeric_* functions copy each
+ * result into an exact-size allocation instead, a copy per step in a
+ * chain of operations.
+ *
+ * A working variable may be passed as an input to any function.  Call
+ * numeric_finalize() once at the end of a chain: it checks, in place,
+ * that the value fits the range of a stored numeric.
+ * numeric_finalize_into() makes the same check while copying the value
+ * into a caller's buffer.
+ * ----------
+ */
+numeric_errcode_t numeric_var_add(const numeric *var1, const numeric *var2,
+        numeric *result);
+numeric_errcode_t numeric_var_sub(const numeric *var1, const numeric *var2,
+        numeric *result);
+numeric_errcode_t numeric_var_mul(const numeric *var1, const numeric *var2,
+        numeric *result, int rscale);
+numeric_errcode_t numeric_var_div(const numeric *var1, const numeric *var2,
+        numeric *result, int rscale, bool round);
+numeric_errcode_t numeric_var_round(const numeric *var, int rscale,
+        numeric *result);
+numeric_errcode_t numeric_var_trunc(const numeric *var, int rscale,
+        numeric *result);
+numeric_errcode_t numeric_finalize(numeric *var);
+numeric_errcode_t numeric_finalize_into(const numeric *var,
+        NumericDigit *digits, int ndigits, numeric *result);
+
+numeric_errcode_t numeric_result_bound(numeric_op_t op, const numeric *num1,
+        const numeric *num2, int rscale, int *ndigits, size_t *length);
+numeric_errcode_t numeric_add_into(const numeric *num1, const numeric *num2,
+        NumericDigit *digits, int ndigits, numeric *result);
+numeric_errcode_t numeric_sub_into(const numeric *num1, const numeric *num2,
+        NumericDigit *digits, int ndigits, numeric *result);
+numeric_errcode_t numeric_mul_into(const numeric *num1, const numeric *num2,
+        int rscale, NumericDigit *digits, int ndigits, numeric *result);
+numeric_errcode_t numeric_div_into(const numeric *num1, const numeric *num2,
+        int rscale, NumericDigit *digits, int ndigits, numeric *result);
 
 numeric_errcode_t numeric_sqrt(const numeric *num, numeric *result);
 numeric_errcode_t numeric_exp(const numeric *num, numeric *result);
@@ -219,5 +519,161 @@ numeric_errcode_t numeric_ln(const numeric *num, numeric *result);
 numeric_errcode_t numeric_log10(const numeric *num, numeric *result);
 numeric_errcode_t numeric_power(const numeric *num1, const numeric *num2,
         numeric *result);
+numeric_errcode_t numeric_exp_batch(const numeric *nums, int n,
+        numeric *results);
+numeric_errcode_t numeric_ln_batch(const numeric *nums, int n,
+        numeric *results);
+numeric_errcode_t numeric_power_batch(const numeric *bases,
+        const numeric *exps, int n, numeric *results);
+numeric_errcode_t numeric_gcd(const numeric *num1, const numeric *num2,
+        numeric *result);
+numeric_errcode_t numeric_lcm(const numeric *num1, const numeric *num2,
+        numeric *result);
+
+numeric_errcode_t numeric_pi(numeric *result);
+numeric_errcode_t numeric_sin(const numeric *num, numeric *result);
+numeric_errcode_t numeric_cos(const numeric *num, numeric *result);
+numeric_errcode_t numeric_atan(const numeric *num, numeric *result);
+numeric_errcode_t numeric_atan2(const numeric *num1, const numeric *num2,
+        numeric *result);
+
+numeric_errcode_t numeric_cache_enable(int capacity);
+void numeric_cache_disable(void);
+void numeric_cache_get_stats(numeric_cache_stats *stats);
+numeric_errcode_t numeric_cache_prewarm(numeric_cache_op_t op,
+        const numeric *num1, const numeric *num2, int rscale);
+
+void numeric_rational_init(numeric_rational *rat);
+void numeric_rational_dispose(numeric_rational *rat);
+numeric_errcode_t numeric_rational_from_numeric(const numeric *num,
+        numeric_rational *result);
+numeric_errcode_t numeric_rational_from_quotient(const numeric *num1,
+        const numeric *num2, numeric_rational *result);
+numeric_errcode_t numeric_rational_to_numeric(const numeric_rational *rat,
+        int rscale, numeric *result);
+numeric_errcode_t numeric_rational_add(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result);
+numeric_errcode_t numeric_rational_sub(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result);
+numeric_errcode_t numeric_rational_mul(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result);
+numeric_errcode_t numeric_rational_div(const numeric_rational *rat1,
+        const numeric_rational *rat2, numeric_rational *result);
+
+numeric_errcode_t numeric_allocate(const numeric *total,
+        const numeric *weights, int n, int scale, numeric *result);
+
+void numeric_budget_init(numeric_budget *budget, int64_t units);
+void numeric_budget_cancel(numeric_budget *budget);
+numeric_budget *numeric_budget_attach(numeric_budget *budget);
+
+void numeric_accum_init(numeric_accum *acc);
+void numeric_accum_dispose(numeric_accum *acc);
+void numeric_accum_add_int64(numeric_accum *acc, int64_t val);
+#ifdef NUMERIC_HAVE_INT128
+void numeric_accum_add_int128(numeric_accum *acc, numeric_int128 val);
+#endif
+numeric_errcode_t numeric_accum_add_double(numeric_accum *acc, double val);
+void numeric_accum_add_numeric(numeric_accum *acc, const numeric *num);
+numeric_errcode_t numeric_accum_finalize(numeric_accum *acc,
+        numeric *result);
+void numeric_accum_merge(numeric_accum *acc, const numeric_accum *other);
+
+void numeric_agg_init(numeric_agg *agg);
+void numeric_agg_dispose(numeric_agg *agg);
+void numeric_agg_add(numeric_agg *agg, const numeric *num);
+void numeric_agg_add_int64(numeric_agg *agg, int64_t val);
+void numeric_agg_merge(numeric_agg *agg, const numeric_agg *other);
+numeric_errcode_t numeric_agg_serialize(const numeric_agg *agg,
+        unsigned char **result, size_t *length);
+numeric_errcode_t numeric_agg_deserialize(const unsigned char *data,
+        size_t length, numeric_agg *result);
+numeric_errcode_t numeric_agg_sum(numeric_agg *agg, numeric *result);
+numeric_errcode_t numeric_agg_avg(numeric_agg *agg, numeric *result);
+numeric_errcode_t numeric_agg_variance(numeric_agg *agg, bool sample,
+        numeric *result);
+numeric_errcode_t numeric_agg_stddev(numeric_agg *agg, bool sample,
+        numeric *result);
+
+/* ----------
+ * Grouped aggregation
+ *
+ * The numeric_group_* functions aggregate a column of values by dense
+ * group ids in [0, n_groups) assigned by the caller, a negative id
+ * skipping its row.  Each call continues the aggregation held in the
+ * per-group arrays, so a table may be fed in batches.  With nthreads
+ * above 1 the groups are split among that many threads.
+ *
+ * numeric_group_min() and numeric_group_max() copy the winning values
+ * into results[], releasing whatever those held before, so every element
+ * must have been set up with numeric_init() (or hold a value of its own)
+ * even while found[] is all false.
+ * ----------
+ */
+numeric_errcode_t numeric_group_sum(const numeric *values,
+        const int *group_ids, int n, int n_groups, numeric_accum *accums,
+        int nthreads);
+numeric_errcode_t numeric_group_min(const numeric *values,
+        const int *group_ids, int n, int n_groups, numeric *results,
+        bool *found, int nthreads);
+numeric_errcode_t numeric_group_max(const numeric *values,
+        const int *group_ids, int n, int n_groups, numeric *results,
+        bool *found, int nthreads);
+numeric_errcode_t numeric_group_count(const int *group_ids, int n,
+        int n_groups, int64_t *counts);
+
+void numeric_array_init(numeric_array *arr);
+void numeric_array_dispose(numeric_array *arr);
+numeric_errcode_t numeric_prefix_sum(const numeric *values, int n,
+        numeric_array *result, int nthreads);
+
+void numeric_compact_init(numeric_compact *c);
+void numeric_compact_dispose(numeric_compact *c);
+numeric_errcode_t numeric_compact_pack(const numeric *num,
+        numeric_compact *result);
+numeric_errcode_t numeric_compact_pack_array(const numeric *nums, int n,
+        numeric_compact *result, NumericDigit **digitbuf);
+void numeric_compact_view(const numeric_compact *c, numeric *view);
+numeric_errcode_t numeric_compact_unpack(const numeric_compact *c,
+        numeric *result);
+int numeric_compact_cmp(const numeric_compact *c1,
+        const numeric_compact *c2);
+
+size_t numeric_sortkey_max_length(const numeric *num);
+numeric_errcode_t numeric_sortkey(const numeric *num, unsigned char *buf,
+        size_t buflen, size_t *length);
+numeric_errcode_t numeric_from_sortkey(const unsigned char *key,
+        size_t length, int dscale, numeric *result);
+
+numeric_errcode_t numeric_buckets_from_bounds(const numeric *bounds,
+        int nbounds, numeric_buckets **result);
+numeric_errcode_t numeric_buckets_from_range(const numeric *bound1,
+        const numeric *bound2, int count, numeric_buckets **result);
+void numeric_buckets_free(numeric_buckets *buckets);
+numeric_errcode_t numeric_buckets_assign(const numeric_buckets *buckets,
+        const numeric *operands, int n, int *results);
+
+numeric_errcode_t numeric_write_text(numeric_textbuf *buf,
+        const numeric *values, const bool *nulls, int nrows, int ncols,
+        const int *scales, const numeric_text_options *options,
+        size_t *row_offsets);
+
+numeric_errcode_t numeric_format_compile(const char *pattern,
+        const numeric_format_locale *locale, numeric_format **result);
+void numeric_format_free(numeric_format *fmt);
+size_t numeric_format_max_length(const numeric_format *fmt);
+numeric_errcode_t numeric_format_render(const numeric_format *fmt,
+        const numeric *num, char *buf, size_t buflen, size_t *length);
+
+numeric_errcode_t numeric_formula_compile(const char *expr,
+        const char *const *names, int nnames, numeric_formula **result);
+void numeric_formula_free(numeric_formula *formula);
+numeric_errcode_t numeric_formula_eval(numeric_formula *formula,
+        const numeric *inputs, numeric *result);
+numeric_errcode_t numeric_formula_eval_into(numeric_formula *formula,
+        const numeric *inputs, NumericDigit *digits, int ndigits,
+        numeric *result);
+numeric_errcode_t numeric_formula_eval_batch(numeric_formula *formula,
+        const numeric *inputs, int nrows, numeric *results);
 
 #endif   /* _PG_NUMERIC_H_ */
@@ -0,0 +1,32 @@
+/*-------------------------------------------------------------------------
+ *
+ * numeric_tune.h
+ *    Algorithm crossover thresholds for numeric.c
+ *
+ * These defaults were measured by pgnumeric-tuneup on an x86-64 host.
+ * "make tune" measures them on the machine it runs on and writes them to
+ * numeric_tune_local.h in the build tree's src directory, which takes
+ * precedence over this file; rebuild the library afterwards, and delete
+ * that file to return to the defaults.  Each value may also be overridden
+ * with -D in CFLAGS.
+ *
+ * Sizes are written in decimal digits and converted to NBASE digits, so
+ * a file tuned for one NBASE stays roughly right for another.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef _PG_NUMERIC_TUNE_H_
+#define _PG_NUMERIC_TUNE_H_
+
+#if defined(__has_include)
+#if __has_include("numeric_tune_local.h")
+#include "numeric_tune_local.h"
+#endif
+#endif
+
+/* Divisor and quotient length from which div_var_checked beats div_var */
+#ifndef DIV_CHECKED_THRESHOLD
+#define DIV_CHECKED_THRESHOLD       (264 / DEC_DIGITS)
+#endif
+
+#endif   /* _PG_NUMERIC_TUNE_H_ */
@@ -1,5 +1,10 @@
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
 #include <cutter.h>
 #include "numeric.h"
+#include "numeric_tune.h"
 
 void test_numeric_from_str(void)
 {
@@ -32,6 +37,93 @@ void test_numeric_from_str(void)
     cut_assert_equal_string("0.12", str);
     free(str);
     numeric_dispose(&x);
+
+    /* values too large for the precision are rejected */
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE,
+        numeric_from_str("123.4", 3, 1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE,
+        numeric_from_str("99.96", 3, 1, &x));
+    numeric_dispose(&x);
+}
+
+#define TEST_COERCE(expected_errcode, expected, arg, precision, scale) \
+do { \
+    numeric x; \
+    char *str; \
+ \
+    numeric_init(&x); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((arg), -1, -1, &x)); \
+    cut_assert_equal_int((expected_errcode), \
+        numeric_coerce(&x, (precision), (scale))); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_to_str(&x, -1, &str)); \
+    cut_assert_equal_string((expected), str); \
+    free(str); \
+    numeric_dispose(&x); \
+} while (0)
+
+void test_numeric_coerce(void)
+{
+    static const char *const values[] = {
+        "1.005", "-99.994", "99.995", "0", "NaN", "123456.7"
+    };
+    static const char *const expected[] = {
+        "1.01", "-99.99", "99.995", "0.00", "NaN", "123456.7"
+    };
+    numeric nums[6];
+    numeric_errcode_t errcodes[6];
+    char *str;
+    int i;
+
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "12.35", "12.345", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "-12.34", "-12.344", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "1.50", "1.5", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "0.00", "-0.001", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "NaN", "NaN", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "123.456", "123.456", -1, -1);
+
+    /* rounding up into a new digit, within and beyond the precision */
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "10000", "9999.5", 5, 0);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "1.000", "0.9996", 4, 3);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "100000000.0", "99999999.96",
+        10, 1);
+    TEST_COERCE(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE, "999.995",
+        "999.995", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE, "0.9996",
+        "0.9996", 3, 3);
+    TEST_COERCE(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE, "1000",
+        "1000", 5, 2);
+    TEST_COERCE(NUMERIC_ERRCODE_NO_ERROR, "999.99", "999.994", 5, 2);
+
+    TEST_COERCE(NUMERIC_ERRCODE_INVALID_ARGUMENT, "1", "1", 0, 0);
+    TEST_COERCE(NUMERIC_ERRCODE_INVALID_ARGUMENT, "1", "1", 5, 6);
+    TEST_COERCE(NUMERIC_ERRCODE_INVALID_ARGUMENT, "1", "1", 5, -1);
+
+    /* rows that do not fit keep their values and do not stop the rest */
+    for (i = 0; i < 6; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &nums[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE,
+        numeric_coerce_batch(nums, 6, 4, 2, errcodes));
+    for (i = 0; i < 6; i++)
+    {
+        cut_assert_equal_int(i == 2 || i == 5 ?
+            NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE :
+            NUMERIC_ERRCODE_NO_ERROR, errcodes[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&nums[i], -1, &str));
+        cut_assert_equal_string(expected[i], str);
+        free(str);
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_coerce_batch(nums, 6, 0, 0, errcodes));
+    for (i = 0; i < 6; i++)
+        numeric_dispose(&nums[i]);
 }
 
 void test_numeric_from_double(void)
@@ -220,6 +312,18 @@ void test_numeric_trunc(void)
     TEST_SCALE("NaN", numeric_trunc, "NaN", 1);
 }
 
+void test_numeric_trim_scale(void)
+{
+    TEST_UNARY("1.5", numeric_trim_scale, "1.500");
+    TEST_UNARY("1", numeric_trim_scale, "1.00");
+    TEST_UNARY("-0.0001", numeric_trim_scale, "-0.000100");
+    TEST_UNARY("120", numeric_trim_scale, "120.0");
+    TEST_UNARY("12345678.90123", numeric_trim_scale, "12345678.901230000");
+    TEST_UNARY("0", numeric_trim_scale, "0.000");
+    TEST_UNARY("1.5", numeric_trim_scale, "1.5");
+    TEST_UNARY("NaN", numeric_trim_scale, "NaN");
+}
+
 void test_numeric_ceil(void)
 {
     TEST_UNARY("13", numeric_ceil, "12.345");
@@ -405,6 +509,15 @@ void test_numeric_mul(void)
     TEST_BINARY("0.113", numeric_mul, "1.13", "0.1");
     TEST_BINARY("1.243", numeric_mul, "1.13", "1.1");
     TEST_BINARY("-56.088", numeric_mul, "12.3", "-4.56");
+    /* carries through every column, at and past the short-operand kernels */
+    TEST_BINARY("99980001", numeric_mul, "9999", "9999");
+    TEST_BINARY("-9999999999999999999899999.00000000000000000001",
+        numeric_mul, "99999999999999999999", "-99999.99999999999999999999");
+    TEST_BINARY("999999999999999999999998000000000000000000000001",
+        numeric_mul, "999999999999999999999999", "999999999999999999999999");
+    TEST_BINARY("99999999999999999999999999980000000000000000000000000001",
+        numeric_mul, "9999999999999999999999999999",
+        "9999999999999999999999999999");
     TEST_BINARY("NaN", numeric_mul, "1.13", "NaN");
     TEST_BINARY("NaN", numeric_mul, "NaN", "1.13");
 }
@@ -438,6 +551,141 @@ void test_numeric_div_trunc(void)
     TEST_BINARY("NaN", numeric_div_trunc, "NaN", "1.13");
 }
 
+/* longer than the divisor and quotient from which div_var_checked() is used */
+#define DIV_LONG_DIGITS     (DIV_CHECKED_THRESHOLD * DEC_DIGITS + 40)
+
+void test_numeric_div_long(void)
+{
+    /* repeated to DIV_LONG_DIGITS, the digits of sqrt(2) and -sqrt(3) */
+    const char *qdigits = "4142135623730950488016887242096980785696718753"
+        "769480731766797379907324784621070388503875343276415727350138462"
+        "30912297024924836055850737212644121497099";
+    const char *ydigits = "732050807568877293527446341505872366942805253"
+        "810380628055806979451933016908800037081146186757248575675626141"
+        "4154067030299699450949989";
+    char qstr[DIV_LONG_DIGITS + 3];
+    char ystr[DIV_LONG_DIGITS + 4];
+    numeric q;
+    numeric y;
+    numeric x;
+    numeric h;
+    numeric r;
+    char buf[32];
+    char nines[495];
+    char digits[789];
+    char *str;
+    int scale;
+    int i;
+
+    /*
+     * The divisor and the quotients are long enough that numeric_div()
+     * computes a fast quotient and verifies it, correcting it by a unit
+     * when it falls on a digit boundary.
+     */
+    strcpy(qstr, "1.");
+    for (i = 0; i < DIV_LONG_DIGITS; i++)
+        qstr[2 + i] = qdigits[i % strlen(qdigits)];
+    qstr[2 + i] = '\0';
+    strcpy(ystr, "-1.");
+    for (i = 0; i < DIV_LONG_DIGITS - 17; i++)
+        ystr[3 + i] = ydigits[i % strlen(ydigits)];
+    ystr[3 + i] = '\0';
+
+    numeric_init(&q);
+    numeric_init(&y);
+    numeric_init(&x);
+    numeric_init(&h);
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(qstr, -1, -1, &q));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(ystr, -1, -1, &y));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_mul(&q, &y, &x));
+
+    /* exact quotients */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_div(&x, &y, &r));
+    cut_assert_equal_int(0, numeric_cmp(&r, &q));
+    scale = r.dscale;
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_div(&x, &y, &r, q.dscale, false));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&r));
+    cut_assert_equal_int(0, numeric_cmp(&r, &q));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_div_trunc(&x, &y, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("1", str);
+    free(str);
+
+    /* x / y now lies exactly half way between two quotients at scale */
+    snprintf(buf, sizeof(buf), "5e-%d", scale + 1);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(buf, -1, -1, &h));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_mul(&h, &y, &h));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_add(&x, &h, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_div(&x, &y, &r, scale, false));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&r));
+    cut_assert_equal_int(0, numeric_cmp(&r, &q));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_div(&x, &y, &r, scale, true));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&r));
+    snprintf(buf, sizeof(buf), "1e-%d", scale);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(buf, -1, -1, &h));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_add(&q, &h, &h));
+    cut_assert_equal_int(0, numeric_cmp(&r, &h));
+
+    /* ... and just short of half way */
+    snprintf(buf, sizeof(buf), "1e-%d", x.dscale);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(buf, -1, -1, &h));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_add(&x, &h, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_div(&x, &y, &r, scale, true));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&r));
+    cut_assert_equal_int(0, numeric_cmp(&r, &q));
+
+    /*
+     * A divisor of all 9s drives the intermediate digits of div_var_fast
+     * and of the verifying multiplication to their limits.
+     */
+    memset(nines, '9', 494);
+    nines[254] = '.';
+    nines[494] = '\0';
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(nines, -1, -1, &y));
+    for (i = 0; i < 784; i++)
+        digits[i] = "225"[i % 3];
+    strcpy(digits + 784, ".371");
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(digits, -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_div_trunc(&x, &y, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_int(530, strlen(str));
+    cut_assert_equal_string("74774774774774774774", str + 510);
+    free(str);
+    for (i = 0; i < 784; i++)
+        digits[i] = "4313373928043"[i % 13];
+    strcpy(digits + 784, ".043");
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(digits, -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_div(&x, &y, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_int(770, strlen(str));
+    cut_assert_equal_string("08477744711320847774", str + 750);
+    free(str);
+
+    numeric_dispose(&r);
+    numeric_dispose(&h);
+    numeric_dispose(&x);
+    numeric_dispose(&y);
+    numeric_dispose(&q);
+}
+
 void test_numeric_mod(void)
 {
     TEST_BINARY("0.13", numeric_mod, "1.13", "1.0");
@@ -472,6 +720,299 @@ void test_numeric_max(void)
     TEST_BINARY("NaN", numeric_max, "NaN", "1.13");
 }
 
+#define TEST_CMP_NATIVE(expected, func, arg, val) \
+do { \
+    numeric x; \
+ \
+    numeric_init(&x); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((arg), -1, -1, &x)); \
+    cut_assert_equal_int((expected), (func)(&x, (val))); \
+    numeric_dispose(&x); \
+} while (0)
+
+#define TEST_INT64(expected, func, arg, val) \
+do { \
+    numeric x; \
+    numeric r; \
+    char *str; \
+ \
+    numeric_init(&x); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((arg), -1, -1, &x)); \
+    numeric_init(&r); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        (func)(&x, (val), &r)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_to_str(&r, -1, &str)); \
+    cut_assert_equal_string((expected), str); \
+    free(str); \
+    numeric_dispose(&r); \
+    numeric_dispose(&x); \
+} while (0)
+
+void test_numeric_cmp_int64(void)
+{
+    TEST_CMP_NATIVE(1, numeric_cmp_int64, "0.001", 0);
+    TEST_CMP_NATIVE(0, numeric_cmp_int64, "100.00", 100);
+    TEST_CMP_NATIVE(-1, numeric_cmp_int64, "-100.5", -100);
+    TEST_CMP_NATIVE(0, numeric_cmp_int64, "-9223372036854775808", INT64_MIN);
+    TEST_CMP_NATIVE(1, numeric_cmp_int64, "9223372036854775808", INT64_MAX);
+    TEST_CMP_NATIVE(1, numeric_cmp_int64, "NaN", INT64_MAX);
+}
+
+void test_numeric_cmp_double(void)
+{
+    /* doubles compare as numeric_from_double() converts them */
+    TEST_CMP_NATIVE(0, numeric_cmp_double, "0.1", 0.1);
+    TEST_CMP_NATIVE(0, numeric_cmp_double, "-12.5", -12.5);
+    TEST_CMP_NATIVE(-1, numeric_cmp_double, "0.29", 0.3);
+    TEST_CMP_NATIVE(0, numeric_cmp_double, "123456789012346000000",
+                    1.23456789012345678e20);
+    TEST_CMP_NATIVE(1, numeric_cmp_double, "1e-300", 0.0);
+    TEST_CMP_NATIVE(-1, numeric_cmp_double, "1e300", INFINITY);
+    TEST_CMP_NATIVE(1, numeric_cmp_double, "-1e300", -INFINITY);
+    TEST_CMP_NATIVE(1, numeric_cmp_double, "NaN", INFINITY);
+    TEST_CMP_NATIVE(0, numeric_cmp_double, "NaN", NAN);
+    TEST_CMP_NATIVE(-1, numeric_cmp_double, "1", NAN);
+}
+
+void test_numeric_add_int64(void)
+{
+    TEST_INT64("1.13", numeric_add_int64, "0.13", 1);
+    TEST_INT64("-1.75", numeric_add_int64, "1.25", -3);
+    TEST_INT64("-9223372036854775809", numeric_add_int64, "-1", INT64_MIN);
+    TEST_INT64("NaN", numeric_add_int64, "NaN", 1);
+}
+
+void test_numeric_mul_int64(void)
+{
+    TEST_INT64("125.00", numeric_mul_int64, "1.25", 100);
+    TEST_INT64("0", numeric_mul_int64, "1.250", 0);
+    TEST_INT64("-18446744073709551614", numeric_mul_int64, "-2", INT64_MAX);
+    TEST_INT64("NaN", numeric_mul_int64, "NaN", 2);
+}
+
+void test_numeric_div_int64(void)
+{
+    TEST_INT64("3.3333333333333333", numeric_div_int64, "10", 3);
+    TEST_INT64("-0.12500000000000000000", numeric_div_int64, "1", -8);
+    TEST_INT64("NaN", numeric_div_int64, "NaN", 0);
+    {
+        numeric x;
+        numeric r;
+
+        numeric_init(&x);
+        numeric_init(&r);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str("1.5", -1, -1, &x));
+        cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+            numeric_div_int64(&x, 0, &r));
+        numeric_dispose(&r);
+        numeric_dispose(&x);
+    }
+}
+
+void test_numeric_var(void)
+{
+    numeric a;
+    numeric b;
+    numeric c;
+    numeric v;
+    char *str;
+
+    numeric_init(&a);
+    numeric_init(&b);
+    numeric_init(&c);
+    numeric_init(&v);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("19.99", -1, -1, &a));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("3", -1, -1, &b));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("8.25", -1, -1, &c));
+
+    /* round(a * b * (1 + c / 100), 2), computed in place in v */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_int32(100, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_div(&c, &v, &v, -1, true));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_add(&v, &b, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_sub(&v, &b, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_int32(1, &c));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_add(&c, &v, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_mul(&v, &a, &v, -1));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_mul(&v, &b, &v, -1));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_round(&v, 2, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&v, -1, &str));
+    cut_assert_equal_string("64.92", str);
+    free(str);
+
+    /* rounding a stored numeric, which has no spare digit, carries */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("9999.995", -1, -1, &a));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_round(&a, 2, &a));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&a));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&a, -1, &str));
+    cut_assert_equal_string("10000.00", str);
+    free(str);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_trunc(&a, -3, &v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&v));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&v, -1, &str));
+    cut_assert_equal_string("10000", str);
+    free(str);
+
+    /* errors and NaN */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_int32(0, &b));
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_var_div(&a, &b, &v, -1, true));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("NaN", -1, -1, &b));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_var_mul(&a, &b, &v, 2));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_finalize(&v));
+    cut_assert_true(NUMERIC_IS_NAN(&v));
+
+    numeric_dispose(&v);
+    numeric_dispose(&c);
+    numeric_dispose(&b);
+    numeric_dispose(&a);
+}
+
+void test_numeric_result_bound(void)
+{
+    static const char *const values[] = {
+        "0", "1", "-1", "9999.9999", "0.00001", "123456789.987654321",
+        "-99999999", "1e-20", "NaN"
+    };
+    static const numeric_op_t ops[] = {
+        NUMERIC_OP_ADD, NUMERIC_OP_SUB, NUMERIC_OP_MUL, NUMERIC_OP_DIV
+    };
+    static const int rscales[] = { -1, 0, 3, 25 };
+    int nvalues = sizeof(values) / sizeof(values[0]);
+    NumericDigit digits[64];
+    numeric x;
+    numeric y;
+    numeric r;
+    char *str;
+    int bound;
+    size_t length;
+    int i;
+    int j;
+    int k;
+
+    for (i = 0; i < nvalues; i++)
+    {
+        for (j = 0; j < nvalues; j++)
+        {
+            numeric_init(&x);
+            numeric_init(&y);
+            numeric_from_str(values[i], -1, -1, &x);
+            numeric_from_str(values[j], -1, -1, &y);
+            for (k = 0; k < 4 * 4; k++)
+            {
+                numeric_errcode_t errcode;
+                int rscale = rscales[k % 4];
+
+                errcode = numeric_result_bound(ops[k / 4], &x, &y, rscale,
+                                               &bound, &length);
+                if (errcode == NUMERIC_ERRCODE_DIVISION_BY_ZERO)
+                    continue;
+                cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, errcode);
+                cut_assert_true(bound <= 64);
+
+                numeric_init(&r);
+                switch (ops[k / 4])
+                {
+                    case NUMERIC_OP_ADD:
+                        errcode = numeric_add_into(&x, &y, digits, bound, &r);
+                        break;
+                    case NUMERIC_OP_SUB:
+                        errcode = numeric_sub_into(&x, &y, digits, bound, &r);
+                        break;
+                    case NUMERIC_OP_MUL:
+                        errcode = numeric_mul_into(&x, &y, rscale,
+                                                   digits, bound, &r);
+                        break;
+                    case NUMERIC_OP_DIV:
+                        errcode = numeric_div_into(&x, &y, rscale,
+                                                   digits, bound, &r);
+                        break;
+                }
+                cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, errcode);
+                cut_assert_true(r.ndigits <= bound);
+                if (rscale >= 0 && r.ndigits > 0 &&
+                    (ops[k / 4] == NUMERIC_OP_MUL ||
+                     ops[k / 4] == NUMERIC_OP_DIV))
+                    cut_assert_equal_int(rscale, r.dscale);
+                cut_assert_null(r.buf);
+                cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                    numeric_to_str(&r, -1, &str));
+                cut_assert_true(strlen(str) <= length);
+                free(str);
+                numeric_dispose(&r);
+            }
+            numeric_dispose(&x);
+            numeric_dispose(&y);
+        }
+    }
+
+    numeric_init(&x);
+    numeric_init(&y);
+    numeric_init(&r);
+    numeric_from_str("12345678", -1, -1, &x);
+    numeric_from_str("87654321", -1, -1, &y);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_result_bound(NUMERIC_OP_MUL, &x, &y, -1, &bound, NULL));
+    cut_assert_equal_int(4, bound);
+    cut_assert_equal_int(NUMERIC_ERRCODE_BUFFER_TOO_SMALL,
+        numeric_mul_into(&x, &y, -1, digits, 3, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_mul_into(&x, &y, -1, digits, bound, &r));
+    cut_assert_true(r.digits == digits);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("1082152022374638", str);
+    free(str);
+    numeric_dispose(&r);
+    numeric_init(&r);
+    numeric_dispose(&x);
+    numeric_dispose(&y);
+    numeric_init(&x);
+    numeric_init(&y);
+    numeric_from_str("1.23456789", -1, -1, &x);
+    numeric_from_str("9.87654321", -1, -1, &y);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_result_bound(NUMERIC_OP_MUL, &x, &y, 2, &bound, NULL));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_mul_into(&x, &y, 2, digits, bound, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("12.19", str);
+    free(str);
+    numeric_from_str("0", -1, -1, &y);
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_result_bound(NUMERIC_OP_DIV, &x, &y, -1, &bound, NULL));
+    numeric_dispose(&r);
+    numeric_dispose(&y);
+    numeric_dispose(&x);
+}
+
 void test_numeric_sqrt(void)
 {
     TEST_UNARY("1.000000000000000", numeric_sqrt, "1");
@@ -591,3 +1132,1652 @@ void test_numeric_power(void)
     TEST_BINARY("NaN", numeric_power, "1.13", "NaN");
     TEST_BINARY("NaN", numeric_power, "NaN", "1.13");
 }
+
+void test_numeric_transcendental_batch(void)
+{
+    static const char *const values[] = {
+        "-5.5", "0", "0.001", "1", "2.5", "10", "0.75", "-0.3333"
+    };
+    static const char *const bases[] = {
+        "2", "0.5", "1.0001", "3.7", "10", "123.456", "0.75", "9"
+    };
+    numeric nums[8];
+    numeric pos[8];
+    numeric batch[8];
+    numeric single;
+    char *str1;
+    char *str2;
+    int op;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        numeric_init(&nums[i]);
+        numeric_init(&pos[i]);
+        numeric_init(&batch[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &nums[i]));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(bases[i], -1, -1, &pos[i]));
+    }
+    numeric_init(&single);
+
+    /* batches agree with one-at-a-time evaluation */
+    for (op = 0; op < 3; op++)
+    {
+        if (op == 0)
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_exp_batch(nums, 8, batch));
+        else if (op == 1)
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_ln_batch(pos, 8, batch));
+        else
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_power_batch(pos, nums, 8, batch));
+
+        for (i = 0; i < 8; i++)
+        {
+            if (op == 0)
+                numeric_exp(&nums[i], &single);
+            else if (op == 1)
+                numeric_ln(&pos[i], &single);
+            else
+                numeric_power(&pos[i], &nums[i], &single);
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&single, -1, &str1));
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&batch[i], -1, &str2));
+            cut_assert_equal_string(str1, str2);
+            free(str1);
+            free(str2);
+        }
+    }
+
+    /* the first error stops the batch */
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_ln_batch(nums, 8, batch));
+
+    numeric_dispose(&single);
+    for (i = 0; i < 8; i++)
+    {
+        numeric_dispose(&nums[i]);
+        numeric_dispose(&pos[i]);
+        numeric_dispose(&batch[i]);
+    }
+}
+
+/* a fixed LCG, so that a failure can be reproduced */
+static int
+next_rand(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) % 100000;
+}
+
+void test_numeric_transcendental_batch_random(void)
+{
+    enum { N = 300 };
+    static numeric nums[N];
+    static numeric bases[N];
+    static numeric batch[N];
+    numeric single;
+    unsigned int seed = 12345;
+    char buf[64];
+    char *str1;
+    char *str2;
+    int d[4];
+    int op;
+    int i;
+    int j;
+
+    for (i = 0; i < N; i++)
+    {
+        numeric_init(&nums[i]);
+        numeric_init(&bases[i]);
+        numeric_init(&batch[i]);
+        for (j = 0; j < 4; j++)
+            d[j] = next_rand(&seed);
+        if (i == 0)
+            strcpy(buf, "65.97031902799864155895193");
+        else
+            sprintf(buf, "%s%d.%05d%05d%05d", (i % 3 == 0) ? "-" : "",
+                    d[0] % 100, d[1], d[2], d[3]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(buf, -1, -1, &nums[i]));
+        for (j = 0; j < 2; j++)
+            d[j] = next_rand(&seed);
+        sprintf(buf, "%d.%05d", d[0] % 20, d[1] % 99999 + 1);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(buf, -1, -1, &bases[i]));
+    }
+    numeric_init(&single);
+
+    /* batches are bit-identical to one-at-a-time evaluation */
+    for (op = 0; op < 3; op++)
+    {
+        if (op == 0)
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_exp_batch(nums, N, batch));
+        else if (op == 1)
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_ln_batch(bases, N, batch));
+        else
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_power_batch(bases, nums, N, batch));
+
+        for (i = 0; i < N; i++)
+        {
+            if (op == 0)
+                numeric_exp(&nums[i], &single);
+            else if (op == 1)
+                numeric_ln(&bases[i], &single);
+            else
+                numeric_power(&bases[i], &nums[i], &single);
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&single, -1, &str1));
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&batch[i], -1, &str2));
+            cut_assert_equal_string(str1, str2);
+            free(str1);
+            free(str2);
+        }
+    }
+
+    numeric_dispose(&single);
+    for (i = 0; i < N; i++)
+    {
+        numeric_dispose(&nums[i]);
+        numeric_dispose(&bases[i]);
+        numeric_dispose(&batch[i]);
+    }
+}
+
+void test_numeric_gcd(void)
+{
+    TEST_BINARY("6", numeric_gcd, "12", "18");
+    TEST_BINARY("6", numeric_gcd, "-12", "18");
+    TEST_BINARY("5", numeric_gcd, "0", "-5");
+    TEST_BINARY("0", numeric_gcd, "0", "0");
+    TEST_BINARY("0.75", numeric_gcd, "1.5", "2.25");
+    TEST_BINARY("NaN", numeric_gcd, "NaN", "2");
+    /* consecutive Fibonacci numbers: the longest quotient sequence */
+    TEST_BINARY("1", numeric_gcd,
+        "280571172992510140037611932413038677189525",
+        "453973694165307953197296969697410619233826");
+    TEST_BINARY("123456789012345678901234567890123", numeric_gcd,
+        "12193263113702179522618422493004797134336296860222381401",
+        "152415787532388367504953515390945940602047447271453030048271");
+    TEST_BINARY("17592186044416", numeric_gcd,
+        "643198194854625715002247387021312",
+        "2263796937940309584893706240000");
+}
+
+void test_numeric_lcm(void)
+{
+    TEST_BINARY("12", numeric_lcm, "4", "6");
+    TEST_BINARY("12", numeric_lcm, "-4", "6");
+    TEST_BINARY("0", numeric_lcm, "0", "3");
+    TEST_BINARY("4.50", numeric_lcm, "1.5", "2.25");
+    TEST_BINARY("82768002812408456151823478973192342962102599680000",
+        numeric_lcm, "643198194854625715002247387021312",
+        "2263796937940309584893706240000");
+}
+
+void test_numeric_pi(void)
+{
+    numeric x;
+    char *str;
+
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_pi(&x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&x, -1, &str));
+    cut_assert_equal_string("3.1415926535897932", str);
+    free(str);
+    numeric_dispose(&x);
+}
+
+void test_numeric_sin(void)
+{
+    TEST_UNARY("0", numeric_sin, "0");
+    TEST_UNARY("0.8414709848078965", numeric_sin, "1");
+    TEST_UNARY("-0.5984721441039565", numeric_sin, "-2.5");
+    TEST_UNARY("0.00000099999999999983", numeric_sin, "0.000001");
+    TEST_UNARY("-0.3499935021712930", numeric_sin, "1000000");
+    TEST_UNARY("NaN", numeric_sin, "NaN");
+}
+
+void test_numeric_cos(void)
+{
+    TEST_UNARY("1.0000000000000000", numeric_cos, "0");
+    TEST_UNARY("0.5403023058681397", numeric_cos, "1");
+    TEST_UNARY("-1.00000000000000000000", numeric_cos,
+        "3.14159265358979323846");
+    TEST_UNARY("NaN", numeric_cos, "NaN");
+}
+
+void test_numeric_atan(void)
+{
+    TEST_UNARY("0.7853981633974483", numeric_atan, "1");
+    TEST_UNARY("0.4636476090008061", numeric_atan, "0.5");
+    TEST_UNARY("-1.4711276743037346", numeric_atan, "-10");
+    TEST_UNARY("NaN", numeric_atan, "NaN");
+}
+
+void test_numeric_atan2(void)
+{
+    TEST_BINARY("0.7853981633974483", numeric_atan2, "1", "1");
+    TEST_BINARY("2.3561944901923449", numeric_atan2, "1", "-1");
+    TEST_BINARY("-2.3561944901923449", numeric_atan2, "-1", "-1");
+    TEST_BINARY("3.1415926535897932", numeric_atan2, "0", "-1");
+    TEST_BINARY("-1.5707963267948966", numeric_atan2, "-3", "0");
+    TEST_BINARY("0", numeric_atan2, "0", "0");
+    TEST_BINARY("NaN", numeric_atan2, "NaN", "1");
+}
+
+#define TEST_RATIONAL_BINARY(expected, func, num1, den1, num2, den2, rscale) \
+do { \
+    numeric n1, d1, n2, d2, r; \
+    numeric_rational x; \
+    numeric_rational y; \
+    numeric_rational z; \
+    char *str; \
+ \
+    numeric_init(&n1); \
+    numeric_init(&d1); \
+    numeric_init(&n2); \
+    numeric_init(&d2); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((num1), -1, -1, &n1)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((den1), -1, -1, &d1)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((num2), -1, -1, &n2)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((den2), -1, -1, &d2)); \
+    numeric_rational_init(&x); \
+    numeric_rational_init(&y); \
+    numeric_rational_init(&z); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_rational_from_quotient(&n1, &d1, &x)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_rational_from_quotient(&n2, &d2, &y)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        (func)(&x, &y, &z)); \
+    numeric_init(&r); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_rational_to_numeric(&z, (rscale), &r)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_to_str(&r, -1, &str)); \
+    cut_assert_equal_string((expected), str); \
+    free(str); \
+    numeric_dispose(&r); \
+    numeric_rational_dispose(&z); \
+    numeric_rational_dispose(&y); \
+    numeric_rational_dispose(&x); \
+    numeric_dispose(&d2); \
+    numeric_dispose(&n2); \
+    numeric_dispose(&d1); \
+    numeric_dispose(&n1); \
+} while (0)
+
+void test_numeric_rational_add(void)
+{
+    TEST_RATIONAL_BINARY("0.50", numeric_rational_add, "1", "3", "1", "6", 2);
+    TEST_RATIONAL_BINARY("1.0000", numeric_rational_add, "2", "3", "1", "3", 4);
+    TEST_RATIONAL_BINARY("0.35", numeric_rational_add, "0.1", "1", "0.25", "1", 2);
+    TEST_RATIONAL_BINARY("-0.167", numeric_rational_add, "-1", "3", "1", "6", 3);
+    TEST_RATIONAL_BINARY("NaN", numeric_rational_add, "NaN", "3", "1", "6", 2);
+}
+
+void test_numeric_rational_sub(void)
+{
+    TEST_RATIONAL_BINARY("0.17", numeric_rational_sub, "1", "3", "1", "6", 2);
+    TEST_RATIONAL_BINARY("0", numeric_rational_sub, "1", "3", "2", "6", 0);
+    TEST_RATIONAL_BINARY("-0.15", numeric_rational_sub, "0.1", "1", "0.25", "1", 2);
+}
+
+void test_numeric_rational_mul(void)
+{
+    TEST_RATIONAL_BINARY("100.00", numeric_rational_mul, "100", "3", "3", "1", 2);
+    TEST_RATIONAL_BINARY("0.125", numeric_rational_mul, "0.5", "2", "1", "2", 3);
+    TEST_RATIONAL_BINARY("-0.3333", numeric_rational_mul, "1", "-3", "1.5", "1.5", 4);
+}
+
+void test_numeric_rational_div(void)
+{
+    TEST_RATIONAL_BINARY("2.00", numeric_rational_div, "1", "3", "1", "6", 2);
+    TEST_RATIONAL_BINARY("-1.5", numeric_rational_div, "3", "7", "-2", "7", 1);
+    TEST_RATIONAL_BINARY("0.33333333333333333333", numeric_rational_div,
+        "1", "1", "3", "1", -1);
+}
+
+void test_numeric_rational_to_numeric(void)
+{
+    numeric a, b, c, r;
+    numeric_rational sum;
+    numeric_rational term;
+    numeric_budget budget;
+    numeric_errcode_t errcode;
+    char *str;
+    int ncancelled;
+    int units;
+    int i;
+
+    /*
+     * Pro-rata shares 1000 * w / 3 for w = 1, 1, 1: each share rounds to
+     * 333.33 on its own, but the exact sum is 1000.
+     */
+    numeric_init(&a);
+    numeric_init(&b);
+    numeric_init(&c);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("1000", -1, -1, &a));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("3", -1, -1, &c));
+    numeric_rational_init(&sum);
+    numeric_rational_init(&term);
+    for (i = 0; i < 3; i++)
+    {
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_rational_from_quotient(&a, &c, &term));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_rational_add(&sum, &term, &sum));
+    }
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_rational_to_numeric(&sum, 2, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("1000.00", str);
+    free(str);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_rational_from_quotient(&a, &b, &term));
+
+    /*
+     * A budget running out anywhere in the exact arithmetic, including the
+     * GCD of a fraction large enough to be reduced, leaves nothing behind.
+     */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("12345678901234567890123456789012345678901234567890"
+                         "12345678901234567890123456789", -1, -1, &b));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("98765432109876543210987654321098765432109876543210"
+                         "98765432109876543210987654321", -1, -1, &c));
+    ncancelled = 0;
+    for (units = 0; units < 20000; units += 13)
+    {
+        numeric_budget_init(&budget, units);
+        numeric_budget_attach(&budget);
+        errcode = numeric_rational_from_quotient(&a, &b, &sum);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = numeric_rational_from_quotient(&a, &c, &term);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = numeric_rational_add(&sum, &term, &sum);
+        if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+            errcode = numeric_rational_to_numeric(&sum, 10, &r);
+        numeric_budget_attach(NULL);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            cut_assert_equal_int(NUMERIC_ERRCODE_CANCELLED, errcode);
+            ncancelled++;
+        }
+    }
+    cut_assert_true(ncancelled > 0);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, errcode);
+
+    numeric_dispose(&r);
+    numeric_rational_dispose(&term);
+    numeric_rational_dispose(&sum);
+    numeric_dispose(&c);
+    numeric_dispose(&b);
+    numeric_dispose(&a);
+}
+
+void test_numeric_cache(void)
+{
+    numeric_cache_stats stats;
+    numeric x;
+    numeric y;
+    numeric r;
+    char *str;
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_cache_enable(2));
+
+    /* a miss followed by a hit must give the same answer */
+    TEST_UNARY("2.7182818284590452", numeric_exp, "1");
+    TEST_UNARY("2.7182818284590452", numeric_exp, "1");
+    TEST_UNARY("1.414213562373095", numeric_sqrt, "2");
+    TEST_UNARY("1.414213562373095", numeric_sqrt, "2.00");
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(2, stats.hits);
+    cut_assert_equal_int(2, stats.misses);
+    cut_assert_equal_int(2, stats.nentries);
+
+    /* a third entry evicts the least recently used one, exp(1) */
+    TEST_UNARY("0.6931471805599453", numeric_ln, "2");
+    TEST_UNARY("2.7182818284590452", numeric_exp, "1");
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(2, stats.hits);
+    cut_assert_equal_int(4, stats.misses);
+    cut_assert_equal_int(2, stats.evictions);
+
+    TEST_BINARY("166.53672446385521", numeric_power, "71", "1.2");
+    TEST_BINARY("166.53672446385521", numeric_power, "71", "1.2");
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(3, stats.hits);
+
+    /* equal arguments of larger dscale give a more precise power */
+    TEST_BINARY("1.4142135623730950", numeric_power, "2", "0.5");
+    TEST_BINARY("1.414213562373095048801688724210", numeric_power,
+                "2.000000000000000000000000000000", "0.5");
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(3, stats.hits);
+
+    /* an entry prewarmed at a larger scale serves the default scale */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_cache_enable(8));
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("10", -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_cache_prewarm(NUMERIC_CACHE_LN, &x, NULL, 40));
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, numeric_ln(&x, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("2.3025850929940457", str);
+    free(str);
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(1, stats.hits);
+    cut_assert_equal_int(0, stats.misses);
+
+    numeric_init(&y);
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_cache_prewarm(NUMERIC_CACHE_LN, &y, NULL, -1));
+
+    numeric_cache_disable();
+    numeric_cache_get_stats(&stats);
+    cut_assert_equal_int(0, stats.nentries);
+    cut_assert_equal_int(0, stats.capacity);
+
+    numeric_dispose(&r);
+    numeric_dispose(&y);
+    numeric_dispose(&x);
+}
+
+#define TEST_FORMAT(expected, pattern, str) \
+    do { \
+        numeric_format *fmt; \
+        numeric x; \
+        char buf[64]; \
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+            numeric_format_compile(pattern, NULL, &fmt)); \
+        numeric_init(&x); \
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+            numeric_from_str(str, -1, -1, &x)); \
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+            numeric_format_render(fmt, &x, buf, sizeof(buf), NULL)); \
+        cut_assert_equal_string(expected, buf); \
+        numeric_dispose(&x); \
+        numeric_format_free(fmt); \
+    } while (0)
+
+void test_numeric_format_render(void)
+{
+    numeric_format *fmt;
+    numeric_format_locale locale = {"EUR ", ",", "."};
+    numeric x;
+    char buf[64];
+    char *nanbuf;
+    size_t length;
+
+    TEST_FORMAT("  -12", "9999", "-12");
+    TEST_FORMAT("    0", "9999", "0");
+    TEST_FORMAT("  .50", "9.99", "0.5");
+    TEST_FORMAT(" 0.13", "0.99", "0.125");
+    TEST_FORMAT("  .00", "9.99", "-0.004");
+    TEST_FORMAT(" 0012", "0999", "12");
+    TEST_FORMAT("   1,234", "999,999", "1234");
+    TEST_FORMAT("1,234,567.89", "FM9G999G990D00", "1234567.891");
+    TEST_FORMAT("0.50", "FM9G999G990D00", "0.5");
+    TEST_FORMAT("-0.5", "FM990.999", "-0.5");
+    TEST_FORMAT("1.", "FM9.99", "1");
+    TEST_FORMAT("$<1,234.50>", "L9,999.99PR", "-1234.5");
+    TEST_FORMAT("$ 1,234.50 ", "L9,999.99PR", "1234.5");
+    TEST_FORMAT("  -12", "S9999", "-12");
+    TEST_FORMAT("  12+", "9999S", "12");
+    TEST_FORMAT("  12-", "9999MI", "-12");
+    TEST_FORMAT("  12 ", "9999MI", "12");
+    TEST_FORMAT("Total: 42", "\"Total: \"FM999", "42");
+    TEST_FORMAT(" ###", "999", "12345");
+    TEST_FORMAT(" #.##", "9.99", "9.995");
+    TEST_FORMAT(" 1000", "9999", "999.5");
+    TEST_FORMAT("NaN", "9999", "NaN");
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_format_compile("9.9.9", NULL, &fmt));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_format_compile("PR999", NULL, &fmt));
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_format_compile("L9G999D99", &locale, &fmt));
+    cut_assert_equal_int(14, numeric_format_max_length(fmt));
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("1234.5", -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_format_render(fmt, &x, buf, sizeof(buf), &length));
+    cut_assert_equal_string("EUR  1.234,50", buf);
+    cut_assert_equal_int(13, length);
+    cut_assert_equal_int(NUMERIC_ERRCODE_BUFFER_TOO_SMALL,
+        numeric_format_render(fmt, &x, buf, 13, &length));
+    numeric_dispose(&x);
+    numeric_format_free(fmt);
+
+    /* NaN must fit the buffer numeric_format_max_length() asks for */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_format_compile("9", NULL, &fmt));
+    cut_assert_equal_int(sizeof("NaN"), numeric_format_max_length(fmt));
+    nanbuf = malloc(numeric_format_max_length(fmt));
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("NaN", -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_format_render(fmt, &x, nanbuf,
+                              numeric_format_max_length(fmt), &length));
+    cut_assert_equal_string("NaN", nanbuf);
+    cut_assert_equal_int(3, length);
+    free(nanbuf);
+    numeric_dispose(&x);
+    numeric_format_free(fmt);
+}
+
+static void
+test_allocate(const char *total, int n, const char **weights, int scale,
+        const char **expected)
+{
+    numeric t;
+    numeric w[8];
+    numeric r[8];
+    char *str;
+    int i;
+
+    numeric_init(&t);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(total, -1, -1, &t));
+    for (i = 0; i < n; i++)
+    {
+        numeric_init(&w[i]);
+        numeric_init(&r[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(weights[i], -1, -1, &w[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_allocate(&t, w, n, scale, r));
+    for (i = 0; i < n; i++)
+    {
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&r[i], -1, &str));
+        cut_assert_equal_string(expected[i], str);
+        free(str);
+        numeric_dispose(&w[i]);
+        numeric_dispose(&r[i]);
+    }
+    numeric_dispose(&t);
+}
+
+void test_numeric_allocate(void)
+{
+    numeric t;
+    numeric w[2];
+    numeric r[2];
+
+    {
+        const char *w[] = {"1", "1", "1"};
+        const char *e[] = {"33.34", "33.33", "33.33"};
+        test_allocate("100", 3, w, 2, e);
+    }
+    {
+        const char *w[] = {"1", "1", "1"};
+        const char *e[] = {"-33.34", "-33.33", "-33.33"};
+        test_allocate("-100", 3, w, 2, e);
+    }
+    {
+        /* shares .015 .015 .020: the tie goes to the lower index */
+        const char *w[] = {"0.3", "0.3", "0.4"};
+        const char *e[] = {"0.02", "0.01", "0.02"};
+        test_allocate("0.05", 3, w, 2, e);
+    }
+    {
+        const char *w[] = {"2", "0", "1", "1"};
+        const char *e[] = {"5", "0", "3", "2"};
+        test_allocate("10", 4, w, 0, e);
+    }
+    {
+        /* total is rounded to scale first */
+        const char *w[] = {"1", "3"};
+        const char *e[] = {"2.502", "7.506"};
+        test_allocate("10.0075", 2, w, 3, e);
+    }
+    {
+        const char *w[] = {"1", "1", "1", "1", "1", "1", "1"};
+        const char *e[] = {"0.00015", "0.00015", "0.00014", "0.00014",
+                           "0.00014", "0.00014", "0.00014"};
+        test_allocate("0.001", 7, w, 5, e);
+    }
+
+    numeric_init(&t);
+    numeric_init(&w[0]);
+    numeric_init(&w[1]);
+    numeric_init(&r[0]);
+    numeric_init(&r[1]);
+    numeric_from_str("1", -1, -1, &t);
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_allocate(&t, w, 2, 2, r));
+    numeric_from_str("-1", -1, -1, &w[0]);
+    numeric_from_str("2", -1, -1, &w[1]);
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_allocate(&t, w, 2, 2, r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_allocate(&t, w, 0, 2, r));
+    numeric_dispose(&r[1]);
+    numeric_dispose(&r[0]);
+    numeric_dispose(&w[1]);
+    numeric_dispose(&w[0]);
+    numeric_dispose(&t);
+}
+
+void test_numeric_budget(void)
+{
+    numeric_budget budget;
+    numeric_budget *prev;
+    numeric x;
+    numeric r;
+    char *str;
+
+    numeric_init(&x);
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("123.456", -1, -1, &x));
+
+    /* a tiny budget stops a long series early */
+    numeric_budget_init(&budget, 100);
+    prev = numeric_budget_attach(&budget);
+    cut_assert_null(prev);
+    cut_assert_equal_int(NUMERIC_ERRCODE_CANCELLED,
+        numeric_exp(&x, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_CANCELLED,
+        numeric_ln(&x, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_CANCELLED,
+        numeric_add(&x, &x, &r));
+    cut_assert_true(numeric_budget_attach(prev) == &budget);
+
+    /* a cancelled operation leaves its result disposable */
+    numeric_dispose(&r);
+    numeric_init(&r);
+
+    /* an unlimited budget changes nothing until it is cancelled */
+    numeric_budget_init(&budget, -1);
+    numeric_budget_attach(&budget);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_sqrt(&x, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("11.111075555498666", str);
+    free(str);
+    numeric_budget_cancel(&budget);
+    cut_assert_equal_int(NUMERIC_ERRCODE_CANCELLED,
+        numeric_mul(&x, &x, &r));
+    numeric_budget_attach(NULL);
+
+    /* detached, everything works again */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_ln(&x, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("4.8158848172832639", str);
+    free(str);
+
+    numeric_dispose(&r);
+    numeric_dispose(&x);
+}
+
+static void
+test_accum_result(numeric_accum *acc, const char *expected)
+{
+    numeric r;
+    char *str;
+
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_accum_finalize(acc, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string(expected, str);
+    free(str);
+    numeric_dispose(&r);
+}
+
+void test_numeric_accum(void)
+{
+    numeric_accum acc;
+    numeric x;
+
+    /* the integer sum spills into numeric digits instead of overflowing */
+    numeric_accum_init(&acc);
+    numeric_accum_add_int64(&acc, INT64_MAX);
+    numeric_accum_add_int64(&acc, INT64_MAX);
+    numeric_accum_add_int64(&acc, INT64_MAX);
+    numeric_accum_add_int64(&acc, -1);
+    test_accum_result(&acc, "27670116110564327420");
+    numeric_accum_dispose(&acc);
+
+#ifdef NUMERIC_HAVE_INT128
+    numeric_accum_init(&acc);
+    numeric_accum_add_int128(&acc, (numeric_int128) 1 << 126);
+    numeric_accum_add_int128(&acc, (numeric_int128) 1 << 126);
+    numeric_accum_add_int128(&acc, (numeric_int128) 1 << 126);
+    test_accum_result(&acc, "255211775190703847597530955573826158592");
+    numeric_accum_dispose(&acc);
+#endif
+
+    /* doubles are added by their exact binary value */
+    numeric_accum_init(&acc);
+    numeric_accum_add_double(&acc, 0.1);
+    test_accum_result(&acc,
+        "0.1000000000000000055511151231257827021181583404541015625");
+    numeric_accum_add_double(&acc, 0.2);
+    numeric_accum_add_double(&acc, -0.3);
+    test_accum_result(&acc,
+        "0.0000000000000000277555756156289135105907917022705078125");
+    numeric_accum_dispose(&acc);
+
+    numeric_accum_init(&acc);
+    numeric_accum_add_double(&acc, 1e300);
+    numeric_accum_add_double(&acc, 1.0);
+    numeric_accum_add_double(&acc, -1e300);
+    numeric_accum_add_double(&acc, 5e-324);
+    numeric_accum_add_double(&acc, -5e-324);
+    test_accum_result(&acc, "1");
+    numeric_accum_dispose(&acc);
+
+    /* all three kinds of value mix freely */
+    numeric_accum_init(&acc);
+    numeric_init(&x);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("1.25", -1, -1, &x));
+    numeric_accum_add_numeric(&acc, &x);
+    numeric_accum_add_int64(&acc, -4);
+    numeric_accum_add_double(&acc, 0.5);
+    test_accum_result(&acc, "-2.25");
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_accum_add_double(&acc, HUGE_VAL));
+    numeric_accum_add_double(&acc, NAN);
+    test_accum_result(&acc, "NaN");
+    numeric_dispose(&x);
+    numeric_accum_dispose(&acc);
+}
+
+static void
+test_agg_pipe(const numeric_agg *agg, numeric_agg *result)
+{
+    int fds[2];
+    unsigned char *data;
+    unsigned char buf[1024];
+    size_t length;
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_agg_serialize(agg, &data, &length));
+    cut_assert_true(length <= sizeof(buf));
+    cut_assert_equal_int(0, pipe(fds));
+    cut_assert_equal_int((int) length, (int) write(fds[1], data, length));
+    close(fds[1]);
+    cut_assert_equal_int((int) length, (int) read(fds[0], buf, sizeof(buf)));
+    close(fds[0]);
+    free(data);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_agg_deserialize(buf, length - 1, result));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_agg_deserialize(buf, length, result));
+}
+
+static void
+test_agg_result(numeric_errcode_t (*func)(numeric_agg *, numeric *),
+        numeric_agg *agg, const char *expected)
+{
+    numeric r;
+    char *str;
+
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, func(agg, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string(expected, str);
+    free(str);
+    numeric_dispose(&r);
+}
+
+static numeric_errcode_t
+test_agg_var_samp(numeric_agg *agg, numeric *result)
+{
+    return numeric_agg_variance(agg, true, result);
+}
+
+static numeric_errcode_t
+test_agg_stddev_pop(numeric_agg *agg, numeric *result)
+{
+    return numeric_agg_stddev(agg, false, result);
+}
+
+void test_numeric_agg(void)
+{
+    static const char *const values[] = {
+        "1.5", "-2.25", "10", "3", "0.125", "7"
+    };
+    numeric_agg partial[3];
+    numeric_agg received[3];
+    numeric_agg total;
+    numeric_agg empty;
+    numeric_agg back;
+    numeric x;
+    char *str;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        numeric_agg_init(&partial[i]);
+        numeric_agg_init(&received[i]);
+    }
+    numeric_init(&x);
+    for (i = 0; i < 6; i++)
+    {
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &x));
+        numeric_agg_add(&partial[i % 2], &x);
+    }
+    numeric_agg_add_int64(&partial[2], 4);
+    numeric_agg_add_int64(&partial[2], -6);
+
+    /* ship every partial state through a pipe and merge out of order */
+    for (i = 0; i < 3; i++)
+        test_agg_pipe(&partial[i], &received[i]);
+    numeric_agg_init(&total);
+    numeric_agg_merge(&total, &received[2]);
+    numeric_agg_merge(&received[1], &received[0]);
+    numeric_agg_merge(&total, &received[1]);
+
+    cut_assert_equal_int(8, (int) total.count);
+    test_agg_result(numeric_agg_sum, &total, "17.375");
+    test_agg_result(numeric_agg_avg, &total, "2.1718750000000000");
+    test_agg_result(test_agg_var_samp, &total, "25.6559709821428571");
+    test_agg_result(test_agg_stddev_pop, &total, "4.7380348889993413");
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&total.min, -1, &str));
+    cut_assert_equal_string("-6", str);
+    free(str);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&total.max, -1, &str));
+    cut_assert_equal_string("10", str);
+    free(str);
+
+    /* an empty state survives the trip too, and has no sum */
+    numeric_agg_init(&empty);
+    numeric_agg_init(&back);
+    test_agg_pipe(&empty, &back);
+    cut_assert_equal_int(0, (int) back.count);
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_agg_sum(&back, &x));
+    numeric_agg_dispose(&empty);
+    numeric_agg_dispose(&back);
+
+    for (i = 0; i < 3; i++)
+    {
+        numeric_agg_dispose(&partial[i]);
+        numeric_agg_dispose(&received[i]);
+    }
+    numeric_agg_dispose(&total);
+    numeric_dispose(&x);
+}
+
+void test_numeric_group(void)
+{
+    static const char *const values[] = {
+        "1.5", "-2", "99999999.99", "0.01", "-0.25", "NaN", "7", "0.500"
+    };
+    static const int group_ids[] = { 0, 1, 2, 2, 0, 3, -1, 1 };
+    static const char *const sums[] = {
+        "1.25", "-1.500", "100000000.00", "NaN"
+    };
+    static const char *const mins[] = { "-0.25", "-2", "0.01", "NaN" };
+    static const char *const maxs[] = { "1.5", "0.500", "99999999.99", "NaN" };
+    numeric nums[8];
+    numeric_accum accums[5];
+    numeric mins_r[5];
+    numeric maxs_r[5];
+    bool found_min[5];
+    bool found_max[5];
+    int64_t counts[5];
+    numeric x;
+    char *str;
+    int nthreads;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &nums[i]));
+    }
+
+    /* the same results whether the groups are split among threads or not */
+    for (nthreads = 1; nthreads <= 3; nthreads += 2)
+    {
+        for (i = 0; i < 5; i++)
+        {
+            numeric_accum_init(&accums[i]);
+            numeric_init(&mins_r[i]);
+            numeric_init(&maxs_r[i]);
+            found_min[i] = false;
+            found_max[i] = false;
+            counts[i] = 0;
+        }
+
+        /* in two batches, the second continuing the first */
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_sum(nums, group_ids, 3, 5, accums, nthreads));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_sum(nums + 3, group_ids + 3, 5, 5, accums,
+                              nthreads));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_min(nums, group_ids, 4, 5, mins_r, found_min,
+                              nthreads));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_min(nums + 4, group_ids + 4, 4, 5, mins_r,
+                              found_min, nthreads));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_max(nums, group_ids, 8, 5, maxs_r, found_max,
+                              nthreads));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_group_count(group_ids, 8, 5, counts));
+
+        for (i = 0; i < 4; i++)
+        {
+            numeric_init(&x);
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_accum_finalize(&accums[i], &x));
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&x, -1, &str));
+            cut_assert_equal_string(sums[i], str);
+            free(str);
+            numeric_dispose(&x);
+
+            cut_assert_true(found_min[i]);
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&mins_r[i], -1, &str));
+            cut_assert_equal_string(mins[i], str);
+            free(str);
+            cut_assert_true(found_max[i]);
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&maxs_r[i], -1, &str));
+            cut_assert_equal_string(maxs[i], str);
+            free(str);
+        }
+        cut_assert_equal_int(2, (int) counts[0]);
+        cut_assert_equal_int(2, (int) counts[1]);
+        cut_assert_equal_int(1, (int) counts[3]);
+
+        /* group 4 has no rows */
+        cut_assert_false(found_min[4]);
+        cut_assert_false(found_max[4]);
+        cut_assert_equal_int(0, (int) counts[4]);
+
+        for (i = 0; i < 5; i++)
+        {
+            numeric_accum_dispose(&accums[i]);
+            numeric_dispose(&mins_r[i]);
+            numeric_dispose(&maxs_r[i]);
+        }
+    }
+
+    /* group ids must be below n_groups */
+    numeric_accum_init(&accums[0]);
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_group_sum(nums, group_ids, 8, 3, accums, 1));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_group_count(group_ids, 8, 3, counts));
+    numeric_accum_dispose(&accums[0]);
+
+    for (i = 0; i < 8; i++)
+        numeric_dispose(&nums[i]);
+}
+
+void test_numeric_prefix_sum(void)
+{
+    static const char *const values[] = {
+        "1.5", "-2", "99999999.99", "0.01", "-100000000", "0.001", "3",
+        "NaN", "4"
+    };
+    static const char *const sums[] = {
+        "1.5", "-0.5", "99999999.49", "99999999.50", "-0.50", "-0.499",
+        "2.501", "NaN", "NaN"
+    };
+    numeric nums[9];
+    numeric_array arr;
+    char *str;
+    int nthreads;
+    int i;
+
+    for (i = 0; i < 9; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &nums[i]));
+    }
+
+    /* the same totals however the rows are split among threads */
+    numeric_array_init(&arr);
+    for (nthreads = 1; nthreads <= 16; nthreads *= 2)
+    {
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_prefix_sum(nums, 9, &arr, nthreads));
+        cut_assert_equal_int(9, arr.n);
+        for (i = 0; i < 9; i++)
+        {
+            cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+                numeric_to_str(&arr.values[i], -1, &str));
+            cut_assert_equal_string(sums[i], str);
+            free(str);
+        }
+    }
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_prefix_sum(nums, 0, &arr, 4));
+    cut_assert_equal_int(0, arr.n);
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_prefix_sum(nums, -1, &arr, 1));
+    numeric_array_dispose(&arr);
+
+    for (i = 0; i < 9; i++)
+        numeric_dispose(&nums[i]);
+}
+
+void test_numeric_compact(void)
+{
+    static const char *const values[] = {
+        "3.25", "-1000000.5", "0", "NaN", "0.00012", "-2"
+    };
+    static const int order[] = {1, 5, 2, 4, 0, 3};
+    numeric nums[6];
+    numeric_compact packed[6];
+    numeric_compact single;
+    NumericDigit *digitbuf;
+    numeric view;
+    numeric r;
+    char *str;
+    int i;
+
+    if (sizeof(void *) == 8)
+        cut_assert_equal_int(16, (int) sizeof(numeric_compact));
+
+    for (i = 0; i < 6; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &nums[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_compact_pack_array(nums, 6, packed, &digitbuf));
+
+    /* unpacking gives back the original values */
+    for (i = 0; i < 6; i++)
+    {
+        numeric_init(&r);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_compact_unpack(&packed[i], &r));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&r, -1, &str));
+        cut_assert_equal_string(values[i], str);
+        free(str);
+        numeric_dispose(&r);
+    }
+    numeric_init(&r);
+
+    /* packed values compare like numerics */
+    for (i = 0; i < 5; i++)
+        cut_assert_equal_int(-1, numeric_compact_cmp(&packed[order[i]],
+                                                     &packed[order[i + 1]]));
+    cut_assert_equal_int(0, numeric_compact_cmp(&packed[3], &packed[3]));
+
+    /* views feed the arithmetic without copying */
+    numeric_compact_view(&packed[0], &view);
+    cut_assert_true(view.digits == packed[0].digits);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_mul(&view, &nums[5], &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("-6.50", str);
+    free(str);
+    free(digitbuf);
+
+    numeric_compact_init(&single);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_compact_pack(&nums[1], &single));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_compact_pack(&nums[4], &single));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_compact_unpack(&single, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("0.00012", str);
+    free(str);
+    numeric_compact_dispose(&single);
+
+    numeric_dispose(&r);
+    for (i = 0; i < 6; i++)
+        numeric_dispose(&nums[i]);
+}
+
+void test_numeric_sortkey(void)
+{
+    /* in ascending order */
+    static const char *const values[] = {
+        "-100000", "-1.0001", "-1.00000001", "-1", "-0.5", "0",
+        "0.0001", "1", "1.00000001", "99999999", "100000000", "NaN"
+    };
+    unsigned char keys[12][32];
+    size_t lengths[12];
+    numeric x;
+    numeric r;
+    char *str;
+    int i;
+
+    for (i = 0; i < 12; i++)
+    {
+        numeric_init(&x);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(values[i], -1, -1, &x));
+        cut_assert_true(numeric_sortkey_max_length(&x) <= sizeof(keys[i]));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_sortkey(&x, keys[i], sizeof(keys[i]), &lengths[i]));
+
+        /* keys decode to the same value, with the natural scale */
+        numeric_init(&r);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_sortkey(keys[i], lengths[i], -1, &r));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&r, -1, &str));
+        cut_assert_equal_string(values[i], str);
+        free(str);
+        numeric_dispose(&r);
+        numeric_dispose(&x);
+    }
+
+    /* memcmp() order, shorter first on a common prefix, is numeric order */
+    for (i = 0; i < 11; i++)
+    {
+        size_t n = lengths[i] < lengths[i + 1] ? lengths[i] : lengths[i + 1];
+        int c = memcmp(keys[i], keys[i + 1], n);
+
+        cut_assert_true(c < 0 || (c == 0 && lengths[i] < lengths[i + 1]));
+    }
+
+    /* the key ignores dscale; decoding takes it as an argument */
+    numeric_init(&x);
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("1.000", -1, -1, &x));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_sortkey(&x, keys[0], sizeof(keys[0]), &lengths[0]));
+    cut_assert_equal_int((int) lengths[7], (int) lengths[0]);
+    cut_assert_equal_int(0, memcmp(keys[0], keys[7], lengths[0]));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_sortkey(keys[0], lengths[0], 2, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string("1.00", str);
+    free(str);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_BUFFER_TOO_SMALL,
+        numeric_sortkey(&x, keys[0], 2, &lengths[0]));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_from_sortkey(keys[7], lengths[7] - 1, -1, &r));
+    numeric_dispose(&r);
+    numeric_dispose(&x);
+}
+
+#define TEST_WIDTH_BUCKET(expected_errcode, expected, operand, bound1, \
+        bound2, count) \
+do { \
+    numeric x; \
+    numeric b1; \
+    numeric b2; \
+    int bucket = -1; \
+ \
+    numeric_init(&x); \
+    numeric_init(&b1); \
+    numeric_init(&b2); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((operand), -1, -1, &x)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((bound1), -1, -1, &b1)); \
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR, \
+        numeric_from_str((bound2), -1, -1, &b2)); \
+    cut_assert_equal_int((expected_errcode), \
+        numeric_width_bucket(&x, &b1, &b2, (count), &bucket)); \
+    if ((expected_errcode) == NUMERIC_ERRCODE_NO_ERROR) \
+        cut_assert_equal_int((expected), bucket); \
+    numeric_dispose(&b2); \
+    numeric_dispose(&b1); \
+    numeric_dispose(&x); \
+} while (0)
+
+void test_numeric_width_bucket(void)
+{
+    static const char *const bounds[] = {
+        "-1", "0", "1.5", "1.5", "123456789.01", "123456789.02", "NaN"
+    };
+    static const char *const operands[] = {
+        "-2", "-1", "-0.5", "1.5", "2", "123456789.015", "123456789.02",
+        "1e20", "NaN"
+    };
+    static const int expected_bounds[] = { 0, 1, 1, 4, 4, 5, 6, 6, 7 };
+    static const char *const range_operands[] = {
+        "-0.1", "0", "3.33", "3.3333333333333333333333333",
+        "3.3333333333333333333333334", "9.99", "10"
+    };
+    static const int expected_range[] = { 0, 1, 1, 1, 2, 3, 4 };
+    static const int expected_reversed[] = { 4, 4, 3, 3, 2, 1, 1 };
+    numeric nums[9];
+    numeric pair[2];
+    numeric b1;
+    numeric b2;
+    numeric_buckets *buckets;
+    int results[9];
+    int i;
+
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 3,
+        "5.35", "0.024", "10.06", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 0, "-1", "0", "10", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 1, "0", "0", "10", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 6, "10", "0", "10", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 5, "0.1", "10", "0", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 6, "0", "10", "0", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 0, "10.5", "10", "0", 5);
+    /* exact: (1 - 0) * 3 / 3 is 1, not 0.999... */
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NO_ERROR, 2, "1", "0", "3", 3);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_INVALID_ARGUMENT, 0, "1", "0", "10", 0);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_INVALID_ARGUMENT, 0, "1", "5", "5", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_INVALID_ARGUMENT, 0,
+        "NaN", "0", "10", 5);
+    TEST_WIDTH_BUCKET(NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE, 0,
+        "10", "0", "10", INT_MAX);
+
+    /* thresholds, including ones sharing a long sort key prefix */
+    for (i = 0; i < 7; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(bounds[i], -1, -1, &nums[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_from_bounds(nums, 7, &buckets));
+    for (i = 0; i < 7; i++)
+        numeric_dispose(&nums[i]);
+    for (i = 0; i < 9; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(operands[i], -1, -1, &nums[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_assign(buckets, nums, 9, results));
+    for (i = 0; i < 9; i++)
+        cut_assert_equal_int(expected_bounds[i], results[i]);
+    numeric_buckets_free(buckets);
+
+    /* thresholds out of order */
+    pair[0] = nums[4];
+    pair[1] = nums[0];
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_buckets_from_bounds(pair, 2, &buckets));
+    for (i = 0; i < 9; i++)
+        numeric_dispose(&nums[i]);
+
+    /*
+     * Equal width, with boundaries at thirds: operands past the rounded
+     * boundaries' places agree with numeric_width_bucket() too.
+     */
+    numeric_init(&b1);
+    numeric_init(&b2);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("0", -1, -1, &b1));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("10", -1, -1, &b2));
+    for (i = 0; i < 7; i++)
+    {
+        numeric_init(&nums[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(range_operands[i], -1, -1, &nums[i]));
+    }
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_from_range(&b1, &b2, 3, &buckets));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_assign(buckets, nums, 7, results));
+    for (i = 0; i < 7; i++)
+        cut_assert_equal_int(expected_range[i], results[i]);
+    numeric_buckets_free(buckets);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_from_range(&b2, &b1, 3, &buckets));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_buckets_assign(buckets, nums, 7, results));
+    for (i = 0; i < 7; i++)
+        cut_assert_equal_int(expected_reversed[i], results[i]);
+
+    /* NaN operands are an error as for numeric_width_bucket() */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str("NaN", -1, -1, &nums[3]));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_buckets_assign(buckets, nums, 7, results));
+    numeric_buckets_free(buckets);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_buckets_from_range(&b1, &b1, 3, &buckets));
+    for (i = 0; i < 7; i++)
+        numeric_dispose(&nums[i]);
+    numeric_dispose(&b2);
+    numeric_dispose(&b1);
+}
+
+void test_numeric_write_text(void)
+{
+    static const char *const strs[] = {
+        "1.5", "-2", "NaN", "0.125", "12345678.9", "0", "9999.9999", "-0.004"
+    };
+    static const bool nulls[] = {
+        false, false, false, false, false, true, false, false
+    };
+    static const int scales[] = {-1, 2};
+    numeric values[8];
+    numeric_textbuf buf = {NULL, 0, 0};
+    numeric_text_options opts;
+    size_t offsets[5];
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        numeric_init(&values[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(strs[i], -1, -1, &values[i]));
+    }
+
+    /*
+     * CSV with the defaults; the second column is rounded to 2 places,
+     * keeping the sign of a negative value that rounds to zero just as
+     * numeric_to_str() does
+     */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_write_text(&buf, values, nulls, 4, 2, scales, NULL,
+                           offsets));
+    cut_assert_equal_string(
+        "1.5,-2.00\nNaN,0.13\n12345678.9,\n9999.9999,-0.00\n", buf.data);
+    cut_assert_equal_int(0, (int) offsets[0]);
+    cut_assert_equal_int(10, (int) offsets[1]);
+    cut_assert_equal_int(19, (int) offsets[2]);
+    cut_assert_equal_int(31, (int) offsets[3]);
+    cut_assert_equal_int(47, (int) offsets[4]);
+    cut_assert_equal_int(47, (int) buf.len);
+
+    /* appended TSV with every field quoted and custom NaN and NULL */
+    memset(&opts, 0, sizeof(opts));
+    opts.delimiter = "\t";
+    opts.newline = "\r\n";
+    opts.quote = '"';
+    opts.force_quote = true;
+    opts.nan_text = "not \"a\" number";
+    opts.null_text = "\\N";
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_write_text(&buf, values + 2, nulls + 2, 2, 2, NULL, &opts,
+                           NULL));
+    cut_assert_equal_string("\"not \"\"a\"\" number\"\t\"0.125\"\r\n"
+                            "\"12345678.9\"\t\\N\r\n",
+                            buf.data + 47);
+
+    /* numbers are quoted only when they contain the delimiter */
+    buf.len = 0;
+    opts.delimiter = ".";
+    opts.newline = NULL;
+    opts.force_quote = false;
+    opts.nan_text = NULL;
+    opts.null_text = NULL;
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_write_text(&buf, values, NULL, 1, 3, NULL, &opts, NULL));
+    cut_assert_equal_string("\"1.5\".-2.NaN\n", buf.data);
+
+    /* rounding carries into a new digit, as in numeric_to_str() */
+    buf.len = 0;
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_write_text(&buf, values + 6, NULL, 1, 1, scales + 1, NULL,
+                           NULL));
+    cut_assert_equal_string("10000.00\n", buf.data);
+
+    opts.quote = '-';
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_write_text(&buf, values, NULL, 1, 1, NULL, &opts, NULL));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_write_text(&buf, values, NULL, 1, 0, NULL, NULL, NULL));
+    cut_assert_equal_string("10000.00\n", buf.data);
+
+    free(buf.data);
+    for (i = 0; i < 8; i++)
+        numeric_dispose(&values[i]);
+}
+
+static void
+test_formula(const char *expected, const char *expr, const char *a,
+        const char *b)
+{
+    static const char *const names[] = {"a", "b"};
+    numeric_formula *formula;
+    numeric inputs[2];
+    numeric r;
+    NumericDigit digits[16];
+    char *str;
+
+    numeric_init(&inputs[0]);
+    numeric_init(&inputs[1]);
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(a, -1, -1, &inputs[0]));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_from_str(b, -1, -1, &inputs[1]));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile(expr, names, 2, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_eval(formula, inputs, &r));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string(expected, str);
+    free(str);
+
+    numeric_dispose(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_eval_into(formula, inputs, digits, 16, &r));
+    cut_assert_null(r.buf);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_to_str(&r, -1, &str));
+    cut_assert_equal_string(expected, str);
+    free(str);
+
+    numeric_formula_free(formula);
+    numeric_dispose(&inputs[1]);
+    numeric_dispose(&inputs[0]);
+}
+
+void test_numeric_formula_eval(void)
+{
+    static const char *const names[] = {"price", "qty", "rate"};
+    static const char *const rows[3][3] = {
+        {"19.99", "3", "8.25"},
+        {"0.10", "7", "0"},
+        {"1000", "1", "-12.5"}
+    };
+    static const char *const expected[3] = {"64.92", "0.70", "875.00"};
+    numeric_formula *formula;
+    numeric inputs[9];
+    numeric results[3];
+    char *deep;
+    char *str;
+    int i;
+
+    test_formula("7", "a + b * 2", "1", "3");
+    test_formula("8", "(a + b) * 2", "1", "3");
+    test_formula("-4.0000000000000000", "-2 ^ 2", "0", "0");
+    test_formula("512.0000000000000000", "2 ^ 3 ^ 2", "0", "0");
+    test_formula("2.5", "A", "2.5", "0");
+    test_formula("42", "42", "0", "0");
+    test_formula("1500", "1.5e3", "0", "0");
+    test_formula("1", "a % b", "7", "3");
+    test_formula("2", "div(a, b)", "7", "3");
+    test_formula("4", "max(a, b) - min(a, b)", "7", "3");
+    test_formula("3.14", "round(a, b)", "3.14159", "2");
+    test_formula("3", "trunc(a)", "3.9", "0");
+    test_formula("-3.9", "-abs(a) * sign(b)", "3.9", "5");
+    test_formula("1.414213562373095", "sqrt(a) + 0 * b", "2", "0");
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile("price +", names, 3, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile("price * cost", names, 3, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile("nosuch(price)", names, 3, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile("round(price, 2, 3)", names, 3, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile("(price", names, 3, &formula));
+
+    /* nesting is bounded instead of overflowing the stack */
+    deep = (char *) malloc(2 * 100000 + 6);
+    memset(deep, '(', 100000);
+    strcpy(deep + 100000, "price");
+    memset(deep + 100005, ')', 100000);
+    deep[200005] = '\0';
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile(deep, names, 3, &formula));
+    memset(deep, '-', 100000);
+    deep[100005] = '\0';
+    cut_assert_equal_int(NUMERIC_ERRCODE_INVALID_ARGUMENT,
+        numeric_formula_compile(deep, names, 3, &formula));
+    strcpy(deep + 100, "price");
+    memset(deep + 105, ')', 100);
+    deep[205] = '\0';
+    memset(deep, '(', 100);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile(deep, names, 3, &formula));
+    numeric_formula_free(formula);
+    free(deep);
+
+    /* constant sub-expressions are folded at compile time */
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_formula_compile("price * (1 / 0)", names, 3, &formula));
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile("round(price * qty * (1 + rate / 100), 2)",
+            names, 3, &formula));
+    for (i = 0; i < 9; i++)
+    {
+        numeric_init(&inputs[i]);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(rows[i / 3][i % 3], -1, -1, &inputs[i]));
+    }
+    for (i = 0; i < 3; i++)
+        numeric_init(&results[i]);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_eval_batch(formula, inputs, 3, results));
+    for (i = 0; i < 3; i++)
+    {
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&results[i], -1, &str));
+        cut_assert_equal_string(expected[i], str);
+        free(str);
+        numeric_dispose(&results[i]);
+    }
+    numeric_formula_free(formula);
+
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile("price / (qty - 1)", names, 3, &formula));
+    numeric_init(&results[0]);
+    cut_assert_equal_int(NUMERIC_ERRCODE_DIVISION_BY_ZERO,
+        numeric_formula_eval(formula, &inputs[6], &results[0]));
+    numeric_dispose(&results[0]);
+    numeric_formula_free(formula);
+
+    for (i = 0; i < 9; i++)
+        numeric_dispose(&inputs[i]);
+}
+
+void test_numeric_formula_eval_into(void)
+{
+    static const char *const names[] = {"x", "y"};
+    numeric_formula *formula;
+    numeric inputs[2];
+    numeric r;
+    NumericDigit digits[8];
+    char buf[32];
+    char *str;
+    char *str2;
+    int i;
+
+    numeric_init(&inputs[0]);
+    numeric_init(&inputs[1]);
+    numeric_init(&r);
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile("round(exp(x / 10) * (x + y) / 7 - y, 4)",
+            names, 2, &formula));
+
+    /* the registers are reused from row to row */
+    for (i = 0; i < 50; i++)
+    {
+        snprintf(buf, sizeof(buf), "%d.25", i);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(buf, -1, -1, &inputs[0]));
+        snprintf(buf, sizeof(buf), "%d", 1000 - i * 37);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_from_str(buf, -1, -1, &inputs[1]));
+
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_formula_eval(formula, inputs, &r));
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&r, -1, &str));
+        numeric_dispose(&r);
+
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_formula_eval_into(formula, inputs, digits, 8, &r));
+        cut_assert_true(r.digits == digits);
+        cut_assert_null(r.buf);
+        cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+            numeric_to_str(&r, -1, &str2));
+        cut_assert_equal_string(str, str2);
+        free(str);
+        free(str2);
+    }
+
+    /* a result that does not fit the caller's digits */
+    cut_assert_equal_int(NUMERIC_ERRCODE_BUFFER_TOO_SMALL,
+        numeric_formula_eval_into(formula, inputs, digits, 1, &r));
+    numeric_formula_free(formula);
+
+    /* a formula that is a single input */
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_compile("y", names, 2, &formula));
+    cut_assert_equal_int(NUMERIC_ERRCODE_NO_ERROR,
+        numeric_formula_eval_into(formula, inputs, digits, 8, &r));
+    cut_assert_true(r.digits == digits);
+    cut_assert_equal_int(0, numeric_cmp(&r, &inputs[1]));
+    numeric_formula_free(formula);
+
+    numeric_dispose(&inputs[1]);
+    numeric_dispose(&inputs[0]);
+}
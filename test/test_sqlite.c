@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+#include <cutter.h>
+
+/*
+ * The extension is loaded from the build tree, the way an application
+ * would load it with sqlite3_load_extension().
+ */
+static sqlite3 *
+open_db(void)
+{
+    const char *base_dir = getenv("BASE_DIR");
+    char        path[1024];
+    char       *errmsg = NULL;
+    sqlite3    *db;
+
+    snprintf(path, sizeof(path), "%s/../sqlite/.libs/pgnumeric",
+             base_dir ? base_dir : ".");
+    cut_assert_equal_int(SQLITE_OK, sqlite3_open(":memory:", &db));
+    cut_assert_equal_int(SQLITE_OK, sqlite3_enable_load_extension(db, 1));
+    cut_assert_equal_int(SQLITE_OK,
+        sqlite3_load_extension(db, path, "sqlite3_pgnumeric_init", &errmsg));
+    sqlite3_free(errmsg);
+    return db;
+}
+
+static void
+exec(sqlite3 *db, const char *sql)
+{
+    cut_assert_equal_int(SQLITE_OK, sqlite3_exec(db, sql, NULL, NULL, NULL));
+}
+
+/* Check the rows of a single-column query, joined with commas */
+static void
+assert_query(const char *expected, sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    char        buf[1024];
+    size_t      len = 0;
+    int         rc;
+
+    buf[0] = '\0';
+    cut_assert_equal_int(SQLITE_OK,
+        sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        const char *text = (const char *) sqlite3_column_text(stmt, 0);
+
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+                        len > 0 ? "," : "", text ? text : "NULL");
+    }
+    if (rc != SQLITE_DONE)
+        snprintf(buf, sizeof(buf), "error: %s", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    cut_assert_equal_string(expected, buf);
+}
+
+void test_sqlite_functions(void)
+{
+    sqlite3 *db = open_db();
+
+    assert_query("0.3", db, "SELECT numeric_text(numeric_add('0.1', 0.2))");
+    assert_query("-0.1", db, "SELECT numeric_text(numeric_sub(0.1, '0.2'))");
+    assert_query("6.0000", db,
+        "SELECT numeric_text(numeric_mul('2.00', '3.00'))");
+    assert_query("0.33333333333333333333", db,
+        "SELECT numeric_text(numeric_div(1, 3))");
+    assert_query("1", db, "SELECT numeric_text(numeric_mod(10, 3))");
+    assert_query("2.35,-2", db,
+        "SELECT numeric_text(numeric_round('2.345', 2)) "
+        "UNION ALL SELECT numeric_text(numeric_trunc('-2.9'))");
+    assert_query("1.414213562373095", db,
+        "SELECT numeric_text(numeric_sqrt(2))");
+    assert_query("1024.0000000000000000", db,
+        "SELECT numeric_text(numeric_power(2, 10))");
+    assert_query("NULL", db, "SELECT numeric_add(1, NULL)");
+    assert_query("-1,0,1", db,
+        "SELECT numeric_cmp(1, '1.5') UNION ALL "
+        "SELECT numeric_cmp('1.0', numeric('1.00')) UNION ALL "
+        "SELECT numeric_cmp('NaN', 1e300)");
+    assert_query("error: division by zero", db,
+        "SELECT numeric_div(1, 0)");
+    assert_query("error: invalid numeric argument", db,
+        "SELECT numeric('abc')");
+
+    /* blobs round-trip, keeping their scale */
+    assert_query("12345678901234567890.123450", db,
+        "SELECT numeric_text(numeric(numeric("
+        "'12345678901234567890.123450')))");
+
+    sqlite3_close(db);
+}
+
+void test_sqlite_aggregates(void)
+{
+    sqlite3 *db = open_db();
+
+    exec(db, "CREATE TABLE t (g INTEGER, v BLOB)");
+    exec(db,
+        "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+        "WHERE i < 10000) "
+        "INSERT INTO t SELECT i % 2, numeric('0.10') FROM n");
+    exec(db, "INSERT INTO t VALUES (2, numeric('-3.5')), (2, NULL), "
+             "(2, numeric('12')), (2, numeric('1e-3'))");
+
+    /* no drift, unlike sum() over REAL */
+    assert_query("1000.00", db,
+        "SELECT numeric_text(numeric_sum(v)) FROM t WHERE g < 2");
+    assert_query("500.00,500.00,8.501", db,
+        "SELECT numeric_text(numeric_sum(v)) FROM t GROUP BY g");
+    assert_query("2.8336666666666667", db,
+        "SELECT numeric_text(numeric_avg(v)) FROM t WHERE g = 2");
+    assert_query("-3.5,12", db,
+        "SELECT numeric_text(numeric_min(v)) FROM t WHERE g = 2 UNION ALL "
+        "SELECT numeric_text(numeric_max(v)) FROM t WHERE g = 2");
+    assert_query("NULL", db,
+        "SELECT numeric_sum(v) FROM t WHERE g = 3");
+
+    /* integers and text are summed exactly too */
+    assert_query("18446744073709551614", db,
+        "SELECT numeric_text(numeric_sum(x)) FROM "
+        "(SELECT 9223372036854775807 AS x UNION ALL "
+        "SELECT 9223372036854775807)");
+
+    /* BLOB columns sort in numeric order */
+    assert_query("-3.5,0.001,0.10,12", db,
+        "SELECT DISTINCT numeric_text(v) FROM t WHERE v IS NOT NULL "
+        "ORDER BY v");
+
+    sqlite3_close(db);
+}
+
+void test_sqlite_collation(void)
+{
+    sqlite3 *db = open_db();
+
+    exec(db, "CREATE TABLE s (v TEXT COLLATE NUMERIC)");
+    exec(db, "INSERT INTO s VALUES ('10'), ('9.5'), ('-2'), ('abc'), "
+             "('1e2'), ('NaN'), ('0.0')");
+    assert_query("-2,0.0,9.5,10,1e2,NaN,abc", db,
+        "SELECT v FROM s ORDER BY v");
+    assert_query("1", db, "SELECT '1.50' = '1.5' COLLATE NUMERIC");
+    assert_query("2", db,
+        "SELECT count(*) FROM (SELECT v FROM "
+        "(SELECT '1.0' AS v UNION ALL SELECT '1.00' UNION ALL SELECT '2') "
+        "GROUP BY v COLLATE NUMERIC)");
+
+    sqlite3_close(db);
+}
+
+/*
+ * Stored values keep their scale, so BLOB comparison tells 1.0 from 1.00;
+ * numeric_trim_scale() gives one BLOB per numeric value.
+ */
+void test_sqlite_scale(void)
+{
+    sqlite3 *db = open_db();
+
+    exec(db, "CREATE TABLE t (v BLOB)");
+    exec(db, "INSERT INTO t VALUES (numeric('1.0')), (numeric('1.00')), "
+             "(numeric('1')), (numeric('2.50')), (numeric('2.5'))");
+
+    assert_query("0,1,0", db,
+        "SELECT numeric('1.0') = numeric('1.00') UNION ALL "
+        "SELECT numeric_trim_scale('1.0') = numeric_trim_scale('1.00') "
+        "UNION ALL SELECT numeric_cmp('1.0', '1.00')");
+
+    /* as stored: one group per representation, ordered by scale */
+    assert_query("5", db, "SELECT count(DISTINCT v) FROM t");
+    assert_query("1,1.0,1.00,2.5,2.50", db,
+        "SELECT numeric_text(v) FROM t GROUP BY v ORDER BY v");
+
+    /* by value */
+    assert_query("2", db,
+        "SELECT count(DISTINCT numeric_trim_scale(v)) FROM t");
+    assert_query("1:3,2.5:2", db,
+        "SELECT numeric_text(numeric_trim_scale(v)) || ':' || count(*) "
+        "FROM t GROUP BY numeric_trim_scale(v) ORDER BY 1");
+    exec(db, "CREATE TABLE u (v BLOB)");
+    exec(db, "CREATE UNIQUE INDEX u_value ON u (numeric_trim_scale(v))");
+    assert_query("error: UNIQUE constraint failed: index 'u_value'", db,
+        "INSERT INTO u VALUES (numeric('3.0')), (numeric('3'))");
+
+    sqlite3_close(db);
+}
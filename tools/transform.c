@@ -0,0 +1,753 @@
+/*-------------------------------------------------------------------------
+ *
+ * transform.c
+ *    pgnumeric-transform: apply a formula to numeric columns of a CSV file.
+ *
+ *    pgnumeric-transform -e 'round(price * qty, 2)' -c price=3,qty=4 in.csv
+ *
+ * The input is memory-mapped and cut into chunks on line boundaries.  A
+ * pool of threads takes chunks in turn; each thread has its own compiled
+ * copy of the formula (compiled formulas own their registers) and renders
+ * its chunk into a private buffer.  The main thread writes the buffers
+ * out in input order, so the output is identical whatever the number of
+ * threads, and at most a few chunks per thread are held in memory.
+ *
+ * Each output line is the input line with the result appended as a new
+ * last field, or put in place of field -r.  Rows whose inputs do not
+ * parse, or whose formula raises an error, are reported on stderr with
+ * their line number and get an empty result; the exit status is then 1.
+ *
+ * Copyright (c) 2011, Hiroaki Nakamura
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numeric.h"
+
+#define CHUNK_SIZE          (4 * 1024 * 1024)
+#define CHUNKS_PER_THREAD   4       /* chunks in flight per worker */
+#define MAX_BINDINGS        64
+#define MAX_FIELD_LEN       1024
+
+/* A formula input taken from a CSV column */
+typedef struct binding
+{
+    char       *name;
+    int         column;         /* 1-based; 0 until resolved from header */
+} binding;
+
+typedef struct options
+{
+    const char *expr;
+    const char *input;
+    const char *output;
+    const char *result_name;
+    char        delim;
+    bool        header;
+    int         nthreads;
+    int         replace;        /* 1-based column to replace, 0 to append */
+    binding     bindings[MAX_BINDINGS];
+    int         nbindings;
+} options;
+
+typedef struct row_error
+{
+    long        line;           /* line number within the chunk, 1-based */
+    numeric_errcode_t errcode;
+} row_error;
+
+/* A slice of the input and, once processed, its rendered output */
+typedef struct chunk
+{
+    const char *begin;
+    const char *end;
+    char       *out;
+    size_t      outlen;
+    size_t      outcap;
+    long        nlines;
+    row_error  *errors;
+    int         nerrors;
+    int         errcap;
+    bool        failed;         /* out of memory */
+    bool        done;
+} chunk;
+
+typedef struct job
+{
+    const options *opts;
+    chunk      *chunks;
+    int         nchunks;
+    int         next;           /* next chunk to hand out */
+    int         written;        /* chunks already written by main */
+    int         window;         /* chunks allowed ahead of written */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} job;
+
+static void usage(void);
+static bool parse_bindings(options *opts, char *arg);
+static bool resolve_header(options *opts, const char *line,
+        const char *end);
+static const char *next_field(const char *p, const char *end, char delim,
+        const char **field_end);
+static void *worker(void *arg);
+static void process_chunk(const options *opts, numeric_formula *formula,
+        numeric *inputs, numeric *result, chunk *c);
+static numeric_errcode_t process_line(const options *opts,
+        numeric_formula *formula, numeric *inputs, numeric *result,
+        const char *line, const char *end, chunk *c);
+static bool out_append(chunk *c, const char *data, size_t len);
+static const char *errcode_message(numeric_errcode_t errcode);
+
+
+int
+main(int argc, char **argv)
+{
+    options     opts;
+    job         jb;
+    pthread_t  *threads;
+    struct stat st;
+    struct timespec start;
+    struct timespec stop;
+    const char *data;
+    const char *body;
+    const char *end;
+    FILE       *out;
+    numeric_formula *formula;
+    long        lines_before = 0;
+    long        nrows = 0;
+    long        nerrors = 0;
+    double      elapsed;
+    int         fd;
+    int         opt;
+    int         i;
+    int         j;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.delim = ',';
+    opts.result_name = "result";
+    opts.nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts.nthreads < 1)
+        opts.nthreads = 1;
+
+    while ((opt = getopt(argc, argv, "c:d:e:Hn:o:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (!parse_bindings(&opts, optarg))
+                    return 2;
+                break;
+            case 'd':
+                if (strcmp(optarg, "\\t") == 0)
+                    opts.delim = '\t';
+                else if (strlen(optarg) == 1)
+                    opts.delim = optarg[0];
+                else
+                {
+                    fprintf(stderr, "delimiter must be one character\n");
+                    return 2;
+                }
+                break;
+            case 'e':
+                opts.expr = optarg;
+                break;
+            case 'H':
+                opts.header = true;
+                break;
+            case 'n':
+                opts.result_name = optarg;
+                break;
+            case 'o':
+                opts.output = optarg;
+                break;
+            case 'r':
+                opts.replace = atoi(optarg);
+                if (opts.replace < 1)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 't':
+                opts.nthreads = atoi(optarg);
+                if (opts.nthreads < 1)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (opts.expr == NULL || optind != argc - 1)
+    {
+        usage();
+        return 2;
+    }
+    opts.input = argv[optind];
+
+    /* Map the input */
+    fd = open(opts.input, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", opts.input, strerror(errno));
+        return 2;
+    }
+    data = "";
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "%s: %s\n", opts.input, strerror(errno));
+            return 2;
+        }
+        madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    }
+    end = data + st.st_size;
+
+    out = stdout;
+    if (opts.output != NULL && (out = fopen(opts.output, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", opts.output, strerror(errno));
+        return 2;
+    }
+
+    /* The header line names the columns and is copied through */
+    body = data;
+    if (opts.header && data < end)
+    {
+        const char *eol = memchr(data, '\n', end - data);
+        const char *line_end = eol ? eol : end;
+
+        body = eol ? eol + 1 : end;
+        lines_before = 1;
+        if (line_end > data && line_end[-1] == '\r')
+            line_end--;
+        if (!resolve_header(&opts, data, line_end))
+            return 2;
+        fwrite(data, 1, line_end - data, out);
+        if (opts.replace == 0)
+            fprintf(out, "%c%s", opts.delim, opts.result_name);
+        fputc('\n', out);
+    }
+    for (i = 0; i < opts.nbindings; i++)
+    {
+        if (opts.bindings[i].column == 0)
+        {
+            fprintf(stderr, "column for \"%s\" not given\n",
+                    opts.bindings[i].name);
+            return 2;
+        }
+    }
+
+    /* Check the formula once here, so that workers cannot fail to compile */
+    {
+        const char *names[MAX_BINDINGS];
+
+        for (i = 0; i < opts.nbindings; i++)
+            names[i] = opts.bindings[i].name;
+        if (numeric_formula_compile(opts.expr, names, opts.nbindings,
+                                    &formula) != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            fprintf(stderr, "invalid formula: %s\n", opts.expr);
+            return 2;
+        }
+        numeric_formula_free(formula);
+    }
+
+    /* Cut the body into chunks that end on line boundaries */
+    memset(&jb, 0, sizeof(jb));
+    jb.opts = &opts;
+    jb.nchunks = (int) ((end - body) / CHUNK_SIZE) + 1;
+    jb.chunks = (chunk *) calloc(jb.nchunks, sizeof(chunk));
+    threads = (pthread_t *) malloc(opts.nthreads * sizeof(pthread_t));
+    if (jb.chunks == NULL || threads == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    for (i = 0; i < jb.nchunks; i++)
+    {
+        const char *target = (i == 0) ? body : jb.chunks[i - 1].end;
+        const char *eol;
+
+        jb.chunks[i].begin = target;
+        target = (end - target > CHUNK_SIZE) ? target + CHUNK_SIZE : end;
+        eol = (target < end) ? memchr(target, '\n', end - target) : NULL;
+        jb.chunks[i].end = eol ? eol + 1 : end;
+    }
+    jb.window = opts.nthreads * CHUNKS_PER_THREAD;
+    pthread_mutex_init(&jb.lock, NULL);
+    pthread_cond_init(&jb.cond, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < opts.nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, &jb);
+
+    /* Write the chunks out in order as they complete */
+    for (i = 0; i < jb.nchunks; i++)
+    {
+        chunk      *c = &jb.chunks[i];
+
+        pthread_mutex_lock(&jb.lock);
+        while (!c->done)
+            pthread_cond_wait(&jb.cond, &jb.lock);
+        pthread_mutex_unlock(&jb.lock);
+
+        if (c->failed)
+        {
+            fprintf(stderr, "out of memory\n");
+            return 2;
+        }
+        fwrite(c->out, 1, c->outlen, out);
+        for (j = 0; j < c->nerrors; j++)
+            fprintf(stderr, "%s:%ld: %s\n", opts.input,
+                    lines_before + c->errors[j].line,
+                    errcode_message(c->errors[j].errcode));
+        lines_before += c->nlines;
+        nrows += c->nlines;
+        nerrors += c->nerrors;
+        free(c->out);
+        free(c->errors);
+
+        pthread_mutex_lock(&jb.lock);
+        jb.written = i + 1;
+        pthread_cond_broadcast(&jb.cond);
+        pthread_mutex_unlock(&jb.lock);
+    }
+
+    for (i = 0; i < opts.nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(jb.chunks);
+    if (st.st_size > 0)
+        munmap((void *) data, st.st_size);
+    close(fd);
+
+    if (fflush(out) != 0 || ferror(out))
+    {
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    elapsed = (stop.tv_sec - start.tv_sec) +
+        (stop.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld rows in %.3f s (%.0f rows/s), %d threads",
+            nrows, elapsed, elapsed > 0 ? nrows / elapsed : 0.0,
+            opts.nthreads);
+    if (nerrors > 0)
+        fprintf(stderr, ", %ld errors", nerrors);
+    fputc('\n', stderr);
+
+    return nerrors > 0 ? 1 : 0;
+}
+
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: pgnumeric-transform -e FORMULA -c NAME[=COL],... "
+            "[options] INPUT\n"
+            "\n"
+            "  -e FORMULA  formula to evaluate for every row\n"
+            "  -c NAME=COL bind formula input NAME to column COL "
+            "(1-based);\n"
+            "              with -H, COL defaults to the column named NAME\n"
+            "  -d CHAR     field delimiter (default ',', '\\t' for tab)\n"
+            "  -H          the first line is a header\n"
+            "  -n NAME     header of the appended column "
+            "(default \"result\")\n"
+            "  -o FILE     write to FILE instead of standard output\n"
+            "  -r COL      replace column COL instead of appending\n"
+            "  -t N        number of worker threads "
+            "(default: number of CPUs)\n");
+}
+
+
+/*
+ * parse_bindings() -
+ *
+ *  Add the comma-separated NAME[=COL] bindings in arg to opts.
+ */
+static bool
+parse_bindings(options *opts, char *arg)
+{
+    char       *item;
+    char       *saveptr;
+
+    for (item = strtok_r(arg, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr))
+    {
+        binding    *b;
+        char       *eq;
+
+        if (opts->nbindings == MAX_BINDINGS)
+        {
+            fprintf(stderr, "too many columns\n");
+            return false;
+        }
+        b = &opts->bindings[opts->nbindings++];
+        b->name = item;
+        b->column = 0;
+        eq = strchr(item, '=');
+        if (eq != NULL)
+        {
+            *eq = '\0';
+            b->column = atoi(eq + 1);
+            if (b->column < 1)
+            {
+                fprintf(stderr, "invalid column for \"%s\"\n", item);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/*
+ * resolve_header() -
+ *
+ *  Give bindings without a column number the column whose header matches
+ *  their name.
+ */
+static bool
+resolve_header(options *opts, const char *line, const char *end)
+{
+    const char *p = line;
+    const char *field_end;
+    int         column = 0;
+    int         i;
+
+    while (p != NULL)
+    {
+        const char *f = p;
+
+        p = next_field(p, end, opts->delim, &field_end);
+        column++;
+        if (field_end - f >= 2 && *f == '"')
+        {
+            f++;
+            field_end--;
+        }
+        for (i = 0; i < opts->nbindings; i++)
+        {
+            binding    *b = &opts->bindings[i];
+
+            if (b->column == 0 && strlen(b->name) == (size_t) (field_end - f)
+                && memcmp(b->name, f, field_end - f) == 0)
+                b->column = column;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * next_field() -
+ *
+ *  Find the end of the field starting at p, which may be double-quoted
+ *  with "" standing for a quote, and store it into *field_end.  Returns
+ *  the start of the next field, or NULL if this was the last one.
+ */
+static const char *
+next_field(const char *p, const char *end, char delim,
+        const char **field_end)
+{
+    if (p < end && *p == '"')
+    {
+        for (p++; p < end; p++)
+        {
+            if (*p == '"')
+            {
+                if (p + 1 < end && p[1] == '"')
+                    p++;
+                else
+                {
+                    p++;
+                    break;
+                }
+            }
+        }
+    }
+    while (p < end && *p != delim)
+        p++;
+    *field_end = p;
+    return (p < end) ? p + 1 : NULL;
+}
+
+
+static void *
+worker(void *arg)
+{
+    job        *jb = (job *) arg;
+    const options *opts = jb->opts;
+    const char *names[MAX_BINDINGS];
+    numeric     inputs[MAX_BINDINGS];
+    numeric     result;
+    numeric_formula *formula;
+    int         i;
+
+    for (i = 0; i < opts->nbindings; i++)
+    {
+        names[i] = opts->bindings[i].name;
+        numeric_init(&inputs[i]);
+    }
+    numeric_init(&result);
+    /* main() has already checked that this compiles */
+    numeric_formula_compile(opts->expr, names, opts->nbindings, &formula);
+
+    for (;;)
+    {
+        chunk      *c;
+
+        pthread_mutex_lock(&jb->lock);
+        while (jb->next < jb->nchunks && jb->next >= jb->written + jb->window)
+            pthread_cond_wait(&jb->cond, &jb->lock);
+        if (jb->next == jb->nchunks)
+        {
+            pthread_mutex_unlock(&jb->lock);
+            break;
+        }
+        c = &jb->chunks[jb->next++];
+        pthread_mutex_unlock(&jb->lock);
+
+        process_chunk(opts, formula, inputs, &result, c);
+
+        pthread_mutex_lock(&jb->lock);
+        c->done = true;
+        pthread_cond_broadcast(&jb->cond);
+        pthread_mutex_unlock(&jb->lock);
+    }
+
+    numeric_formula_free(formula);
+    for (i = 0; i < opts->nbindings; i++)
+        numeric_dispose(&inputs[i]);
+    numeric_dispose(&result);
+    return NULL;
+}
+
+
+/*
+ * process_chunk() -
+ *
+ *  Transform every line of c into c->out.
+ */
+static void
+process_chunk(const options *opts, numeric_formula *formula,
+        numeric *inputs, numeric *result, chunk *c)
+{
+    const char *p = c->begin;
+
+    c->outcap = (c->end - c->begin) + (c->end - c->begin) / 2 + 64;
+    c->out = (char *) malloc(c->outcap);
+    if (c->out == NULL)
+    {
+        c->failed = true;
+        return;
+    }
+
+    while (p < c->end && !c->failed)
+    {
+        const char *eol = memchr(p, '\n', c->end - p);
+        const char *line_end = eol ? eol : c->end;
+        numeric_errcode_t errcode;
+
+        c->nlines++;
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+
+        errcode = process_line(opts, formula, inputs, result, p, line_end, c);
+        if (errcode != NUMERIC_ERRCODE_NO_ERROR)
+        {
+            if (c->nerrors == c->errcap)
+            {
+                row_error  *errors;
+
+                c->errcap = c->errcap ? c->errcap * 2 : 16;
+                errors = (row_error *)
+                    realloc(c->errors, c->errcap * sizeof(row_error));
+                if (errors == NULL)
+                {
+                    c->failed = true;
+                    break;
+                }
+                c->errors = errors;
+            }
+            c->errors[c->nerrors].line = c->nlines;
+            c->errors[c->nerrors].errcode = errcode;
+            c->nerrors++;
+        }
+        out_append(c, "\n", 1);
+        p = eol ? eol + 1 : c->end;
+    }
+}
+
+
+/*
+ * process_line() -
+ *
+ *  Evaluate the formula for one line and append the line, with the result
+ *  in place, to c->out.  On error the result field is left empty.
+ */
+static numeric_errcode_t
+process_line(const options *opts, numeric_formula *formula,
+        numeric *inputs, numeric *result, const char *line, const char *end,
+        chunk *c)
+{
+    const char *field_start[MAX_BINDINGS];
+    const char *field_stop[MAX_BINDINGS];
+    const char *replace_start = NULL;
+    const char *replace_stop = NULL;
+    const char *p = line;
+    const char *field_end;
+    char        buf[MAX_FIELD_LEN];
+    char       *str = NULL;
+    numeric_errcode_t errcode = NUMERIC_ERRCODE_NO_ERROR;
+    int         column = 0;
+    int         i;
+
+    for (i = 0; i < opts->nbindings; i++)
+        field_start[i] = NULL;
+
+    /* Locate the fields we need */
+    while (p != NULL)
+    {
+        const char *f = p;
+
+        p = next_field(p, end, opts->delim, &field_end);
+        column++;
+        for (i = 0; i < opts->nbindings; i++)
+        {
+            if (opts->bindings[i].column == column)
+            {
+                field_start[i] = f;
+                field_stop[i] = field_end;
+            }
+        }
+        if (column == opts->replace)
+        {
+            replace_start = f;
+            replace_stop = field_end;
+        }
+    }
+
+    /* Parse them */
+    for (i = 0; i < opts->nbindings && errcode == NUMERIC_ERRCODE_NO_ERROR;
+         i++)
+    {
+        const char *f = field_start[i];
+        size_t      len;
+
+        if (f == NULL)
+        {
+            errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            break;
+        }
+        len = field_stop[i] - f;
+        if (len >= 2 && *f == '"')
+        {
+            f++;
+            len -= 2;
+        }
+        if (len >= sizeof(buf))
+        {
+            errcode = NUMERIC_ERRCODE_INVALID_ARGUMENT;
+            break;
+        }
+        memcpy(buf, f, len);
+        buf[len] = '\0';
+        errcode = numeric_from_str(buf, -1, -1, &inputs[i]);
+    }
+
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_formula_eval(formula, inputs, result);
+    if (errcode == NUMERIC_ERRCODE_NO_ERROR)
+        errcode = numeric_to_str(result, -1, &str);
+
+    /* Render the line */
+    if (opts->replace > 0 && replace_start != NULL)
+    {
+        out_append(c, line, replace_start - line);
+        if (str != NULL)
+            out_append(c, str, strlen(str));
+        out_append(c, replace_stop, end - replace_stop);
+    }
+    else
+    {
+        out_append(c, line, end - line);
+        out_append(c, &opts->delim, 1);
+        if (str != NULL)
+            out_append(c, str, strlen(str));
+    }
+    free(str);
+
+    return errcode;
+}
+
+
+static bool
+out_append(chunk *c, const char *data, size_t len)
+{
+    if (c->outlen + len > c->outcap)
+    {
+        size_t      cap = c->outcap * 2;
+        char       *out;
+
+        if (cap < c->outlen + len)
+            cap = c->outlen + len;
+        out = (char *) realloc(c->out, cap);
+        if (out == NULL)
+        {
+            c->failed = true;
+            return false;
+        }
+        c->out = out;
+        c->outcap = cap;
+    }
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
+    return true;
+}
+
+
+static const char *
+errcode_message(numeric_errcode_t errcode)
+{
+    switch (errcode)
+    {
+        case NUMERIC_ERRCODE_NO_ERROR:
+            return "no error";
+        case NUMERIC_ERRCODE_DIVISION_BY_ZERO:
+            return "division by zero";
+        case NUMERIC_ERRCODE_INVALID_ARGUMENT:
+            return "invalid input";
+        case NUMERIC_ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE:
+            return "value out of range";
+        case NUMERIC_ERRCODE_OUT_OF_MEMORY:
+            return "out of memory";
+        case NUMERIC_ERRCODE_BUFFER_TOO_SMALL:
+            return "buffer too small";
+        case NUMERIC_ERRCODE_CANCELLED:
+            return "cancelled";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,361 @@
+/*-------------------------------------------------------------------------
+ *
+ * tuneup.c
+ *    pgnumeric-tuneup: measure algorithm crossover thresholds on this host.
+ *
+ *    pgnumeric-tuneup -o src/numeric_tune_local.h
+ *
+ * numeric.c picks between algorithms by operand size, using thresholds
+ * from numeric_tune.h.  This program is linked against its own copy of
+ * numeric.c built with NUMERIC_TUNE, where each threshold is a variable.
+ * For every threshold it times the public operation that depends on it
+ * with the threshold forced off and forced on, over growing operand
+ * sizes, and takes the size from which the newer algorithm stays faster.
+ * The results are written as numeric_tune_local.h, which numeric_tune.h
+ * includes ahead of its defaults.
+ *
+ * Timings take the best of several runs, each repeated until it lasts a
+ * few milliseconds, so an otherwise idle machine gives stable results.
+ *
+ * Copyright (c) 2011, Hiroaki Nakamura
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numeric.h"
+
+#define MIN_DIGITS          16      /* smallest size tried, decimal digits */
+#define DEFAULT_MAX_DIGITS  2048    /* largest size tried, decimal digits */
+#define TRIALS              7
+#define MIN_TRIAL_NSEC      5000000L
+
+/* The variables numeric.c reads when built with NUMERIC_TUNE */
+int         tune_div_checked_threshold = INT_MAX;
+
+/*
+ * An operation whose algorithm depends on a threshold.  setup() prepares
+ * operands of about ndigits decimal digits, run() performs the operation
+ * once on them.
+ */
+typedef struct tune_param
+{
+    const char *name;           /* macro in numeric_tune.h */
+    const char *comment;
+    int        *threshold;      /* in NBASE digits */
+    void        (*setup) (int ndigits);
+    void        (*run) (void);
+} tune_param;
+
+static void setup_div(int ndigits);
+static void run_div(void);
+
+static tune_param params[] =
+{
+    {
+        "DIV_CHECKED_THRESHOLD",
+        "Divisor and quotient length from which div_var_checked beats div_var",
+        &tune_div_checked_threshold,
+        setup_div,
+        run_div
+    }
+};
+
+#define NPARAMS ((int) (sizeof(params) / sizeof(params[0])))
+
+static numeric arg1;
+static numeric arg2;
+static numeric res;
+static unsigned long long seed = 0x2545F4914F6CDD1DULL;
+static bool verbose = false;
+
+static void usage(void);
+static int  tune(tune_param *param, int max_digits);
+static void measure(tune_param *param, int ndigits, double *t_old,
+            double *t_new);
+static double elapsed_nsec(const struct timespec *start);
+static void random_integer(numeric *var, int ndigits);
+static bool write_header(FILE *out, const int *results);
+
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    int         max_digits = DEFAULT_MAX_DIGITS;
+    int         results[NPARAMS];
+    FILE       *out = stdout;
+    int         opt;
+    int         i;
+
+    while ((opt = getopt(argc, argv, "m:o:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                max_digits = atoi(optarg);
+                if (max_digits < MIN_DIGITS)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (optind != argc)
+    {
+        usage();
+        return 2;
+    }
+
+    numeric_init(&arg1);
+    numeric_init(&arg2);
+    numeric_init(&res);
+
+    for (i = 0; i < NPARAMS; i++)
+    {
+        results[i] = tune(&params[i], max_digits);
+        fprintf(stderr, "%s %d\n", params[i].name, results[i]);
+    }
+
+    numeric_dispose(&res);
+    numeric_dispose(&arg2);
+    numeric_dispose(&arg1);
+
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        perror(output);
+        return 2;
+    }
+    if (!write_header(out, results) || (output != NULL && fclose(out) != 0))
+    {
+        perror(output != NULL ? output : "stdout");
+        return 2;
+    }
+    return 0;
+}
+
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: pgnumeric-tuneup [options]\n"
+            "\n"
+            "  -m DIGITS   largest operand size to try, in decimal digits "
+            "(default %d)\n"
+            "  -o FILE     write the header to FILE instead of standard "
+            "output\n"
+            "  -v          report every measurement on stderr\n",
+            DEFAULT_MAX_DIGITS);
+}
+
+
+/*
+ * tune() -
+ *
+ *  Return the crossover size of param in decimal digits, a whole number of
+ *  NBASE digits: the size just past the largest one at which the old
+ *  algorithm still won.  Near the crossover the two are within noise of
+ *  each other, so an early win of the new one is not taken on its own.
+ *  If the old algorithm wins at max_digits, the result is past max_digits.
+ */
+static int
+tune(tune_param *param, int max_digits)
+{
+    int         result = MIN_DIGITS;
+    int         ndigits;
+    int         step;
+    double      t_old;
+    double      t_new;
+
+    for (ndigits = MIN_DIGITS; ndigits <= max_digits; ndigits += step)
+    {
+        /* grow by about an eighth, in whole NBASE digits */
+        step = DEC_DIGITS * ((ndigits / 8 + DEC_DIGITS - 1) / DEC_DIGITS);
+
+        measure(param, ndigits, &t_old, &t_new);
+        if (verbose)
+            fprintf(stderr, "%s %5d digits: %10.0f ns %10.0f ns%s\n",
+                    param->name, ndigits, t_old, t_new,
+                    t_new < t_old ? "  *" : "");
+        if (t_new >= t_old)
+            result = ndigits + step;
+    }
+    return result;
+}
+
+
+/*
+ * measure() -
+ *
+ *  Best times per operation, in nanoseconds, of param at ndigits with its
+ *  threshold forced off (old algorithm) and on (new one).  The two are
+ *  timed in alternation so that drift in the machine's speed affects both.
+ */
+static void
+measure(tune_param *param, int ndigits, double *t_old, double *t_new)
+{
+    struct timespec start;
+    double      elapsed;
+    long        reps;
+    long        i;
+    int         trial;
+    int         which;
+
+    param->setup(ndigits);
+    *t_old = 0;
+    *t_new = 0;
+
+    /* Find a repeat count that runs for MIN_TRIAL_NSEC */
+    *param->threshold = INT_MAX;
+    for (reps = 1;; reps *= 2)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < reps; i++)
+            param->run();
+        if (elapsed_nsec(&start) >= MIN_TRIAL_NSEC)
+            break;
+    }
+
+    for (trial = 0; trial < TRIALS; trial++)
+    {
+        for (which = 0; which < 2; which++)
+        {
+            *param->threshold = which == 0 ? INT_MAX : 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < reps; i++)
+                param->run();
+            elapsed = elapsed_nsec(&start) / reps;
+            if (which == 0 && (trial == 0 || elapsed < *t_old))
+                *t_old = elapsed;
+            if (which == 1 && (trial == 0 || elapsed < *t_new))
+                *t_new = elapsed;
+        }
+    }
+
+    *param->threshold = INT_MAX;
+}
+
+
+static double
+elapsed_nsec(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 +
+        (now.tv_nsec - start->tv_nsec);
+}
+
+
+/*
+ * random_integer() -
+ *
+ *  Set var to a random integer of exactly ndigits decimal digits.
+ */
+static void
+random_integer(numeric *var, int ndigits)
+{
+    char       *str = malloc(ndigits + 1);
+    int         i;
+
+    for (i = 0; i < ndigits; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        str[i] = (char) ('0' + (i == 0 ? 1 + seed % 9 : seed % 10));
+    }
+    str[ndigits] = '\0';
+    if (numeric_from_str(str, -1, -1, var) != NUMERIC_ERRCODE_NO_ERROR)
+    {
+        fprintf(stderr, "cannot build a %d digit operand\n", ndigits);
+        exit(2);
+    }
+    free(str);
+}
+
+
+/*
+ * Division: a 2n-digit integer by an n-digit one, so that both the divisor
+ * and the quotient have n digits.
+ */
+static void
+setup_div(int ndigits)
+{
+    random_integer(&arg1, 2 * ndigits);
+    random_integer(&arg2, ndigits);
+}
+
+static void
+run_div(void)
+{
+    numeric_div(&arg1, &arg2, &res);
+}
+
+
+/*
+ * write_header() -
+ *
+ *  Write numeric_tune_local.h with the measured thresholds.
+ */
+static bool
+write_header(FILE *out, const int *results)
+{
+    char        host[256];
+    int         i;
+
+    if (gethostname(host, sizeof(host)) != 0)
+        strcpy(host, "unknown");
+    host[sizeof(host) - 1] = '\0';
+
+    fprintf(out,
+            "/*-------------------------------------------------------------------------\n"
+            " *\n"
+            " * numeric_tune_local.h\n"
+            " *    Algorithm crossover thresholds for numeric.c, tuned locally\n"
+            " *\n"
+            " * Generated by pgnumeric-tuneup on %s (NBASE %d).  These values\n"
+            " * take precedence over the defaults in numeric_tune.h.  Run \"make tune\"\n"
+            " * again on a different machine, or delete this file to return to the\n"
+            " * defaults; rebuild the library afterwards.  Each value may also be\n"
+            " * overridden with -D in CFLAGS.\n"
+            " *\n"
+            " * Sizes are written in decimal digits and converted to NBASE digits, so\n"
+            " * a file tuned for one NBASE stays roughly right for another.\n"
+            " *\n"
+            " *-------------------------------------------------------------------------\n"
+            " */\n"
+            "#ifndef _PG_NUMERIC_TUNE_LOCAL_H_\n"
+            "#define _PG_NUMERIC_TUNE_LOCAL_H_\n",
+            host, NBASE);
+
+    for (i = 0; i < NPARAMS; i++)
+        fprintf(out,
+                "\n"
+                "/* %s */\n"
+                "#ifndef %s\n"
+                "#define %-27s (%d / DEC_DIGITS)\n"
+                "#endif\n",
+                params[i].comment, params[i].name, params[i].name,
+                results[i]);
+
+    fprintf(out, "\n#endif   /* _PG_NUMERIC_TUNE_LOCAL_H_ */\n");
+    return !ferror(out);
+}